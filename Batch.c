@@ -0,0 +1,485 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Batch.c
+
+Abstract:
+
+    IOCTL_PACKET_BATCH: many packet mode transfers, of either channel,
+    for one request. The read and write paths take one common buffer
+    per ReadFile or WriteFile; a batch hands each channel its entries in
+    order on the batch's own transactions, which go straight to
+    HSACDmaChannelQueue since common buffers need no mapping. Up to
+    HSAC_BATCH_TRANSACTIONS entries per channel are Ready at once, so
+    the ISR starts the next one as soon as the last one finishes, and
+    the DPC gives each finished transaction the channel's next entry.
+    The request completes when the last entry does.
+
+    IOCTL_PACKET_CHAIN: the same request, but each channel's entries
+    are linked into one DTE chain across their common buffers
+    (HSACDmaChannelBuildPacketChain) and run on the batch's chain
+    transaction, as a scatter/gather transfer: one doorbell and one
+    interrupt per channel, however many buffers it covers.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Batch.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACBatchCommitBuffers)
+#endif
+
+//
+// Entries[i].Channel of an entry that was rejected up front.
+//
+#define HSAC_BATCH_SKIP		((ULONG) -1)
+
+NTSTATUS
+HSACBatchInitialize(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Create the batch transactions. Called from HSACInitializeDMA after
+    the channels.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status = STATUS_SUCCESS;
+    PHSAC_BATCH             batch = &DevExt->Batch;
+    PTRANSACTION_CONTEXT    transContext;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    ULONG                   channel;
+    ULONG                   i;
+
+    for (channel = 0; channel < 2; channel++) {
+
+        for (i = 0; i < HSAC_BATCH_TRANSACTIONS; i++) {
+
+            if (batch->Transactions[channel][i]) {
+                continue;
+            }
+
+            WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TRANSACTION_CONTEXT);
+
+            status = WdfDmaTransactionCreate( DevExt->DmaEnabler,
+                                              &attributes,
+                                              &batch->Transactions[channel][i] );
+            if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+                TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                            "WdfDmaTransactionCreate(batch) failed: %!STATUS!", status);
+#endif
+                batch->Transactions[channel][i] = NULL;
+                return status;
+            }
+
+            transContext = HSACGetTransactionContext(batch->Transactions[channel][i]);
+            RtlZeroMemory(transContext, sizeof(TRANSACTION_CONTEXT));
+
+            transContext->Transaction = batch->Transactions[channel][i];
+            transContext->Channel     = (channel == 0) ? &DevExt->WriteChannel :
+                                                         &DevExt->ReadChannel;
+            transContext->State       = HsacDmaAllocated;
+            transContext->Packet      = TRUE;
+            transContext->Batched     = TRUE;
+        }
+
+        if (batch->Chains[channel]) {
+            continue;
+        }
+
+        //
+        // A chain transaction's DTE slot is the size of a channel slot,
+        // which is far more than HSAC_MAX_BATCH_ENTRIES buffers take.
+        //
+        status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+                                        (channel == 0) ? DevExt->WriteChannel.DteSlotSize :
+                                                         DevExt->ReadChannel.DteSlotSize,
+                                        WDF_NO_OBJECT_ATTRIBUTES,
+                                        &batch->ChainDte[channel] );
+        if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                        "WdfCommonBufferCreate(chain) failed: %!STATUS!", status);
+#endif
+            batch->ChainDte[channel] = NULL;
+            return status;
+        }
+
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TRANSACTION_CONTEXT);
+
+        status = WdfDmaTransactionCreate( DevExt->DmaEnabler,
+                                          &attributes,
+                                          &batch->Chains[channel] );
+        if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                        "WdfDmaTransactionCreate(chain) failed: %!STATUS!", status);
+#endif
+            batch->Chains[channel] = NULL;
+            return status;
+        }
+
+        transContext = HSACGetTransactionContext(batch->Chains[channel]);
+        RtlZeroMemory(transContext, sizeof(TRANSACTION_CONTEXT));
+
+        transContext->Transaction = batch->Chains[channel];
+        transContext->Channel     = (channel == 0) ? &DevExt->WriteChannel :
+                                                     &DevExt->ReadChannel;
+        transContext->State       = HsacDmaAllocated;
+        transContext->Batched     = TRUE;
+        transContext->DteVA       = (PDMA_TRANSFER_ELEMENT)
+            WdfCommonBufferGetAlignedVirtualAddress(batch->ChainDte[channel]);
+        transContext->DteLA       =
+            WdfCommonBufferGetAlignedLogicalAddress(batch->ChainDte[channel]);
+    }
+
+    return status;
+}
+
+static ULONG
+HSACBatchNextEntry(
+    IN PHSAC_BATCH Batch,
+    IN ULONG       Channel
+    )
+/*++
+Routine Description:
+
+    The channel's next entry, or Count if it has none left.
+
+--*/
+{
+    ULONG   i;
+
+    while (Batch->Next[Channel] < Batch->Count) {
+        i = Batch->Next[Channel]++;
+        if (Batch->Entries[i].Channel == Channel) {
+            return i;
+        }
+    }
+
+    return Batch->Count;
+}
+
+static VOID
+HSACBatchAssign(
+    IN PHSAC_BATCH          Batch,
+    IN PTRANSACTION_CONTEXT TransContext,
+    IN ULONG                Entry
+    )
+{
+    TransContext->BatchEntry  = Entry;
+    TransContext->PacketIndex = Batch->Entries[Entry].Index;
+    TransContext->PacketSize  = Batch->Entries[Entry].Size;
+}
+
+static VOID
+HSACBatchRelease(
+    IN PHSAC_BATCH Batch,
+    IN LONG        Count
+    )
+/*++
+Routine Description:
+
+    Drop Count references to the running batch; the last one completes
+    the request. Once it is completed BatchQueue may present the next batch,
+    which reuses Batch.
+
+--*/
+{
+    WDFREQUEST  request;
+    ULONG       count;
+
+    if (InterlockedExchangeAdd( &Batch->Remaining, -Count ) != Count) {
+        return;
+    }
+
+    request = Batch->Request;
+    count   = Batch->Count;
+    Batch->Request = NULL;
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "Completing packet batch of %d entries", count);
+#endif
+
+    WdfRequestCompleteWithInformation( request, STATUS_SUCCESS,
+                                       count * sizeof(HSAC_PACKET_RESULT) );
+}
+
+VOID
+HSACBatchCommitBuffers(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFREQUEST        Request
+    )
+/*++
+Routine Description:
+
+    Commit the common buffers a batch or chain names (Buffers.c), from
+    HSACEvtIoDeviceControl at PASSIVE_LEVEL before it is forwarded:
+    BatchQueue may present it from the DPC, where no buffer can be
+    created. A malformed request or entry is left for
+    HSACEvtIoPacketBatch to reject.
+
+--*/
+{
+    PHSAC_PACKET_BATCH  input;
+    PVOID               pInputBuffer = NULL;
+    size_t              length = 0;
+    ULONG               i;
+
+    PAGED_CODE();
+
+    if (!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request,
+            FIELD_OFFSET(HSAC_PACKET_BATCH, Entries), &pInputBuffer, &length))) {
+        return;
+    }
+
+    input = (PHSAC_PACKET_BATCH) pInputBuffer;
+
+    if (input->Count == 0 || input->Count > HSAC_MAX_BATCH_ENTRIES ||
+        length < FIELD_OFFSET(HSAC_PACKET_BATCH, Entries) +
+                 input->Count * sizeof(HSAC_PACKET_ENTRY)) {
+        return;
+    }
+
+    for (i = 0; i < input->Count; i++) {
+        if ((input->Entries[i].Index & HSAC_HEAP_HANDLE) == 0) {
+            (VOID) HSACBuffersCommit( DevExt, input->Entries[i].Channel,
+                                      input->Entries[i].Index, 1 );
+        }
+    }
+}
+
+VOID
+HSACEvtIoPacketBatch(
+    IN WDFQUEUE      Queue,
+    IN WDFREQUEST    Request,
+    IN size_t        OutputBufferLength,
+    IN size_t        InputBufferLength,
+    IN ULONG         IoControlCode
+    )
+/*++
+Routine Description:
+
+    IOCTL_PACKET_BATCH or IOCTL_PACKET_CHAIN, forwarded to BatchQueue by
+    HSACEvtIoDeviceControl. Check the entries, give each channel's
+    transactions its first entries (or build each channel's chain), and
+    only then queue them, each channel's all at once: from the first
+    doorbell on the channel's DPC owns Next[], and queues the next entry
+    behind whatever is Ready.
+
+--*/
+{
+    NTSTATUS                status;
+    PDEVICE_EXTENSION       devExt;
+    PHSAC_BATCH             batch;
+    PHSAC_PACKET_BATCH      input;
+    PTRANSACTION_CONTEXT    transContext;
+    WDFDMATRANSACTION       started[2][HSAC_BATCH_TRANSACTIONS];
+    ULONG                   startedCount[2] = { 0, 0 };
+    PVOID                   pInputBuffer = NULL;
+    PVOID                   pOutputBuffer = NULL;
+    size_t                  length = 0;
+    ULONG                   channel;
+    ULONG                   entry;
+    LONG                    failed;
+    ULONG                   i;
+
+    UNREFERENCED_PARAMETER( OutputBufferLength );
+    UNREFERENCED_PARAMETER( InputBufferLength );
+
+    devExt = HSACGetDeviceContext(WdfIoQueueGetDevice(Queue));
+    batch  = &devExt->Batch;
+
+    do {
+        if (IoControlCode != IOCTL_PACKET_BATCH &&
+            IoControlCode != IOCTL_PACKET_CHAIN) {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
+
+        status = WdfRequestRetrieveInputBuffer(Request,
+            FIELD_OFFSET(HSAC_PACKET_BATCH, Entries), &pInputBuffer, &length);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        input = (PHSAC_PACKET_BATCH) pInputBuffer;
+
+        if (input->Count == 0 || input->Count > HSAC_MAX_BATCH_ENTRIES ||
+            length < FIELD_OFFSET(HSAC_PACKET_BATCH, Entries) +
+                     input->Count * sizeof(HSAC_PACKET_ENTRY)) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        //
+        // METHOD_BUFFERED: the results overwrite the entries, so copy
+        // them out first.
+        //
+        batch->Count = input->Count;
+        RtlCopyMemory(batch->Entries, input->Entries,
+                      batch->Count * sizeof(HSAC_PACKET_ENTRY));
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            batch->Count * sizeof(HSAC_PACKET_RESULT), &pOutputBuffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+    } while (0);
+
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                    "IOCTL_PACKET_BATCH/CHAIN failed: %!STATUS!", status);
+#endif
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    batch->Request   = Request;
+    batch->Results   = (PHSAC_PACKET_RESULT) pOutputBuffer;
+    batch->Next[0]   = 0;
+    batch->Next[1]   = 0;
+    batch->Remaining = 1;
+
+    for (i = 0; i < batch->Count; i++) {
+
+        batch->Results[i].Bytes = 0;
+
+        if (HSACDmaChannelPacketValid(devExt, batch->Entries[i].Channel,
+                batch->Entries[i].Index, batch->Entries[i].Size)) {
+            batch->Results[i].Status = STATUS_PENDING;
+            batch->Remaining++;
+        } else {
+            batch->Results[i].Status = STATUS_INVALID_PARAMETER;
+            batch->Entries[i].Channel = HSAC_BATCH_SKIP;
+        }
+    }
+
+    for (channel = 0; channel < 2 && IoControlCode == IOCTL_PACKET_CHAIN; channel++) {
+
+        transContext = HSACGetTransactionContext(batch->Chains[channel]);
+
+        if (HSACDmaChannelBuildPacketChain(devExt, transContext,
+                                           batch->Entries, batch->Count)) {
+            started[channel][startedCount[channel]++] = transContext->Transaction;
+            continue;
+        }
+
+        //
+        // No entries for this channel, or too many DTEs for them.
+        //
+        failed = 0;
+        for (i = 0; i < batch->Count; i++) {
+            if (batch->Entries[i].Channel == channel) {
+                HSACDmaChannelPacketDone(devExt, batch->Entries[i].Index);
+                batch->Results[i].Status  = STATUS_INSUFFICIENT_RESOURCES;
+                batch->Entries[i].Channel = HSAC_BATCH_SKIP;
+                failed++;
+            }
+        }
+        batch->Remaining -= failed;
+    }
+
+    for (channel = 0; channel < 2 && IoControlCode == IOCTL_PACKET_BATCH; channel++) {
+        for (i = 0; i < HSAC_BATCH_TRANSACTIONS; i++) {
+
+            entry = HSACBatchNextEntry(batch, channel);
+            if (entry == batch->Count) {
+                break;
+            }
+
+            transContext = HSACGetTransactionContext(batch->Transactions[channel][i]);
+            HSACBatchAssign(batch, transContext, entry);
+            started[channel][startedCount[channel]++] = transContext->Transaction;
+        }
+    }
+
+    for (channel = 0; channel < 2; channel++) {
+        if (startedCount[channel]) {
+            HSACDmaChannelQueueList(devExt, started[channel], startedCount[channel]);
+        }
+    }
+
+    HSACBatchRelease(batch, 1);
+}
+
+VOID
+HSACBatchComplete(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFDMATRANSACTION Transaction,
+    IN NTSTATUS          Status
+    )
+/*++
+Routine Description:
+
+    A batch entry is done (DPC): give its buffer back
+    (HSACDmaChannelPacketDone), record it, and run the channel's next
+    entry on the same transaction. A chain is done: the same for each of
+    the channel's entries.
+
+--*/
+{
+    PHSAC_BATCH             batch = &DevExt->Batch;
+    PTRANSACTION_CONTEXT    transContext = HSACGetTransactionContext(Transaction);
+    ULONG                   channel = transContext->Channel->Index;
+    ULONG                   entry;
+    LONG                    done = 0;
+
+    if (!transContext->Packet) {
+
+        for (entry = 0; entry < batch->Count; entry++) {
+            if (batch->Entries[entry].Channel == channel) {
+                HSACDmaChannelPacketDone(DevExt, batch->Entries[entry].Index);
+                batch->Results[entry].Bytes  =
+                    NT_SUCCESS(Status) ? batch->Entries[entry].Size : 0;
+                batch->Results[entry].Status = Status;
+                done++;
+            }
+        }
+
+        transContext->State = HsacDmaAllocated;
+        HSACBatchRelease(batch, done);
+        return;
+    }
+
+    HSACDmaChannelPacketDone(DevExt, transContext->PacketIndex);
+
+    batch->Results[transContext->BatchEntry].Bytes  =
+        NT_SUCCESS(Status) ? transContext->PacketSize : 0;
+    batch->Results[transContext->BatchEntry].Status = Status;
+
+    entry = HSACBatchNextEntry(batch, channel);
+
+    if (entry != batch->Count) {
+        HSACBatchAssign(batch, transContext, entry);
+        HSACDmaChannelQueue(DevExt, Transaction);
+    } else {
+        transContext->State = HsacDmaAllocated;
+    }
+
+    HSACBatchRelease(batch, 1);
+}
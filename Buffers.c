@@ -0,0 +1,1033 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Buffers.c
+
+Abstract:
+
+    The common buffers that packet mode transfers name by index. Each
+    channel has Count buffers of Size bytes (HSAC_BUFFER_GEOMETRY,
+    Public.h), taken from the device's hardware key when the device is
+    added and changed with IOCTL_SET_BUFFER_GEOMETRY while the channel is
+    idle. The per-buffer arrays of the DEVICE_EXTENSION are sized to
+    match, all five in one WDFMEMORY per channel.
+
+    The device's cache mode (HSAC_CACHE_*) decides how the buffers are
+    allocated. HSAC_CACHE_MULTI_DISCRETE gives each its own common
+    buffer; the other modes allocate a channel's buffers back to back in
+    one, mapped as one, and fill in every buffer's entry of the arrays
+    from it. Either way a transfer finds its buffer in the arrays
+    (HSACDmaChannelPacketAddress), so only allocating, freeing and
+    mapping the buffers depends on the mode. It comes from the hardware
+    key too, and changes with IOCTL_SET_CACHE_MODE while both channels
+    are idle.
+
+    Adding the device only sets up the arrays. A buffer is allocated and
+    zeroed the first time it is needed, at PASSIVE_LEVEL under
+    BuffersLock: all of them when they are mapped or the read and write
+    paths switch to packet mode, and one at a time as ring entries,
+    batches and streams name them. HSACDmaChannelPacketValid refuses a
+    buffer that does not exist yet. With PrewarmBuffers set in the
+    hardware key a work item allocates them all in the background once
+    the device has started.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Buffers.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACBuffersInitialize)
+#pragma alloc_text (PAGE, HSACBuffersSetGeometry)
+#pragma alloc_text (PAGE, HSACBuffersCommit)
+#pragma alloc_text (PAGE, HSACBuffersCommitAll)
+#pragma alloc_text (PAGE, HSACBuffersStopPrewarm)
+#pragma alloc_text (PAGE, HSACBuffersSetCacheMode)
+#endif
+
+//
+// One entry of each of the per-buffer arrays
+//
+#define HSAC_BUFFER_ARRAYS_ENTRY	(sizeof(WDFCOMMONBUFFER) + sizeof(PVOID) + \
+                                     sizeof(PHYSICAL_ADDRESS) + sizeof(PVOID) + sizeof(PMDL))
+
+static NTSTATUS
+HSACBuffersCreate(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Channel,
+    IN ULONG             Count,
+    IN ULONG             Size
+    )
+/*++
+Routine Description:
+
+    Set Channel (0 - write, 1 - read) up for Count common buffers of Size
+    bytes: the arrays that describe them, with none allocated yet. The
+    channel has none. Called with BuffersLock held, or before anything
+    else can use the buffers.
+
+    In a contiguous cache mode entry 0 of the arrays stands for the one
+    common buffer, its MDL and its user mapping.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    WDFMEMORY               memory;
+    PVOID                   arrays;
+    WDFCOMMONBUFFER       * commonBuffer;
+    PVOID                 * base;
+    PHYSICAL_ADDRESS      * baseLA;
+    PVOID                 * userAddress;
+    PMDL                  * mdl;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = DevExt->Device;
+
+    status = WdfMemoryCreate( &attributes,
+                              NonPagedPoolNx,
+                              0,
+                              Count * HSAC_BUFFER_ARRAYS_ENTRY,
+                              &memory,
+                              &arrays );
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                    "WdfMemoryCreate(buffer arrays) failed: %!STATUS!", status);
+#endif
+        return status;
+    }
+
+    RtlZeroMemory( arrays, Count * HSAC_BUFFER_ARRAYS_ENTRY );
+
+    commonBuffer = (WDFCOMMONBUFFER *) arrays;
+    base         = (PVOID *) (commonBuffer + Count);
+    baseLA       = (PHYSICAL_ADDRESS *) (base + Count);
+    userAddress  = (PVOID *) (baseLA + Count);
+    mdl          = (PMDL *) (userAddress + Count);
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
+                "%s common buffers: %d x %d bytes, on demand",
+                (Channel == 0) ? "Write" : "Read", Count, Size);
+#endif
+
+    if (Channel == 0) {
+        DevExt->WriteBufferArrays        = memory;
+        DevExt->pWriteCommonBuffer       = commonBuffer;
+        DevExt->pWriteCommonBufferBase   = base;
+        DevExt->pWriteCommonBufferBaseLA = baseLA;
+        DevExt->pWriteUserAddress        = userAddress;
+        DevExt->pWriteMDL                = mdl;
+        DevExt->WriteCommonBufferSize    = Size;
+        DevExt->writeCommonBufferNum     = Count;
+    } else {
+        DevExt->ReadBufferArrays         = memory;
+        DevExt->pReadCommonBuffer        = commonBuffer;
+        DevExt->pReadCommonBufferBase    = base;
+        DevExt->pReadCommonBufferBaseLA  = baseLA;
+        DevExt->pReadUserAddress         = userAddress;
+        DevExt->pReadMDL                 = mdl;
+        DevExt->ReadCommonBufferSize     = Size;
+        DevExt->readCommonBufferNum      = Count;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+HSACBuffersCommitContiguous(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Channel
+    )
+/*++
+Routine Description:
+
+    Allocate and zero Channel's buffers as one common buffer, if that
+    has not been done yet, and point each buffer's entry of the arrays
+    into it. BuffersLock is held.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    PHSAC_DMA_CHANNEL       channel;
+    WDFCOMMONBUFFER       * commonBuffer;
+    PVOID                 * base;
+    PHYSICAL_ADDRESS      * baseLA;
+    WDFCOMMONBUFFER         buffer;
+    PUCHAR                  va;
+    PHYSICAL_ADDRESS        la;
+    size_t                  size;
+    ULONG                   count;
+    ULONG                   i;
+
+    if (Channel == 0) {
+        channel      = &DevExt->WriteChannel;
+        commonBuffer = DevExt->pWriteCommonBuffer;
+        base         = DevExt->pWriteCommonBufferBase;
+        baseLA       = DevExt->pWriteCommonBufferBaseLA;
+        size         = DevExt->WriteCommonBufferSize;
+        count        = DevExt->writeCommonBufferNum;
+    } else {
+        channel      = &DevExt->ReadChannel;
+        commonBuffer = DevExt->pReadCommonBuffer;
+        base         = DevExt->pReadCommonBufferBase;
+        baseLA       = DevExt->pReadCommonBufferBaseLA;
+        size         = DevExt->ReadCommonBufferSize;
+        count        = DevExt->readCommonBufferNum;
+    }
+
+    if (commonBuffer[0] != NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+                                    size * count,
+                                    WDF_NO_OBJECT_ATTRIBUTES,
+                                    &buffer );
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                    "WdfCommonBufferCreate (%s, %d x %d bytes) failed: %!STATUS!",
+                    (Channel == 0) ? "write" : "read", count, (ULONG) size, status);
+#endif
+        return status;
+    }
+
+    va = (PUCHAR) WdfCommonBufferGetAlignedVirtualAddress( buffer );
+    la = WdfCommonBufferGetAlignedLogicalAddress( buffer );
+
+    RtlZeroMemory( va, size * count );
+
+    for (i = 0; i < count; i++) {
+        base[i]            = va + i * size;
+        baseLA[i].QuadPart = la.QuadPart + i * size;
+    }
+
+    //
+    // Entry 0 last: it owns the common buffer (HSACBuffersDelete).
+    //
+    for (i = count; i-- > 0; ) {
+        commonBuffer[i] = buffer;
+    }
+
+    InterlockedIncrement( &channel->Stats.Buffers );
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+HSACBuffersCommitLocked(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Channel,
+    IN ULONG             First,
+    IN ULONG             Count
+    )
+/*++
+Routine Description:
+
+    Allocate and zero those of Channel's buffers First..First+Count-1
+    that do not exist yet. BuffersLock is held and the range is valid.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    PHSAC_DMA_CHANNEL       channel;
+    WDFCOMMONBUFFER       * commonBuffer;
+    PVOID                 * base;
+    PHYSICAL_ADDRESS      * baseLA;
+    WDFCOMMONBUFFER         buffer;
+    size_t                  size;
+    ULONG                   i;
+
+    if (HSAC_CACHE_CONTIGUOUS(DevExt->CacheMode)) {
+        return HSACBuffersCommitContiguous( DevExt, Channel );
+    }
+
+    if (Channel == 0) {
+        channel      = &DevExt->WriteChannel;
+        commonBuffer = DevExt->pWriteCommonBuffer;
+        base         = DevExt->pWriteCommonBufferBase;
+        baseLA       = DevExt->pWriteCommonBufferBaseLA;
+        size         = DevExt->WriteCommonBufferSize;
+    } else {
+        channel      = &DevExt->ReadChannel;
+        commonBuffer = DevExt->pReadCommonBuffer;
+        base         = DevExt->pReadCommonBufferBase;
+        baseLA       = DevExt->pReadCommonBufferBaseLA;
+        size         = DevExt->ReadCommonBufferSize;
+    }
+
+    for (i = First; i < First + Count; i++) {
+
+        if (commonBuffer[i] != NULL) {
+            continue;
+        }
+
+        //
+        // NOTE: These common buffers will not be cached.
+        //
+        status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+                                        size,
+                                        WDF_NO_OBJECT_ATTRIBUTES,
+                                        &buffer );
+        if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                        "WdfCommonBufferCreate (%s %d) failed: %!STATUS!",
+                        (Channel == 0) ? "write" : "read", i, status);
+#endif
+            return status;
+        }
+
+        base[i]   = WdfCommonBufferGetAlignedVirtualAddress( buffer );
+        baseLA[i] = WdfCommonBufferGetAlignedLogicalAddress( buffer );
+
+        RtlZeroMemory( base[i], size );
+
+        //
+        // A buffer with a handle is ready (HSACDmaChannelPacketValid).
+        //
+        commonBuffer[i] = buffer;
+
+        InterlockedIncrement( &channel->Stats.Buffers );
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+HSACBuffersDelete(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Channel
+    )
+/*++
+Routine Description:
+
+    Free Channel's common buffers and their arrays. Nothing may be using
+    or mapping them, and BuffersLock is held. DevExt->CacheMode is still
+    the mode they were allocated in.
+
+--*/
+{
+    WDFMEMORY           memory;
+    WDFCOMMONBUFFER   * commonBuffer;
+    ULONG               count;
+    ULONG               i;
+
+    if (Channel == 0) {
+        memory       = DevExt->WriteBufferArrays;
+        commonBuffer = DevExt->pWriteCommonBuffer;
+        count        = DevExt->writeCommonBufferNum;
+
+        DevExt->writeCommonBufferNum     = 0;
+        DevExt->WriteCommonBufferSize    = 0;
+        DevExt->WriteBufferArrays        = NULL;
+        DevExt->pWriteCommonBuffer       = NULL;
+        DevExt->pWriteCommonBufferBase   = NULL;
+        DevExt->pWriteCommonBufferBaseLA = NULL;
+        DevExt->pWriteUserAddress        = NULL;
+        DevExt->pWriteMDL                = NULL;
+    } else {
+        memory       = DevExt->ReadBufferArrays;
+        commonBuffer = DevExt->pReadCommonBuffer;
+        count        = DevExt->readCommonBufferNum;
+
+        DevExt->readCommonBufferNum      = 0;
+        DevExt->ReadCommonBufferSize     = 0;
+        DevExt->ReadBufferArrays         = NULL;
+        DevExt->pReadCommonBuffer        = NULL;
+        DevExt->pReadCommonBufferBase    = NULL;
+        DevExt->pReadCommonBufferBaseLA  = NULL;
+        DevExt->pReadUserAddress         = NULL;
+        DevExt->pReadMDL                 = NULL;
+    }
+
+    if (HSAC_CACHE_CONTIGUOUS(DevExt->CacheMode)) {
+        count = (count != 0) ? 1 : 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (commonBuffer[i] != NULL) {
+            WdfObjectDelete( commonBuffer[i] );
+        }
+    }
+
+    if (memory != NULL) {
+        WdfObjectDelete( memory );
+    }
+
+    InterlockedExchange( (Channel == 0) ? &DevExt->WriteChannel.Stats.Buffers :
+                                          &DevExt->ReadChannel.Stats.Buffers, 0 );
+}
+
+static BOOLEAN
+HSACBuffersCountValid(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Count
+    )
+{
+    return HSAC_CACHE_SINGLE(DevExt->CacheMode) ?
+        Count == 1 : (Count != 0 && Count <= HSAC_MAX_TRANSFER_BUFFERS);
+}
+
+static BOOLEAN
+HSACBuffersSizeValid(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Size
+    )
+{
+    return Size != 0 && Size <= DevExt->MaximumTransferLength;
+}
+
+static BOOLEAN
+HSACBuffersModeValid(
+    IN ULONG Mode
+    )
+{
+    return Mode == HSAC_CACHE_PING_PANG || Mode == HSAC_CACHE_MULTI ||
+           Mode == HSAC_CACHE_MULTI_DISCRETE || Mode == HSAC_CACHE_NONE;
+}
+
+static VOID
+HSACBuffersReadGeometry(
+    IN PDEVICE_EXTENSION      DevExt,
+    OUT PULONG                Mode,
+    OUT PHSAC_BUFFER_GEOMETRY Geometry,
+    OUT PBOOLEAN              Prewarm
+    )
+/*++
+Routine Description:
+
+    Mode, Geometry[0] (write) and Geometry[1] (read) from the device's
+    hardware key. A value that is missing or out of range leaves the
+    default: HSAC_DEFAULT_CACHE_MODE, HSAC_TRANSFER_BUFFER_NUM buffers of
+    MaximumTransferLength bytes. Prewarm is PrewarmBuffers, FALSE if it
+    is missing. The counts are not fitted to the mode yet
+    (HSACBuffersFitMode).
+
+--*/
+{
+    DECLARE_CONST_UNICODE_STRING(cacheMode,  L"CacheMode");
+    DECLARE_CONST_UNICODE_STRING(writeCount, L"WriteBufferCount");
+    DECLARE_CONST_UNICODE_STRING(writeSize,  L"WriteBufferSize");
+    DECLARE_CONST_UNICODE_STRING(readCount,  L"ReadBufferCount");
+    DECLARE_CONST_UNICODE_STRING(readSize,   L"ReadBufferSize");
+    DECLARE_CONST_UNICODE_STRING(prewarm,    L"PrewarmBuffers");
+    PCUNICODE_STRING    names[2][2];
+    NTSTATUS            status;
+    WDFKEY              key;
+    ULONG               channel;
+    ULONG               value;
+
+    names[0][0] = &writeCount;
+    names[0][1] = &writeSize;
+    names[1][0] = &readCount;
+    names[1][1] = &readSize;
+
+    for (channel = 0; channel < 2; channel++) {
+        Geometry[channel].Channel = channel;
+        Geometry[channel].Count   = HSAC_TRANSFER_BUFFER_NUM;
+        Geometry[channel].Size    = DevExt->MaximumTransferLength;
+    }
+    *Mode    = HSAC_DEFAULT_CACHE_MODE;
+    *Prewarm = FALSE;
+
+    status = WdfDeviceOpenRegistryKey( DevExt->Device,
+                                       PLUGPLAY_REGKEY_DEVICE,
+                                       KEY_READ,
+                                       WDF_NO_OBJECT_ATTRIBUTES,
+                                       &key );
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_WARNING, DBG_PNP,
+                    "WdfDeviceOpenRegistryKey failed: %!STATUS!", status);
+#endif
+        return;
+    }
+
+    if (NT_SUCCESS(WdfRegistryQueryULong( key, &cacheMode, &value ))) {
+        if (HSACBuffersModeValid( value )) {
+            *Mode = value;
+        } else {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                        "Ignoring cache mode 0x%x", value);
+#endif
+        }
+    }
+
+    for (channel = 0; channel < 2; channel++) {
+
+        if (NT_SUCCESS(WdfRegistryQueryULong( key, names[channel][0], &value ))) {
+            if (value != 0 && value <= HSAC_MAX_TRANSFER_BUFFERS) {
+                Geometry[channel].Count = value;
+            } else {
+#if (DBG != 0)
+                TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                            "Ignoring buffer count %d", value);
+#endif
+            }
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong( key, names[channel][1], &value ))) {
+            if (HSACBuffersSizeValid( DevExt, value )) {
+                Geometry[channel].Size = (ULONG) ROUND_TO_PAGES( value );
+            } else {
+#if (DBG != 0)
+                TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                            "Ignoring buffer size %d", value);
+#endif
+            }
+        }
+    }
+
+    if (NT_SUCCESS(WdfRegistryQueryULong( key, &prewarm, &value ))) {
+        *Prewarm = (value != 0);
+    }
+
+    WdfRegistryClose( key );
+}
+
+static VOID
+HSACBuffersFitMode(
+    IN ULONG                     Mode,
+    IN OUT PHSAC_BUFFER_GEOMETRY Geometry
+    )
+/*++
+Routine Description:
+
+    A single buffer cache mode has one buffer per channel, of the size
+    the channel's geometry asks for.
+
+--*/
+{
+    ULONG   channel;
+
+    if (HSAC_CACHE_SINGLE(Mode)) {
+        for (channel = 0; channel < 2; channel++) {
+            Geometry[channel].Count = 1;
+        }
+    }
+}
+
+static VOID
+HSACEvtBuffersPrewarm(
+    IN WDFWORKITEM WorkItem
+    )
+/*++
+Routine Description:
+
+    Allocate every common buffer that does not exist yet, one at a time
+    so that a transfer that needs one is not held up behind them all.
+    Stops early when the hardware is released (HSACBuffersStopPrewarm).
+
+--*/
+{
+    PDEVICE_EXTENSION   devExt;
+    NTSTATUS            status = STATUS_SUCCESS;
+    ULONG               channel;
+    ULONG               i;
+
+    devExt = HSACGetDeviceContext(WdfWorkItemGetParentObject(WorkItem));
+
+    for (channel = 0; channel < 2 && NT_SUCCESS(status); channel++) {
+
+        for (i = 0; NT_SUCCESS(status); i++) {
+
+            if (ReadNoFence( &devExt->BuffersPrewarmStop ) != 0) {
+                return;
+            }
+
+            WdfWaitLockAcquire( devExt->BuffersLock, NULL );
+
+            if (i >= ((channel == 0) ? devExt->writeCommonBufferNum :
+                                       devExt->readCommonBufferNum)) {
+                WdfWaitLockRelease( devExt->BuffersLock );
+                break;
+            }
+
+            status = HSACBuffersCommitLocked( devExt, channel, i, 1 );
+
+            WdfWaitLockRelease( devExt->BuffersLock );
+        }
+    }
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
+                "Common buffers prewarmed: %!STATUS!", status);
+#endif
+}
+
+NTSTATUS
+HSACBuffersInitialize(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Set both channels up for the common buffers the device's hardware
+    key asks for, without allocating any. Called from HSACInitializeDMA
+    once the DMA enabler exists.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    HSAC_BUFFER_GEOMETRY    geometry[2];
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    WDF_WORKITEM_CONFIG     workItemConfig;
+    BOOLEAN                 prewarm;
+    NTSTATUS                status;
+
+    PAGED_CODE();
+
+    HSACBuffersReadGeometry( DevExt, &DevExt->CacheMode, geometry, &prewarm );
+    HSACBuffersFitMode( DevExt->CacheMode, geometry );
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
+                "Cache mode 0x%x", DevExt->CacheMode);
+#endif
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = DevExt->Device;
+
+    status = WdfWaitLockCreate( &attributes, &DevExt->BuffersLock );
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                    "WdfWaitLockCreate(buffers) failed: %!STATUS!", status);
+#endif
+        return status;
+    }
+
+    if (prewarm) {
+        WDF_WORKITEM_CONFIG_INIT(&workItemConfig, HSACEvtBuffersPrewarm);
+        workItemConfig.AutomaticSerialization = FALSE;
+
+        status = WdfWorkItemCreate( &workItemConfig, &attributes, &DevExt->BuffersWorkItem );
+        if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                        "WdfWorkItemCreate(buffers) failed: %!STATUS!", status);
+#endif
+            return status;
+        }
+    }
+
+    status = HSACBuffersCreate( DevExt, 0, geometry[0].Count, geometry[0].Size );
+    if (NT_SUCCESS(status)) {
+        status = HSACBuffersCreate( DevExt, 1, geometry[1].Count, geometry[1].Size );
+    }
+
+    return status;
+}
+
+NTSTATUS
+HSACBuffersCommit(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Channel,
+    IN ULONG             First,
+    IN ULONG             Count
+    )
+/*++
+Routine Description:
+
+    Make sure Channel's buffers First..First+Count-1 exist. PASSIVE_LEVEL.
+
+Return Value:
+
+     STATUS_INVALID_PARAMETER if the channel has no such buffers
+
+--*/
+{
+    NTSTATUS    status;
+    ULONG       buffers;
+
+    PAGED_CODE();
+
+    if (Channel > 1) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WdfWaitLockAcquire( DevExt->BuffersLock, NULL );
+
+    buffers = (Channel == 0) ? DevExt->writeCommonBufferNum : DevExt->readCommonBufferNum;
+
+    if (First >= buffers || Count > buffers - First) {
+        status = STATUS_INVALID_PARAMETER;
+    } else {
+        status = HSACBuffersCommitLocked( DevExt, Channel, First, Count );
+    }
+
+    WdfWaitLockRelease( DevExt->BuffersLock );
+
+    return status;
+}
+
+NTSTATUS
+HSACBuffersCommitAll(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Make sure every buffer of both channels exists, before they are
+    mapped or the read and write paths name them. PASSIVE_LEVEL.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS    status;
+
+    PAGED_CODE();
+
+    WdfWaitLockAcquire( DevExt->BuffersLock, NULL );
+
+    status = HSACBuffersCommitLocked( DevExt, 0, 0, DevExt->writeCommonBufferNum );
+    if (NT_SUCCESS(status)) {
+        status = HSACBuffersCommitLocked( DevExt, 1, 0, DevExt->readCommonBufferNum );
+    }
+
+    WdfWaitLockRelease( DevExt->BuffersLock );
+
+    return status;
+}
+
+VOID
+HSACBuffersStartPrewarm(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Start allocating the buffers in the background if the hardware key
+    asks for it. Called from HSACEvtDevicePrepareHardware.
+
+--*/
+{
+    if (DevExt->BuffersWorkItem != NULL) {
+        InterlockedExchange( &DevExt->BuffersPrewarmStop, 0 );
+        WdfWorkItemEnqueue( DevExt->BuffersWorkItem );
+    }
+}
+
+VOID
+HSACBuffersStopPrewarm(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Stop the background allocation and wait for it. Called from
+    HSACEvtDeviceReleaseHardware.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (DevExt->BuffersWorkItem != NULL) {
+        InterlockedExchange( &DevExt->BuffersPrewarmStop, 1 );
+        WdfWorkItemFlush( DevExt->BuffersWorkItem );
+    }
+}
+
+NTSTATUS
+HSACBuffersGetGeometry(
+    IN PDEVICE_EXTENSION         DevExt,
+    IN OUT PHSAC_BUFFER_GEOMETRY Geometry
+    )
+/*++
+Routine Description:
+
+    IOCTL_GET_BUFFER_GEOMETRY: Count and Size of Geometry->Channel.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    if (Geometry->Channel > 1) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Geometry->Channel == 0) {
+        Geometry->Count = DevExt->writeCommonBufferNum;
+        Geometry->Size  = (ULONG) DevExt->WriteCommonBufferSize;
+    } else {
+        Geometry->Count = DevExt->readCommonBufferNum;
+        Geometry->Size  = (ULONG) DevExt->ReadCommonBufferSize;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HSACBuffersSetGeometry(
+    IN PDEVICE_EXTENSION     DevExt,
+    IN PHSAC_BUFFER_GEOMETRY Geometry
+    )
+/*++
+Routine Description:
+
+    IOCTL_SET_BUFFER_GEOMETRY: replace a channel's common buffers. Runs
+    on the sequential device control queue, so no ring entry, stream
+    start or buffer mapping can start meanwhile; the channel's read or
+    write queue and the batch queue are stopped while the buffers change.
+
+Return Value:
+
+     STATUS_DEVICE_BUSY if the buffers are mapped or in use
+
+--*/
+{
+    HSAC_BUFFER_GEOMETRY    geometry;
+    HSAC_BUFFER_GEOMETRY    old;
+    PHSAC_DMA_CHANNEL       channel;
+    WDFQUEUE                queue;
+    NTSTATUS                status;
+
+    PAGED_CODE();
+
+    geometry = *Geometry;
+
+    if (geometry.Channel > 1 ||
+        !HSACBuffersCountValid( DevExt, geometry.Count ) ||
+        !HSACBuffersSizeValid( DevExt, geometry.Size )) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    geometry.Size = (ULONG) ROUND_TO_PAGES( geometry.Size );
+
+    if (DevExt->MapFlag != 0 ||
+        ReadNoFence( &DevExt->Stream[geometry.Channel].State ) != HSAC_STREAM_FREE) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    channel = (geometry.Channel == 0) ? &DevExt->WriteChannel : &DevExt->ReadChannel;
+    queue   = (geometry.Channel == 0) ? DevExt->WriteQueue : DevExt->ReadQueue;
+
+    WdfIoQueueStopSynchronously( queue );
+    WdfIoQueueStopSynchronously( DevExt->BatchQueue );
+
+    //
+    // What is left in flight came from the packet ring.
+    //
+    WdfWaitLockAcquire( DevExt->BuffersLock, NULL );
+
+    if (ReadNoFence( &channel->Stats.InFlight ) != 0) {
+        status = STATUS_DEVICE_BUSY;
+    } else {
+        old.Channel = geometry.Channel;
+        (VOID) HSACBuffersGetGeometry( DevExt, &old );
+
+        HSACBuffersDelete( DevExt, geometry.Channel );
+
+        status = HSACBuffersCreate( DevExt, geometry.Channel, geometry.Count, geometry.Size );
+        if (!NT_SUCCESS(status)) {
+            geometry = old;
+            if (!NT_SUCCESS(HSACBuffersCreate( DevExt, old.Channel, old.Count, old.Size ))) {
+#if (DBG != 0)
+                TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                            "Channel %d is left without common buffers", old.Channel);
+#endif
+                geometry.Count = 0;
+            }
+        }
+
+        //
+        // ReadFile and WriteFile headers may name any buffer of a
+        // channel in packet mode.
+        //
+        if (geometry.Count != 0 && DevExt->dmaProfile == WdfDmaProfilePacket64) {
+            NTSTATUS commitStatus = HSACBuffersCommitLocked( DevExt, geometry.Channel,
+                                                             0, geometry.Count );
+            if (NT_SUCCESS(status)) {
+                status = commitStatus;
+            }
+        }
+    }
+
+    WdfWaitLockRelease( DevExt->BuffersLock );
+
+    WdfIoQueueStart( DevExt->BatchQueue );
+    WdfIoQueueStart( queue );
+
+    return status;
+}
+
+NTSTATUS
+HSACBuffersSetCacheMode(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Mode
+    )
+/*++
+Routine Description:
+
+    IOCTL_SET_CACHE_MODE: free both channels' common buffers and set them
+    up again in Mode, with the geometry of the device's hardware key, as
+    if the device had started in it. As for HSACBuffersSetGeometry, the
+    device control queue is sequential, and the read and write queues
+    and the batch queue are stopped while the buffers change.
+
+Return Value:
+
+     STATUS_DEVICE_BUSY if the buffers are mapped or in use
+
+--*/
+{
+    HSAC_BUFFER_GEOMETRY    geometry[2];
+    HSAC_BUFFER_GEOMETRY    old[2];
+    BOOLEAN                 prewarm;
+    ULONG                   keyMode;
+    ULONG                   oldMode;
+    ULONG                   channel;
+    NTSTATUS                status;
+
+    PAGED_CODE();
+
+    if (!HSACBuffersModeValid( Mode )) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (DevExt->MapFlag != 0 ||
+        ReadNoFence( &DevExt->Stream[0].State ) != HSAC_STREAM_FREE ||
+        ReadNoFence( &DevExt->Stream[1].State ) != HSAC_STREAM_FREE) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    HSACBuffersReadGeometry( DevExt, &keyMode, geometry, &prewarm );
+    HSACBuffersFitMode( Mode, geometry );
+
+    WdfIoQueueStopSynchronously( DevExt->WriteQueue );
+    WdfIoQueueStopSynchronously( DevExt->ReadQueue );
+    WdfIoQueueStopSynchronously( DevExt->BatchQueue );
+
+    //
+    // What is left in flight came from the packet ring.
+    //
+    WdfWaitLockAcquire( DevExt->BuffersLock, NULL );
+
+    if (ReadNoFence( &DevExt->WriteChannel.Stats.InFlight ) != 0 ||
+        ReadNoFence( &DevExt->ReadChannel.Stats.InFlight ) != 0) {
+        status = STATUS_DEVICE_BUSY;
+        goto Exit;
+    }
+
+    for (channel = 0; channel < 2; channel++) {
+        old[channel].Channel = channel;
+        (VOID) HSACBuffersGetGeometry( DevExt, &old[channel] );
+        HSACBuffersDelete( DevExt, channel );
+    }
+
+    oldMode = DevExt->CacheMode;
+    DevExt->CacheMode = Mode;
+
+    status = HSACBuffersCreate( DevExt, 0, geometry[0].Count, geometry[0].Size );
+    if (NT_SUCCESS(status)) {
+        status = HSACBuffersCreate( DevExt, 1, geometry[1].Count, geometry[1].Size );
+    }
+
+    if (!NT_SUCCESS(status)) {
+        HSACBuffersDelete( DevExt, 0 );
+        HSACBuffersDelete( DevExt, 1 );
+
+        DevExt->CacheMode = oldMode;
+
+        for (channel = 0; channel < 2; channel++) {
+            if (!NT_SUCCESS(HSACBuffersCreate( DevExt, channel,
+                                               old[channel].Count, old[channel].Size ))) {
+#if (DBG != 0)
+                TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                            "Channel %d is left without common buffers", channel);
+#endif
+            }
+        }
+    }
+
+    //
+    // ReadFile and WriteFile headers may name any buffer in packet mode.
+    //
+    if (DevExt->dmaProfile == WdfDmaProfilePacket64) {
+        for (channel = 0; channel < 2; channel++) {
+            NTSTATUS commitStatus = HSACBuffersCommitLocked( DevExt, channel, 0,
+                (channel == 0) ? DevExt->writeCommonBufferNum : DevExt->readCommonBufferNum );
+            if (NT_SUCCESS(status)) {
+                status = commitStatus;
+            }
+        }
+    }
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "Cache mode 0x%x: %!STATUS!", DevExt->CacheMode, status);
+#endif
+
+Exit:
+    WdfWaitLockRelease( DevExt->BuffersLock );
+
+    WdfIoQueueStart( DevExt->BatchQueue );
+    WdfIoQueueStart( DevExt->ReadQueue );
+    WdfIoQueueStart( DevExt->WriteQueue );
+
+    return status;
+}
+
+ULONG
+HSACBuffersMappings(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Channel,
+    OUT size_t         * Size
+    )
+/*++
+Routine Description:
+
+    How Channel's buffers are mapped into the application: entries 0 on
+    of the arrays, as many as the return value, each of *Size bytes. In
+    a contiguous cache mode that is entry 0, all the buffers.
+
+--*/
+{
+    ULONG   count;
+
+    count = (Channel == 0) ? DevExt->writeCommonBufferNum : DevExt->readCommonBufferNum;
+    *Size = (Channel == 0) ? DevExt->WriteCommonBufferSize : DevExt->ReadCommonBufferSize;
+
+    if (HSAC_CACHE_CONTIGUOUS(DevExt->CacheMode) && count != 0) {
+        *Size *= count;
+        count  = 1;
+    }
+
+    return count;
+}
@@ -76,6 +76,8 @@ Return Value:
     // Get the device extension.
     //
     devExt = HSACGetDeviceContext(WdfIoQueueGetDevice( Queue ));
+    HSACFlightRecord(devExt, HSAC_FLIGHT_REQUEST, HSAC_FLIGHT_NO_CHANNEL, 0,
+                     IoControlCode, (ULONGLONG) (ULONG_PTR) Request);
 #if (DBG != 0)
 	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
 		"HSACEvtIoDeviceControl InputBufferLength: 0x%x, OutputBufferLength: 0x%x\n", 
@@ -319,7 +321,8 @@ Return Value:
 		}
 	case IOCTL_MAP_DMA_BUF_ADDR:
 		{
-			ULONG_PTR address = 0;
+			ULONG mappings;
+			size_t size;
 
 			status = WdfRequestRetrieveInputBuffer(Request, 0, &pInputBuffer, &length);
 			if( !NT_SUCCESS(status)) {
@@ -338,6 +341,32 @@ Return Value:
 				break;
 			}
 
+			//
+			// As many addresses as the channel's buffers are mapped
+			// in now: one in a contiguous cache mode
+			//
+			if (*(PULONG)pInputBuffer > 1) {
+				status = STATUS_INVALID_DEVICE_REQUEST;
+				length = 0;
+				break;
+			}
+			mappings = HSACBuffersMappings(devExt,
+				(*(PULONG)pInputBuffer == 0) ? 1 : 0, &size);
+			if (length < mappings * sizeof(PVOID)) {
+				status = STATUS_BUFFER_TOO_SMALL;
+				length = 0;
+				break;
+			}
+
+			//
+			// Every buffer is mapped, so every buffer has to exist.
+			//
+			status = HSACBuffersCommitAll(devExt);
+			if (!NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
 			if (devExt->MapFlag == 1)
 			{
 				HSACUnmapUserAddress(devExt);
@@ -346,70 +375,541 @@ Return Value:
 			HSACMapUserAddress( devExt );
 			devExt->MapFlag = 1;
 
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-			if (*(PULONG)pInputBuffer == 0)
-			{
-				length = devExt->readCommonBufferNum * sizeof(PVOID);
-				RtlCopyMemory(pOutputBuffer, devExt->pReadUserAddress, length);
-			} 
-			else if (*(PULONG)pInputBuffer == 1)
+			length = mappings * sizeof(PVOID);
+			RtlCopyMemory(pOutputBuffer, (*(PULONG)pInputBuffer == 0) ?
+				devExt->pReadUserAddress : devExt->pWriteUserAddress, length);
+			break;
+		}
+	case IOCTL_UNMAP_DMA_BUF_ADDR:
+		{
+			if (devExt->MapFlag == 1)
 			{
-				length = devExt->writeCommonBufferNum * sizeof(PVOID);
-				RtlCopyMemory(pOutputBuffer, devExt->pWriteUserAddress, length);
+				HSACUnmapUserAddress(devExt);
+				devExt->MapFlag = 0;
 			}
-			else
-			{
-				status = STATUS_INVALID_DEVICE_REQUEST;
+			break;
+		}
+	case IOCTL_SET_DMA_PROFILE:
+		{
+			status = WdfRequestRetrieveInputBuffer(Request, 0, &pInputBuffer, &length);
+			if( !NT_SUCCESS(status)) {
+#if (DBG != 0)
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+					"WdfRequestRetrieveInputBuffer failed 0x%x\n", status);
+#endif
+				break;
 			}
-#else
-			if (*(PULONG)pInputBuffer == 0)
-			{
-				address = (ULONG_PTR)devExt->ReadUserAddress0;
-			} 
-			else if (*(PULONG)pInputBuffer == 1)
-			{
-				address = (ULONG_PTR)devExt->WriteUserAddress0;
+
+			//
+			// Packet mode ReadFile and WriteFile name any buffer.
+			//
+			if ((WDF_DMA_PROFILE)(*(PULONG)pInputBuffer) == WdfDmaProfilePacket64) {
+				status = HSACBuffersCommitAll(devExt);
+				if (!NT_SUCCESS(status)) {
+					length = 0;
+					break;
+				}
 			}
-			else
-			{
+
+			devExt->dmaProfile = (WDF_DMA_PROFILE)(*(PULONG)pInputBuffer);
+
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+				"dmaProfile: %d\n", devExt->dmaProfile);
+#endif
+			length = 0;
+			break;
+		}
+	case IOCTL_SET_INT_MODERATION:
+		{
+			PHSAC_INT_MODERATION moderation;
+
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_INT_MODERATION),
+				&pInputBuffer, &length);
+			if( !NT_SUCCESS(status)) {
+#if (DBG != 0)
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+					"WdfRequestRetrieveInputBuffer failed 0x%x\n", status);
+#endif
+				break;
+			}
+
+			moderation = (PHSAC_INT_MODERATION)pInputBuffer;
+
+			if (moderation->Channel > 1) {
+				status = STATUS_INVALID_PARAMETER;
+			} else {
+				status = HSACDmaChannelSetModeration(devExt,
+					(moderation->Channel == 0) ? &devExt->WriteChannel : &devExt->ReadChannel,
+					moderation->Count, moderation->DelayUs);
+			}
+
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+				"channel: %d, count: %d, delay: %d us, status 0x%x\n",
+				moderation->Channel, moderation->Count, moderation->DelayUs, status);
+#endif
+			length = 0;
+			break;
+		}
+	case IOCTL_SET_DPC_AFFINITY:
+		{
+			PHSAC_DPC_AFFINITY affinity;
+
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_DPC_AFFINITY),
+				&pInputBuffer, &length);
+			if( !NT_SUCCESS(status)) {
+#if (DBG != 0)
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+					"WdfRequestRetrieveInputBuffer failed 0x%x\n", status);
+#endif
+				break;
+			}
+
+			affinity = (PHSAC_DPC_AFFINITY)pInputBuffer;
+
+			if (affinity->Channel > 1 ||
+				KeGetProcessorIndexFromNumber(&affinity->Processor) ==
+					INVALID_PROCESSOR_INDEX) {
+				status = STATUS_INVALID_PARAMETER;
+			} else {
+				status = HSACDmaChannelSetDpcTarget((affinity->Channel == 0) ?
+					&devExt->WriteChannel : &devExt->ReadChannel,
+					&affinity->Processor);
+			}
+
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+				"channel: %d, DPC processor: %d:%d, status 0x%x\n",
+				affinity->Channel, affinity->Processor.Group,
+				affinity->Processor.Number, status);
+#endif
+			length = 0;
+			break;
+		}
+	case IOCTL_SET_POLL_MODE:
+		{
+			PHSAC_POLL_MODE pollMode;
+			WDFFILEOBJECT   fileObject = WdfRequestGetFileObject(Request);
+
+			if (fileObject == NULL) {
 				status = STATUS_INVALID_DEVICE_REQUEST;
+				break;
 			}
 
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_POLL_MODE),
+				&pInputBuffer, &length);
+			if( !NT_SUCCESS(status)) {
 #if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
-				"UserAddress: 0x%I64x", address);
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+					"WdfRequestRetrieveInputBuffer failed 0x%x\n", status);
 #endif
+				break;
+			}
+
+			pollMode = (PHSAC_POLL_MODE)pInputBuffer;
+
+			status = HSACPollSetMode(HSACGetFileContext(fileObject),
+				pollMode->Mode, pollMode->BudgetUs);
 
-			RtlCopyMemory(pOutputBuffer, &address, sizeof(PVOID));
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+				"poll mode: %d, budget: %d us, status 0x%x\n",
+				pollMode->Mode, pollMode->BudgetUs, status);
 #endif
+			length = 0;
 			break;
 		}
-	case IOCTL_UNMAP_DMA_BUF_ADDR:
+	case IOCTL_REGISTER_BUFFER:
 		{
-			if (devExt->MapFlag == 1)
-			{
-				HSACUnmapUserAddress(devExt);
-				devExt->MapFlag = 0;
+			PHSAC_REGISTER_BUFFER reg;
+			ULONG                 channel, regLength, bufferId = 0;
+			PVOID                 address;
+
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_REGISTER_BUFFER),
+				&pInputBuffer, &length);
+			if( !NT_SUCCESS(status)) {
+#if (DBG != 0)
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+					"WdfRequestRetrieveInputBuffer failed 0x%x\n", status);
+#endif
+				length = 0;
+				break;
+			}
+
+			status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG),
+				&pOutputBuffer, &length);
+			if( !NT_SUCCESS(status)) {
+#if (DBG != 0)
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+					"WdfRequestRetrieveOutputBuffer failed 0x%x\n", status);
+#endif
+				length = 0;
+				break;
+			}
+
+			//
+			// METHOD_BUFFERED: the input and output share one buffer.
+			//
+			reg       = (PHSAC_REGISTER_BUFFER)pInputBuffer;
+			channel   = reg->Channel;
+			regLength = reg->Length;
+			address   = (PVOID)(ULONG_PTR)reg->Address;
+
+			status = HSACRegisterBuffer(devExt, WdfRequestGetFileObject(Request),
+				channel, address, regLength, &bufferId);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
 			}
+
+			*(PULONG)pOutputBuffer = bufferId;
+			length = sizeof(ULONG);
 			break;
 		}
-	case IOCTL_SET_DMA_PROFILE:
+	case IOCTL_UNREGISTER_BUFFER:
 		{
-			status = WdfRequestRetrieveInputBuffer(Request, 0, &pInputBuffer, &length);
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_REGISTERED_IO),
+				&pInputBuffer, &length);
 			if( !NT_SUCCESS(status)) {
 #if (DBG != 0)
 				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
 					"WdfRequestRetrieveInputBuffer failed 0x%x\n", status);
 #endif
+				length = 0;
 				break;
 			}
 
-			devExt->dmaProfile = (WDF_DMA_PROFILE)(*(PULONG)pInputBuffer);
+			status = HSACUnregisterBuffer(devExt, WdfRequestGetFileObject(Request),
+				((PHSAC_REGISTERED_IO)pInputBuffer)->BufferId);
+			length = 0;
+			break;
+		}
+	case IOCTL_REGISTERED_READ:
+	case IOCTL_REGISTERED_WRITE:
+		{
+			//
+			// Transfers go through the channel's own queue, which holds
+			// them to the size of its transaction pool (HSACEvtIoRegistered).
+			//
+			status = WdfRequestForwardToIoQueue(Request,
+				(IoControlCode == IOCTL_REGISTERED_READ) ? devExt->ReadQueue : devExt->WriteQueue);
+			if (NT_SUCCESS(status)) {
+				return;
+			}
+			length = 0;
+			break;
+		}
+	case IOCTL_PACKET_BATCH:
+	case IOCTL_PACKET_CHAIN:
+		{
+			//
+			// Batches and chains run one at a time, on their own queue
+			// (Batch.c), which may present them from the DPC: their
+			// buffers are committed here first.
+			//
+			HSACBatchCommitBuffers(devExt, Request);
 
+			status = WdfRequestForwardToIoQueue(Request, devExt->BatchQueue);
+			if (NT_SUCCESS(status)) {
+				return;
+			}
+			length = 0;
+			break;
+		}
+	case IOCTL_MAP_PACKET_RING:
+		{
+			PVOID userAddress = NULL;
+
+			status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONGLONG),
+				&pOutputBuffer, &length);
+			if( !NT_SUCCESS(status)) {
 #if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
-				"dmaProfile: %d\n", devExt->dmaProfile);
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+					"WdfRequestRetrieveOutputBuffer failed 0x%x\n", status);
+#endif
+				length = 0;
+				break;
+			}
+
+			status = HSACRingMap(devExt, WdfRequestGetFileObject(Request), &userAddress);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			*(PULONGLONG)pOutputBuffer = (ULONGLONG)(ULONG_PTR)userAddress;
+			length = sizeof(ULONGLONG);
+			break;
+		}
+	case IOCTL_UNMAP_PACKET_RING:
+		{
+			status = HSACRingUnmap(devExt, WdfRequestGetFileObject(Request));
+			length = 0;
+			break;
+		}
+	case IOCTL_PACKET_RING_ENTER:
+		{
+			ULONG submitted = 0;
+
+			status = HSACRingEnter(devExt, WdfRequestGetFileObject(Request), &submitted);
+
+			length = 0;
+			if (OutputBufferLength >= sizeof(ULONG) &&
+				NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG),
+					&pOutputBuffer, NULL))) {
+				*(PULONG)pOutputBuffer = submitted;
+				length = sizeof(ULONG);
+			}
+			break;
+		}
+	case IOCTL_START_STREAM:
+		{
+			PVOID userAddress = NULL;
+
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_STREAM_START),
+				&pInputBuffer, NULL);
+			if (NT_SUCCESS(status)) {
+				status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONGLONG),
+					&pOutputBuffer, NULL);
+			}
+			if( !NT_SUCCESS(status)) {
+#if (DBG != 0)
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+					"IOCTL_START_STREAM buffers: 0x%x\n", status);
 #endif
+				length = 0;
+				break;
+			}
+
+			status = HSACStreamStart(devExt, WdfRequestGetFileObject(Request),
+				(PHSAC_STREAM_START)pInputBuffer, &userAddress);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			*(PULONGLONG)pOutputBuffer = (ULONGLONG)(ULONG_PTR)userAddress;
+			length = sizeof(ULONGLONG);
+			break;
+		}
+	case IOCTL_STOP_STREAM:
+		{
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG),
+				&pInputBuffer, NULL);
+			if (NT_SUCCESS(status)) {
+				status = HSACStreamStop(devExt, WdfRequestGetFileObject(Request),
+					*(PULONG)pInputBuffer);
+			}
+			length = 0;
+			break;
+		}
+	case IOCTL_GET_STATS:
+		{
+			status = WdfRequestRetrieveOutputBuffer(Request, sizeof(HSAC_STATS),
+				&pOutputBuffer, NULL);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			HSACStatsSnapshot(devExt, (PHSAC_STATS)pOutputBuffer);
+			length = sizeof(HSAC_STATS);
+			break;
+		}
+	case IOCTL_MAP_STATS_PAGE:
+		{
+			PVOID userAddress = NULL;
+
+			status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONGLONG),
+				&pOutputBuffer, NULL);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			status = HSACStatsMap(devExt, WdfRequestGetFileObject(Request), &userAddress);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			*(PULONGLONG)pOutputBuffer = (ULONGLONG)(ULONG_PTR)userAddress;
+			length = sizeof(ULONGLONG);
+			break;
+		}
+	case IOCTL_UNMAP_STATS_PAGE:
+		{
+			status = HSACStatsUnmap(devExt, WdfRequestGetFileObject(Request));
+			length = 0;
+			break;
+		}
+	case IOCTL_GET_FLIGHT_RECORD:
+		{
+			ULONG processor;
+
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG),
+				&pInputBuffer, NULL);
+			if (NT_SUCCESS(status)) {
+				//
+				// Take the input before the output overwrites it.
+				//
+				processor = *(PULONG)pInputBuffer;
+				status = WdfRequestRetrieveOutputBuffer(Request,
+					sizeof(HSAC_FLIGHT_RECORD), &pOutputBuffer, NULL);
+			}
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			status = HSACFlightDump(devExt, processor, (PHSAC_FLIGHT_RECORD)pOutputBuffer);
+			length = NT_SUCCESS(status) ? sizeof(HSAC_FLIGHT_RECORD) : 0;
+			break;
+		}
+	case IOCTL_GET_REQUEST_TIMES:
+		{
+			WDFFILEOBJECT   fileObject = WdfRequestGetFileObject(Request);
+
+			if (fileObject == NULL) {
+				status = STATUS_INVALID_DEVICE_REQUEST;
+				length = 0;
+				break;
+			}
+
+			status = WdfRequestRetrieveOutputBuffer(Request,
+				sizeof(HSAC_REQUEST_LOG), &pOutputBuffer, NULL);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			HSACTimesCopy(HSACGetFileContext(fileObject), (PHSAC_REQUEST_LOG)pOutputBuffer);
+			length = sizeof(HSAC_REQUEST_LOG);
+			break;
+		}
+	case IOCTL_SET_BUFFER_GEOMETRY:
+		{
+			HSAC_BUFFER_GEOMETRY geometry;
+
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_BUFFER_GEOMETRY),
+				&pInputBuffer, NULL);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			geometry = *(PHSAC_BUFFER_GEOMETRY)pInputBuffer;
+			status = HSACBuffersSetGeometry(devExt, &geometry);
+
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+				"channel: %d, %d buffers of %d bytes, status 0x%x\n",
+				geometry.Channel, geometry.Count, geometry.Size, status);
+#endif
+			//
+			// The output, if any, is the geometry the channel ended up with.
+			//
+			length = 0;
+			if (OutputBufferLength >= sizeof(HSAC_BUFFER_GEOMETRY) &&
+				NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request,
+					sizeof(HSAC_BUFFER_GEOMETRY), &pOutputBuffer, NULL)) &&
+				NT_SUCCESS(HSACBuffersGetGeometry(devExt, &geometry))) {
+				*(PHSAC_BUFFER_GEOMETRY)pOutputBuffer = geometry;
+				length = sizeof(HSAC_BUFFER_GEOMETRY);
+			}
+			break;
+		}
+	case IOCTL_GET_BUFFER_GEOMETRY:
+		{
+			HSAC_BUFFER_GEOMETRY geometry;
+
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG),
+				&pInputBuffer, NULL);
+			if (NT_SUCCESS(status)) {
+				geometry.Channel = *(PULONG)pInputBuffer;
+				status = WdfRequestRetrieveOutputBuffer(Request,
+					sizeof(HSAC_BUFFER_GEOMETRY), &pOutputBuffer, NULL);
+			}
+			if (NT_SUCCESS(status)) {
+				status = HSACBuffersGetGeometry(devExt, &geometry);
+			}
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			*(PHSAC_BUFFER_GEOMETRY)pOutputBuffer = geometry;
+			length = sizeof(HSAC_BUFFER_GEOMETRY);
+			break;
+		}
+	case IOCTL_SET_CACHE_MODE:
+		{
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG),
+				&pInputBuffer, NULL);
+			if (NT_SUCCESS(status)) {
+				status = HSACBuffersSetCacheMode(devExt, *(PULONG)pInputBuffer);
+			}
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+				"IOCTL_SET_CACHE_MODE status 0x%x\n", status);
+#endif
+			length = 0;
+			break;
+		}
+	case IOCTL_GET_CACHE_MODE:
+		{
+			status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG),
+				&pOutputBuffer, NULL);
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			*(PULONG)pOutputBuffer = devExt->CacheMode;
+			length = sizeof(ULONG);
+			break;
+		}
+	case IOCTL_ALLOC_DMA_BUFFER:
+		{
+			HSAC_DMA_BUFFER buffer;
+			ULONG           size;
+
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_DMA_ALLOC),
+				&pInputBuffer, NULL);
+			if (NT_SUCCESS(status)) {
+				//
+				// METHOD_BUFFERED: the input and output share one buffer.
+				//
+				size = ((PHSAC_DMA_ALLOC)pInputBuffer)->Size;
+				status = WdfRequestRetrieveOutputBuffer(Request, sizeof(HSAC_DMA_BUFFER),
+					&pOutputBuffer, NULL);
+			}
+			if (NT_SUCCESS(status)) {
+				status = HSACHeapAllocate(devExt, WdfRequestGetFileObject(Request),
+					size, &buffer);
+			}
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+				"IOCTL_ALLOC_DMA_BUFFER status 0x%x\n", status);
+#endif
+			if( !NT_SUCCESS(status)) {
+				length = 0;
+				break;
+			}
+
+			*(PHSAC_DMA_BUFFER)pOutputBuffer = buffer;
+			length = sizeof(HSAC_DMA_BUFFER);
+			break;
+		}
+	case IOCTL_FREE_DMA_BUFFER:
+		{
+			status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG),
+				&pInputBuffer, NULL);
+			if (NT_SUCCESS(status)) {
+				status = HSACHeapFree(devExt, WdfRequestGetFileObject(Request),
+					*(PULONG)pInputBuffer);
+			}
 			length = 0;
 			break;
 		}
@@ -0,0 +1,1586 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Dma.c
+
+Abstract:
+
+    Per channel request pipeline. Each DMA channel owns a pool of
+    HSAC_MAX_OUTSTANDING_REQUESTS transactions; a transaction moves
+    Free -> Allocated (EvtIoRead/EvtIoWrite) -> Ready (EvtProgramDma)
+    -> Active (channel started) -> Done (ISR) and back to Ready or Free
+    when the DPC drives or completes its request.
+
+    The engine has no way to append to a chain it is already walking, so
+    when a channel goes idle every Ready scatter/gather chain is linked
+    behind the first one (LastElement cleared, next pointer set to the
+    following slot) and the whole batch is started with one doorbell.
+    The ISR restarts the channel before queueing the DPC. A request for a
+    registered buffer (Register.c) brings the chain built when the buffer
+    was registered instead of one in its slot, and is linked the same way.
+    A packet ring transfer (Ring.c) or IOCTL_PACKET_BATCH entry
+    (Batch.c) is a packet mode transfer on a transaction of the ring's
+    or the batch's own, which is never on the Free list.
+
+    Interrupt moderation holds an idle channel back until enough requests
+    are Ready to share one chain, and so one interrupt, or the oldest has
+    waited long enough; the moderation timer starts whatever is left.
+
+    The ISR hands retired transactions to the DPC without a lock: it
+    pushes them on the channel's interlocked DoneStack and ORs the
+    channel's bit into DevExt->IntPending, and the channel's own DPC
+    clears that bit and flushes the stack. An interrupt that arrives
+    while the DPC runs only adds to what the next DPC finds, so none is
+    lost and the DPC takes the interrupt spinlock only to program the
+    channel again.
+
+    A Polled transaction belongs to the thread that issued it: that thread
+    spins on INT_STATE, retires the chain itself if the ISR has not, and
+    takes the transaction once it is Done. It is never pushed for the DPC
+    unless the poller gives up and clears Polled first.
+
+    The Free, Ready and Active lists and the moderation state are
+    protected by the spinlock of Channel->Interrupt, the interrupt that
+    reports the channel; nothing else serializes the two channels. With
+    one line interrupt both channels share it, but only for these list
+    splices and doorbells, never across a whole I/O callback or DPC; with
+    one MSI message per channel each channel has an interrupt of its own.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Dma.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACDmaChannelInitialize)
+#endif
+
+NTSTATUS
+HSACDmaChannelInitialize(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN ULONG             Index,
+	IN ULONG             TransferElements
+	)
+/*++
+Routine Description:
+
+    Create the channel's transaction pool and the common buffer its DTE
+    chains are built in, one slot per transaction. The descriptors get a
+    buffer of their own so that none of the data buffers user space maps
+    with IOCTL_MAP_DMA_BUF_ADDR is written by a scatter/gather transfer.
+    Called from HSACInitializeDMA once the DMA enabler exists.
+
+Arguments:
+
+    DevExt           Pointer to our DEVICE_EXTENSION
+    Channel          &DevExt->WriteChannel or &DevExt->ReadChannel
+    Index            0 - DMA0 (write), 1 - DMA1 (read)
+    TransferElements Largest number of DTEs one transfer needs
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+	NTSTATUS				status = STATUS_SUCCESS;
+	WDF_OBJECT_ATTRIBUTES	attributes;
+	WDF_TIMER_CONFIG		timerConfig;
+	WDF_DPC_CONFIG			dpcConfig;
+	PTRANSACTION_CONTEXT	transContext;
+	ULONG					i;
+
+	PAGED_CODE();
+
+	Channel->Index     = Index;
+	Channel->IntActive = (Index == 0) ? DMA0IntActive : DMA1IntActive;
+	Channel->Interrupt = DevExt->Interrupt;
+
+	Channel->ModerationCount = 1;
+	Channel->ModerationDelay = 0;
+	Channel->ModerationTicks = 0;
+	Channel->ModerationHeld  = FALSE;
+
+	InitializeListHead(&Channel->FreeList);
+	InitializeListHead(&Channel->ReadyList);
+	InitializeListHead(&Channel->ActiveList);
+	InitializeSListHead(&Channel->DoneStack);
+
+	//
+	// HSAC DMA_TRANSFER_ELEMENTS must be 16-byte aligned, so every slot
+	// starts on a 16-byte boundary. The common buffer itself is aligned
+	// by WdfDeviceSetAlignmentRequirement.
+	//
+	Channel->DteSlotSize = (TransferElements * sizeof(DMA_TRANSFER_ELEMENT) +
+		HSAC_DTE_ALIGNMENT_16) & ~HSAC_DTE_ALIGNMENT_16;
+
+	if (!Channel->DteCommonBuffer) {
+
+		status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+			(size_t) Channel->DteSlotSize * HSAC_MAX_OUTSTANDING_REQUESTS,
+			WDF_NO_OBJECT_ATTRIBUTES,
+			&Channel->DteCommonBuffer );
+
+		if(!NT_SUCCESS(status)) {
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+				"WdfCommonBufferCreate(channel %d DTEs) failed: %!STATUS!",
+				Index, status);
+#endif
+			Channel->DteCommonBuffer = NULL;
+			return status;
+		}
+	}
+
+	Channel->DteBase   = (PUCHAR)
+		WdfCommonBufferGetAlignedVirtualAddress(Channel->DteCommonBuffer);
+	Channel->DteBaseLA =
+		WdfCommonBufferGetAlignedLogicalAddress(Channel->DteCommonBuffer);
+
+	RtlZeroMemory( Channel->DteBase,
+		WdfCommonBufferGetLength(Channel->DteCommonBuffer) );
+
+	//
+	// Transactions objects are parented to DMA enabler object by default.
+	// They will be deleted along with the DMA enabler object.
+	//
+	for (i = 0; i < HSAC_MAX_OUTSTANDING_REQUESTS; i++) {
+
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TRANSACTION_CONTEXT);
+
+		status = WdfDmaTransactionCreate( DevExt->DmaEnabler,
+			&attributes,
+			&Channel->Transactions[i] );
+
+		if(!NT_SUCCESS(status)) {
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+				"WdfDmaTransactionCreate(channel %d) failed: %!STATUS!",
+				Index, status);
+#endif
+			return status;
+		}
+
+		transContext = HSACGetTransactionContext(Channel->Transactions[i]);
+		RtlZeroMemory(transContext, sizeof(TRANSACTION_CONTEXT));
+
+		transContext->Transaction = Channel->Transactions[i];
+		transContext->Channel     = Channel;
+		transContext->State       = HsacDmaFree;
+		transContext->DteVA       = (PDMA_TRANSFER_ELEMENT)
+			(Channel->DteBase + i * Channel->DteSlotSize);
+		transContext->DteLA.QuadPart =
+			Channel->DteBaseLA.QuadPart + i * Channel->DteSlotSize;
+
+		InsertTailList(&Channel->FreeList, &transContext->ListEntry);
+	}
+
+	//
+	// The timer callback takes the interrupt spinlock itself.
+	//
+	if (!Channel->ModerationTimer) {
+
+		WDF_TIMER_CONFIG_INIT(&timerConfig, HSACEvtModerationTimer);
+		timerConfig.AutomaticSerialization = FALSE;
+
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, MODERATION_TIMER_CONTEXT);
+		attributes.ParentObject = DevExt->Device;
+
+		status = WdfTimerCreate( &timerConfig, &attributes, &Channel->ModerationTimer );
+
+		if(!NT_SUCCESS(status)) {
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+				"WdfTimerCreate(channel %d) failed: %!STATUS!", Index, status);
+#endif
+			Channel->ModerationTimer = NULL;
+			return status;
+		}
+
+		HSACGetModerationTimerContext(Channel->ModerationTimer)->Channel = Channel;
+	}
+
+	//
+	// Each channel completes on a DPC of its own, so a write and a read
+	// finishing together are completed on two processors at once; the
+	// target processor of each can be set with IOCTL_SET_DPC_AFFINITY
+	// (HSACDmaChannelSetDpcTarget). It is queued only through
+	// HSACDmaChannelQueueDpc and runs one pass at a time (IsrDpc.c).
+	//
+	if (!Channel->Dpc) {
+
+		WDF_DPC_CONFIG_INIT(&dpcConfig, HSACEvtChannelDpc);
+		dpcConfig.AutomaticSerialization = FALSE;
+
+		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, CHANNEL_DPC_CONTEXT);
+		attributes.ParentObject = DevExt->Device;
+
+		status = WdfDpcCreate( &dpcConfig, &attributes, &Channel->Dpc );
+
+		if(!NT_SUCCESS(status)) {
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+				"WdfDpcCreate(channel %d) failed: %!STATUS!", Index, status);
+#endif
+			Channel->Dpc = NULL;
+			return status;
+		}
+
+		HSACGetChannelDpcContext(Channel->Dpc)->Channel = Channel;
+	}
+
+#if (DBG != 0)
+	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
+		"DMA channel %d: %d transactions, DTE slot %d bytes at 0x%p (#0x%I64X)",
+		Index, HSAC_MAX_OUTSTANDING_REQUESTS, Channel->DteSlotSize,
+		Channel->DteBase, Channel->DteBaseLA.QuadPart);
+#endif
+
+	return status;
+}
+
+WDFDMATRANSACTION
+HSACDmaChannelAllocate(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN WDFREQUEST        Request
+	)
+/*++
+Routine Description:
+
+    Take a transaction from the channel's pool for Request (or NULL).
+    The queues present at most HSAC_MAX_OUTSTANDING_REQUESTS requests,
+    so this only fails if a request is completed without returning its
+    transaction. Request is set under the interrupt spinlock, under
+    which HSACDmaChannelCancel looks for it.
+
+Return Value:
+
+    The transaction, or NULL.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext = NULL;
+
+	UNREFERENCED_PARAMETER(DevExt);
+
+	WdfInterruptAcquireLock( Channel->Interrupt );
+
+	if (!IsListEmpty(&Channel->FreeList)) {
+		transContext = CONTAINING_RECORD(RemoveHeadList(&Channel->FreeList),
+			TRANSACTION_CONTEXT, ListEntry);
+		transContext->State     = HsacDmaAllocated;
+		transContext->Cancelled = FALSE;
+		transContext->Polled    = FALSE;
+		transContext->CompletionOwners = 2;
+		transContext->Request   = Request;
+		transContext->Packet    = FALSE;
+		transContext->Registered = NULL;
+	}
+
+	WdfInterruptReleaseLock( Channel->Interrupt );
+
+	return transContext ? transContext->Transaction : NULL;
+}
+
+VOID
+HSACDmaChannelFree(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction
+	)
+/*++
+Routine Description:
+
+    Return an Allocated (or, from the DPC, Done) transaction to its pool,
+    and a packet mode transfer's buffer (HSACDmaChannelPacketDone). The
+    caller has already released it.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext = HSACGetTransactionContext(Transaction);
+
+	if (transContext->Packet) {
+		HSACDmaChannelPacketDone(DevExt, transContext->PacketIndex);
+	}
+
+	WdfInterruptAcquireLock( transContext->Channel->Interrupt );
+
+	ASSERT(transContext->State == HsacDmaAllocated ||
+		transContext->State == HsacDmaDone);
+	transContext->State   = HsacDmaFree;
+	transContext->Request = NULL;
+	InsertTailList(&transContext->Channel->FreeList, &transContext->ListEntry);
+
+	WdfInterruptReleaseLock( transContext->Channel->Interrupt );
+}
+
+static VOID
+HSACDmaChannelProgram(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN PHYSICAL_ADDRESS  Address,
+	IN ULONG             Size,
+	IN ULONG             Ctrl,
+	IN ULONG             Dtes
+	)
+/*++
+Routine Description:
+
+    Write ADDR/SIZE and then CTRL (the doorbell) of one channel. Dtes
+    is only recorded. Interrupt spinlock held.
+
+--*/
+{
+	InterlockedIncrement64(&Channel->Stats.Programs);
+	HSACFlightRecord(DevExt, HSAC_FLIGHT_PROGRAM, (UCHAR) Channel->Index,
+		(USHORT) min(Dtes, 0xFFFF), Size, (ULONGLONG) Address.QuadPart);
+
+	if (Channel->Index == 0) {
+		WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->DMA0_ADDR32, Address.LowPart );
+		WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->DMA0_ADDR64, Address.HighPart );
+		WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->DMA0_SIZE, Size );
+		WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->DMA0_CTRL, Ctrl );
+	} else {
+		WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->DMA1_ADDR32, Address.LowPart );
+		WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->DMA1_ADDR64, Address.HighPart );
+		WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->DMA1_SIZE, Size );
+		WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->DMA1_CTRL, Ctrl );
+		HSAC_STAMP_READ(DevExt, HsacReadStageProgrammed);
+	}
+}
+
+static PHYSICAL_ADDRESS
+HSACDmaChannelPacketAddress(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN ULONG             Index
+	)
+/*++
+Routine Description:
+
+    Logical address of the channel's common buffer Index, or of the heap
+    buffer whose handle it is, which a packet mode transfer names. The
+    same in every cache mode: each buffer has its entry in the arrays
+    (Buffers.c).
+
+--*/
+{
+	if (Index & HSAC_HEAP_HANDLE) {
+		return HSACHeapAddress(DevExt, Index);
+	}
+
+	return (Channel->Index == 0) ?
+		DevExt->pWriteCommonBufferBaseLA[Index] :
+		DevExt->pReadCommonBufferBaseLA[Index];
+}
+
+BOOLEAN
+HSACDmaChannelPacketValid(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Channel,
+	IN ULONG             Index,
+	IN ULONG             Size
+	)
+/*++
+Routine Description:
+
+    Does a packet mode transfer of Size bytes name a common buffer of
+    Channel (0 - write, 1 - read), or a buffer from the heap (Heap.c),
+    and fit in it? Every packet mode transfer is checked here before it
+    is built, since the buffers' number and size can change, and a
+    buffer only exists once it has been committed (Buffers.c). A heap
+    buffer cannot be freed from under the transfer until
+    HSACDmaChannelPacketDone.
+
+--*/
+{
+	ULONG	buffers;
+	size_t	size;
+
+	if (Channel > 1 || Size == 0) {
+		return FALSE;
+	}
+
+	if (Index & HSAC_HEAP_HANDLE) {
+		return HSACHeapPacketValid(DevExt, Index, Size);
+	}
+
+	buffers = (Channel == 0) ?
+		DevExt->writeCommonBufferNum : DevExt->readCommonBufferNum;
+	size = (Channel == 0) ?
+		DevExt->WriteCommonBufferSize : DevExt->ReadCommonBufferSize;
+
+	if (Index < buffers &&
+		((Channel == 0) ? DevExt->pWriteCommonBuffer :
+						  DevExt->pReadCommonBuffer)[Index] == NULL) {
+		return FALSE;
+	}
+
+	return Index < buffers && Size <= size;
+}
+
+VOID
+HSACDmaChannelPacketDone(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Index
+	)
+/*++
+Routine Description:
+
+    A transfer HSACDmaChannelPacketValid took is done with its buffer,
+    whether it ran or not. Only a heap buffer keeps count.
+
+--*/
+{
+	if (Index & HSAC_HEAP_HANDLE) {
+		HSACHeapPacketDone(DevExt, Index);
+	}
+}
+
+static PHYSICAL_ADDRESS
+HSACDmaChannelChainAddress(
+	IN PTRANSACTION_CONTEXT TransContext
+	)
+/*++
+Routine Description:
+
+    Logical address of the first DTE of a scatter/gather request: its
+    registered buffer's prebuilt chain, or the chain in its own slot.
+
+--*/
+{
+	return TransContext->Registered ?
+		TransContext->Registered->DteLA : TransContext->DteLA;
+}
+
+static BOOLEAN
+HSACDmaChannelHold(
+	IN PHSAC_DMA_CHANNEL    Channel,
+	IN PTRANSACTION_CONTEXT First
+	)
+/*++
+Routine Description:
+
+    Interrupt moderation: should the Ready scatter/gather chains wait for
+    more to join them? Packet mode transfers cannot be linked and are
+    never held. Interrupt spinlock held.
+
+--*/
+{
+	PLIST_ENTRY		entry;
+	ULONG			ready = 0;
+
+	if (Channel->ModerationCount <= 1 || First->Packet) {
+		return FALSE;
+	}
+
+	for (entry = Channel->ReadyList.Flink;
+		 entry != &Channel->ReadyList && ready < Channel->ModerationCount;
+		 entry = entry->Flink) {
+		ready++;
+	}
+
+	if (ready >= Channel->ModerationCount) {
+		return FALSE;
+	}
+
+	return KeQueryPerformanceCounter(NULL).QuadPart - First->ReadyTime <
+		Channel->ModerationTicks;
+}
+
+static VOID
+HSACDmaChannelStart(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    If the channel is idle, start whatever is Ready: one packet mode
+    transfer, or every scatter/gather chain up to the next packet mode
+    transfer linked into a single chain. Sets ModerationHeld if Ready
+    work is held back for interrupt moderation. Nothing is started while
+    the channel is powered down or an abort has not come back from the
+    card (HSACDmaChannelAbort). Interrupt spinlock held.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	first;
+	PTRANSACTION_CONTEXT	prev;
+	PTRANSACTION_CONTEXT	transContext;
+	ULONG					sgTransferSize;
+	ULONG					count;
+	ULONG					dtes;
+
+	Channel->ModerationHeld = FALSE;
+
+	if (Channel->PoweredDown || Channel->Aborting) {
+		return;
+	}
+
+	if (!IsListEmpty(&Channel->ActiveList) || IsListEmpty(&Channel->ReadyList)) {
+		return;
+	}
+
+	first = CONTAINING_RECORD(Channel->ReadyList.Flink, TRANSACTION_CONTEXT, ListEntry);
+
+	if (HSACDmaChannelHold(Channel, first)) {
+		Channel->ModerationHeld = TRUE;
+		return;
+	}
+
+	if (first->Packet) {
+
+		RemoveEntryList(&first->ListEntry);
+		first->State = HsacDmaActive;
+		InsertTailList(&Channel->ActiveList, &first->ListEntry);
+
+		HSACStatsMax(&Channel->Stats.MaxDtes, 1);
+
+		HSACDmaChannelProgram(DevExt, Channel,
+			HSACDmaChannelPacketAddress(DevExt, Channel, first->PacketIndex),
+			first->PacketSize, DMA_CTRL_START, 1);
+		return;
+	}
+
+	prev           = NULL;
+	sgTransferSize = 0;
+	count          = 0;
+	dtes           = 0;
+
+	while (!IsListEmpty(&Channel->ReadyList)) {
+
+		transContext = CONTAINING_RECORD(Channel->ReadyList.Flink,
+			TRANSACTION_CONTEXT, ListEntry);
+		if (transContext->Packet) {
+			break;
+		}
+
+		RemoveEntryList(&transContext->ListEntry);
+		transContext->State = HsacDmaActive;
+		InsertTailList(&Channel->ActiveList, &transContext->ListEntry);
+
+		//
+		// A chain is built with LastElement set on its final DTE; point
+		// the previous chain's final DTE at this one instead.
+		//
+		if (prev) {
+			PHYSICAL_ADDRESS next = HSACDmaChannelChainAddress(transContext);
+
+			prev->LastDte->DescPtrLow.LowAddress   = DESC_PTR_ADDR( next.LowPart );
+			prev->LastDte->DescPtrHigh.HighAddress = next.HighPart;
+			prev->LastDte->DescPtrLow.LastElement  = FALSE;
+		}
+
+		sgTransferSize += transContext->TransferSize;
+		dtes += transContext->DteCount;
+		prev = transContext;
+		count++;
+	}
+
+	HSACStatsMax(&Channel->Stats.MaxDtes, (LONG) dtes);
+
+	//
+	// A registered buffer's chain is reused, and may have been linked to
+	// another one the last time it ran.
+	//
+	prev->LastDte->DescPtrLow.LastElement = TRUE;
+
+	//
+	// The chain must be visible to the device before the doorbell.
+	//
+	KeMemoryBarrier();
+
+#if (DBG != 0)
+	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
+		"DMA channel %d: start %d linked chains, total size: %d",
+		Channel->Index, count, sgTransferSize);
+#endif
+
+	HSACDmaChannelProgram(DevExt, Channel, HSACDmaChannelChainAddress(first),
+		sgTransferSize, DMA_CTRL_START | DMA_CTRL_SG_ENA, dtes);
+}
+
+static LONGLONG
+HSACDmaChannelDueTime(
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    If Ready work is held back, the relative due time (100ns units) at
+    which the oldest Ready request's ModerationDelay is up; otherwise 0.
+    The timer cannot be set from under the interrupt spinlock, so
+    callers arm it once they have released the lock. Interrupt spinlock
+    held.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	first;
+	LARGE_INTEGER			frequency;
+	LONGLONG				remaining;
+
+	if (!Channel->ModerationHeld) {
+		return 0;
+	}
+
+	first = CONTAINING_RECORD(Channel->ReadyList.Flink, TRANSACTION_CONTEXT, ListEntry);
+
+	remaining = Channel->ModerationTicks -
+		(KeQueryPerformanceCounter(&frequency).QuadPart - first->ReadyTime);
+	remaining = remaining * 10000000 / frequency.QuadPart;
+
+	return -((remaining > 0) ? remaining : 1);
+}
+
+static BOOLEAN
+HSACDmaChannelChainRun(
+	IN PTRANSACTION_CONTEXT TransContext,
+	IN ULONGLONG            Address,
+	IN ULONGLONG            Length
+	)
+/*++
+Routine Description:
+
+    Append the Length bytes at Address to the chain in the transaction's
+    DTE slot, cut at each 4GB boundary they cross (Reg.h). DteCount is
+    the number of DTEs so far, and LastDte the last of them.
+
+Return Value:
+
+    FALSE if the chain does not fit in the slot.
+
+--*/
+{
+	PHSAC_DMA_CHANNEL		channel = TransContext->Channel;
+	PDMA_TRANSFER_ELEMENT	dteVA;
+	ULONG					dteLALow;
+	ULONGLONG				run;
+
+	while (Length) {
+
+		run = HSAC_DTE_BOUNDARY - (Address & (HSAC_DTE_BOUNDARY - 1));
+		if (run > Length) {
+			run = Length;
+		}
+
+		if (TransContext->DteCount == channel->DteSlotSize / sizeof(DMA_TRANSFER_ELEMENT)) {
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_ERROR, DBG_DPC,
+				"DMA channel %d: chain needs more than %d DTEs",
+				channel->Index, TransContext->DteCount);
+#endif
+			return FALSE;
+		}
+
+		dteVA    = TransContext->DteVA + TransContext->DteCount;
+		dteLALow = TransContext->DteLA.LowPart +
+			(TransContext->DteCount + 1) * sizeof(DMA_TRANSFER_ELEMENT);
+
+		dteVA->PageAddressLow  = (ULONG) Address;
+		dteVA->PageAddressHigh = (ULONG) (Address >> 32);
+		dteVA->TransferSize    = (ULONG) run;
+
+		dteVA->DescPtrLow.LastElement  = FALSE;
+		dteVA->DescPtrLow.LowAddress   = DESC_PTR_ADDR( dteLALow );
+		dteVA->DescPtrHigh.HighAddress = TransContext->DteLA.HighPart;
+
+		TransContext->LastDte = dteVA;
+		TransContext->DteCount++;
+
+		Address += run;
+		Length  -= run;
+	}
+
+	return TRUE;
+}
+
+BOOLEAN
+HSACDmaChannelBuildChain(
+	IN PTRANSACTION_CONTEXT TransContext,
+	IN PSCATTER_GATHER_LIST SgList
+	)
+/*++
+Routine Description:
+
+    Translate the system's SCATTER_GATHER_LIST into a chain of
+    DMA_TRANSFER_ELEMENTs in the transaction's DTE slot. Elements that
+    are physically contiguous are merged into one DTE, so a buffer
+    backed by large pages takes a handful of DTEs instead of one per
+    4KB page, and a DTE that would cross a 4GB boundary is split there.
+    The final DTE has LastElement set. Called from EvtProgramDma, before
+    the transaction is queued.
+
+Return Value:
+
+    FALSE if the chain does not fit in the slot.
+
+--*/
+{
+	ULONG					sgTransferSize = 0;
+	ULONGLONG				address;
+	ULONGLONG				length;
+	ULONG					i;
+
+	TransContext->DteCount = 0;
+
+	for (i = 0; i < SgList->NumberOfElements; ) {
+
+		//
+		// Take the run of elements that continue each other.
+		//
+		address = (ULONGLONG) SgList->Elements[i].Address.QuadPart;
+		length  = SgList->Elements[i].Length;
+
+		for (i++; i < SgList->NumberOfElements &&
+			(ULONGLONG) SgList->Elements[i].Address.QuadPart == address + length; i++) {
+			length += SgList->Elements[i].Length;
+		}
+
+		sgTransferSize += (ULONG) length;
+
+		if (!HSACDmaChannelChainRun(TransContext, address, length)) {
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_ERROR, DBG_DPC,
+				"DMA channel %d: %d SG elements do not fit one DTE slot",
+				TransContext->Channel->Index, SgList->NumberOfElements);
+#endif
+			return FALSE;
+		}
+	}
+
+	if (TransContext->DteCount == 0) {
+		return FALSE;
+	}
+
+	TransContext->LastDte->DescPtrLow.LastElement = TRUE;
+	TransContext->TransferSize = sgTransferSize;
+
+	return TRUE;
+}
+
+BOOLEAN
+HSACDmaChannelBuildPacketChain(
+	IN PDEVICE_EXTENSION    DevExt,
+	IN PTRANSACTION_CONTEXT TransContext,
+	IN PHSAC_PACKET_ENTRY   Entries,
+	IN ULONG                Count
+	)
+/*++
+Routine Description:
+
+    Hardware chained packet mode: one DTE chain, in the transaction's
+    DTE slot, over the common buffers that the transaction's channel's
+    entries name, in array order, so the engine moves them all from one
+    start command with one completion interrupt. Entries of the other
+    channel are passed over; those given must have been checked with
+    HSACDmaChannelPacketValid. Buffers that follow each other in memory
+    share a DTE. The transaction is then queued like a scatter/gather
+    one (Packet is FALSE).
+
+Return Value:
+
+    FALSE if there are no entries for the channel, or they take more
+    DTEs than a slot holds.
+
+--*/
+{
+	PHSAC_DMA_CHANNEL		channel = TransContext->Channel;
+	PHYSICAL_ADDRESS		buffer;
+	ULONG					transferSize = 0;
+	ULONGLONG				address = 0;
+	ULONGLONG				length = 0;
+	ULONG					i;
+
+	TransContext->DteCount = 0;
+
+	for (i = 0; i < Count; i++) {
+
+		if (Entries[i].Channel != channel->Index) {
+			continue;
+		}
+
+		buffer = HSACDmaChannelPacketAddress(DevExt, channel, Entries[i].Index);
+		transferSize += Entries[i].Size;
+
+		if (length && (ULONGLONG) buffer.QuadPart == address + length) {
+			length += Entries[i].Size;
+			continue;
+		}
+
+		if (length && !HSACDmaChannelChainRun(TransContext, address, length)) {
+			return FALSE;
+		}
+
+		address = (ULONGLONG) buffer.QuadPart;
+		length  = Entries[i].Size;
+	}
+
+	if (length == 0 || !HSACDmaChannelChainRun(TransContext, address, length)) {
+		return FALSE;
+	}
+
+	TransContext->LastDte->DescPtrLow.LastElement = TRUE;
+	TransContext->TransferSize = transferSize;
+
+#if (DBG != 0)
+	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
+		"DMA channel %d: packet chain of %d DTEs, total size: %d",
+		channel->Index, TransContext->DteCount, transferSize);
+#endif
+
+	return TRUE;
+}
+
+static VOID
+HSACDmaChannelRetireAll(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    Give up on everything Active or Ready on the channel: ABORT the
+    chain the card is running, if any, and hand every transaction to the
+    DPC (or its poller) as the ISR would, flagged Aborted so it completes
+    as cancelled. Nothing is started until the card reports the aborted
+    chain or the channel is powered up again. Interrupt spinlock held.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext;
+	PLIST_ENTRY				list;
+	PULONG					ctrlRegister;
+	LONGLONG				now;
+	LONG					retired = 0;
+
+	if (!IsListEmpty(&Channel->ActiveList)) {
+
+		ctrlRegister = (Channel->Index == 0) ?
+			(PULONG) &DevExt->Regs->DMA0_CTRL : (PULONG) &DevExt->Regs->DMA1_CTRL;
+
+		WRITE_REGISTER_ULONG( ctrlRegister,
+			(READ_REGISTER_ULONG( ctrlRegister ) & ~(ULONG) DMA_CTRL_CH_STATUS) |
+			DMA_CTRL_ABORT );
+
+		Channel->Aborting = TRUE;
+	}
+
+	now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+	//
+	// Active first: it is older, and the DPC takes the stack in order.
+	//
+	for (list = &Channel->ActiveList; ;list = &Channel->ReadyList) {
+
+		while (!IsListEmpty(list)) {
+			transContext = CONTAINING_RECORD(RemoveHeadList(list),
+				TRANSACTION_CONTEXT, ListEntry);
+			transContext->State = HsacDmaDone;
+			transContext->Aborted = TRUE;
+			transContext->InterruptTime = now;
+			retired++;
+			if (!transContext->Polled) {
+				InterlockedPushEntrySList(&Channel->DoneStack, &transContext->DoneEntry);
+			}
+		}
+
+		if (list == &Channel->ReadyList) {
+			break;
+		}
+	}
+
+	Channel->ModerationHeld = FALSE;
+
+	if (retired == 0) {
+		return;
+	}
+
+	InterlockedExchangeAdd(&Channel->Stats.InFlight, -retired);
+	HSACFlightRecord(DevExt, HSAC_FLIGHT_RETIRE, (UCHAR) Channel->Index,
+		(USHORT) retired, 0, 0);
+
+	InterlockedOr(&DevExt->IntPending, (LONG) Channel->IntActive);
+	InterlockedIncrement(&Channel->Retired);
+
+	HSACDmaChannelQueueDpc(Channel);
+}
+
+VOID
+HSACDmaChannelQueue(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction
+	)
+/*++
+Routine Description:
+
+    Called from EvtProgramDma once the transaction's DTE chain (or packet
+    description) is ready. Starts the channel if it is idle.
+
+--*/
+{
+	HSACDmaChannelQueueList(DevExt, &Transaction, 1);
+}
+
+VOID
+HSACDmaChannelQueueList(
+	IN PDEVICE_EXTENSION   DevExt,
+	IN WDFDMATRANSACTION * Transactions,
+	IN ULONG               Count
+	)
+/*++
+Routine Description:
+
+    HSACDmaChannelQueue for Count transactions of one channel, made Ready
+    in order under one hold of the interrupt spinlock: once the first
+    is started, its DPC may queue more behind it.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext = HSACGetTransactionContext(Transactions[0]);
+	PHSAC_DMA_CHANNEL		channel = transContext->Channel;
+	LONGLONG				readyTime = 0;
+	LONGLONG				dueTime;
+	ULONG					i;
+
+	WdfInterruptAcquireLock( channel->Interrupt );
+
+	if (channel->ModerationCount > 1) {
+		readyTime = KeQueryPerformanceCounter(NULL).QuadPart;
+	}
+
+	for (i = 0; i < Count; i++) {
+
+		transContext = HSACGetTransactionContext(Transactions[i]);
+		ASSERT(transContext->Channel == channel);
+
+		if (readyTime) {
+			transContext->ReadyTime = readyTime;
+		}
+
+		ASSERT(transContext->State == HsacDmaAllocated ||
+			transContext->State == HsacDmaDone);
+		transContext->State = HsacDmaReady;
+		transContext->Aborted = FALSE;
+		InsertTailList(&channel->ReadyList, &transContext->ListEntry);
+
+		InterlockedIncrement64(&channel->Stats.Transfers);
+		InterlockedIncrement(&channel->Stats.InFlight);
+	}
+
+	//
+	// Out of D0 the card will not run them; hand them straight back.
+	//
+	if (channel->PoweredDown) {
+		HSACDmaChannelRetireAll(DevExt, channel);
+	}
+
+	HSACDmaChannelStart(DevExt, channel);
+	dueTime = HSACDmaChannelDueTime(channel);
+
+	WdfInterruptReleaseLock( channel->Interrupt );
+
+	if (dueTime) {
+		WdfTimerStart( channel->ModerationTimer, dueTime );
+	}
+}
+
+VOID
+HSACDmaChannelInterrupt(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN LONGLONG          Time
+	)
+/*++
+Routine Description:
+
+    Called from the ISR (or a poller, under the interrupt spinlock) for a
+    channel whose interrupt bit is set: the Active batch is done. Hand it
+    to the DPC and start the next batch. The caller queues the DPC.
+    The channel's state and the bytes moved go into its statistics.
+    Time is the performance counter when the caller saw the bit; every
+    retired transaction keeps it for its request's completion record.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext;
+	ULONG					ctrl;
+	LONGLONG				bytes = 0;
+	LONG					retired = 0;
+
+	ctrl = READ_REGISTER_ULONG( (Channel->Index == 0) ?
+		(PULONG) &DevExt->Regs->DMA0_CTRL : (PULONG) &DevExt->Regs->DMA1_CTRL );
+	InterlockedIncrement64(
+		&Channel->Stats.ChannelStates[(ctrl & DMA_CTRL_CH_STATUS) >> 8]);
+
+	while (!IsListEmpty(&Channel->ActiveList)) {
+		transContext = CONTAINING_RECORD(RemoveHeadList(&Channel->ActiveList),
+			TRANSACTION_CONTEXT, ListEntry);
+		bytes += transContext->Packet ?
+			transContext->PacketSize : transContext->TransferSize;
+		transContext->State = HsacDmaDone;
+		transContext->InterruptTime = Time;
+		retired++;
+		if (!transContext->Polled) {
+			InterlockedPushEntrySList(&Channel->DoneStack, &transContext->DoneEntry);
+		}
+	}
+
+	InterlockedExchangeAdd64(&Channel->Stats.Bytes, bytes);
+	InterlockedExchangeAdd(&Channel->Stats.InFlight, -retired);
+	HSACFlightRecord(DevExt, HSAC_FLIGHT_RETIRE, (UCHAR) Channel->Index,
+		(USHORT) retired, ctrl, 0);
+
+	InterlockedOr(&DevExt->IntPending, (LONG) Channel->IntActive);
+	InterlockedIncrement(&Channel->Retired);
+
+	//
+	// An aborted chain interrupts too; after it the channel is free.
+	//
+	Channel->Aborting = FALSE;
+
+	HSACDmaChannelStart(DevExt, Channel);
+}
+
+VOID
+HSACDmaChannelTakeDone(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	OUT PLIST_ENTRY      DoneList
+	)
+/*++
+Routine Description:
+
+    Move every transaction the ISR has pushed on the channel's DoneStack
+    to the caller's (DPC) list, oldest first. Takes no lock; the
+    transactions stay Done until the DPC queues or frees them.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext;
+	PSLIST_ENTRY			entry;
+
+	UNREFERENCED_PARAMETER(DevExt);
+
+	InitializeListHead(DoneList);
+
+	//
+	// The stack comes back newest first.
+	//
+	entry = InterlockedFlushSList(&Channel->DoneStack);
+	while (entry != NULL) {
+		transContext = CONTAINING_RECORD(entry, TRANSACTION_CONTEXT, DoneEntry);
+		entry = entry->Next;
+
+		ASSERT(transContext->State == HsacDmaDone);
+		InsertHeadList(DoneList, &transContext->ListEntry);
+	}
+}
+
+BOOLEAN
+HSACDmaChannelModerated(
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    Is interrupt moderation on for the channel? For callers that do not
+    hold the channel's lock; IOCTL_SET_INT_MODERATION may change it at
+    any time.
+
+--*/
+{
+	return ReadNoFence((volatile LONG *) &Channel->ModerationCount) > 1;
+}
+
+VOID
+HSACDmaChannelKick(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    Start the channel if it is idle and re-arm the moderation timer if
+    Ready work is still held back. Called from the DPC (the ISR may have
+    held work back but cannot set the timer), from the moderation timer
+    and after the moderation settings change.
+
+--*/
+{
+	LONGLONG	dueTime;
+
+	WdfInterruptAcquireLock( Channel->Interrupt );
+
+	HSACDmaChannelStart(DevExt, Channel);
+	dueTime = HSACDmaChannelDueTime(Channel);
+
+	WdfInterruptReleaseLock( Channel->Interrupt );
+
+	if (dueTime) {
+		WdfTimerStart( Channel->ModerationTimer, dueTime );
+	}
+}
+
+VOID
+HSACEvtModerationTimer(
+	IN WDFTIMER Timer
+	)
+/*++
+Routine Description:
+
+    The oldest held request has waited ModerationDelay: start the
+    channel with whatever is Ready.
+
+--*/
+{
+	PMODERATION_TIMER_CONTEXT	timerContext = HSACGetModerationTimerContext(Timer);
+	PDEVICE_EXTENSION			devExt;
+
+	devExt = HSACGetDeviceContext(WdfTimerGetParentObject(Timer));
+
+	HSACDmaChannelKick(devExt, timerContext->Channel);
+}
+
+NTSTATUS
+HSACDmaChannelSetModeration(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN ULONG             Count,
+	IN ULONG             DelayUs
+	)
+/*++
+Routine Description:
+
+    IOCTL_SET_INT_MODERATION. Start the channel once Count requests are
+    Ready or the oldest has waited DelayUs microseconds. Count 1 turns
+    moderation off and starts anything held back.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+	LARGE_INTEGER	frequency;
+
+	if (Count == 0 || Count > HSAC_MAX_OUTSTANDING_REQUESTS ||
+		(Count > 1 && DelayUs == 0) || DelayUs > HSAC_INT_MODERATION_MAX_DELAY_US) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	KeQueryPerformanceCounter(&frequency);
+
+	WdfInterruptAcquireLock( Channel->Interrupt );
+
+	InterlockedExchange((volatile LONG *) &Channel->ModerationCount, (LONG) Count);
+	Channel->ModerationDelay = (Count > 1) ? DelayUs : 0;
+	Channel->ModerationTicks = (LONGLONG) Channel->ModerationDelay *
+		frequency.QuadPart / 1000000;
+
+	WdfInterruptReleaseLock( Channel->Interrupt );
+
+#if (DBG != 0)
+	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+		"DMA channel %d: moderation %d requests / %d us",
+		Channel->Index, Count, Channel->ModerationDelay);
+#endif
+
+	HSACDmaChannelKick(DevExt, Channel);
+
+	return STATUS_SUCCESS;
+}
+
+WDFDMATRANSACTION
+HSACDmaChannelCancel(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN WDFREQUEST        Request,
+	OUT PBOOLEAN         Queued
+	)
+/*++
+Routine Description:
+
+    Called from EvtRequestCancel. A request whose transfer has not been
+    handed to the channel yet is taken off the Ready list and its
+    transaction returned (Allocated) with *Queued set: nothing else will
+    see it, so the caller completes the request. Otherwise the
+    transaction is flagged, so that the DPC (or its poller) stops it
+    early, and returned for HSACDmaChannelDropCompletion.
+
+Return Value:
+
+    The request's transaction, or NULL.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext;
+	WDFDMATRANSACTION		transaction = NULL;
+	ULONG					i;
+
+	UNREFERENCED_PARAMETER(DevExt);
+
+	*Queued = FALSE;
+
+	WdfInterruptAcquireLock( Channel->Interrupt );
+
+	for (i = 0; i < HSAC_MAX_OUTSTANDING_REQUESTS; i++) {
+
+		transContext = HSACGetTransactionContext(Channel->Transactions[i]);
+		if (transContext->State == HsacDmaFree || transContext->Request != Request) {
+			continue;
+		}
+
+		InterlockedIncrement64(&Channel->Stats.Cancellations);
+
+		if (transContext->State == HsacDmaReady && !transContext->Polled) {
+			RemoveEntryList(&transContext->ListEntry);
+			InterlockedDecrement(&Channel->Stats.InFlight);
+			transContext->State = HsacDmaAllocated;
+			*Queued = TRUE;
+		} else {
+			InterlockedExchange(&transContext->Cancelled, TRUE);
+		}
+		transaction = transContext->Transaction;
+		break;
+	}
+
+	WdfInterruptReleaseLock( Channel->Interrupt );
+
+	return transaction;
+}
+
+BOOLEAN
+HSACDmaChannelDropCompletion(
+	IN WDFDMATRANSACTION Transaction
+	)
+/*++
+Routine Description:
+
+    Once a request's cancel routine has been taken, EvtRequestCancel and
+    the path finishing its transfer (the DPC, a poller, or the issuing
+    thread on failure) each drop one of the transaction's two completion
+    owners. The one that drops the last completes the request and frees
+    the transaction; the other must touch neither again, since the
+    request may already be completed and its handle reused.
+
+Return Value:
+
+    TRUE if the caller completes the request.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext = HSACGetTransactionContext(Transaction);
+
+	return InterlockedDecrement(&transContext->CompletionOwners) == 0;
+}
+
+static VOID
+HSACDmaChannelTakePolled(
+	IN PDEVICE_EXTENSION    DevExt,
+	IN PTRANSACTION_CONTEXT TransContext
+	)
+/*++
+Routine Description:
+
+    Take a Done Polled transaction for its poller. Interrupt spinlock
+    held.
+
+--*/
+{
+	TransContext->State = HsacDmaAllocated;
+
+	if (TransContext->Channel->Index == 1) {
+		HSAC_STAMP_READ(DevExt, HsacReadStageDpc);
+	}
+}
+
+VOID
+HSACDmaChannelQueueDpc(
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    Queue the channel's DPC, counting the insertion in DpcQueued until
+    the DPC runs. Called with the channel's interrupt spinlock held, so
+    that HSACDmaChannelSetDpcTarget, which holds it too, sees the count
+    and the DPC's queue agree.
+
+--*/
+{
+	if (WdfDpcEnqueue( Channel->Dpc )) {
+		InterlockedIncrement( &Channel->DpcQueued );
+	}
+}
+
+NTSTATUS
+HSACDmaChannelSetDpcTarget(
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN PPROCESSOR_NUMBER ProcNumber
+	)
+/*++
+Routine Description:
+
+    Run the channel's DPC on ProcNumber from now on. The target of a DPC
+    may not be changed while it sits in a DPC queue, so it is set only
+    when no insertion is outstanding; the interrupt spinlock keeps the
+    ISR, the poller and the stream timer from queueing it meanwhile. A
+    run already started finishes where it is.
+
+Return Value:
+
+    STATUS_DEVICE_BUSY - the DPC is queued; try again.
+
+--*/
+{
+	NTSTATUS	status;
+
+	WdfInterruptAcquireLock( Channel->Interrupt );
+
+	if (InterlockedCompareExchange( &Channel->DpcQueued, 0, 0 ) != 0) {
+		status = STATUS_DEVICE_BUSY;
+	} else {
+		status = KeSetTargetProcessorDpcEx( WdfDpcWdmGetDpc( Channel->Dpc ),
+											ProcNumber );
+	}
+
+	WdfInterruptReleaseLock( Channel->Interrupt );
+
+	return status;
+}
+
+static VOID
+HSACDmaChannelWaitStopped(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    After HSACDmaChannelRetireAll: ABORT stops a chain only at its next
+    descriptor, and a packet transfer not at all, so wait up to
+    HSAC_DRAIN_TIMEOUT_MS for the card to leave the busy states before
+    the caller lets the buffers go. PASSIVE_LEVEL.
+
+--*/
+{
+	PULONG			ctrlRegister;
+	LARGE_INTEGER	interval;
+	ULONG			waited;
+
+	ctrlRegister = (Channel->Index == 0) ?
+		(PULONG) &DevExt->Regs->DMA0_CTRL : (PULONG) &DevExt->Regs->DMA1_CTRL;
+
+	interval.QuadPart = -10000;     // 1 ms
+
+	for (waited = 0; waited < HSAC_DRAIN_TIMEOUT_MS; waited++) {
+		if (!(((READ_REGISTER_ULONG( ctrlRegister ) & DMA_CTRL_CH_STATUS) >> 8) &
+			  CHAN_STATE_BUSY_MASK)) {
+			return;
+		}
+		KeDelayExecutionThread( KernelMode, FALSE, &interval );
+	}
+
+#if (DBG != 0)
+	TraceEvents(TRACE_LEVEL_ERROR, DBG_DPC,
+		"DMA channel %d: still busy after the abort", Channel->Index);
+#endif
+}
+
+VOID
+HSACDmaChannelAbort(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    Take back every transfer queued on the channel, for a caller that
+    has waited HSAC_DRAIN_TIMEOUT_MS for the card to finish one it
+    cannot let go of. They complete as cancelled; the channel resumes
+    with the next transfer queued once the card reports the abort.
+    Returns once the card has stopped. PASSIVE_LEVEL.
+
+--*/
+{
+	WdfInterruptAcquireLock( Channel->Interrupt );
+	HSACDmaChannelRetireAll(DevExt, Channel);
+	WdfInterruptReleaseLock( Channel->Interrupt );
+
+	HSACDmaChannelWaitStopped(DevExt, Channel);
+
+#if (DBG != 0)
+	TraceEvents(TRACE_LEVEL_WARNING, DBG_DPC,
+		"DMA channel %d: transfers aborted", Channel->Index);
+#endif
+}
+
+VOID
+HSACDmaChannelPowerDown(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    D0Exit, interrupts disabled: the card will finish nothing more.
+    Transfers no queue drains (stream, ring) would otherwise never leave
+    InFlight, so abort everything queued on the channel, and anything
+    queued until HSACDmaChannelPowerUp, and let the DPC complete it.
+    Returns once the card has stopped, since the buffers may be freed
+    as soon as D0Exit returns.
+
+--*/
+{
+	WdfInterruptAcquireLock( Channel->Interrupt );
+	Channel->PoweredDown = TRUE;
+	HSACDmaChannelRetireAll(DevExt, Channel);
+	WdfInterruptReleaseLock( Channel->Interrupt );
+
+	HSACDmaChannelWaitStopped(DevExt, Channel);
+}
+
+VOID
+HSACDmaChannelPowerUp(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	)
+/*++
+Routine Description:
+
+    D0Entry, before interrupts are enabled: let the channel start work
+    again. An abort written at power down may have latched the channel's
+    interrupt bit; it belongs to no chain now, so clear it.
+
+--*/
+{
+	WdfInterruptAcquireLock( Channel->Interrupt );
+
+	Channel->PoweredDown = FALSE;
+	Channel->Aborting    = FALSE;
+
+	WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->INT_STATE, Channel->IntActive );
+
+	WdfInterruptReleaseLock( Channel->Interrupt );
+}
+
+BOOLEAN
+HSACDmaChannelPoll(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction,
+	IN LONGLONG          BudgetTicks
+	)
+/*++
+Routine Description:
+
+    Busy-poll for a Polled transaction the caller has just executed. Spin
+    on the channel's INT_STATE bit for up to BudgetTicks (performance
+    counter); when it is set, retire the finished chain as the ISR would.
+    The interrupt that follows finds INT_STATE clear and is not ours.
+
+    Called at <= DISPATCH_LEVEL.
+
+Return Value:
+
+    TRUE  - the transfer is done and the transaction is Allocated again;
+            the caller completes it like the DPC does.
+    FALSE - budget spent; Polled is cleared and the DPC completes it.
+
+--*/
+{
+	PTRANSACTION_CONTEXT	transContext = HSACGetTransactionContext(Transaction);
+	PHSAC_DMA_CHANNEL		channel = transContext->Channel;
+	LONGLONG				start = KeQueryPerformanceCounter(NULL).QuadPart;
+	LONG					retired;
+	ULONG					intState;
+	BOOLEAN					done = FALSE;
+
+	ASSERT(transContext->Polled);
+
+	//
+	// Without the lock, only watch for the channel's bit in INT_STATE or
+	// for the ISR retiring a chain; the transaction is checked under it.
+	// Chains retired before this snapshot are caught by the first look.
+	//
+	retired = InterlockedCompareExchange(&channel->Retired, 0, 0) - 1;
+
+	for (;;) {
+
+		intState = READ_REGISTER_ULONG( (PULONG) &DevExt->Regs->INT_STATE );
+
+		if ((intState & channel->IntActive) ||
+			InterlockedCompareExchange(&channel->Retired, 0, 0) != retired) {
+
+			retired = InterlockedCompareExchange(&channel->Retired, 0, 0);
+
+			WdfInterruptAcquireLock( channel->Interrupt );
+
+			//
+			// Re-check under the lock; the ISR may have got there first.
+			//
+			intState = READ_REGISTER_ULONG( (PULONG) &DevExt->Regs->INT_STATE );
+			if (intState & channel->IntActive) {
+
+				WRITE_REGISTER_ULONG( (PULONG) &DevExt->Regs->INT_STATE,
+					channel->IntActive );
+
+				if (channel->Index == 1) {
+					HSAC_STAMP_READ(DevExt, HsacReadStageIsr);
+				}
+				HSACDmaChannelInterrupt(DevExt, channel,
+					KeQueryPerformanceCounter(NULL).QuadPart);
+
+				//
+				// The interrupt will not be ours, so the DPC must be
+				// queued here for the other requests in the chain.
+				//
+				HSACDmaChannelQueueDpc(channel);
+			}
+
+			if (transContext->State == HsacDmaDone) {
+				HSACDmaChannelTakePolled(DevExt, transContext);
+				done = TRUE;
+			}
+
+			WdfInterruptReleaseLock( channel->Interrupt );
+
+			if (done) {
+				break;
+			}
+		}
+
+		if (KeQueryPerformanceCounter(NULL).QuadPart - start >= BudgetTicks) {
+
+			WdfInterruptAcquireLock( channel->Interrupt );
+
+			if (transContext->State == HsacDmaDone) {
+				HSACDmaChannelTakePolled(DevExt, transContext);
+				done = TRUE;
+			} else {
+				transContext->Polled = FALSE;
+			}
+
+			WdfInterruptReleaseLock( channel->Interrupt );
+			break;
+		}
+
+		YieldProcessor();
+	}
+
+	return done;
+}
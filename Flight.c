@@ -0,0 +1,219 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Flight.c
+
+Abstract:
+
+    Flight recorder: the last HSAC_FLIGHT_EVENTS hot path events of each
+    processor (HSAC_FLIGHT_EVENT, Public.h), kept in every build so that
+    when a channel stalls the timeline that led up to it can be read
+    back with IOCTL_GET_FLIGHT_RECORD. Recording an event costs an
+    interlocked increment on the processor's own ring and four stores;
+    nothing waits.
+
+    Each slot carries the Sequence of its event, cleared while the slot
+    is rewritten. The dump copies a slot between two reads of Sequence
+    and throws it away if they differ, so it never returns a torn event.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Flight.tmh"
+
+C_ASSERT(sizeof(HSAC_FLIGHT_EVENT) == 4 * sizeof(LONGLONG));
+C_ASSERT(FIELD_OFFSET(HSAC_FLIGHT_EVENT, Sequence) == 3 * sizeof(LONGLONG));
+C_ASSERT(FIELD_OFFSET(HSAC_FLIGHT_RING, Events) % 64 == 0);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACFlightInitialize)
+#endif
+
+NTSTATUS
+HSACFlightInitialize(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Allocate a ring for each active processor. Called from
+    HSACInitializeDeviceExtension, before the interrupt is created.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    PVOID                   buffer;
+    ULONG                   processors;
+
+    PAGED_CODE();
+
+    processors = KeQueryActiveProcessorCount(NULL);
+    if (processors == 0) {
+        processors = 1;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = DevExt->Device;
+
+    status = WdfMemoryCreate( &attributes,
+                              NonPagedPoolNx,
+                              0,
+                              processors * sizeof(HSAC_FLIGHT_RING),
+                              &DevExt->FlightMemory,
+                              &buffer );
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                    "WdfMemoryCreate(flight recorder) failed: %!STATUS!", status);
+#endif
+        DevExt->FlightMemory = NULL;
+        return status;
+    }
+
+    RtlZeroMemory( buffer, processors * sizeof(HSAC_FLIGHT_RING) );
+
+    DevExt->FlightRings      = (PHSAC_FLIGHT_RING) buffer;
+    DevExt->FlightProcessors = processors;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+HSACFlightRecord(
+    IN PDEVICE_EXTENSION DevExt,
+    IN UCHAR             Type,
+    IN UCHAR             Channel,
+    IN USHORT            Count,
+    IN ULONG             Value,
+    IN ULONGLONG         Address
+    )
+/*++
+Routine Description:
+
+    Record one event in the current processor's ring. Any IRQL. A
+    processor numbered past the rings shares one; the slot is claimed
+    with an interlocked increment either way.
+
+--*/
+{
+    PHSAC_FLIGHT_RING   ring;
+    PHSAC_FLIGHT_EVENT  slot;
+    HSAC_FLIGHT_EVENT   event;
+    PLONGLONG           words;
+    ULONG               sequence;
+
+    if (DevExt->FlightRings == NULL) {
+        return;
+    }
+
+    ring = &DevExt->FlightRings[KeGetCurrentProcessorNumber() % DevExt->FlightProcessors];
+
+    sequence = (ULONG) InterlockedIncrement( &ring->Next );
+    slot = &ring->Events[(sequence - 1) % HSAC_FLIGHT_EVENTS];
+
+    event.Time    = KeQueryPerformanceCounter( NULL ).QuadPart;
+    event.Address = Address;
+    event.Value   = Value;
+    event.Type    = Type;
+    event.Channel = Channel;
+    event.Count   = Count;
+
+    //
+    // Clear Sequence before the rest of the slot changes, and set it
+    // after: a dump that sees the same Sequence on both sides of its
+    // copy has the whole event.
+    //
+    InterlockedExchange( (volatile LONG *) &slot->Sequence, 0 );
+
+    words = (PLONGLONG) slot;
+    WriteNoFence64( &words[0], ((PLONGLONG) &event)[0] );
+    WriteNoFence64( &words[1], ((PLONGLONG) &event)[1] );
+    WriteNoFence64( &words[2], ((PLONGLONG) &event)[2] );
+
+    WriteULongRelease( &slot->Sequence, sequence );
+}
+
+NTSTATUS
+HSACFlightDump(
+    IN PDEVICE_EXTENSION    DevExt,
+    IN ULONG                Processor,
+    OUT PHSAC_FLIGHT_RECORD Record
+    )
+/*++
+Routine Description:
+
+    IOCTL_GET_FLIGHT_RECORD: copy out one processor's ring while it is
+    being written.
+
+Return Value:
+
+     STATUS_NO_MORE_ENTRIES past the last ring
+
+--*/
+{
+    PHSAC_FLIGHT_RING   ring;
+    PHSAC_FLIGHT_EVENT  slot;
+    PLONGLONG           words;
+    PLONGLONG           copy;
+    LARGE_INTEGER       frequency;
+    ULONG               sequence;
+    ULONG               i;
+
+    if (DevExt->FlightRings == NULL || Processor >= DevExt->FlightProcessors) {
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    ring = &DevExt->FlightRings[Processor];
+
+    KeQueryPerformanceCounter( &frequency );
+
+    Record->Processor  = Processor;
+    Record->Processors = DevExt->FlightProcessors;
+    Record->Frequency  = frequency.QuadPart;
+    Record->Reserved   = 0;
+
+    for (i = 0; i < HSAC_FLIGHT_EVENTS; i++) {
+
+        slot  = &ring->Events[i];
+        words = (PLONGLONG) slot;
+        copy  = (PLONGLONG) &Record->Events[i];
+
+        sequence = ReadULongAcquire( &slot->Sequence );
+
+        copy[0] = ReadNoFence64( &words[0] );
+        copy[1] = ReadNoFence64( &words[1] );
+        copy[2] = ReadNoFence64( &words[2] );
+
+        KeMemoryBarrier();
+
+        Record->Events[i].Sequence =
+            (ReadNoFence( (volatile LONG *) &slot->Sequence ) == (LONG) sequence) ?
+                sequence : 0;
+        Record->Events[i].Reserved = 0;
+    }
+
+    //
+    // Next is read after the copy, so every event kept is older than it.
+    //
+    Record->Next = (ULONG) ReadNoFence( &ring->Next ) + 1;
+
+    return STATUS_SUCCESS;
+}
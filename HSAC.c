@@ -156,9 +156,11 @@ Return Value:
 {
     NTSTATUS                   status = STATUS_SUCCESS;
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
+    WDF_FILEOBJECT_CONFIG       fileConfig;
     WDF_OBJECT_ATTRIBUTES       attributes;
     WDFDEVICE                   device;
     PDEVICE_EXTENSION           devExt = NULL;
+    LONGLONG                    addStarted;
 
     UNREFERENCED_PARAMETER( Driver );
 #if (DBG != 0)
@@ -166,6 +168,8 @@ Return Value:
 #endif
     PAGED_CODE();
 
+    addStarted = KeQueryPerformanceCounter(NULL).QuadPart;
+
     WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoDirect);
 
     //
@@ -193,20 +197,29 @@ Return Value:
     //
     WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
 
+    //
+    // Each handle keeps its own completion mode (IOCTL_SET_POLL_MODE) and
+    // owns the buffers it registers (IOCTL_REGISTER_BUFFER).
+    //
+    WDF_FILEOBJECT_CONFIG_INIT(&fileConfig,
+                               HSACEvtDeviceFileCreate,
+                               WDF_NO_EVENT_CALLBACK,
+                               HSACEvtFileCleanup);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, FILE_CONTEXT);
+    WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &attributes);
+
     //
     // Initialize Fdo Attributes.
     //
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, DEVICE_EXTENSION);
     //
-    // By opting for SynchronizationScopeDevice, we tell the framework to
-    // synchronize callbacks events of all the objects directly associated
-    // with the device. In this driver, we will associate queues and
-    // and DpcForIsr. By doing that we don't have to worry about synchronizing
-    // access to device-context by Io Events and DpcForIsr because they would
-    // not concurrently ever. Framework will serialize them by using an
-    // internal device-lock.
+    // No framework synchronization scope: the read queue, the write queue,
+    // the IOCTL queue and the two channel DPCs run concurrently. DMA0 and
+    // DMA1 are independent engines, and each channel's pipeline (Dma.c)
+    // does its own locking, so a write completion never waits behind a
+    // read submission or a register IOCTL.
     //
-    attributes.SynchronizationScope = WdfSynchronizationScopeDevice;
+    attributes.SynchronizationScope = WdfSynchronizationScopeNone;
 
     //
     // Create the device
@@ -293,6 +306,8 @@ Return Value:
     if (!NT_SUCCESS(status)) {
         return status;
     }
+
+    devExt->DeviceAddUs = HSACStatsElapsedUs(addStarted);
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
                 "<-- HSACEvtDeviceAdd %!STATUS!", status);
@@ -334,8 +349,6 @@ Return Value:
     NTSTATUS            status = STATUS_SUCCESS;
     PDEVICE_EXTENSION   devExt;
 
-    UNREFERENCED_PARAMETER(Resources);
-
     PAGED_CODE();
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
@@ -343,16 +356,32 @@ Return Value:
 #endif
     devExt = HSACGetDeviceContext(Device);
 
+    //
+    // Timed up to the end of the first D0Entry (IOCTL_GET_STATS).
+    //
+    devExt->PrepareTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
 	//A locked down section is unlocked by calling MmUnlockPagableImageSection.
 	devExt->lockDataHandle = MmLockPagableDataSection(devExt);
 
     status = HSACPrepareHardware(devExt, ResourcesTranslated);
+    if (!NT_SUCCESS (status)){
+        return status;
+    }
+
+    status = HSACChannelInterruptCreate(devExt, Resources, ResourcesTranslated);
     if (!NT_SUCCESS (status)){
         return status;
     }
 	
 	//HSACMapUserAddress(devExt);
 
+    //
+    // Common buffers are otherwise only allocated as they are first
+    // used (Buffers.c).
+    //
+    HSACBuffersStartPrewarm(devExt);
+
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
                 "<-- HSACEvtDevicePrepareHardware, status %!STATUS!", status);
@@ -399,7 +428,7 @@ Return Value:
 #endif
     devExt = HSACGetDeviceContext(Device);
 
-
+    HSACBuffersStopPrewarm(devExt);
 
     if (devExt->RegsBase) {
 
@@ -413,6 +442,13 @@ Return Value:
 		devExt->SRAMBase = NULL;
 	}
 
+	//
+	// The framework deletes the read channel's message interrupt after
+	// this returns; the read channel goes back to sharing the first one.
+	//
+	devExt->ReadInterrupt = NULL;
+	devExt->ReadChannel.Interrupt = devExt->Interrupt;
+
 	//HSACUnmapUserAddress(devExt);
 
 	//MmUnlockPagableImageSection(devExt->lockDataHandle);
@@ -478,6 +514,17 @@ Return Value:
 
     }
 
+    if (NT_SUCCESS(status)) {
+        HSACDmaChannelPowerUp( devExt, &devExt->WriteChannel );
+        HSACDmaChannelPowerUp( devExt, &devExt->ReadChannel );
+    }
+
+    if (NT_SUCCESS(status) && devExt->PrepareTime != 0) {
+        WriteNoFence64( &devExt->DeviceStartUs,
+                        HSACStatsElapsedUs(devExt->PrepareTime) );
+        devExt->PrepareTime = 0;
+    }
+
     return status;
 }
 
@@ -519,6 +566,25 @@ Return Value:
 
     devExt = HSACGetDeviceContext(Device);
 
+    //
+    // With interrupts off the card reports nothing more. The queues have
+    // drained, but stream and ring transfers, which no queue tracks,
+    // would never leave InFlight and their owners' stops would wait
+    // forever: halt the streams, so they arm no more, and abort what is
+    // left on each channel.
+    //
+    HSACStreamHalt(devExt);
+    HSACDmaChannelPowerDown(devExt, &devExt->WriteChannel);
+    HSACDmaChannelPowerDown(devExt, &devExt->ReadChannel);
+
+    //
+    // The channel DPCs are not tied to the interrupts, so the framework
+    // does not flush them: let those the ISR and the aborts above queued
+    // run to the end before the hardware goes away. Cancelling one
+    // instead would strand the transfers on its DoneStack.
+    //
+    KeFlushQueuedDpcs();
+
     switch (TargetState) {
     case WdfPowerDeviceD1:
     case WdfPowerDeviceD2:
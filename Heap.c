@@ -0,0 +1,696 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Heap.c
+
+Abstract:
+
+    Variable-sized DMA buffers (IOCTL_ALLOC_DMA_BUFFER, Public.h). The
+    common buffers of Buffers.c are all one size, so a small message
+    takes a whole one; here a buddy allocator carves buffers of a power
+    of two pages out of a few contiguous regions of
+    HSAC_HEAP_REGION_SIZE bytes, each one common buffer, created the
+    first time the regions already there cannot satisfy a request.
+
+    Each region describes its HSAC_HEAP_MIN_BLOCK pages in Blocks[]. A
+    free block is on its order's free list. A buffer handed out keeps
+    its handle, which also carries its place and order, in its first
+    page's Handle; that is all a transfer looks at (HSACHeapPacketValid),
+    at any IRQL and without the lock. A transfer also counts itself in
+    the page's InFlight until it is done (HSACHeapPacketDone), and a
+    buffer is not given back while that is not 0. Allocating, freeing
+    and adding regions happen at PASSIVE_LEVEL under HeapLock, and a
+    region is published by writing HeapRegions last.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Heap.tmh"
+
+C_ASSERT(HSAC_HEAP_BLOCKS == (1 << (HSAC_HEAP_ORDERS - 1)));
+C_ASSERT(HSAC_HEAP_BLOCKS <= HSAC_HEAP_BLOCK_MASK + 1);
+C_ASSERT(HSAC_HEAP_REGIONS <= HSAC_HEAP_REGION_MASK + 1);
+C_ASSERT(HSAC_HEAP_ORDERS <= HSAC_HEAP_ORDER_MASK + 1);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACHeapInitialize)
+#pragma alloc_text (PAGE, HSACHeapAllocate)
+#pragma alloc_text (PAGE, HSACHeapFree)
+#pragma alloc_text (PAGE, HSACHeapRelease)
+#endif
+
+static VOID
+HSACHeapPush(
+    IN PHSAC_HEAP_REGION Region,
+    IN ULONG             Block,
+    IN ULONG             Order
+    )
+/*++
+Routine Description:
+
+    Put a free block on its order's free list. HeapLock is held.
+
+--*/
+{
+    PHSAC_HEAP_BLOCK block = &Region->Blocks[Block];
+    ULONG            head  = Region->FreeList[Order];
+
+    block->Order = (UCHAR) Order;
+    block->Free  = TRUE;
+    block->Prev  = HSAC_HEAP_NONE;
+    block->Next  = head;
+
+    if (head != HSAC_HEAP_NONE) {
+        Region->Blocks[head].Prev = Block;
+    }
+    Region->FreeList[Order] = Block;
+}
+
+static VOID
+HSACHeapUnlink(
+    IN PHSAC_HEAP_REGION Region,
+    IN ULONG             Block
+    )
+/*++
+Routine Description:
+
+    Take a free block off its free list. HeapLock is held.
+
+--*/
+{
+    PHSAC_HEAP_BLOCK block = &Region->Blocks[Block];
+
+    if (block->Prev != HSAC_HEAP_NONE) {
+        Region->Blocks[block->Prev].Next = block->Next;
+    } else {
+        Region->FreeList[block->Order] = block->Next;
+    }
+    if (block->Next != HSAC_HEAP_NONE) {
+        Region->Blocks[block->Next].Prev = block->Prev;
+    }
+
+    block->Free = FALSE;
+}
+
+static BOOLEAN
+HSACHeapTake(
+    IN PHSAC_HEAP_REGION Region,
+    IN ULONG             Order,
+    OUT PULONG           Block
+    )
+/*++
+Routine Description:
+
+    Find the smallest free block of at least Order in the region and
+    split it down to Order, freeing the upper halves. HeapLock is held.
+
+--*/
+{
+    ULONG   order;
+    ULONG   block;
+
+    for (order = Order; order < HSAC_HEAP_ORDERS; order++) {
+        if (Region->FreeList[order] != HSAC_HEAP_NONE) {
+            break;
+        }
+    }
+    if (order == HSAC_HEAP_ORDERS) {
+        return FALSE;
+    }
+
+    block = Region->FreeList[order];
+    HSACHeapUnlink(Region, block);
+
+    while (order > Order) {
+        order--;
+        HSACHeapPush(Region, block + (1 << order), order);
+    }
+
+    Region->Blocks[block].Order = (UCHAR) Order;
+    *Block = block;
+
+    return TRUE;
+}
+
+static VOID
+HSACHeapPut(
+    IN PHSAC_HEAP_REGION Region,
+    IN ULONG             Block
+    )
+/*++
+Routine Description:
+
+    Give a block back, merging it with its buddy for as long as the
+    buddy is free and whole. HeapLock is held.
+
+--*/
+{
+    ULONG   order = Region->Blocks[Block].Order;
+    ULONG   buddy;
+
+    while (order < HSAC_HEAP_ORDERS - 1) {
+
+        buddy = Block ^ (1 << order);
+
+        if (!Region->Blocks[buddy].Free || Region->Blocks[buddy].Order != order) {
+            break;
+        }
+
+        HSACHeapUnlink(Region, buddy);
+        Block = min(Block, buddy);
+        order++;
+    }
+
+    HSACHeapPush(Region, Block, order);
+}
+
+static NTSTATUS
+HSACHeapGrow(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Add a region, one free block of the largest order. HeapLock is held.
+
+Return Value:
+
+     STATUS_INSUFFICIENT_RESOURCES once there are HSAC_HEAP_REGIONS
+
+--*/
+{
+    NTSTATUS                status;
+    PHSAC_HEAP_REGION       region;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    PVOID                   blocks;
+    ULONG                   count = DevExt->HeapRegions;
+    ULONG                   i;
+
+    if (count == HSAC_HEAP_REGIONS) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    region = &DevExt->Heap[count];
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = DevExt->Device;
+
+    status = WdfMemoryCreate( &attributes,
+                              NonPagedPoolNx,
+                              0,
+                              HSAC_HEAP_BLOCKS * sizeof(HSAC_HEAP_BLOCK),
+                              &region->BlockMemory,
+                              &blocks );
+    if (!NT_SUCCESS(status)) {
+        region->BlockMemory = NULL;
+        return status;
+    }
+
+    status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+                                    HSAC_HEAP_REGION_SIZE,
+                                    WDF_NO_OBJECT_ATTRIBUTES,
+                                    &region->CommonBuffer );
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                    "WdfCommonBufferCreate(heap region %d) failed %!STATUS!",
+                    count, status);
+#endif
+        WdfObjectDelete( region->BlockMemory );
+        region->BlockMemory  = NULL;
+        region->CommonBuffer = NULL;
+        return status;
+    }
+
+    region->Base   = (PUCHAR) WdfCommonBufferGetAlignedVirtualAddress( region->CommonBuffer );
+    region->BaseLA = WdfCommonBufferGetAlignedLogicalAddress( region->CommonBuffer );
+    region->Blocks = (PHSAC_HEAP_BLOCK) blocks;
+
+    RtlZeroMemory( region->Blocks, HSAC_HEAP_BLOCKS * sizeof(HSAC_HEAP_BLOCK) );
+    for (i = 0; i < HSAC_HEAP_ORDERS; i++) {
+        region->FreeList[i] = HSAC_HEAP_NONE;
+    }
+    HSACHeapPush(region, 0, HSAC_HEAP_ORDERS - 1);
+
+    WriteULongRelease( &DevExt->HeapRegions, count + 1 );
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "heap region %d: 0x%p, LA 0x%I64x", count,
+                region->Base, region->BaseLA.QuadPart);
+#endif
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+HSACHeapUnmap(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PHSAC_HEAP_REGION Region,
+    IN ULONG             Block
+    )
+/*++
+Routine Description:
+
+    Unmap a buffer whose handle has been withdrawn, or never handed out,
+    and give it back. HeapLock is held; called in the owner's process.
+
+--*/
+{
+    PHSAC_HEAP_BLOCK block = &Region->Blocks[Block];
+
+    if (block->FileObject != NULL) {
+        InterlockedDecrement( &DevExt->HeapBuffers );
+        InterlockedExchangeAdd64( &DevExt->HeapBytes,
+                                  -((LONGLONG) HSAC_HEAP_MIN_BLOCK << block->Order) );
+    }
+
+    if (block->UserAddress) {
+        MmUnmapLockedPages( block->UserAddress, block->Mdl );
+        block->UserAddress = NULL;
+    }
+    if (block->Mdl) {
+        IoFreeMdl( block->Mdl );
+        block->Mdl = NULL;
+    }
+    block->FileObject = NULL;
+
+    HSACHeapPut(Region, Block);
+}
+
+NTSTATUS
+HSACHeapInitialize(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Create HeapLock. Regions are only added as buffers are allocated.
+    Called from HSACInitializeDMA.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    PAGED_CODE();
+
+    DevExt->HeapRegions  = 0;
+    DevExt->HeapSequence = 0;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = DevExt->Device;
+
+    status = WdfWaitLockCreate( &attributes, &DevExt->HeapLock );
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                    "WdfWaitLockCreate(heap) failed %!STATUS!", status);
+#endif
+        DevExt->HeapLock = NULL;
+    }
+
+    return status;
+}
+
+NTSTATUS
+HSACHeapAllocate(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject,
+    IN ULONG             Size,
+    OUT PHSAC_DMA_BUFFER Buffer
+    )
+/*++
+Routine Description:
+
+    IOCTL_ALLOC_DMA_BUFFER. Called in the context of the calling
+    process, which the buffer is mapped into the way the packet ring
+    is (Ring.c).
+
+Return Value:
+
+     STATUS_INSUFFICIENT_RESOURCES if no region has room and no more
+     can be added
+
+--*/
+{
+    NTSTATUS            status = STATUS_INSUFFICIENT_RESOURCES;
+    PHSAC_HEAP_REGION   region = NULL;
+    PHSAC_HEAP_BLOCK    block;
+    ULONG               order;
+    ULONG               index = 0;
+    ULONG               bytes;
+    ULONG               handle;
+    ULONG               i;
+
+    PAGED_CODE();
+
+    if (FileObject == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    if (Size == 0 || Size > HSAC_HEAP_REGION_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (order = 0; (HSAC_HEAP_MIN_BLOCK << order) < Size; order++) {
+        ;
+    }
+    bytes = HSAC_HEAP_MIN_BLOCK << order;
+
+    WdfWaitLockAcquire( DevExt->HeapLock, NULL );
+
+    for (i = 0; i < DevExt->HeapRegions; i++) {
+        if (HSACHeapTake(&DevExt->Heap[i], order, &index)) {
+            region = &DevExt->Heap[i];
+            break;
+        }
+    }
+
+    if (region == NULL) {
+        status = HSACHeapGrow(DevExt);
+        if (NT_SUCCESS(status) &&
+            HSACHeapTake(&DevExt->Heap[i], order, &index)) {
+            region = &DevExt->Heap[i];
+        }
+    }
+
+    if (region == NULL) {
+        WdfWaitLockRelease( DevExt->HeapLock );
+        return status;
+    }
+
+    block = &region->Blocks[index];
+
+    //
+    // A buffer never shows what its last owner left in it.
+    //
+    RtlZeroMemory( region->Base + index * HSAC_HEAP_MIN_BLOCK, bytes );
+
+    block->Mdl = IoAllocateMdl( region->Base + index * HSAC_HEAP_MIN_BLOCK,
+                                bytes, FALSE, FALSE, NULL );
+    if (block->Mdl == NULL) {
+        HSACHeapUnmap(DevExt, region, index);
+        WdfWaitLockRelease( DevExt->HeapLock );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    MmBuildMdlForNonPagedPool( block->Mdl );
+
+    __try {
+        block->UserAddress = MmMapLockedPagesSpecifyCache( block->Mdl,
+                                                           UserMode,
+                                                           MmCached,
+                                                           NULL,
+                                                           FALSE,
+                                                           NormalPagePriority );
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        block->UserAddress = NULL;
+    }
+
+    if (block->UserAddress == NULL) {
+        HSACHeapUnmap(DevExt, region, index);
+        WdfWaitLockRelease( DevExt->HeapLock );
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    block->FileObject = FileObject;
+
+    //
+    // The sequence number keeps a freed buffer's handle from naming
+    // whatever is allocated in its place.
+    //
+    DevExt->HeapSequence = (DevExt->HeapSequence + 1) & HSAC_HEAP_SEQUENCE_MASK;
+    handle = HSAC_HEAP_MAKE_HANDLE(DevExt->HeapSequence, order,
+                                   (ULONG) (region - DevExt->Heap), index);
+
+    WriteULongRelease( &block->Handle, handle );
+
+    InterlockedIncrement( &DevExt->HeapBuffers );
+    InterlockedExchangeAdd64( &DevExt->HeapBytes, bytes );
+
+    WdfWaitLockRelease( DevExt->HeapLock );
+
+    Buffer->Handle  = handle;
+    Buffer->Size    = bytes;
+    Buffer->Address = (ULONGLONG) (ULONG_PTR) block->UserAddress;
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "heap: %d bytes for %d, handle 0x%x at 0x%p",
+                bytes, Size, handle, block->UserAddress);
+#endif
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HSACHeapFree(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject,
+    IN ULONG             Handle
+    )
+/*++
+Routine Description:
+
+    IOCTL_FREE_DMA_BUFFER. Only the handle that allocated the buffer may
+    free it, and only once no transfer names it.
+
+Return Value:
+
+     STATUS_DEVICE_BUSY if a transfer still does
+
+--*/
+{
+    PHSAC_HEAP_REGION   region;
+    PHSAC_HEAP_BLOCK    block;
+    ULONG               index = HSAC_HEAP_HANDLE_BLOCK(Handle);
+    ULONG               number = HSAC_HEAP_HANDLE_REGION(Handle);
+    NTSTATUS            status = STATUS_INVALID_PARAMETER;
+
+    PAGED_CODE();
+
+    WdfWaitLockAcquire( DevExt->HeapLock, NULL );
+
+    if ((Handle & HSAC_HEAP_HANDLE) && number < DevExt->HeapRegions) {
+
+        region = &DevExt->Heap[number];
+        block  = &region->Blocks[index];
+
+        if (block->Handle == Handle && block->FileObject == FileObject) {
+
+            //
+            // Withdraw the handle before looking at InFlight, which
+            // HSACHeapPacketValid raises before it looks at the handle:
+            // a transfer either sees it gone or is seen here.
+            //
+            InterlockedExchange( (volatile LONG *) &block->Handle, 0 );
+
+            if (InterlockedCompareExchange( &block->InFlight, 0, 0 ) != 0) {
+                WriteULongRelease( &block->Handle, Handle );
+                status = STATUS_DEVICE_BUSY;
+            } else {
+                HSACHeapUnmap(DevExt, region, index);
+                status = STATUS_SUCCESS;
+            }
+        }
+    }
+
+    WdfWaitLockRelease( DevExt->HeapLock );
+
+    return status;
+}
+
+VOID
+HSACHeapRelease(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject
+    )
+/*++
+Routine Description:
+
+    Free every buffer FileObject allocated, once the transfers that
+    name it are done. Called from its EvtFileCleanup. The handles are
+    withdrawn first and the wait is made without HeapLock, so other
+    handles can allocate and free meanwhile; transfers the card has not
+    finished after HSAC_DRAIN_TIMEOUT_MS are taken back by aborting both
+    channels.
+
+--*/
+{
+    PHSAC_HEAP_REGION   region;
+    PHSAC_HEAP_BLOCK    block;
+    LARGE_INTEGER       interval;
+    BOOLEAN             busy;
+    ULONG               waited;
+    ULONG               i;
+    ULONG               j;
+
+    PAGED_CODE();
+
+    interval.QuadPart = -10000;     // 1 ms
+
+    //
+    // As in HSACHeapFree; no new transfer can take the buffers once
+    // their handles are gone, and nothing else frees them.
+    //
+    WdfWaitLockAcquire( DevExt->HeapLock, NULL );
+
+    for (i = 0; i < DevExt->HeapRegions; i++) {
+
+        region = &DevExt->Heap[i];
+
+        for (j = 0; j < HSAC_HEAP_BLOCKS; j++) {
+
+            block = &region->Blocks[j];
+
+            if (block->Handle != 0 && block->FileObject == FileObject) {
+                InterlockedExchange( (volatile LONG *) &block->Handle, 0 );
+            }
+        }
+    }
+
+    WdfWaitLockRelease( DevExt->HeapLock );
+
+    for (waited = 0; ; waited++) {
+
+        busy = FALSE;
+
+        WdfWaitLockAcquire( DevExt->HeapLock, NULL );
+
+        for (i = 0; i < DevExt->HeapRegions && !busy; i++) {
+
+            region = &DevExt->Heap[i];
+
+            for (j = 0; j < HSAC_HEAP_BLOCKS; j++) {
+
+                block = &region->Blocks[j];
+
+                if (block->FileObject == FileObject &&
+                    InterlockedCompareExchange( &block->InFlight, 0, 0 ) != 0) {
+                    busy = TRUE;
+                    break;
+                }
+            }
+        }
+
+        if (!busy) {
+            for (i = 0; i < DevExt->HeapRegions; i++) {
+
+                region = &DevExt->Heap[i];
+
+                for (j = 0; j < HSAC_HEAP_BLOCKS; j++) {
+                    if (region->Blocks[j].FileObject == FileObject) {
+                        HSACHeapUnmap(DevExt, region, j);
+                    }
+                }
+            }
+        }
+
+        WdfWaitLockRelease( DevExt->HeapLock );
+
+        if (!busy) {
+            break;
+        }
+
+        if (waited == HSAC_DRAIN_TIMEOUT_MS) {
+            HSACDmaChannelAbort( DevExt, &DevExt->WriteChannel );
+            HSACDmaChannelAbort( DevExt, &DevExt->ReadChannel );
+        }
+
+        KeDelayExecutionThread( KernelMode, FALSE, &interval );
+    }
+}
+
+BOOLEAN
+HSACHeapPacketValid(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Handle,
+    IN ULONG             Size
+    )
+/*++
+Routine Description:
+
+    Does Handle name an allocated buffer of at least Size bytes? If so
+    the transfer is counted in its InFlight until HSACHeapPacketDone.
+    Any IRQL; HSACDmaChannelPacketValid for an index with
+    HSAC_HEAP_HANDLE.
+
+--*/
+{
+    PHSAC_HEAP_BLOCK    block;
+    ULONG               number = HSAC_HEAP_HANDLE_REGION(Handle);
+
+    if (number >= ReadULongAcquire( &DevExt->HeapRegions ) ||
+        Size > ((ULONG) HSAC_HEAP_MIN_BLOCK << HSAC_HEAP_HANDLE_ORDER(Handle))) {
+        return FALSE;
+    }
+
+    block = &DevExt->Heap[number].Blocks[HSAC_HEAP_HANDLE_BLOCK(Handle)];
+
+    //
+    // Counted first, then checked: see HSACHeapFree.
+    //
+    InterlockedIncrement( &block->InFlight );
+
+    if (ReadULongAcquire( &block->Handle ) != Handle) {
+        InterlockedDecrement( &block->InFlight );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+VOID
+HSACHeapPacketDone(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Handle
+    )
+/*++
+Routine Description:
+
+    A transfer HSACHeapPacketValid counted is done with the buffer. Any
+    IRQL.
+
+--*/
+{
+    PHSAC_HEAP_REGION   region = &DevExt->Heap[HSAC_HEAP_HANDLE_REGION(Handle)];
+
+    InterlockedDecrement( &region->Blocks[HSAC_HEAP_HANDLE_BLOCK(Handle)].InFlight );
+}
+
+PHYSICAL_ADDRESS
+HSACHeapAddress(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG             Handle
+    )
+/*++
+Routine Description:
+
+    Logical address of the buffer Handle names, once
+    HSACHeapPacketValid has taken it.
+
+--*/
+{
+    PHYSICAL_ADDRESS address = DevExt->Heap[HSAC_HEAP_HANDLE_REGION(Handle)].BaseLA;
+
+    address.QuadPart += (LONGLONG) HSAC_HEAP_HANDLE_BLOCK(Handle) * HSAC_HEAP_MIN_BLOCK;
+
+    return address;
+}
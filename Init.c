@@ -76,10 +76,11 @@ Return Value:
 #endif
     //
     // Calculate the number of DMA_TRANSFER_ELEMENTS + 1 needed to
-    // support the MaximumTransferLength.
+    // support the MaximumTransferLength, and one more for a run of
+    // contiguous pages that has to be split at a 4GB boundary.
     //
     dteCount = BYTES_TO_PAGES((ULONG) ROUND_TO_PAGES(
-        DevExt->MaximumTransferLength) + PAGE_SIZE);
+        DevExt->MaximumTransferLength) + PAGE_SIZE) + 1;
 
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP, "Number of DTEs %d", dteCount);
@@ -92,10 +93,8 @@ Return Value:
 
 	DevExt->MapFlag = 0;
 
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
 	DevExt->readCommonBufferNum = 0;
 	DevExt->writeCommonBufferNum = 0;
-#endif
 
     //
     // The HSAC has two DMA Channels. This driver will use DMA Channel 0
@@ -106,26 +105,31 @@ Return Value:
     // concurrent reads and writes) two Dispatch Queues are created:
     // one for the Write (ToDevice) requests and another for the Read
     // (FromDevice) requests.  While each Dispatch Queue will operate
-    // independently for each other, the requests within a given Dispatch
-    // Queue will be serialized. This is hardware can only process one request
-    // per DMA Channel at a time.
+    // independently for each other, the hardware can only run one
+    // descriptor chain per DMA Channel at a time, so requests of a given
+    // Dispatch Queue are handed to the channel by the pipeline in Dma.c,
+    // which links the chains of the requests waiting for the channel.
     //
 
 
     //
-    // Setup a queue to handle only IRP_MJ_WRITE requests in Sequential
-    // dispatch mode. This mode ensures there is only one write request
-    // outstanding in the driver at any time. Framework will present the next
-    // request only if the current request is completed.
+    // Setup a queue to handle only IRP_MJ_WRITE requests in Parallel
+    // dispatch mode, limited to HSAC_MAX_OUTSTANDING_REQUESTS requests
+    // (one per pooled transaction) outstanding in the driver at any time,
+    // so the next request is already programmed when the current one
+    // completes.
     // Since we have configured the queue to dispatch all the specific requests
     // we care about, we don't need a default queue.  A default queue is
     // used to receive requests that are not predefined to goto
     // a specific queue.
     //
     WDF_IO_QUEUE_CONFIG_INIT ( &queueConfig,
-                              WdfIoQueueDispatchSequential);
+                              WdfIoQueueDispatchParallel);
 
+    queueConfig.Settings.Parallel.NumberOfPresentedRequests =
+        HSAC_MAX_OUTSTANDING_REQUESTS;
     queueConfig.EvtIoWrite = HSACEvtIoWrite;
+    queueConfig.EvtIoDeviceControl = HSACEvtIoRegistered;
 
     status = WdfIoQueueCreate( DevExt->Device,
                                            &queueConfig,
@@ -157,12 +161,15 @@ Return Value:
 
 
     //
-    // Create a new IO Queue for IRP_MJ_READ requests in sequential mode.
+    // Create a new IO Queue for IRP_MJ_READ requests in parallel mode.
     //
     WDF_IO_QUEUE_CONFIG_INIT( &queueConfig,
-                              WdfIoQueueDispatchSequential);
+                              WdfIoQueueDispatchParallel);
 
+    queueConfig.Settings.Parallel.NumberOfPresentedRequests =
+        HSAC_MAX_OUTSTANDING_REQUESTS;
     queueConfig.EvtIoRead = HSACEvtIoRead;
+    queueConfig.EvtIoDeviceControl = HSACEvtIoRegistered;
 
     status = WdfIoQueueCreate( DevExt->Device,
                                &queueConfig,
@@ -228,6 +235,37 @@ Return Value:
 		return status;
 	}
 
+	//
+	// IOCTL_PACKET_BATCH and IOCTL_PACKET_CHAIN requests are forwarded
+	// here from the device control queue; one runs at a time (Batch.c).
+	//
+	WDF_IO_QUEUE_CONFIG_INIT( &queueConfig,
+							  WdfIoQueueDispatchSequential);
+
+	queueConfig.EvtIoDeviceControl = HSACEvtIoPacketBatch;
+
+	status = WdfIoQueueCreate( DevExt->Device,
+		&queueConfig,
+		WDF_NO_OBJECT_ATTRIBUTES,
+		&DevExt->BatchQueue );
+
+	if (!NT_SUCCESS (status)) {
+#if (DBG != 0)
+		TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+			"WdfIoQueueCreate failed 0x%X\n", status);
+#endif
+		return status;
+	}
+
+
+    //
+    // The flight recorder, before anything can record into it.
+    //
+    status = HSACFlightInitialize(DevExt);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
 
     //
     // Create a WDFINTERRUPT object.
@@ -446,8 +484,6 @@ Return Value:
 --*/
 {
     NTSTATUS    status;
-    WDF_OBJECT_ATTRIBUTES attributes;
-	ULONG i = 0;
 
     PAGED_CODE();
 
@@ -488,211 +524,41 @@ Return Value:
     }
 
     //
-    // Allocate common buffer for building writes
+    // The common buffers of both channels, as many, as big and laid out
+    // as the device's hardware key asks for; none is allocated yet.
     //
-    // NOTE: This common buffer will not be cached.
+    // NOTE: These common buffers will not be cached.
     //       Perhaps in some future revision, cached option could
     //       be used. This would have faster access, but requires
     //       flushing before starting the DMA in HSACStartWriteDma.
     //
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-	DevExt->writeCommonBufferNum = HSAC_TRANSFER_BUFFER_NUM;
-	DevExt->WriteCommonBufferSize = DevExt->MaximumTransferLength;
-	//sizeof(DMA_TRANSFER_ELEMENT) * DevExt->WriteTransferElements;
-
-	for (i = 0; i < DevExt->writeCommonBufferNum; i++)
-	{
-		status = WdfCommonBufferCreate( DevExt->DmaEnabler,
-			DevExt->WriteCommonBufferSize,
-			WDF_NO_OBJECT_ATTRIBUTES,
-			&DevExt->pWriteCommonBuffer[i] );
-
-		if (!NT_SUCCESS(status)) {
-#if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
-				"WdfCommonBufferCreate (write) failed: %!STATUS!", status);
-#endif
-			return status;
-		}
-
-		DevExt->pWriteCommonBufferBase[i] =
-			WdfCommonBufferGetAlignedVirtualAddress(DevExt->pWriteCommonBuffer[i]);
-
-		DevExt->pWriteCommonBufferBaseLA[i] =
-			WdfCommonBufferGetAlignedLogicalAddress(DevExt->pWriteCommonBuffer[i]);
-
-		RtlZeroMemory( DevExt->pWriteCommonBufferBase[i],
-			DevExt->WriteCommonBufferSize);
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-			"WriteCommonBuffer[%d] 0x%p  (#0x%I64X), length %I64d",
-			i,
-			DevExt->pWriteCommonBufferBase[i],
-			DevExt->pWriteCommonBufferBaseLA[i].QuadPart,
-			WdfCommonBufferGetLength(DevExt->pWriteCommonBuffer[i]) );
-#endif
-	}
-
-
-#else 
-#if (CACHE_MODE == PING_PANG)
-    DevExt->WriteCommonBufferSize = DevExt->MaximumTransferLength * HSAC_TRANSFER_BUFFER_NUM;
-        //sizeof(DMA_TRANSFER_ELEMENT) * DevExt->WriteTransferElements;
-#else
-	DevExt->WriteCommonBufferSize = DevExt->MaximumTransferLength;
-#endif
-    status = WdfCommonBufferCreate( DevExt->DmaEnabler,
-                                    DevExt->WriteCommonBufferSize,
-                                    WDF_NO_OBJECT_ATTRIBUTES,
-                                    &DevExt->WriteCommonBuffer );
-
-    if (!NT_SUCCESS(status)) {
-#if (DBG != 0)
-        TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
-                    "WdfCommonBufferCreate (write) failed: %!STATUS!", status);
-#endif
-        return status;
-    }
-
-    DevExt->WriteCommonBufferBase =
-        WdfCommonBufferGetAlignedVirtualAddress(DevExt->WriteCommonBuffer);
-
-    DevExt->WriteCommonBufferBaseLA =
-        WdfCommonBufferGetAlignedLogicalAddress(DevExt->WriteCommonBuffer);
-
-    RtlZeroMemory( DevExt->WriteCommonBufferBase, DevExt->WriteCommonBufferSize);
-
-#if (DBG != 0)
-    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-                "WriteCommonBuffer 0x%p  (#0x%I64X), length %I64d",
-                DevExt->WriteCommonBufferBase,
-                DevExt->WriteCommonBufferBaseLA.QuadPart,
-                WdfCommonBufferGetLength(DevExt->WriteCommonBuffer) );
-#endif
-
-#endif
-    //
-    // Allocate common buffer for building reads
-    //
-    // NOTE: This common buffer will not be cached.
-    //       Perhaps in some future revision, cached option could
-    //       be used. This would have faster access, but requires
-    //       flushing before starting the DMA in HSACStartReadDma.
-    //
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-	DevExt->readCommonBufferNum = HSAC_TRANSFER_BUFFER_NUM;
-	DevExt->ReadCommonBufferSize = DevExt->MaximumTransferLength;
-	//sizeof(DMA_TRANSFER_ELEMENT) * DevExt->ReadTransferElements;
-
-	for (i = 0; i < DevExt->readCommonBufferNum; i++)
-	{
-		status = WdfCommonBufferCreate( DevExt->DmaEnabler,
-			DevExt->ReadCommonBufferSize,
-			WDF_NO_OBJECT_ATTRIBUTES,
-			&DevExt->pReadCommonBuffer[i] );
-
-		if (!NT_SUCCESS(status)) {
-#if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
-				"WdfCommonBufferCreate (read) failed %!STATUS!", status);
-#endif
-			return status;
-		}
-
-		DevExt->pReadCommonBufferBase[i] =
-			WdfCommonBufferGetAlignedVirtualAddress(DevExt->pReadCommonBuffer[i]);
-
-		DevExt->pReadCommonBufferBaseLA[i] =
-			WdfCommonBufferGetAlignedLogicalAddress(DevExt->pReadCommonBuffer[i]);
-
-		RtlZeroMemory( DevExt->pReadCommonBufferBase[i],
-			DevExt->ReadCommonBufferSize);
-
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-			"ReadCommonBuffer[%d]  0x%p  (#0x%I64X), length %I64d",
-			i,
-			DevExt->pReadCommonBufferBase[i],
-			DevExt->pReadCommonBufferBaseLA[i].QuadPart,
-			WdfCommonBufferGetLength(DevExt->pReadCommonBuffer[i]) );
-#endif
-	}
-
-#else 
-#if (CACHE_MODE == PING_PANG)
-	DevExt->ReadCommonBufferSize = DevExt->MaximumTransferLength * HSAC_TRANSFER_BUFFER_NUM;
-	//sizeof(DMA_TRANSFER_ELEMENT) * DevExt->ReadTransferElements;
-#else
-	DevExt->ReadCommonBufferSize = DevExt->MaximumTransferLength;
-#endif
-	status = WdfCommonBufferCreate( DevExt->DmaEnabler,
-		DevExt->ReadCommonBufferSize,
-		WDF_NO_OBJECT_ATTRIBUTES,
-		&DevExt->ReadCommonBuffer );
-
+	status = HSACBuffersInitialize( DevExt );
 	if (!NT_SUCCESS(status)) {
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
-			"WdfCommonBufferCreate (read) failed %!STATUS!", status);
-#endif
 		return status;
 	}
 
-	DevExt->ReadCommonBufferBase =
-		WdfCommonBufferGetAlignedVirtualAddress(DevExt->ReadCommonBuffer);
-
-	DevExt->ReadCommonBufferBaseLA =
-		WdfCommonBufferGetAlignedLogicalAddress(DevExt->ReadCommonBuffer);
-
-	RtlZeroMemory( DevExt->ReadCommonBufferBase,
-		DevExt->ReadCommonBufferSize);
-#if (DBG != 0)
-	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-		"ReadCommonBuffer  0x%p  (#0x%I64X), length %I64d",
-		DevExt->ReadCommonBufferBase,
-		DevExt->ReadCommonBufferBaseLA.QuadPart,
-		WdfCommonBufferGetLength(DevExt->ReadCommonBuffer) );
-#endif
-
-#endif
-
-    //
-    // Since we are using sequential queue and processing one request
-    // at a time, we will create transaction objects upfront and reuse
-    // them to do DMA transfer. Transactions objects are parented to
-    // DMA enabler object by default. They will be deleted along with
-    // along with the DMA enabler object. So need to delete them
-    // explicitly.
-    //
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TRANSACTION_CONTEXT);
-    
-    status = WdfDmaTransactionCreate( DevExt->DmaEnabler,
-                                      &attributes,
-                                      &DevExt->ReadDmaTransaction);
-
-    if(!NT_SUCCESS(status)) {
-#if (DBG != 0)
-        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
-                    "WdfDmaTransactionCreate(read) failed: %!STATUS!", status);
-#endif
-        return status;
-    }
-
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TRANSACTION_CONTEXT);
     //
-    // Create a new DmaTransaction.
+    // The queues present at most HSAC_MAX_OUTSTANDING_REQUESTS requests
+    // each, so we will create that many transaction objects per channel
+    // upfront and reuse them to do DMA transfer. Each one builds its
+    // DTE chain in its own slot of the channel's descriptor common
+    // buffer, so every data buffer above is left to the data path.
     //
-    status = WdfDmaTransactionCreate( DevExt->DmaEnabler,
-                                      &attributes,
-                                      &DevExt->WriteDmaTransaction );
-
-    if(!NT_SUCCESS(status)) {
-#if (DBG != 0)
-        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
-                    "WdfDmaTransactionCreate(write) failed: %!STATUS!", status);
-#endif
-        return status;
-    }
+	status = HSACDmaChannelInitialize( DevExt, &DevExt->WriteChannel, 0,
+		DevExt->WriteTransferElements );
+	if (NT_SUCCESS(status)) {
+		status = HSACDmaChannelInitialize( DevExt, &DevExt->ReadChannel, 1,
+			DevExt->ReadTransferElements );
+	}
+	if (NT_SUCCESS(status)) {
+		status = HSACBatchInitialize( DevExt );
+	}
+	if (NT_SUCCESS(status)) {
+		status = HSACHeapInitialize( DevExt );
+	}
+	if (NT_SUCCESS(status)) {
+		status = HSACStatsInitialize( DevExt );
+	}
 
     return status;
 }
@@ -1046,6 +912,8 @@ HSACMapUserAddress(
 	)
 {
 	ULONG i = 0;
+	ULONG mappings;
+	size_t size;
 	//KIRQL oldIrpl;
 //	oldIrpl = KeGetCurrentIrql();
 //#if (DBG != 0)
@@ -1061,12 +929,16 @@ HSACMapUserAddress(
 	KeLowerIrql(APC_LEVEL);
 	// AllocateMDL
 
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-	for (i = 0; i < DevExt->readCommonBufferNum; i++)
+	//
+	// In a contiguous cache mode the first buffer's MDL and address
+	// stand for all of them (HSACBuffersMappings).
+	//
+	mappings = HSACBuffersMappings(DevExt, 1, &size);
+	for (i = 0; i < mappings; i++)
 	{
 		DevExt->pReadMDL[i] = IoAllocateMdl(
 			DevExt->pReadCommonBufferBase[i], 
-			DevExt->ReadCommonBufferSize, 
+			(ULONG)size, 
 			FALSE, 
 			FALSE, 
 			NULL);
@@ -1108,11 +980,12 @@ HSACMapUserAddress(
 #endif
 	}
 
-	for (i = 0; i < DevExt->writeCommonBufferNum; i++)
+	mappings = HSACBuffersMappings(DevExt, 0, &size);
+	for (i = 0; i < mappings; i++)
 	{
 		DevExt->pWriteMDL[i] = IoAllocateMdl(
 			DevExt->pWriteCommonBufferBase[i],
-			DevExt->WriteCommonBufferSize,
+			(ULONG)size,
 			FALSE,          // Is this a secondary buffer?
 			FALSE,          // Charge quota?
 			NULL            // No IRP associated with MDL
@@ -1154,170 +1027,6 @@ HSACMapUserAddress(
 			"HSACMapUserAddress WriteUserAddress%d: 0x%I64x", i, DevExt->pWriteUserAddress[i]);
 #endif
 	}
-
-#else
-	DevExt->ReadMDL0 = IoAllocateMdl(
-		DevExt->ReadCommonBufferBase, 
-		DevExt->ReadCommonBufferSize, 
-		FALSE, 
-		FALSE, 
-		NULL);
-
-	if(DevExt->ReadMDL0 ==NULL)
-	{
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-			"HSACMapUserAddress ReadUserAddress Failed");
-#endif
-		return;
-	}
-
-	MmBuildMdlForNonPagedPool(DevExt->ReadMDL0);
-
-	__try
-	{
-		DevExt->ReadUserAddress0 = MmMapLockedPagesSpecifyCache(
-			DevExt->ReadMDL0,             // MDL for region
-			UserMode,            // User or kernel mode?
-			MmCached,            // System RAM is always Cached (otherwise mapping fails)
-			NULL,              // User address to use
-			FALSE,               // Do not issue a bug check (KernelMode only)
-			NormalPagePriority     // Priority of success
-			);
-	}
-	__except(EXCEPTION_EXECUTE_HANDLER)
-	{
-#if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-				"EXCEPTION: Raised by MmMapLockedPagesSpecifyCache for ReadMDL0");
-#endif
-		return;
-	}
-
-#if (DBG != 0)
-	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-		"HSACMapUserAddress ReadUserAddress0: 0x%I64x", DevExt->ReadUserAddress0);
-#endif
-
-	//// AllocateMDL
-	//pdx->ReadMDL1 =
-	//	IoAllocateMdl(
-	//	pdx->ReadSystemVitualAddress1,
-	//	pdx->ReadDMASize,
-	//	FALSE,          // Is this a secondary buffer?
-	//	FALSE,          // Charge quota?
-	//	NULL            // No IRP associated with MDL
-	//	);	
-
-	//if(pdx->ReadMDL1 ==NULL)
-	//{
-	//	DebugPrintToFile(pdx->hFileLog, "Allocate ReadMDL0 Failed\r\n");
-	//	return FALSE;
-	//}
-
-	//MmBuildMdlForNonPagedPool(pdx->ReadMDL1);
-	//__try
-	//{
-	//	// Attempt to map next region
-	//	pdx->ReadUserAddress1 =
-	//		MmMapLockedPagesSpecifyCache(
-	//		pdx->ReadMDL1,             // MDL for region
-	//		UserMode,            // User or kernel mode?
-	//		MmCached,            // System RAM is always Cached (otherwise mapping fails)
-	//		NULL,              // User address to use
-	//		FALSE,               // Do not issue a bug check (KernelMode only)
-	//		NormalPagePriority     // Priority of success
-	//		);
-	//}
-	//__except (EXCEPTION_EXECUTE_HANDLER)
-	//{
-	//	DebugPrintToFile(pdx->hFileLog, "EXCEPTION: Raised by MmMapLockedPagesSpecifyCache() for ReadMDL1\r\n");
-	//	return FALSE;
-	//}
-
-	// AllocateMDL
-	DevExt->WriteMDL0 = IoAllocateMdl(
-		DevExt->WriteCommonBufferBase,
-		DevExt->WriteCommonBufferSize,
-		FALSE,          // Is this a secondary buffer?
-		FALSE,          // Charge quota?
-		NULL            // No IRP associated with MDL
-		);	
-	if(DevExt->WriteMDL0 ==NULL)
-	{
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-			"HSACMapUserAddress WriteUserAddress Failed");
-#endif
-		return;
-	}
-
-	MmBuildMdlForNonPagedPool(DevExt->WriteMDL0);
-
-	__try
-	{
-		DevExt->WriteUserAddress0 =
-			MmMapLockedPagesSpecifyCache(
-			DevExt->WriteMDL0,             // MDL for region
-			UserMode,            // User or kernel mode?
-			MmCached,            // System RAM is always Cached (otherwise mapping fails)
-			NULL,              // User address to use
-			FALSE,               // Do not issue a bug check (KernelMode only)
-			NormalPagePriority     // Priority of success
-			);
-	}
-	__except(EXCEPTION_EXECUTE_HANDLER)
-	{
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-			"EXCEPTION: Raised by MmMapLockedPagesSpecifyCache for WriteMDL0");
-#endif
-		return;
-	}
-
-#if (DBG != 0)
-	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
-		"HSACMapUserAddress WriteUserAddress0: 0x%I64x", DevExt->WriteUserAddress0);
-#endif
-
-	//// AllocateMDL
-	//pdx->WriteMDL1 =
-	//	IoAllocateMdl(
-	//	pdx->WriteSystemVitualAddress1,
-	//	pdx->WriteDMASize,
-	//	FALSE,          // Is this a secondary buffer?
-	//	FALSE,          // Charge quota?
-	//	NULL            // No IRP associated with MDL
-	//	);	
-
-	//if(pdx->WriteMDL1 ==NULL)
-	//{
-	//	DebugPrintToFile(pdx->hFileLog, "Allocate ReadMDL0 Failed\r\n");
-	//	return FALSE;
-	//}
-
-	//MmBuildMdlForNonPagedPool(pdx->WriteMDL1);
-	//__try
-	//{
-	//	// Attempt to map next region
-	//	pdx->WriteUserAddress1 =
-	//		MmMapLockedPagesSpecifyCache(
-	//		pdx->WriteMDL1,             // MDL for region
-	//		UserMode,            // User or kernel mode?
-	//		MmCached,            // System RAM is always Cached (otherwise mapping fails)
-	//		NULL,              // User address to use
-	//		FALSE,               // Do not issue a bug check (KernelMode only)
-	//		NormalPagePriority     // Priority of success
-	//		);
-	//}
-	//__except (EXCEPTION_EXECUTE_HANDLER)
-	//{
-	//	DebugPrintToFile(pdx->hFileLog, "EXCEPTION: Raised by MmMapLockedPagesSpecifyCache() for WriteMDL1\r\n");
-	//	return FALSE;
-	//}
-
-#endif
-
 }
 
 VOID
@@ -1331,7 +1040,6 @@ HSACUnmapUserAddress(
 		"HSACUnmapUserAddress");
 #endif
 
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
 	for (i = 0; i < DevExt->readCommonBufferNum; i++)
 	{
 		if(DevExt->pReadUserAddress[i] != NULL)
@@ -1361,55 +1069,6 @@ HSACUnmapUserAddress(
 			DevExt->pWriteMDL[i] = NULL;
 		}
 	}
-#else
-	if(DevExt->ReadUserAddress0 != NULL)
-	{
-		MmUnmapLockedPages(DevExt->ReadUserAddress0,DevExt->ReadMDL0);
-		DevExt->ReadUserAddress0 = NULL;
-	}
-
-	if(DevExt->ReadMDL0 != NULL)
-	{
-		IoFreeMdl(DevExt->ReadMDL0);
-		DevExt->ReadMDL0 = NULL;
-	}
-
-	//if(pdx->ReadUserAddress1 != NULL)
-	//{
-	//	MmUnmapLockedPages(pdx->ReadUserAddress1,pdx->ReadMDL1);
-	//	pdx->ReadUserAddress1 = NULL;
-	//}
-
-	//if(pdx->ReadMDL1 != NULL)
-	//{
-	//	IoFreeMdl(pdx->ReadMDL1);
-	//	pdx->ReadMDL1 = NULL;
-	//}
-
-	if(DevExt->WriteUserAddress0 != NULL)
-	{
-		MmUnmapLockedPages(DevExt->WriteUserAddress0,DevExt->WriteMDL0);
-		DevExt->WriteUserAddress0 = NULL;
-	}
-
-	if(DevExt->WriteMDL0 != NULL)
-	{
-		IoFreeMdl(DevExt->WriteMDL0);
-		DevExt->WriteMDL0 = NULL;
-	}
-
-	//if(pdx->WriteUserAddress1 != NULL)
-	//{
-	//	MmUnmapLockedPages(pdx->WriteUserAddress1,pdx->WriteMDL1);
-	//	pdx->WriteUserAddress1 = NULL;
-	//}
-
-	//if(pdx->WriteMDL1 != NULL)
-	//{
-	//	IoFreeMdl(pdx->WriteMDL1);
-	//	pdx->WriteMDL1 = NULL;
-	//}
-#endif
 }
 
 
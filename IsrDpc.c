@@ -48,15 +48,18 @@ Return Value:
     NTSTATUS                    status;
     WDF_INTERRUPT_CONFIG        InterruptConfig;
 
+    //
+    // No DpcForIsr: the ISR queues the DPC of each channel it retired
+    // work on (HSACEvtChannelDpc).
+    //
     WDF_INTERRUPT_CONFIG_INIT( &InterruptConfig,
                                HSACEvtInterruptIsr,
-                               HSACEvtInterruptDpc );
+                               NULL );
 
     InterruptConfig.EvtInterruptEnable  = HSACEvtInterruptEnable;
     InterruptConfig.EvtInterruptDisable = HSACEvtInterruptDisable;
 
-    // JOHNR: Enable testing of the DpcForIsr Synchronization
-    InterruptConfig.AutomaticSerialization = TRUE;
+    InterruptConfig.AutomaticSerialization = FALSE;
 
     //
     // Unlike WDM, framework driver should create interrupt object in EvtDeviceAdd and
@@ -81,6 +84,95 @@ Return Value:
     return status;
 }
 
+NTSTATUS
+HSACChannelInterruptCreate(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFCMRESLIST      Resources,
+    IN WDFCMRESLIST      ResourcesTranslated
+    )
+/*++
+Routine Description:
+
+    Called by EvtDevicePrepareHardware. If the card was granted one MSI
+    message per channel (MSISupported and a MessageNumberLimit of at
+    least 2 in the INF), create a second WDFINTERRUPT for the read
+    channel's message, so that each channel is reported, locked and
+    retired on its own. The interrupt created in EvtDeviceAdd takes the
+    first message (write channel). Otherwise one interrupt serves both
+    channels as before.
+
+    The framework deletes the interrupt after EvtDeviceReleaseHardware.
+
+Arguments:
+
+    DevExt              Pointer to our DEVICE_EXTENSION
+    Resources           Raw resources
+    ResourcesTranslated Translated resources
+
+Return Value:
+
+    NTSTATUS code
+
+--*/
+{
+    NTSTATUS                        status = STATUS_SUCCESS;
+    WDF_INTERRUPT_CONFIG            InterruptConfig;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR desc;
+    ULONG                           messages = 0;
+    ULONG                           i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < WdfCmResourceListGetCount(ResourcesTranslated); i++) {
+
+        desc = WdfCmResourceListGetDescriptor( ResourcesTranslated, i );
+
+        if (!desc || desc->Type != CmResourceTypeInterrupt ||
+            !(desc->Flags & CM_RESOURCE_INTERRUPT_MESSAGE)) {
+            continue;
+        }
+
+        if (messages++ != HSAC_READ_MESSAGE) {
+            continue;
+        }
+
+        WDF_INTERRUPT_CONFIG_INIT( &InterruptConfig,
+                                   HSACEvtInterruptIsr,
+                                   NULL );
+
+        InterruptConfig.EvtInterruptEnable  = HSACEvtInterruptEnable;
+        InterruptConfig.EvtInterruptDisable = HSACEvtInterruptDisable;
+        InterruptConfig.AutomaticSerialization = FALSE;
+
+        InterruptConfig.InterruptRaw        = WdfCmResourceListGetDescriptor( Resources, i );
+        InterruptConfig.InterruptTranslated = desc;
+
+        status = WdfInterruptCreate( DevExt->Device,
+                                     &InterruptConfig,
+                                     WDF_NO_OBJECT_ATTRIBUTES,
+                                     &DevExt->ReadInterrupt );
+
+        if( !NT_SUCCESS(status) ) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                        "WdfInterruptCreate(read message) failed: %!STATUS!", status);
+#endif
+            DevExt->ReadInterrupt = NULL;
+            return status;
+        }
+
+        DevExt->ReadChannel.Interrupt = DevExt->ReadInterrupt;
+    }
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_PNP,
+                "%d MSI message(s), %s interrupt per channel",
+                messages, DevExt->ReadInterrupt ? "one" : "no");
+#endif
+
+    return status;
+}
+
 BOOLEAN
 HSACEvtInterruptIsr(
     IN WDFINTERRUPT Interrupt,
@@ -101,7 +193,8 @@ Routine Description:
 Arguments:
 
     Interrupt   - Handle to WDFINTERRUPT Object for this device.
-    MessageID  - MSI message ID (always 0 in this configuration)
+    MessageID  - MSI message ID: HSAC_WRITE_MESSAGE or HSAC_READ_MESSAGE
+                 with one message per channel, otherwise 0
 
 Return Value:
 
@@ -112,42 +205,85 @@ Return Value:
 {
     PDEVICE_EXTENSION   devExt;
     BOOLEAN             isRecognized = FALSE;
-
-    UNREFERENCED_PARAMETER(MessageID);
+    ULONG               mask = DMA0IntActive | DMA1IntActive;
+    LONGLONG            now;
+    union {
+        INT_REG bits;
+        ULONG ul;
+    }                   intStatus;
 
     //TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INTERRUPT,
     //            "--> HSACInterruptHandler");
 
     devExt  = HSACGetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
+    //
+    // With one message per channel this ISR owns only its channel's bit;
+    // the other channel's ISR may be running on another processor.
+    //
+    if (devExt->ReadInterrupt) {
+        mask = (MessageID == HSAC_READ_MESSAGE) ?
+            devExt->ReadChannel.IntActive : devExt->WriteChannel.IntActive;
+    }
+
     //
     // Read the Interrupt CSR register (INTCSR)
     //
-    devExt->IntStatus.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->INT_STATE );
+    intStatus.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->INT_STATE ) & mask;
+
+    InterlockedIncrement64( &devExt->IsrCalls );
+    HSACFlightRecord( devExt, HSAC_FLIGHT_ISR, HSAC_FLIGHT_NO_CHANNEL,
+                      (USHORT) MessageID, intStatus.ul, 0 );
 
     //
     // Is DMA channel 0 (Write-side) Active?
     //
-    if (devExt->IntStatus.ul) {
+    if (intStatus.ul) {
 
         //TraceEvents(TRACE_LEVEL_INFORMATION,  DBG_INTERRUPT,
         //            " Interrupt for DMA");
 
+        //
+        // The completion time of every transfer this interrupt retires.
+        //
+        now = KeQueryPerformanceCounter( NULL ).QuadPart;
+
+#ifdef HSAC_STAGE_STAMPS
+        if (intStatus.bits.DMA1IntState) {
+            HSAC_STAMP_READ(devExt, HsacReadStageIsr);
+        }
+#endif
+
         //
         // Clear this interrupt.
         //
 
         WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->INT_STATE,
-                              devExt->IntStatus.ul );
+                              intStatus.ul );
+
+        //
+        // Retire the finished chain of each interrupting channel and
+        // start the chains that queued up behind it right away, so the
+        // engine does not sit idle until the DPC runs. Then queue that
+        // channel's DPC.
+        //
 
-		//devExt->dma0.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL);
-		//devExt->dma1.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL);
-		//if (devExt->dma0.bits.ChannelState == CHAN_SUCCESS || devExt->dma1.bits.ChannelState)
-		//{
-			WdfInterruptQueueDpcForIsr( devExt->Interrupt );
-		//}	
+        if (intStatus.bits.DMA0IntState) {
+            InterlockedIncrement64( &devExt->WriteChannel.Stats.Interrupts );
+            WriteNoFence64( &devExt->WriteChannel.Stats.LastInterruptTime, now );
+            HSACDmaChannelInterrupt(devExt, &devExt->WriteChannel, now);
+            HSACDmaChannelQueueDpc( &devExt->WriteChannel );
+        }
+        if (intStatus.bits.DMA1IntState) {
+            InterlockedIncrement64( &devExt->ReadChannel.Stats.Interrupts );
+            WriteNoFence64( &devExt->ReadChannel.Stats.LastInterruptTime, now );
+            HSACDmaChannelInterrupt(devExt, &devExt->ReadChannel, now);
+            HSACDmaChannelQueueDpc( &devExt->ReadChannel );
+        }
 
         isRecognized = TRUE;
+    } else {
+        InterlockedIncrement64( &devExt->IsrSpurious );
     }
 
     ////
@@ -189,112 +325,135 @@ Return Value:
     return isRecognized;
 }
 
-VOID
-HSACEvtInterruptDpc(
-    IN WDFINTERRUPT Interrupt,
-    IN WDFDEVICE    Device
+static VOID
+HSACChannelDpcRun(
+    IN WDFDEVICE         device,
+    IN PDEVICE_EXTENSION devExt,
+    IN PHSAC_DMA_CHANNEL channel
     )
 /*++
 
 Routine Description:
 
-    DPC callback for ISR. Please note that on a multiprocessor system,
-    you could have more than one DPCs running simultaneously on
-    multiple processors. So if you are accessing any global resources
-    make sure to synchronize the accesses with a spinlock.
+    One pass of a channel's DPC: complete what the ISR retired on the
+    channel and keep the channel and its stream moving. Only one pass of
+    a channel runs at a time (HSACEvtChannelDpc), so the stream, batch and
+    moderation state the pass touches needs no further lock.
 
 Arguments:
 
-    Interrupt  - Handle to WDFINTERRUPT Object for this device.
-    Device    - WDFDEVICE object passed to InterruptCreate
+    device  - Handle to the WDFDEVICE.
+    devExt  - Its device context.
+    channel - The channel whose DPC this is.
 
 Return Value:
 
 --*/
 {
     NTSTATUS            status = STATUS_SUCCESS;
+    NTSTATUS            retiredStatus;
     WDFDMATRANSACTION   dmaTransaction;
-    PDEVICE_EXTENSION   devExt;
-    BOOLEAN             writeInterrupt = FALSE;
-    BOOLEAN             readInterrupt  = FALSE;
-
-    UNREFERENCED_PARAMETER(Device);
+    PTRANSACTION_CONTEXT transContext;
+    LIST_ENTRY          done;
+    LONG                pending;
+    LONG                completions = 0;
 
-#if (DBG != 0)
-    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC, "--> EvtInterruptDpc");
-#endif
-    devExt  = HSACGetDeviceContext(WdfInterruptGetDevice(Interrupt));
+    HSACFlightRecord( devExt, HSAC_FLIGHT_DPC_START, (UCHAR) channel->Index, 0, 0, 0 );
 
     //
-    // Acquire this device's InterruptSpinLock.
+    // Take every transaction the ISR has retired on this channel since
+    // the last run. One DPC may cover several interrupts, and one
+    // interrupt several linked requests. The ISR keeps ORing the bit
+    // into IntPending while we run and queues us again, so clearing it
+    // first loses nothing; the other channel's bit is left to its DPC.
     //
-    WdfInterruptAcquireLock( Interrupt );
-#if (DBG != 0)
-	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC, "DMA Interrupt Status: #%x", devExt->IntStatus.ul);	
-#endif
-    if ((devExt->IntStatus.bits.DMA0IntState) /*&&
-        (devExt->dma0.bits.ChannelState == CHAN_SUCCESS)/*(devExt->Dma0Csr.bits.Done)*/ ) {
+    pending = InterlockedAnd( &devExt->IntPending, ~(LONG) channel->IntActive );
 
-        //
-        // If Dma0 channel 0 (write) is interrupting and the
-        //  Done bit is set in the Dma0 CSR,
-        //  we're interrupting because a WRITE is complete.
-        // Clear the done bit and channel interrupting bit from
-        //  our copies...
-        //
-        //devExt->IntCsr.bits.DmaChan0IntActive = FALSE;
-        //devExt->Dma0Csr.uchar = 0;
-
-        writeInterrupt = TRUE;
+    if (pending & channel->IntActive) {
+        HSACDmaChannelTakeDone( devExt, channel, &done );
+    } else {
+        InitializeListHead( &done );
     }
 
-    if ((devExt->IntStatus.bits.DMA1IntState) /*&&
-        (devExt->Dma1Csr.bits.Done) */) {
-
-        //
-        // If DMA channel 1 is interrupting and the
-        //  DONE bit is set in the DMA1 control/status
-        //  register, we're interrupting because a READ
-        //  is complete.
-        // Clear the done bit and channel interrupting bit from
-        //  our copies...
-        //
-        //devExt->IntCsr.bits.DmaChan1IntActive = FALSE;
-        //devExt->Dma0Csr.uchar = 0;
-
-        readInterrupt = TRUE;
+    if (channel == &devExt->ReadChannel && !IsListEmpty(&done)) {
+        HSAC_STAMP_READ(devExt, HsacReadStageDpc);
     }
 
-	//devExt->IntStatus.ul = 0;
-
-    //
-    // Release our interrupt spinlock
-    //
-    WdfInterruptReleaseLock( Interrupt );
-
     //
-    // Did a Write DMA complete?
+    // Did DMAs complete?
     //
-    if (writeInterrupt) {
+    while (!IsListEmpty(&done)) {
 
         BOOLEAN transactionComplete;
+
+        transContext = CONTAINING_RECORD(RemoveHeadList(&done),
+                                         TRANSACTION_CONTEXT, ListEntry);
+        dmaTransaction = transContext->Transaction;
+        completions++;
+
+        //
+        // A transfer HSACDmaChannelAbort took back did not finish.
+        //
+        retiredStatus = transContext->Aborted ? STATUS_CANCELLED : STATUS_SUCCESS;
+
+        HSACFlightRecord( devExt, HSAC_FLIGHT_COMPLETE, (UCHAR) channel->Index, 0,
+                          ReadNoFence(&transContext->Cancelled) ? STATUS_CANCELLED : retiredStatus,
+                          (ULONGLONG) (ULONG_PTR) dmaTransaction );
 #if (DBG != 0)
 		TraceEvents(TRACE_LEVEL_INFORMATION,  DBG_DPC,
-			" Interrupt for DMA writeInterrupt");
+			" Interrupt for DMA channel %d", channel->Index);
 #endif
 
         //
-        // Get the current Write DmaTransaction.
+        // A registered buffer moves in one piece; there is no framework
+        // transaction to drive.
         //
-        dmaTransaction = devExt->WriteDmaTransaction;
+        if (transContext->Registered) {
+            HSACRegisteredRequestComplete( devExt, dmaTransaction, retiredStatus );
+            continue;
+        }
+
+        //
+        // Nor does a packet ring transfer, which reports to the ring.
+        //
+        if (transContext->RingEntry) {
+            HSACRingComplete( devExt, dmaTransaction, retiredStatus );
+            continue;
+        }
+
+        //
+        // Nor does an IOCTL_PACKET_BATCH entry.
+        //
+        if (transContext->Batched) {
+            HSACBatchComplete( devExt, dmaTransaction, retiredStatus );
+            continue;
+        }
+
+        //
+        // Nor does a stream buffer, which re-arms the channel itself.
+        //
+        if (transContext->Streamed) {
+            HSACStreamComplete( devExt, dmaTransaction, retiredStatus );
+            continue;
+        }
 
         //
         // Indicate this DMA operation has completed:
         // This may drive the transfer on the next packet if
         // there is still data to be transfered in the request.
+        // A cancelled or aborted request is not driven any further.
         //
-        transactionComplete = WdfDmaTransactionDmaCompleted( dmaTransaction,
+        if (ReadNoFence(&transContext->Cancelled) || transContext->Aborted) {
+            transactionComplete = WdfDmaTransactionDmaCompletedFinal( dmaTransaction,
+                WdfDmaTransactionGetCurrentDmaTransferLength( dmaTransaction ),
+                &status );
+            if (transContext->Aborted) {
+                status = STATUS_CANCELLED;
+            }
+        } else {
+            transactionComplete = WdfDmaTransactionDmaCompleted( dmaTransaction,
                                                          &status );
+        }
 
         if (transactionComplete) {
             //
@@ -302,85 +461,90 @@ Return Value:
             //
 #if (DBG != 0)
             TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
-                                     "Completing Write request in the DpcForIsr, status: #%x", status);
+				"Completing %s request in the DPC, status: #%x",
+				(channel == &devExt->ReadChannel) ? "Read" : "Write", status);
 #endif
-            HSACWriteRequestComplete( dmaTransaction, status );
-
+            if (channel == &devExt->ReadChannel) {
+                HSACReadRequestComplete( dmaTransaction, device, status );
+            } else {
+                HSACWriteRequestComplete( dmaTransaction, status );
+            }
         }
     }
 
+    InterlockedIncrement64( &channel->Stats.DpcRuns );
+    InterlockedExchangeAdd64( &channel->Stats.Completions, completions );
+    HSACStatsMax( &channel->Stats.MaxCompletionsPerDpc, completions );
+    WriteNoFence64( &channel->Stats.LastDpcTime,
+                    KeQueryPerformanceCounter( NULL ).QuadPart );
+    HSACFlightRecord( devExt, HSAC_FLIGHT_DPC_END, (UCHAR) channel->Index,
+                      (USHORT) min(completions, 0xFFFF), 0, 0 );
+
     //
-    // Did a Read DMA complete?
+    // The ISR may have held Ready requests back for interrupt moderation;
+    // it cannot set the moderation timer, so do it here.
     //
-    if (readInterrupt) {
+    if (HSACDmaChannelModerated( channel )) {
+        HSACDmaChannelKick( devExt, channel );
+    }
 
-        BOOLEAN                transactionComplete;
-        PDMA_TRANSFER_ELEMENT  dteVA;
-        size_t                 length;
+    //
+    // A stream on this channel may have buffers to arm (Stream.c).
+    //
+    HSACStreamRefill( devExt, channel );
+}
 
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION,  DBG_DPC,
-			" Interrupt for DMA readInterrupt");
-#endif
-        //
-        // Get the current Read DmaTransaction.
-        //
-        dmaTransaction = devExt->ReadDmaTransaction;
+VOID
+HSACEvtChannelDpc(
+    IN WDFDPC Dpc
+    )
+/*++
 
-        //
-        // Only on Read-side --
-        //    Use "DMA Clear-Count Mode" to get complementary
-        //    transferred byte count.
-        //
+Routine Description:
 
-		transactionComplete = WdfDmaTransactionDmaCompleted( dmaTransaction, &status );
-
-//        length = WdfDmaTransactionGetCurrentDmaTransferLength( dmaTransaction );
-//
-//#if 1 // set to 1 for recording the details
-//		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
-//			"Len %8d\n",
-//			length);
-//#endif
-//
-//        dteVA = (PDMA_TRANSFER_ELEMENT) devExt->ReadCommonBufferBase;
-//
-//        while(dteVA->DescPtrLow.LastElement == FALSE) {
-//            length -= dteVA->TransferSize;
-//            dteVA++;
-//        }
-//        length -= dteVA->TransferSize;
-//
-//#if 1 // set to 1 for recording the details
-//		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
-//			"Len %8d\n",
-//			length);
-//#endif
-//
-//        //
-//        // Indicate this DMA operation has completed:
-//        // This may drive the transfer on the next packet if
-//        // there is still data to be transfered in the request.
-//        //
-//        transactionComplete =
-//            WdfDmaTransactionDmaCompletedWithLength( dmaTransaction,
-//                                                     length,
-//                                                     &status );
+    Per channel DPC, queued by the ISR (or a poller, or the stream timer)
+    for the channel it retired work on. The write and read channels each
+    have one, so their completions can run at the same time on different
+    processors, each on the processor set with IOCTL_SET_DPC_AFFINITY.
+
+    A DPC is dequeued before it runs, so the same channel's DPC can be
+    queued again and start on another processor while this one is still
+    running. The second run does not enter the body; it counts itself in
+    DpcActive and leaves, and the first runs the body once more for it.
+
+Arguments:
+
+    Dpc  - Handle to the channel's WDFDPC Object.
+
+Return Value:
+
+--*/
+{
+    WDFDEVICE           device;
+    PDEVICE_EXTENSION   devExt;
+    PHSAC_DMA_CHANNEL   channel;
 
-        if (transactionComplete) {
-            //
-            // Complete this DmaTransaction.
-            //
 #if (DBG != 0)
-            TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
-				"Completing Read request in the DpcForIsr, status: #%x", status);
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC, "--> EvtChannelDpc");
 #endif
-            HSACReadRequestComplete( dmaTransaction, Device, status );
+    channel = HSACGetChannelDpcContext(Dpc)->Channel;
+    device  = (WDFDEVICE) WdfDpcGetParentObject(Dpc);
+    devExt  = HSACGetDeviceContext(device);
 
-        }
+    //
+    // This insertion has run (HSACDmaChannelQueueDpc).
+    //
+    InterlockedDecrement( &channel->DpcQueued );
+
+    if (InterlockedIncrement( &channel->DpcActive ) == 1) {
+        do {
+            InterlockedExchange( &channel->DpcActive, 1 );
+            HSACChannelDpcRun( device, devExt, channel );
+        } while (InterlockedCompareExchange( &channel->DpcActive, 0, 1 ) != 1);
     }
+
 #if (DBG != 0)
-    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC, "<-- EvtInterruptDpc");
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC, "<-- EvtChannelDpc");
 #endif
     return;
 }
@@ -411,19 +575,28 @@ Return Value:
 
     devExt  = HSACGetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
-    devExt->dma0.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL );
+    //
+    // With one message per channel each interrupt enables its own channel.
+    //
+    if (Interrupt != devExt->ReadInterrupt) {
+
+        devExt->dma0.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL );
 
-    devExt->dma0.bits.INTEnable = TRUE;
+        devExt->dma0.bits.INTEnable = TRUE;
 
-    WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL,
-                          devExt->dma0.ul );
+        WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL,
+                              devExt->dma0.ul );
+    }
 
-	devExt->dma1.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL );
+    if (devExt->ReadInterrupt == NULL || Interrupt == devExt->ReadInterrupt) {
 
-	devExt->dma1.bits.INTEnable = TRUE;
+        devExt->dma1.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL );
 
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL,
-		devExt->dma1.ul );
+        devExt->dma1.bits.INTEnable = TRUE;
+
+        WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL,
+                              devExt->dma1.ul );
+    }
 
     return STATUS_SUCCESS;
 }
@@ -454,19 +627,25 @@ Return Value:
 
     devExt  = HSACGetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
-	devExt->dma0.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL );
+    if (Interrupt != devExt->ReadInterrupt) {
 
-	devExt->dma0.bits.INTEnable = FALSE;
+        devExt->dma0.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL );
 
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL,
-		devExt->dma0.ul );
+        devExt->dma0.bits.INTEnable = FALSE;
 
-	devExt->dma1.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL );
+        WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL,
+                              devExt->dma0.ul );
+    }
+
+    if (devExt->ReadInterrupt == NULL || Interrupt == devExt->ReadInterrupt) {
 
-	devExt->dma1.bits.INTEnable = FALSE;
+        devExt->dma1.ul = READ_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL );
 
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL,
-		devExt->dma1.ul );
+        devExt->dma1.bits.INTEnable = FALSE;
+
+        WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL,
+                              devExt->dma1.ul );
+    }
 
     return STATUS_SUCCESS;
 }
@@ -0,0 +1,175 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Poll.c
+
+Abstract:
+
+    Per handle busy-poll completion. A handle in poll mode has its reads
+    and writes completed by the thread that issued them: EvtIoRead and
+    EvtIoWrite spin on the channel (HSACDmaChannelPoll) instead of waiting
+    for the ISR and DPC. In adaptive mode the handle keeps a running
+    average of how long its transfers take to finish, spins only about
+    twice that long, and after a transfer outlasts the spin leaves the
+    next few (doubling up to HSAC_POLL_MAX_BACKOFF) to the interrupt.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Poll.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACEvtDeviceFileCreate)
+#endif
+
+VOID
+HSACEvtDeviceFileCreate(
+    IN WDFDEVICE     Device,
+    IN WDFREQUEST    Request,
+    IN WDFFILEOBJECT FileObject
+    )
+/*++
+Routine Description:
+
+    A new handle completes through the interrupt until it asks for
+    IOCTL_SET_POLL_MODE.
+
+--*/
+{
+    PFILE_CONTEXT fileContext = HSACGetFileContext(FileObject);
+
+    UNREFERENCED_PARAMETER(Device);
+
+    PAGED_CODE();
+
+    RtlZeroMemory(fileContext, sizeof(FILE_CONTEXT));
+    fileContext->PollMode = HSAC_POLL_OFF;
+
+    WdfRequestComplete(Request, STATUS_SUCCESS);
+}
+
+NTSTATUS
+HSACPollSetMode(
+    IN PFILE_CONTEXT FileContext,
+    IN ULONG         Mode,
+    IN ULONG         BudgetUs
+    )
+/*++
+Routine Description:
+
+    IOCTL_SET_POLL_MODE. Set the handle's completion mode and spin budget
+    and forget what adaptive mode has learned.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    LARGE_INTEGER frequency;
+
+    if (Mode > HSAC_POLL_ADAPTIVE ||
+        (Mode != HSAC_POLL_OFF &&
+         (BudgetUs == 0 || BudgetUs > HSAC_POLL_MAX_BUDGET_US))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeQueryPerformanceCounter(&frequency);
+
+    FileContext->PollMode        = Mode;
+    FileContext->PollBudget      = (Mode != HSAC_POLL_OFF) ? BudgetUs : 0;
+    FileContext->PollBudgetTicks = (LONGLONG) FileContext->PollBudget *
+        frequency.QuadPart / 1000000;
+    FileContext->AverageTicks    = 0;
+    FileContext->Backoff         = 0;
+    FileContext->InterruptRuns   = 0;
+
+    return STATUS_SUCCESS;
+}
+
+LONGLONG
+HSACPollBudget(
+    IN PFILE_CONTEXT FileContext
+    )
+/*++
+Routine Description:
+
+    How long (performance counter ticks) to spin for the next request
+    issued on the handle; 0 to leave it to the interrupt.
+
+--*/
+{
+    LONGLONG budget = FileContext->PollBudgetTicks;
+
+    switch (FileContext->PollMode) {
+
+    case HSAC_POLL_ALWAYS:
+        return budget;
+
+    case HSAC_POLL_ADAPTIVE:
+        if (FileContext->InterruptRuns) {
+            FileContext->InterruptRuns--;
+            return 0;
+        }
+        if (FileContext->AverageTicks && 2 * FileContext->AverageTicks < budget) {
+            budget = 2 * FileContext->AverageTicks;
+        }
+        return budget;
+
+    default:
+        return 0;
+    }
+}
+
+VOID
+HSACPollUpdate(
+    IN PFILE_CONTEXT FileContext,
+    IN LONGLONG      ElapsedTicks,
+    IN BOOLEAN       Completed
+    )
+/*++
+Routine Description:
+
+    Account for one polled request: ElapsedTicks spent spinning, and
+    whether the transfer finished within them.
+
+--*/
+{
+    if (Completed) {
+        FileContext->PollHits++;
+    } else {
+        FileContext->PollMisses++;
+    }
+
+    if (FileContext->PollMode != HSAC_POLL_ADAPTIVE) {
+        return;
+    }
+
+    //
+    // A miss only tells us the transfer took at least ElapsedTicks, which
+    // is enough to grow the spin again next time.
+    //
+    FileContext->AverageTicks = FileContext->AverageTicks ?
+        (FileContext->AverageTicks * 7 + ElapsedTicks) / 8 : ElapsedTicks;
+
+    if (Completed) {
+        FileContext->Backoff = 0;
+    } else {
+        FileContext->Backoff = FileContext->Backoff ?
+            min(FileContext->Backoff * 2, HSAC_POLL_MAX_BACKOFF) : 1;
+        FileContext->InterruptRuns = FileContext->Backoff;
+    }
+}
@@ -23,16 +23,369 @@ Environment:
 #if !defined(_HSAC_H_)
 #define _HSAC_H_
 
-//#define ENABLE_PING_PANG
-#define PING_PANG				0x00
-#define PING_PANG_DISCRETE		0x10
-#define MULTI_CACHE				0x01
-#define MULTI_DISCRETE_CACHE	0x11
-#define CACHE_NONE_MODE			0xff
-#define CACHE_MODE				MULTI_DISCRETE_CACHE //CACHE_NONE_MODE //
+//
+// The cache mode (HSAC_CACHE_*, Public.h) of a device whose hardware key
+// does not name one. Every mode keeps its buffers in the same per-buffer
+// arrays (Buffers.c), so the data path looks a buffer up the same way in
+// all of them.
+//
+#define HSAC_DEFAULT_CACHE_MODE	HSAC_CACHE_MULTI_DISCRETE
+
+//
+// Modes with one common buffer per channel, and modes that allocate a
+// channel's buffers as one common buffer.
+//
+#define HSAC_CACHE_SINGLE(Mode)		((Mode) == HSAC_CACHE_MULTI || (Mode) == HSAC_CACHE_NONE)
+#define HSAC_CACHE_CONTIGUOUS(Mode)	((Mode) != HSAC_CACHE_MULTI_DISCRETE)
 
 
 #define ENABLE_CANCEL
+
+//
+// Read path stage timestamps, taken with KeQueryPerformanceCounter into
+// DEVICE_EXTENSION.ReadStamps. Off by default; add
+// -DHSAC_STAGE_STAMPS to C_DEFINES (the user-mode build in sim/ always
+// does) to see where the time of a single read goes.
+//
+#ifdef HSAC_STAGE_STAMPS
+typedef enum _HSAC_READ_STAGE {
+	HsacReadStageIoRead = 0,	// HSACEvtIoRead entry
+	HsacReadStageExecute,		// WdfDmaTransactionExecute called
+	HsacReadStageProgrammed,	// DMA1_CTRL start written
+	HsacReadStageIsr,			// ISR saw DMA1IntActive
+	HsacReadStageDpc,			// DPC picked up the read interrupt
+	HsacReadStageComplete,		// HSACReadRequestComplete entry
+	HsacReadStageMax
+} HSAC_READ_STAGE;
+
+#define HSAC_STAMP_READ(DevExt, Stage) \
+	((DevExt)->ReadStamps[(Stage)] = KeQueryPerformanceCounter(NULL).QuadPart)
+#else
+#define HSAC_STAMP_READ(DevExt, Stage)
+#endif
+
+//
+// Number of read (and of write) requests the driver accepts from its
+// queues at once. Each one owns a DMA transaction from the channel's pool
+// and a slot for its DMA_TRANSFER_ELEMENT chain.
+//
+#define HSAC_MAX_OUTSTANDING_REQUESTS	8
+
+//
+// Where a pooled DMA transaction is. Free, Ready and Active mean the
+// transaction sits on the channel list of the same name; the lists and
+// the state are protected by the channel's interrupt spinlock. A Done
+// transaction is on the channel's DoneStack until the DPC flushes it,
+// and is then the DPC's (or, if Polled, its poller's) without the lock.
+//
+typedef enum _HSAC_DMA_STATE {
+	HsacDmaFree = 0,		// on FreeList
+	HsacDmaAllocated,		// owned by EvtIo* code or a poller, on no list
+	HsacDmaReady,			// programmed, waiting for the channel
+	HsacDmaActive,			// handed to the channel
+	HsacDmaDone				// channel finished, on DoneStack for the DPC
+} HSAC_DMA_STATE;
+
+//
+// Per DMA channel request pipeline. Ready transactions that are found
+// together when the channel goes idle are started as one descriptor
+// chain, so the engine does not wait for an interrupt round trip
+// between requests.
+//
+// The card raises one interrupt per started chain, so interrupt
+// moderation is done here: with ModerationCount > 1 an idle channel is
+// not started until that many requests are Ready or the oldest of them
+// has waited ModerationDelay microseconds (IOCTL_SET_INT_MODERATION).
+//
+typedef struct _HSAC_DMA_CHANNEL {
+
+	ULONG					Index;			// 0 - DMA0 (write), 1 - DMA1 (read)
+	ULONG					IntActive;		// INT_STATE bit of this channel
+	WDFINTERRUPT			Interrupt;		// its spinlock guards the lists below
+	WDFDPC					Dpc;			// completes the transfers the ISR retires
+	volatile LONG			DpcQueued;		// Dpc insertions not yet run, lock held to add
+	volatile LONG			DpcActive;		// runs of Dpc since its body started, 0 - idle
+
+	WDFCOMMONBUFFER			DteCommonBuffer;	// descriptors only, never data
+	PUCHAR					DteBase;		// DTE slots, DteSlotSize apart
+	PHYSICAL_ADDRESS		DteBaseLA;
+	ULONG					DteSlotSize;
+
+	WDFDMATRANSACTION		Transactions[HSAC_MAX_OUTSTANDING_REQUESTS];
+
+	LIST_ENTRY				FreeList;
+	LIST_ENTRY				ReadyList;
+	LIST_ENTRY				ActiveList;
+	SLIST_HEADER			DoneStack;			// pushed by the ISR, flushed by the DPC
+	volatile LONG			Retired;			// chains retired, for pollers
+
+	ULONG					ModerationCount;	// 1 - start at once
+	ULONG					ModerationDelay;	// microseconds
+	LONGLONG				ModerationTicks;	// ModerationDelay, performance counter
+	BOOLEAN					ModerationHeld;		// Ready work held back
+	WDFTIMER				ModerationTimer;	// starts held work after the delay
+
+	BOOLEAN					PoweredDown;		// out of D0: transfers are aborted, not started
+	BOOLEAN					Aborting;			// ABORT written, its interrupt not seen yet
+
+	HSAC_CHANNEL_STATS		Stats;				// IOCTL_GET_STATS, interlocked only
+
+} HSAC_DMA_CHANNEL, *PHSAC_DMA_CHANNEL;
+
+//
+// Raise a statistics maximum to Value, without a lock.
+//
+FORCEINLINE VOID
+HSACStatsMax(
+	IN volatile LONG * Maximum,
+	IN LONG            Value
+	)
+{
+	LONG	seen = ReadNoFence(Maximum);
+	LONG	prev;
+
+	while (Value > seen) {
+		prev = InterlockedCompareExchange(Maximum, Value, seen);
+		if (prev == seen) {
+			break;
+		}
+		seen = prev;
+	}
+}
+
+typedef struct _MODERATION_TIMER_CONTEXT {
+
+	PHSAC_DMA_CHANNEL		Channel;
+
+} MODERATION_TIMER_CONTEXT, *PMODERATION_TIMER_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(MODERATION_TIMER_CONTEXT, HSACGetModerationTimerContext)
+
+typedef struct _CHANNEL_DPC_CONTEXT {
+
+	PHSAC_DMA_CHANNEL		Channel;
+
+} CHANNEL_DPC_CONTEXT, *PCHANNEL_DPC_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CHANNEL_DPC_CONTEXT, HSACGetChannelDpcContext)
+
+//
+// A user buffer registered with IOCTL_REGISTER_BUFFER (Register.c). Its
+// pages stay locked by Mdl and mapped by Transaction, which is executed
+// once and not completed until the buffer is unregistered; its DTE chain
+// lives in its own common buffer. State moves with interlocked
+// operations only: the fields are written while the entry is Setup and
+// read-only while it is Idle or Busy.
+//
+#define HSAC_REGISTERED_FREE	0	// slot unused
+#define HSAC_REGISTERED_SETUP	1	// being registered or torn down
+#define HSAC_REGISTERED_IDLE	2	// registered, no transfer
+#define HSAC_REGISTERED_BUSY	3	// a transfer owns it
+
+typedef struct _HSAC_REGISTERED_BUFFER {
+
+	volatile LONG			State;			// HSAC_REGISTERED_*
+	WDFFILEOBJECT			FileObject;		// owner
+	PHSAC_DMA_CHANNEL		Channel;
+	ULONG					Length;
+
+	PMDL					Mdl;
+	WDFDMATRANSACTION		Transaction;
+	BOOLEAN					Mapped;			// Transaction executed
+	WDFCOMMONBUFFER			DteCommonBuffer;
+	PHYSICAL_ADDRESS		DteLA;
+	PDMA_TRANSFER_ELEMENT	LastDte;
+	ULONG					DteCount;
+
+} HSAC_REGISTERED_BUFFER, *PHSAC_REGISTERED_BUFFER;
+
+//
+// A region of the DMA buffer heap (Heap.c) and its pages. Only a
+// buffer's first page has a Handle, written last when it is handed out
+// and cleared first when it is freed, and an InFlight count of the
+// transfers that name it; the rest moves under HeapLock.
+//
+#define HSAC_HEAP_BLOCKS		(HSAC_HEAP_REGION_SIZE / HSAC_HEAP_MIN_BLOCK)
+#define HSAC_HEAP_ORDERS		12		// a block of the last one is a region
+#define HSAC_HEAP_NONE			((ULONG) -1)
+
+//
+// A handle: HSAC_HEAP_HANDLE, sequence, order, region and first page.
+//
+#define HSAC_HEAP_BLOCK_MASK		0x7FF
+#define HSAC_HEAP_REGION_MASK		0x3
+#define HSAC_HEAP_ORDER_MASK		0xF
+#define HSAC_HEAP_SEQUENCE_MASK		0x3FFF
+
+#define HSAC_HEAP_MAKE_HANDLE(Sequence, Order, Region, Block) \
+	(HSAC_HEAP_HANDLE | ((Sequence) << 17) | ((Order) << 13) | ((Region) << 11) | (Block))
+#define HSAC_HEAP_HANDLE_BLOCK(Handle)		((Handle) & HSAC_HEAP_BLOCK_MASK)
+#define HSAC_HEAP_HANDLE_REGION(Handle)		(((Handle) >> 11) & HSAC_HEAP_REGION_MASK)
+#define HSAC_HEAP_HANDLE_ORDER(Handle)		(((Handle) >> 13) & HSAC_HEAP_ORDER_MASK)
+
+typedef struct _HSAC_HEAP_BLOCK {
+
+	volatile ULONG			Handle;			// 0 - not handed out
+	volatile LONG			InFlight;		// HSACHeapPacketValid to HSACHeapPacketDone
+	ULONG					Next;			// free list of its order
+	ULONG					Prev;
+	UCHAR					Order;			// of a free block or a buffer
+	BOOLEAN					Free;			// on a free list
+	WDFFILEOBJECT			FileObject;		// owner
+	PMDL					Mdl;
+	PVOID					UserAddress;
+
+} HSAC_HEAP_BLOCK, *PHSAC_HEAP_BLOCK;
+
+typedef struct _HSAC_HEAP_REGION {
+
+	WDFCOMMONBUFFER			CommonBuffer;
+	PUCHAR					Base;
+	PHYSICAL_ADDRESS		BaseLA;
+	WDFMEMORY				BlockMemory;
+	PHSAC_HEAP_BLOCK		Blocks;			// HSAC_HEAP_BLOCKS
+	ULONG					FreeList[HSAC_HEAP_ORDERS];
+
+} HSAC_HEAP_REGION, *PHSAC_HEAP_REGION;
+
+//
+// The packet ring (Ring.c, Public.h). Its transfers use transactions of
+// their own, HSAC_RING_TRANSACTIONS per channel, so they never take the
+// pool the read and write queues count on. A transaction not in use is
+// on its channel's FreeStack, pushed by the DPC, or on Spare, which only
+// the thread in IOCTL_PACKET_RING_ENTER touches. State moves the way a
+// registered buffer's does; Entering keeps IOCTL_PACKET_RING_ENTER
+// single threaded.
+//
+#define HSAC_RING_TRANSACTIONS	HSAC_MAX_OUTSTANDING_REQUESTS
+
+#define HSAC_RING_FREE			0	// not mapped
+#define HSAC_RING_SETUP			1	// being mapped or torn down
+#define HSAC_RING_MAPPED		2	// mapped, idle
+#define HSAC_RING_ENTERING		3	// IOCTL_PACKET_RING_ENTER running
+
+typedef struct _HSAC_RING {
+
+	volatile LONG			State;			// HSAC_RING_*
+	WDFFILEOBJECT			FileObject;		// owner
+	WDFCOMMONBUFFER			CommonBuffer;
+	PHSAC_PACKET_RING		Shared;
+	PMDL					Mdl;
+	PVOID					UserAddress;
+
+	ULONG					SqHead;			// driver's copy
+	ULONG					CqReserved;		// completions promised
+	volatile LONG			CqNext;			// next CQ position to write
+	volatile LONG			InFlight;		// transfers handed to a channel
+
+	WDFDMATRANSACTION		Transactions[2][HSAC_RING_TRANSACTIONS];
+	SLIST_HEADER			FreeStack[2];
+	PSLIST_ENTRY			Spare[2];
+
+} HSAC_RING, *PHSAC_RING;
+
+//
+// The IOCTL_PACKET_BATCH being run (Batch.c). BatchQueue is sequential,
+// so there is at most one. Each channel has HSAC_BATCH_TRANSACTIONS
+// packet mode transactions of its own; the batch hands each one an
+// entry, and the channel's DPC hands it the channel's next entry when
+// it completes, so the Ready list keeps the ISR restarting the channel
+// back to back. Next[c] is only moved by channel c's DPC once the
+// batch is started.
+//
+// IOCTL_PACKET_CHAIN runs here too, on Chains[c]: a scatter/gather
+// transaction per channel with a DTE slot of its own, whose chain
+// covers all of the channel's entries.
+//
+#define HSAC_BATCH_TRANSACTIONS		HSAC_MAX_OUTSTANDING_REQUESTS
+
+typedef struct _HSAC_BATCH {
+
+	WDFREQUEST				Request;
+	PHSAC_PACKET_RESULT		Results;		// the request's output buffer
+	ULONG					Count;
+	HSAC_PACKET_ENTRY		Entries[HSAC_MAX_BATCH_ENTRIES];
+	ULONG					Next[2];		// per channel, next entry to look at
+	volatile LONG			Remaining;		// entries not done, + 1 while starting
+
+	WDFDMATRANSACTION		Transactions[2][HSAC_BATCH_TRANSACTIONS];
+	WDFDMATRANSACTION		Chains[2];
+	WDFCOMMONBUFFER			ChainDte[2];
+
+} HSAC_BATCH, *PHSAC_BATCH;
+
+//
+// A channel's stream (Stream.c, Public.h). It has transactions of its
+// own, like the packet ring. Once Running, its transfers are armed only
+// by the channel's DPC, which is never run twice at once, so Armed,
+// Idle and Stalled take no lock. InFlight counts armed transfers plus
+// any DPC looking at the stream; stopping waits for it to drain. A
+// stream holds a power reference from start to stop; one the driver
+// had to give up on (the device left D0) is Halted until stopped.
+//
+#define HSAC_STREAM_TRANSACTIONS	HSAC_MAX_OUTSTANDING_REQUESTS
+
+#define HSAC_STREAM_FREE		0	// not started
+#define HSAC_STREAM_SETUP		1	// being started or stopped
+#define HSAC_STREAM_RUNNING		2
+#define HSAC_STREAM_HALTED		3	// arms nothing more; waits to be stopped
+
+//
+// How long a stop waits for transfers the card still has before it
+// takes them back with HSACDmaChannelAbort.
+//
+#define HSAC_DRAIN_TIMEOUT_MS	5000
+
+typedef struct _HSAC_STREAM {
+
+	volatile LONG			State;			// HSAC_STREAM_*
+	WDFFILEOBJECT			FileObject;		// owner
+	PHSAC_DMA_CHANNEL		Channel;
+	WDFCOMMONBUFFER			CommonBuffer;
+	PHSAC_STREAM_PAGE		Shared;
+	PMDL					Mdl;
+	PVOID					UserAddress;
+	ULONG					Buffers;
+	ULONG					BufferSize;
+	volatile LONG			InFlight;
+
+	ULONG					Armed;			// buffers handed to the channel
+	BOOLEAN					Stalled;		// ran dry; counted once
+	ULONG					IdleCount;
+	WDFDMATRANSACTION		Idle[HSAC_STREAM_TRANSACTIONS];
+
+	WDFDMATRANSACTION		Transactions[HSAC_STREAM_TRANSACTIONS];
+	WDFTIMER				Timer;			// looks again while stalled
+
+} HSAC_STREAM, *PHSAC_STREAM;
+
+typedef struct _STREAM_TIMER_CONTEXT {
+
+	PHSAC_STREAM			Stream;
+
+} STREAM_TIMER_CONTEXT, *PSTREAM_TIMER_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(STREAM_TIMER_CONTEXT, HSACGetStreamTimerContext)
+
+//
+// A processor's flight recorder ring (Flight.c). Next is claimed with
+// an interlocked increment, so an ISR may record into the ring of the
+// DPC it interrupted; it has a cache line to itself.
+//
+typedef struct _HSAC_FLIGHT_RING {
+
+	volatile LONG			Next;			// events recorded
+	ULONG					Reserved[15];
+	HSAC_FLIGHT_EVENT		Events[HSAC_FLIGHT_EVENTS];
+
+} HSAC_FLIGHT_RING, *PHSAC_FLIGHT_RING;
+
+//
+// With one MSI message per channel, the message each channel signals.
+//
+#define HSAC_WRITE_MESSAGE		0
+#define HSAC_READ_MESSAGE		1
+
 //
 // The device extension for the device object
 //
@@ -57,11 +410,30 @@ typedef struct _DEVICE_EXTENSION {
     ULONG                   SRAMLength;       // SRAM base length
 
     WDFINTERRUPT            Interrupt;     // Returned by InterruptCreate
-
-	union {
-		INT_REG bits;
-		ULONG ul;
-	}IntStatus;
+	WDFINTERRUPT			ReadInterrupt;	// HSAC_READ_MESSAGE, if the card got one
+
+	volatile LONG			IntPending;		// INT_STATE bits the DPC has not seen yet
+	LONGLONG				IsrCalls;		// IOCTL_GET_STATS, interlocked only
+	LONGLONG				IsrSpurious;
+
+	// IOCTL_MAP_STATS_PAGE (Stats.c): the page, and the timer that is
+	// its only writer while any handle has it mapped
+	WDFCOMMONBUFFER			StatsCommonBuffer;
+	PHSAC_STATS_PAGE		StatsPage;
+	WDFTIMER				StatsTimer;
+	volatile LONG			StatsMappings;
+	volatile LONG			StatsPublishing;
+
+	// How long the device took to come up (IOCTL_GET_STATS), and the
+	// performance counter at HSACEvtDevicePrepareHardware
+	LONGLONG				DeviceAddUs;
+	LONGLONG				DeviceStartUs;
+	LONGLONG				PrepareTime;
+
+	// Flight recorder (Flight.c): one ring per processor
+	WDFMEMORY				FlightMemory;
+	PHSAC_FLIGHT_RING		FlightRings;
+	ULONG					FlightProcessors;
 
 	union {
 		DMA_CTRL bits;
@@ -75,62 +447,74 @@ typedef struct _DEVICE_EXTENSION {
 
 	WDF_DMA_PROFILE			dmaProfile;
 
-#if (CACHE_MODE != CACHE_NONE_MODE)
-	ULONG					ReadBufIndex;
-	ULONG					WriteBufIndex;
-#endif
-
-	ULONG					ReadSize;
-	ULONG					WriteSize;
     // DmaEnabler
     WDFDMAENABLER           DmaEnabler;
     ULONG                   MaximumTransferLength;
 
     // Write
     WDFQUEUE                WriteQueue;
-    WDFDMATRANSACTION       WriteDmaTransaction;
+    HSAC_DMA_CHANNEL        WriteChannel;
     ULONG                   WriteTransferElements;
     size_t                  WriteCommonBufferSize;
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
+	// writeCommonBufferNum of each, all in WriteBufferArrays (Buffers.c)
 	ULONG					writeCommonBufferNum;
-	WDFCOMMONBUFFER         pWriteCommonBuffer[HSAC_TRANSFER_BUFFER_NUM];
-	PVOID                   pWriteCommonBufferBase[HSAC_TRANSFER_BUFFER_NUM];
-	PHYSICAL_ADDRESS        pWriteCommonBufferBaseLA[HSAC_TRANSFER_BUFFER_NUM];  // Logical Address
-	PVOID					pWriteUserAddress[HSAC_TRANSFER_BUFFER_NUM];
-	PMDL					pWriteMDL[HSAC_TRANSFER_BUFFER_NUM];
-#else
-	WDFCOMMONBUFFER         WriteCommonBuffer;
-	PVOID                   WriteCommonBufferBase;
-	PHYSICAL_ADDRESS        WriteCommonBufferBaseLA;  // Logical Address
-	PVOID					WriteUserAddress0;
-	//PVOID					WriteUserAddress1;
-	PMDL					WriteMDL0;
-	//PMDL					WriteMDL1;
-#endif
+	WDFMEMORY				WriteBufferArrays;
+	WDFCOMMONBUFFER       * pWriteCommonBuffer;
+	PVOID                 * pWriteCommonBufferBase;
+	PHYSICAL_ADDRESS      * pWriteCommonBufferBaseLA;  // Logical Address
+	PVOID				  * pWriteUserAddress;
+	PMDL				  * pWriteMDL;
 
     // Read
     WDFQUEUE                ReadQueue;   
-    WDFDMATRANSACTION       ReadDmaTransaction;
+    HSAC_DMA_CHANNEL        ReadChannel;
 	ULONG                   ReadTransferElements;
 	size_t                  ReadCommonBufferSize;
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
+	// readCommonBufferNum of each, all in ReadBufferArrays (Buffers.c)
 	ULONG					readCommonBufferNum;
-	WDFCOMMONBUFFER         pReadCommonBuffer[HSAC_TRANSFER_BUFFER_NUM];
-	PVOID                   pReadCommonBufferBase[HSAC_TRANSFER_BUFFER_NUM];
-	PHYSICAL_ADDRESS        pReadCommonBufferBaseLA[HSAC_TRANSFER_BUFFER_NUM];  // Logical Address
-	PVOID					pReadUserAddress[HSAC_TRANSFER_BUFFER_NUM];
-	PMDL					pReadMDL[HSAC_TRANSFER_BUFFER_NUM];
-#else
-	WDFCOMMONBUFFER         ReadCommonBuffer;
-	PVOID                   ReadCommonBufferBase;
-	PHYSICAL_ADDRESS        ReadCommonBufferBaseLA;   // Logical Address
-	PVOID					ReadUserAddress0;
-	PVOID					ReadUserAddress1;
-	PMDL					ReadMDL0;
-	PMDL					ReadMDL1;
-#endif
+	WDFMEMORY				ReadBufferArrays;
+	WDFCOMMONBUFFER       * pReadCommonBuffer;
+	PVOID                 * pReadCommonBufferBase;
+	PHYSICAL_ADDRESS      * pReadCommonBufferBaseLA;   // Logical Address
+	PVOID				  * pReadUserAddress;
+	PMDL				  * pReadMDL;
+
+	// HSAC_CACHE_*: how the buffers above are laid out. Changes only
+	// with both channels idle (HSACBuffersSetCacheMode)
+	ULONG					CacheMode;
+
+	// The buffers above are allocated on first use, under BuffersLock,
+	// or in the background by BuffersWorkItem (Buffers.c)
+	WDFWAITLOCK				BuffersLock;
+	WDFWORKITEM				BuffersWorkItem;	// NULL unless PrewarmBuffers
+	volatile LONG			BuffersPrewarmStop;
 
 	ULONG					MapFlag;
+
+	// IOCTL_REGISTER_BUFFER, indexed by buffer ID
+	HSAC_REGISTERED_BUFFER	Registered[HSAC_MAX_REGISTERED_BUFFERS];
+
+	// IOCTL_MAP_PACKET_RING
+	HSAC_RING				Ring;
+
+	// IOCTL_ALLOC_DMA_BUFFER; HeapRegions of Heap[] exist
+	WDFWAITLOCK				HeapLock;
+	volatile ULONG			HeapRegions;
+	ULONG					HeapSequence;
+	volatile LONG			HeapBuffers;	// handed out, for IOCTL_GET_STATS
+	volatile LONGLONG		HeapBytes;
+	HSAC_HEAP_REGION		Heap[HSAC_HEAP_REGIONS];
+
+	// IOCTL_PACKET_BATCH, forwarded to BatchQueue
+	WDFQUEUE				BatchQueue;
+	HSAC_BATCH				Batch;
+
+	// IOCTL_START_STREAM, indexed by channel
+	HSAC_STREAM				Stream[2];
+
+#ifdef HSAC_STAGE_STAMPS
+	LONGLONG				ReadStamps[HsacReadStageMax];
+#endif
 	// Device Control
 	WDFQUEUE				DeviceControlQueue;
 
@@ -162,7 +546,6 @@ typedef struct _DEVICE_EXTENSION {
 //
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_EXTENSION, HSACGetDeviceContext)
 
-#if !defined(ASSOC_WRITE_REQUEST_WITH_DMA_TRANSACTION)
 //
 // The context structure used with WdfDmaTransactionCreate
 //
@@ -170,11 +553,96 @@ typedef struct TRANSACTION_CONTEXT {
 
     WDFREQUEST     Request;
 
+	WDFDMATRANSACTION		Transaction;	// back pointer, for list walks
+	PHSAC_DMA_CHANNEL		Channel;
+	LIST_ENTRY				ListEntry;
+	SLIST_ENTRY				DoneEntry;		// on Channel->DoneStack
+	HSAC_DMA_STATE			State;
+	volatile LONG			Cancelled;		// cancel routine ran while started
+	BOOLEAN					Polled;			// completed by the issuing thread, not the DPC
+	BOOLEAN					Aborted;		// retired by HSACDmaChannelAbort, not the card
+	LONG					CompletionOwners;	// see HSACDmaChannelDropCompletion
+
+	// This transaction's DTE slot and the last DTE of the current chain
+	PDMA_TRANSFER_ELEMENT	DteVA;
+	PHYSICAL_ADDRESS		DteLA;
+	PDMA_TRANSFER_ELEMENT	LastDte;
+	ULONG					TransferSize;
+	ULONG					DteCount;		// DTEs in the chain, for the trace
+	LONGLONG				ReadyTime;		// performance counter when queued
+
+	// Read/write requests: performance counter in EvtIoRead/EvtIoWrite and
+	// in the ISR that retired the transfer, and the request's number on
+	// its handle; for the handle's HSAC_REQUEST_TIME log
+	LONGLONG				SubmitTime;
+	LONGLONG				InterruptTime;
+	ULONG					RequestNumber;		// 0 - not logged
+
+	// WdfDmaProfilePacket64: {size, index} from the request
+	BOOLEAN					Packet;
+	ULONG					PacketSize;
+	ULONG					PacketIndex;
+
+	// IOCTL_REGISTERED_READ/WRITE: the buffer whose prebuilt chain is run
+	// instead of the slot's; the transaction itself is not initialized
+	PHSAC_REGISTERED_BUFFER	Registered;
+
+	// A packet ring transfer (also Packet): its SQ position. Not in the
+	// channel's pool; free on DevExt->Ring.FreeStack through DoneEntry
+	BOOLEAN					RingEntry;
+	ULONG					RingSequence;
+
+	// An IOCTL_PACKET_BATCH transfer (also Packet): its entry. Not in the
+	// channel's pool. An IOCTL_PACKET_CHAIN chain is Batched but not Packet
+	BOOLEAN					Batched;
+	ULONG					BatchEntry;
+
+	// A stream transfer (also Packet): its buffer's sequence number. Not
+	// in the channel's pool
+	BOOLEAN					Streamed;
+	ULONG					StreamSequence;
+
 } TRANSACTION_CONTEXT, * PTRANSACTION_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(TRANSACTION_CONTEXT, HSACGetTransactionContext)
 
-#endif
+//
+// Per handle completion mode (IOCTL_SET_POLL_MODE). The adaptive state
+// is a heuristic and is updated without a lock.
+//
+#define HSAC_POLL_MAX_BACKOFF	64
+
+#define HSAC_STATS_UNMAPPED		0
+#define HSAC_STATS_SETUP		1		// being mapped or unmapped
+#define HSAC_STATS_MAPPED		2
+
+typedef struct _FILE_CONTEXT {
+
+	ULONG					PollMode;		// HSAC_POLL_*
+	ULONG					PollBudget;		// microseconds
+	LONGLONG				PollBudgetTicks;
+
+	// HSAC_POLL_ADAPTIVE
+	LONGLONG				AverageTicks;	// recent time to completion
+	ULONG					Backoff;		// requests left to interrupts after a miss
+	ULONG					InterruptRuns;	// of Backoff, still to go
+
+	ULONG					PollHits;		// requests completed by polling
+	ULONG					PollMisses;		// requests left to the interrupt
+
+	// IOCTL_MAP_STATS_PAGE: this handle's read-only mapping
+	volatile LONG			StatsState;		// HSAC_STATS_*
+	PMDL					StatsMdl;
+	PVOID					StatsUserAddress;
+
+	// IOCTL_GET_REQUEST_TIMES: this handle's last read/write requests,
+	// request n in Times[(n - 1) % HSAC_REQUEST_TIMES]
+	volatile LONG			Requests;		// numbered so far
+	HSAC_REQUEST_TIME		Times[HSAC_REQUEST_TIMES];
+
+} FILE_CONTEXT, * PFILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_CONTEXT, HSACGetFileContext)
 
 //
 // Function prototypes
@@ -193,12 +661,18 @@ EVT_WDF_DEVICE_RELEASE_HARDWARE HSACEvtDeviceReleaseHardware;
 EVT_WDF_IO_QUEUE_IO_READ HSACEvtIoRead;
 EVT_WDF_IO_QUEUE_IO_WRITE HSACEvtIoWrite;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL HSACEvtIoDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL HSACEvtIoRegistered;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL HSACEvtIoPacketBatch;
+
+EVT_WDF_DEVICE_FILE_CREATE HSACEvtDeviceFileCreate;
+EVT_WDF_FILE_CLEANUP HSACEvtFileCleanup;
 
 EVT_WDF_REQUEST_CANCEL HSACEvtRequestCancelRead;
 EVT_WDF_REQUEST_CANCEL HSACEvtRequestCancelWrite;
+EVT_WDF_REQUEST_CANCEL HSACEvtRequestCancelRegistered;
 
 EVT_WDF_INTERRUPT_ISR HSACEvtInterruptIsr;
-EVT_WDF_INTERRUPT_DPC HSACEvtInterruptDpc;
+EVT_WDF_DPC HSACEvtChannelDpc;
 EVT_WDF_INTERRUPT_ENABLE HSACEvtInterruptEnable;
 EVT_WDF_INTERRUPT_DISABLE HSACEvtInterruptDisable;
 
@@ -236,6 +710,13 @@ HSACInterruptCreate(
     IN PDEVICE_EXTENSION DevExt
     );
 
+NTSTATUS
+HSACChannelInterruptCreate(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFCMRESLIST      Resources,
+    IN WDFCMRESLIST      ResourcesTranslated
+    );
+
 VOID
 HSACReadRequestComplete(
     IN WDFDMATRANSACTION  DmaTransaction,
@@ -261,6 +742,7 @@ HSACShutdown(
 
 EVT_WDF_PROGRAM_DMA HSACEvtProgramReadDma;
 EVT_WDF_PROGRAM_DMA HSACEvtProgramWriteDma;
+EVT_WDF_PROGRAM_DMA HSACEvtProgramRegisteredDma;
 
 VOID
 HSACHardwareReset(
@@ -272,6 +754,478 @@ HSACInitializeDMA(
     IN PDEVICE_EXTENSION DevExt
     );
 
+//
+// Common buffer pool (Buffers.c)
+//
+NTSTATUS
+HSACBuffersInitialize(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+NTSTATUS
+HSACBuffersSetGeometry(
+	IN PDEVICE_EXTENSION     DevExt,
+	IN PHSAC_BUFFER_GEOMETRY Geometry
+	);
+
+NTSTATUS
+HSACBuffersGetGeometry(
+	IN PDEVICE_EXTENSION     DevExt,
+	IN OUT PHSAC_BUFFER_GEOMETRY Geometry
+	);
+
+NTSTATUS
+HSACBuffersSetCacheMode(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Mode
+	);
+
+ULONG
+HSACBuffersMappings(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Channel,
+	OUT size_t         * Size
+	);
+
+NTSTATUS
+HSACBuffersCommit(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Channel,
+	IN ULONG             First,
+	IN ULONG             Count
+	);
+
+NTSTATUS
+HSACBuffersCommitAll(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+VOID
+HSACBuffersStartPrewarm(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+VOID
+HSACBuffersStopPrewarm(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+//
+// Variable-sized DMA buffers (Heap.c)
+//
+NTSTATUS
+HSACHeapInitialize(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+NTSTATUS
+HSACHeapAllocate(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject,
+	IN ULONG             Size,
+	OUT PHSAC_DMA_BUFFER Buffer
+	);
+
+NTSTATUS
+HSACHeapFree(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject,
+	IN ULONG             Handle
+	);
+
+VOID
+HSACHeapRelease(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject
+	);
+
+BOOLEAN
+HSACHeapPacketValid(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Handle,
+	IN ULONG             Size
+	);
+
+VOID
+HSACHeapPacketDone(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Handle
+	);
+
+PHYSICAL_ADDRESS
+HSACHeapAddress(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Handle
+	);
+
+//
+// DMA channel pipeline (Dma.c)
+//
+NTSTATUS
+HSACDmaChannelInitialize(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN ULONG             Index,
+	IN ULONG             TransferElements
+	);
+
+WDFDMATRANSACTION
+HSACDmaChannelAllocate(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN WDFREQUEST        Request
+	);
+
+VOID
+HSACDmaChannelFree(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction
+	);
+
+BOOLEAN
+HSACDmaChannelPacketValid(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Channel,
+	IN ULONG             Index,
+	IN ULONG             Size
+	);
+
+VOID
+HSACDmaChannelPacketDone(
+	IN PDEVICE_EXTENSION DevExt,
+	IN ULONG             Index
+	);
+
+BOOLEAN
+HSACDmaChannelBuildChain(
+	IN PTRANSACTION_CONTEXT TransContext,
+	IN PSCATTER_GATHER_LIST SgList
+	);
+
+BOOLEAN
+HSACDmaChannelBuildPacketChain(
+	IN PDEVICE_EXTENSION    DevExt,
+	IN PTRANSACTION_CONTEXT TransContext,
+	IN PHSAC_PACKET_ENTRY   Entries,
+	IN ULONG                Count
+	);
+
+VOID
+HSACDmaChannelQueue(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction
+	);
+
+VOID
+HSACDmaChannelQueueList(
+	IN PDEVICE_EXTENSION   DevExt,
+	IN WDFDMATRANSACTION * Transactions,
+	IN ULONG               Count
+	);
+
+VOID
+HSACDmaChannelInterrupt(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN LONGLONG          Time
+	);
+
+VOID
+HSACDmaChannelTakeDone(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	OUT PLIST_ENTRY      DoneList
+	);
+
+WDFDMATRANSACTION
+HSACDmaChannelCancel(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN WDFREQUEST        Request,
+	OUT PBOOLEAN         Queued
+	);
+
+BOOLEAN
+HSACDmaChannelDropCompletion(
+	IN WDFDMATRANSACTION Transaction
+	);
+
+BOOLEAN
+HSACDmaChannelModerated(
+	IN PHSAC_DMA_CHANNEL Channel
+	);
+
+VOID
+HSACDmaChannelKick(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	);
+
+NTSTATUS
+HSACDmaChannelSetModeration(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN ULONG             Count,
+	IN ULONG             DelayUs
+	);
+
+EVT_WDF_TIMER HSACEvtModerationTimer;
+EVT_WDF_TIMER HSACEvtStreamTimer;
+EVT_WDF_TIMER HSACEvtStatsTimer;
+
+VOID
+HSACDmaChannelQueueDpc(
+	IN PHSAC_DMA_CHANNEL Channel
+	);
+
+VOID
+HSACDmaChannelAbort(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	);
+
+VOID
+HSACDmaChannelPowerDown(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	);
+
+VOID
+HSACDmaChannelPowerUp(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	);
+
+NTSTATUS
+HSACDmaChannelSetDpcTarget(
+	IN PHSAC_DMA_CHANNEL Channel,
+	IN PPROCESSOR_NUMBER ProcNumber
+	);
+
+BOOLEAN
+HSACDmaChannelPoll(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction,
+	IN LONGLONG          BudgetTicks
+	);
+
+//
+// Busy-poll completion (Poll.c)
+//
+NTSTATUS
+HSACPollSetMode(
+	IN PFILE_CONTEXT FileContext,
+	IN ULONG         Mode,
+	IN ULONG         BudgetUs
+	);
+
+LONGLONG
+HSACPollBudget(
+	IN PFILE_CONTEXT FileContext
+	);
+
+VOID
+HSACPollUpdate(
+	IN PFILE_CONTEXT FileContext,
+	IN LONGLONG      ElapsedTicks,
+	IN BOOLEAN       Completed
+	);
+
+//
+// Registered user buffers (Register.c)
+//
+NTSTATUS
+HSACRegisterBuffer(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject,
+	IN ULONG             Channel,
+	IN PVOID             Address,
+	IN ULONG             Length,
+	OUT PULONG           BufferId
+	);
+
+NTSTATUS
+HSACUnregisterBuffer(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject,
+	IN ULONG             BufferId
+	);
+
+VOID
+HSACRegisteredRequestComplete(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction,
+	IN NTSTATUS          Status
+	);
+
+//
+// Batched packet transfers (Batch.c)
+//
+NTSTATUS
+HSACBatchInitialize(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+VOID
+HSACBatchCommitBuffers(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFREQUEST        Request
+	);
+
+VOID
+HSACBatchComplete(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction,
+	IN NTSTATUS          Status
+	);
+
+//
+// Statistics (Stats.c)
+//
+VOID
+HSACStatsSnapshot(
+	IN PDEVICE_EXTENSION DevExt,
+	OUT PHSAC_STATS      Stats
+	);
+
+NTSTATUS
+HSACStatsInitialize(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+LONGLONG
+HSACStatsElapsedUs(
+	IN LONGLONG Since
+	);
+
+NTSTATUS
+HSACStatsMap(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject,
+	OUT PVOID *          UserAddress
+	);
+
+NTSTATUS
+HSACStatsUnmap(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject
+	);
+
+//
+// Flight recorder (Flight.c)
+//
+NTSTATUS
+HSACFlightInitialize(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+VOID
+HSACFlightRecord(
+	IN PDEVICE_EXTENSION DevExt,
+	IN UCHAR             Type,
+	IN UCHAR             Channel,
+	IN USHORT            Count,
+	IN ULONG             Value,
+	IN ULONGLONG         Address
+	);
+
+NTSTATUS
+HSACFlightDump(
+	IN PDEVICE_EXTENSION    DevExt,
+	IN ULONG                Processor,
+	OUT PHSAC_FLIGHT_RECORD Record
+	);
+
+//
+// Request times (Times.c)
+//
+VOID
+HSACTimesStart(
+	IN PFILE_CONTEXT        FileContext,
+	IN PTRANSACTION_CONTEXT TransContext,
+	IN LONGLONG             SubmitTime
+	);
+
+VOID
+HSACTimesRecord(
+	IN WDFREQUEST           Request,
+	IN PTRANSACTION_CONTEXT TransContext,
+	IN NTSTATUS             Status,
+	IN size_t               Bytes
+	);
+
+VOID
+HSACTimesCopy(
+	IN PFILE_CONTEXT        FileContext,
+	OUT PHSAC_REQUEST_LOG   Log
+	);
+
+//
+// Streaming (Stream.c)
+//
+NTSTATUS
+HSACStreamStart(
+	IN PDEVICE_EXTENSION  DevExt,
+	IN WDFFILEOBJECT      FileObject,
+	IN PHSAC_STREAM_START Start,
+	OUT PVOID *           UserAddress
+	);
+
+NTSTATUS
+HSACStreamStop(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject,
+	IN ULONG             Channel
+	);
+
+VOID
+HSACStreamComplete(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction,
+	IN NTSTATUS          Status
+	);
+
+VOID
+HSACStreamRefill(
+	IN PDEVICE_EXTENSION DevExt,
+	IN PHSAC_DMA_CHANNEL Channel
+	);
+
+VOID
+HSACStreamHalt(
+	IN PDEVICE_EXTENSION DevExt
+	);
+
+//
+// Packet ring (Ring.c)
+//
+NTSTATUS
+HSACRingMap(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject,
+	OUT PVOID *          UserAddress
+	);
+
+NTSTATUS
+HSACRingUnmap(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject
+	);
+
+NTSTATUS
+HSACRingEnter(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFFILEOBJECT     FileObject,
+	OUT PULONG           Submitted
+	);
+
+VOID
+HSACRingComplete(
+	IN PDEVICE_EXTENSION DevExt,
+	IN WDFDMATRANSACTION Transaction,
+	IN NTSTATUS          Status
+	);
+
 NTSTATUS
 HSACInitializeDirectDMA(
 	IN PDEVICE_EXTENSION DevExt
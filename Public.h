@@ -53,6 +53,464 @@ DEFINE_GUID(GUID_HSAC_INTERFACE,
 #define IOCTL_SET_DMA_PROFILE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
 #define IOCTL_DIRECT_DMA_READ			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x810, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
 #define IOCTL_DIRECT_DMA_WRITE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x811, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_SET_INT_MODERATION		CTL_CODE(FILE_DEVICE_UNKNOWN, 0x812, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_SET_POLL_MODE				CTL_CODE(FILE_DEVICE_UNKNOWN, 0x813, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_SET_DPC_AFFINITY			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x814, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_REGISTER_BUFFER			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x815, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_UNREGISTER_BUFFER			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x816, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_REGISTERED_READ			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x817, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_REGISTERED_WRITE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x818, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_MAP_PACKET_RING			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x819, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_UNMAP_PACKET_RING			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81A, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_PACKET_RING_ENTER			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81B, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_PACKET_BATCH				CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81C, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_PACKET_CHAIN				CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81D, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_START_STREAM				CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81E, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_STOP_STREAM				CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81F, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_GET_STATS					CTL_CODE(FILE_DEVICE_UNKNOWN, 0x820, METHOD_BUFFERED,	FILE_READ_ACCESS)
+#define IOCTL_MAP_STATS_PAGE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x821, METHOD_BUFFERED,	FILE_READ_ACCESS)
+#define IOCTL_UNMAP_STATS_PAGE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x822, METHOD_BUFFERED,	FILE_READ_ACCESS)
+#define IOCTL_GET_FLIGHT_RECORD			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x823, METHOD_BUFFERED,	FILE_READ_ACCESS)
+#define IOCTL_GET_REQUEST_TIMES			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x824, METHOD_BUFFERED,	FILE_READ_ACCESS)
+#define IOCTL_SET_BUFFER_GEOMETRY		CTL_CODE(FILE_DEVICE_UNKNOWN, 0x825, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_GET_BUFFER_GEOMETRY		CTL_CODE(FILE_DEVICE_UNKNOWN, 0x826, METHOD_BUFFERED,	FILE_READ_ACCESS)
+#define IOCTL_ALLOC_DMA_BUFFER			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x827, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_FREE_DMA_BUFFER			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x828, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_SET_CACHE_MODE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x829, METHOD_BUFFERED,	FILE_READ_ACCESS|FILE_WRITE_ACCESS)
+#define IOCTL_GET_CACHE_MODE			CTL_CODE(FILE_DEVICE_UNKNOWN, 0x82A, METHOD_BUFFERED,	FILE_READ_ACCESS)
+
+//
+// IOCTL_SET_INT_MODERATION input. Requests on Channel (0 - write, 1 - read)
+// are started, and so interrupt, together once Count of them are queued
+// or the first has waited DelayUs microseconds. Count 1 turns moderation
+// off; at most 8 requests per channel are outstanding.
+//
+typedef struct _HSAC_INT_MODERATION {
+	ULONG	Channel;
+	ULONG	Count;
+	ULONG	DelayUs;
+} HSAC_INT_MODERATION, *PHSAC_INT_MODERATION;
+
+#define HSAC_INT_MODERATION_MAX_DELAY_US	10000
+
+//
+// IOCTL_SET_POLL_MODE input, per handle. In poll mode a read or write
+// issued on the handle spins on the channel's interrupt status for up to
+// BudgetUs microseconds and is completed inline; if the transfer takes
+// longer it is completed by the interrupt as usual. Adaptive mode polls
+// only while recent transfers on the handle finished within the budget.
+//
+#define HSAC_POLL_OFF			0
+#define HSAC_POLL_ALWAYS		1
+#define HSAC_POLL_ADAPTIVE		2
+
+typedef struct _HSAC_POLL_MODE {
+	ULONG	Mode;
+	ULONG	BudgetUs;
+} HSAC_POLL_MODE, *PHSAC_POLL_MODE;
+
+#define HSAC_POLL_MAX_BUDGET_US		1000
+
+//
+// IOCTL_SET_DPC_AFFINITY input. Completions of Channel (0 - write,
+// 1 - read) run on Processor from then on: a processor group and a
+// number within it (Reserved 0), so that any active processor can be
+// named, not only the first 64. Each channel completes on a DPC of its
+// own; with one MSI message per channel its interrupt can be steered to
+// the same processor through the INF's affinity policy. The DPC cannot
+// be moved while it is queued: the request then fails with
+// STATUS_DEVICE_BUSY (ERROR_BUSY) and may be sent again, best while the
+// channel is idle.
+//
+typedef struct _HSAC_DPC_AFFINITY {
+	ULONG				Channel;
+	PROCESSOR_NUMBER	Processor;
+} HSAC_DPC_AFFINITY, *PHSAC_DPC_AFFINITY;
+
+//
+// The common buffers of each channel that packet mode transfers name by
+// index (IOCTL_MAP_DMA_BUF_ADDR maps them): Count buffers of Size bytes.
+// The driver takes them from the device's hardware key when the device
+// is added (REG_DWORD WriteBufferCount, WriteBufferSize, ReadBufferCount,
+// ReadBufferSize; see hsac_pcie.inf), or 64 buffers of 8MB for a value
+// that is missing or out of range.
+//
+// A buffer is allocated and zeroed the first time it is used: when the
+// buffers are mapped, when the DMA profile becomes packet mode, or when
+// a batch, chain, ring entry or stream names it. With PrewarmBuffers
+// set to 1 a work item allocates the rest in the background once the
+// device has started. HSAC_CHANNEL_STATS.Buffers counts them.
+//
+// IOCTL_GET_BUFFER_GEOMETRY takes a channel (ULONG) and returns its
+// HSAC_BUFFER_GEOMETRY. IOCTL_SET_BUFFER_GEOMETRY frees a channel's
+// buffers and allocates new ones; its output, if any, is the geometry
+// the channel then has. In the single buffer cache modes below Count
+// can only be 1. The channel must be idle: the buffers
+// must not be mapped and no stream may run on it, or it fails with
+// STATUS_DEVICE_BUSY. The channel's reads or writes and batches wait
+// while it runs. If the new buffers cannot be had, the old geometry is
+// put back.
+//
+#define HSAC_MAX_TRANSFER_BUFFERS	1024
+
+typedef struct _HSAC_BUFFER_GEOMETRY {
+	ULONG	Channel;		// 0 - write, 1 - read
+	ULONG	Count;			// 1..HSAC_MAX_TRANSFER_BUFFERS
+	ULONG	Size;			// bytes, at most the maximum transfer length;
+							// rounded up to whole pages
+} HSAC_BUFFER_GEOMETRY, *PHSAC_BUFFER_GEOMETRY;
+
+//
+// How the common buffers above are laid out: the device's cache mode.
+// The driver takes it from the device's hardware key (REG_DWORD
+// CacheMode), or uses HSAC_CACHE_MULTI_DISCRETE for a value that is
+// missing or unknown.
+//
+//   HSAC_CACHE_MULTI_DISCRETE  each buffer is a common buffer of its own;
+//                              IOCTL_MAP_DMA_BUF_ADDR returns Count
+//                              addresses
+//   HSAC_CACHE_PING_PANG       the Count buffers lie back to back in one
+//                              common buffer, mapped at one address
+//   HSAC_CACHE_MULTI           one buffer (Count is 1)
+//   HSAC_CACHE_NONE            one buffer, and the header of a packet
+//                              ReadFile or WriteFile is only its size
+//
+// Whatever the mode, a buffer is named by its index. IOCTL_GET_CACHE_MODE
+// returns the mode (ULONG). IOCTL_SET_CACHE_MODE (input: ULONG) frees
+// both channels' buffers and sets them up again as the device would
+// start in that mode, with the geometry of the hardware key. Both
+// channels must be idle, as for IOCTL_SET_BUFFER_GEOMETRY.
+//
+#define HSAC_CACHE_PING_PANG		0x00
+#define HSAC_CACHE_MULTI			0x01
+#define HSAC_CACHE_MULTI_DISCRETE	0x11
+#define HSAC_CACHE_NONE				0xff
+
+//
+// Variable-sized DMA buffers. IOCTL_ALLOC_DMA_BUFFER (input:
+// HSAC_DMA_ALLOC) takes Size bytes, rounded up to a power of two
+// pages, out of up to HSAC_HEAP_REGIONS contiguous regions of
+// HSAC_HEAP_REGION_SIZE bytes, and maps them into the caller; its
+// output (HSAC_DMA_BUFFER) is the buffer's handle, size and address.
+// A buffer starts zeroed and is aligned to its size within its region.
+//
+// The handle has HSAC_HEAP_HANDLE set and stands in for a common buffer
+// index in packet mode, on either channel: in the header of a packet
+// ReadFile or WriteFile, a batch or chain entry or a ring entry. The
+// buffer belongs to the handle that allocated it until
+// IOCTL_FREE_DMA_BUFFER (input: the handle, ULONG) or until it is
+// closed; free it only once the transfers that name it have completed.
+//
+#define HSAC_HEAP_HANDLE		0x80000000
+#define HSAC_HEAP_REGIONS		4
+#define HSAC_HEAP_REGION_SIZE	0x800000	// 8MB, the largest buffer
+#define HSAC_HEAP_MIN_BLOCK		0x1000		// the smallest
+
+typedef struct _HSAC_DMA_ALLOC {
+	ULONG	Size;			// bytes, 1..HSAC_HEAP_REGION_SIZE
+	ULONG	Reserved;
+} HSAC_DMA_ALLOC, *PHSAC_DMA_ALLOC;
+
+typedef struct _HSAC_DMA_BUFFER {
+	ULONG		Handle;
+	ULONG		Size;		// bytes
+	ULONGLONG	Address;	// in the caller
+} HSAC_DMA_BUFFER, *PHSAC_DMA_BUFFER;
+
+//
+// IOCTL_REGISTER_BUFFER input; the output is the buffer's ID (ULONG).
+// The Length bytes at Address are locked down for Channel (0 - write,
+// 1 - read) and their DTE chain is built once. They stay registered until
+// IOCTL_UNREGISTER_BUFFER (input: the ID) or until the handle that
+// registered them is closed, and only that handle may use them.
+//
+// IOCTL_REGISTERED_WRITE and IOCTL_REGISTERED_READ (input:
+// HSAC_REGISTERED_IO) move the whole buffer and complete with its
+// length, without probing, mapping or describing it again. A buffer
+// takes one transfer at a time; a second one fails with
+// STATUS_DEVICE_BUSY, as does unregistering a buffer in use.
+//
+#define HSAC_MAX_REGISTERED_BUFFERS		64
+
+typedef struct _HSAC_REGISTER_BUFFER {
+	ULONG		Channel;
+	ULONG		Length;		// at most the maximum transfer length
+	ULONGLONG	Address;
+} HSAC_REGISTER_BUFFER, *PHSAC_REGISTER_BUFFER;
+
+typedef struct _HSAC_REGISTERED_IO {
+	ULONG	BufferId;
+} HSAC_REGISTERED_IO, *PHSAC_REGISTERED_IO;
+
+//
+// Packet ring. IOCTL_MAP_PACKET_RING maps an HSAC_PACKET_RING into the
+// caller and returns its address (ULONGLONG); the handle owns it until
+// IOCTL_UNMAP_PACKET_RING or until it is closed. The application fills
+// Sq[SqTail % HSAC_RING_ENTRIES] with transfers between the common
+// buffers of IOCTL_MAP_DMA_BUF_ADDR and the card, advances SqTail, and
+// calls IOCTL_PACKET_RING_ENTER, which starts them in order and returns
+// how many it took (ULONG); the rest wait for the next call, made once
+// some have completed. An entry's SQ position is its sequence number.
+//
+// Completions are written to Cq without a request: the entry at CqHead
+// is valid once its Position is CqHead + 1, and the application
+// advances CqHead past the entries it has reaped. The driver never has
+// more than HSAC_RING_ENTRIES completions outstanding beyond CqHead.
+// The head and tail indices count entries and wrap at 2^32.
+//
+// A mapped ring keeps the device in D0. Should the device leave D0
+// anyway, entries already started complete with STATUS_CANCELLED.
+//
+#define HSAC_RING_ENTRIES		64		// power of two
+
+typedef struct _HSAC_RING_SQE {
+	ULONG	Direction;		// 0 - write (DMA0), 1 - read (DMA1)
+	ULONG	Index;			// common buffer, or heap buffer handle
+	ULONG	Size;			// bytes, at most the maximum transfer length
+	ULONG	Reserved;
+} HSAC_RING_SQE, *PHSAC_RING_SQE;
+
+typedef struct _HSAC_RING_CQE {
+	ULONG	Position;		// CQ position + 1, written last
+	ULONG	Sequence;		// SQ position of the entry
+	ULONG	Direction;
+	ULONG	Index;
+	ULONG	Bytes;			// transferred
+	LONG	Status;			// NTSTATUS
+} HSAC_RING_CQE, *PHSAC_RING_CQE;
+
+typedef struct _HSAC_PACKET_RING {
+	volatile ULONG	SqHead;			// driver: entries taken
+	ULONG			Reserved0[15];
+	volatile ULONG	SqTail;			// application: entries posted
+	ULONG			Reserved1[15];
+	volatile ULONG	CqHead;			// application: completions reaped
+	ULONG			Reserved2[15];
+	HSAC_RING_SQE	Sq[HSAC_RING_ENTRIES];
+	HSAC_RING_CQE	Cq[HSAC_RING_ENTRIES];
+} HSAC_PACKET_RING, *PHSAC_PACKET_RING;
+
+//
+// IOCTL_PACKET_BATCH input: Count packet mode transfers between the
+// common buffers of IOCTL_MAP_DMA_BUF_ADDR and the card. Each channel
+// runs its entries back to back in array order; the two channels run
+// at the same time. The request completes once, when every entry is
+// done, and its output is one HSAC_PACKET_RESULT per entry. An entry
+// that names no common buffer, or does not fit in one, fails alone
+// with STATUS_INVALID_PARAMETER. One batch runs at a time.
+//
+// IOCTL_PACKET_CHAIN takes the same input and output, but each
+// channel's entries go to the card as one DTE chain across their
+// common buffers: one start command and one completion interrupt per
+// channel. A chain succeeds or fails as a whole. Batches and chains
+// share one queue and run one at a time.
+//
+#define HSAC_MAX_BATCH_ENTRIES	64
+
+typedef struct _HSAC_PACKET_ENTRY {
+	ULONG	Channel;		// 0 - write (DMA0), 1 - read (DMA1)
+	ULONG	Index;			// common buffer, or heap buffer handle
+	ULONG	Size;			// bytes
+} HSAC_PACKET_ENTRY, *PHSAC_PACKET_ENTRY;
+
+typedef struct _HSAC_PACKET_BATCH {
+	ULONG				Count;
+	HSAC_PACKET_ENTRY	Entries[1];		// Count of them
+} HSAC_PACKET_BATCH, *PHSAC_PACKET_BATCH;
+
+typedef struct _HSAC_PACKET_RESULT {
+	ULONG	Bytes;			// transferred
+	LONG	Status;			// NTSTATUS
+} HSAC_PACKET_RESULT, *PHSAC_PACKET_RESULT;
+
+//
+// Streaming. IOCTL_START_STREAM (input: HSAC_STREAM_START) keeps
+// Channel moving through its first Buffers common buffers, in order and
+// round and round, BufferSize bytes each, with no request per buffer;
+// its output is the address (ULONGLONG) of an HSAC_STREAM_PAGE mapped
+// into the caller. The handle owns the stream until IOCTL_STOP_STREAM
+// (input: the channel, ULONG) or until it is closed.
+//
+// Capture (Channel 1): the driver fills buffer Producer % Buffers and
+// advances Producer; the application reads the buffers up to Producer
+// and advances Consumer past those it is done with. The driver never
+// fills a buffer more than Buffers ahead of Consumer: when it has none
+// to give the card, the card's data overflows, and the driver counts
+// the overflow and notes when it happened. Other reads share the card's
+// data with a running capture.
+//
+// Playback (Channel 0): the application fills buffer Producer % Buffers,
+// sets its entry in Bytes (0 - BufferSize), and advances Producer; the
+// driver sends the buffers up to Producer in order and advances
+// Consumer past each one sent, after which the buffer may be filled
+// again. When the card has taken every filled buffer the stream
+// underruns, which is counted the same way; so is the end of playback.
+// A stalled stream looks at the application's index every millisecond.
+//
+// A running stream keeps the device in D0. Should the device leave D0
+// anyway (sleep, removal), the stream halts: Status is set, buffers the
+// card had not finished are reported as if done (capture: 0 in Bytes)
+// and nothing more is moved until the stream is stopped and started
+// again.
+//
+// Producer and Consumer count buffers and wrap at 2^32.
+//
+#define HSAC_STREAM_BUFFERS		64
+
+typedef struct _HSAC_STREAM_START {
+	ULONG	Channel;		// 0 - playback (DMA0), 1 - capture (DMA1)
+	ULONG	Buffers;		// common buffers to cycle through
+	ULONG	BufferSize;		// bytes, at most the channel's buffer size
+} HSAC_STREAM_START, *PHSAC_STREAM_START;
+
+typedef struct _HSAC_STREAM_PAGE {
+	volatile ULONG	Producer;			// buffers filled
+	ULONG			Reserved0[15];
+	volatile ULONG	Consumer;			// buffers released (capture) or sent
+	volatile LONG	Status;				// STATUS_SUCCESS, or why the stream halted
+	ULONG			Reserved1[14];
+	volatile ULONG	Overflows;			// times the card found no buffer
+	volatile ULONG	OverflowProducer;	// Producer at the last one
+	volatile LONGLONG OverflowTime;		// and the performance counter
+	volatile ULONG	Underruns;			// times the card had nothing to send
+	volatile ULONG	UnderrunConsumer;	// Consumer at the last one
+	volatile LONGLONG UnderrunTime;
+	ULONG			Buffers;
+	ULONG			BufferSize;
+	ULONG			Bytes[HSAC_STREAM_BUFFERS];	// in each buffer
+} HSAC_STREAM_PAGE, *PHSAC_STREAM_PAGE;
+
+//
+// IOCTL_GET_STATS output. The driver counts these in every build, with
+// interlocked operations only, from the time the device is added; each
+// counter is read on its own, so a snapshot taken under load is not
+// exactly consistent across counters.
+//
+typedef struct _HSAC_CHANNEL_STATS {
+	LONGLONG	Bytes;					// moved by retired transfers
+	LONGLONG	Transfers;				// handed to the channel
+	LONGLONG	Programs;				// doorbells rung
+	LONGLONG	Interrupts;				// recognized for this channel
+	LONGLONG	DpcRuns;
+	LONGLONG	Completions;			// transfers completed by the DPC
+	LONGLONG	Cancellations;
+	LONG		MaxCompletionsPerDpc;
+	LONG		MaxDtes;				// in one doorbell
+	LONG		InFlight;				// transfers handed over, not yet retired
+	LONG		Buffers;				// common buffers allocated so far
+	LONGLONG	LastInterruptTime;		// performance counter, 0 - never
+	LONGLONG	LastDpcTime;
+	LONGLONG	ChannelStates[16];		// retirements by DMA_CTRL.ChannelState;
+										// all but [0] (success) are errors
+} HSAC_CHANNEL_STATS, *PHSAC_CHANNEL_STATS;
+
+typedef struct _HSAC_STATS {
+	LONGLONG			Interrupts;		// ISR calls
+	LONGLONG			Spurious;		// of them, not this device's
+	HSAC_CHANNEL_STATS	Channel[2];		// 0 - write (DMA0), 1 - read (DMA1)
+	LONGLONG			DeviceAddUs;	// EvtDeviceAdd, microseconds
+	LONGLONG			DeviceStartUs;	// EvtDevicePrepareHardware through
+										// EvtDeviceD0Entry, last start
+	LONG				HeapRegions;	// IOCTL_ALLOC_DMA_BUFFER regions
+	LONG				HeapBuffers;	// buffers handed out
+	LONGLONG			HeapBytes;		// in them
+} HSAC_STATS, *PHSAC_STATS;
+
+//
+// IOCTL_MAP_STATS_PAGE maps an HSAC_STATS_PAGE read-only into the
+// caller and returns its address (ULONGLONG); it stays mapped until
+// IOCTL_UNMAP_STATS_PAGE or until the handle is closed. Any number of
+// handles may map it. While one has, the driver copies its counters
+// into the page every HSAC_STATS_PAGE_PERIOD milliseconds without
+// taking a lock or stopping the data path; readers take a consistent
+// snapshot by retrying while Sequence is odd or changed under them:
+//
+//     do {
+//         seq = Sequence (acquire);
+//         copy Frequency .. Stats, 8 bytes at a time;
+//         acquire fence;
+//     } while ((seq & 1) || Sequence != seq);
+//
+#define HSAC_STATS_PAGE_PERIOD	10
+
+typedef struct _HSAC_STATS_PAGE {
+	volatile ULONG	Sequence;		// odd while the driver is writing
+	ULONG			Reserved;
+	LONGLONG		Frequency;		// of the performance counter
+	LONGLONG		Published;		// performance counter at the copy
+	HSAC_STATS		Stats;
+} HSAC_STATS_PAGE, *PHSAC_STATS_PAGE;
+
+//
+// Flight recorder: the driver always keeps the last HSAC_FLIGHT_EVENTS
+// hot path events of each processor, in every build.
+// IOCTL_GET_FLIGHT_RECORD takes a processor number (ULONG) and returns
+// an HSAC_FLIGHT_RECORD of that processor's ring, or
+// STATUS_NO_MORE_ENTRIES past the last one. The ring keeps being written
+// while it is copied; a slot that changed under the copy comes back
+// with Sequence 0, like one never written. Sort by Time to merge rings.
+//
+#define HSAC_FLIGHT_EVENTS		512
+
+#define HSAC_FLIGHT_REQUEST		1	// Value - length, or IOCTL code; Address - request
+#define HSAC_FLIGHT_PROGRAM		2	// Address, Value - size, Count - DTEs
+#define HSAC_FLIGHT_ISR			3	// Value - INT_STATE, Count - MSI message
+#define HSAC_FLIGHT_RETIRE		4	// Value - DMA_CTRL, Count - transfers
+#define HSAC_FLIGHT_DPC_START	5
+#define HSAC_FLIGHT_DPC_END		6	// Count - completions
+#define HSAC_FLIGHT_COMPLETE	7	// Value - status, Address - transaction
+
+#define HSAC_FLIGHT_NO_CHANNEL	0xFF
+
+typedef struct _HSAC_FLIGHT_EVENT {
+	LONGLONG		Time;			// performance counter
+	ULONGLONG		Address;
+	ULONG			Value;
+	UCHAR			Type;			// HSAC_FLIGHT_*
+	UCHAR			Channel;		// 0 - write, 1 - read, or HSAC_FLIGHT_NO_CHANNEL
+	USHORT			Count;
+	volatile ULONG	Sequence;		// on its processor, from 1; 0 - none
+	ULONG			Reserved;
+} HSAC_FLIGHT_EVENT, *PHSAC_FLIGHT_EVENT;
+
+typedef struct _HSAC_FLIGHT_RECORD {
+	ULONG				Processor;
+	ULONG				Processors;		// rings there are
+	LONGLONG			Frequency;		// of the performance counter
+	ULONG				Next;			// Sequence of the next event
+	ULONG				Reserved;
+	HSAC_FLIGHT_EVENT	Events[HSAC_FLIGHT_EVENTS];		// by slot
+} HSAC_FLIGHT_RECORD, *PHSAC_FLIGHT_RECORD;
+
+//
+// Request times: the driver keeps, per handle, the times of the last
+// HSAC_REQUEST_TIMES reads and writes it sent to a channel, all taken
+// from the same performance counter, so Interrupt - Submitted is the
+// device side latency with no user mode clock in it.
+// IOCTL_GET_REQUEST_TIMES returns the calling handle's HSAC_REQUEST_LOG.
+// The handle's nth read or write (from 1) is in Entries[(n - 1) %
+// HSAC_REQUEST_TIMES] once it has completed; an entry being rewritten
+// comes back with Request 0. Requests failed before they reached a
+// channel leave their number unused.
+//
+#define HSAC_REQUEST_TIMES		64
+
+typedef struct _HSAC_REQUEST_TIME {
+	NTSTATUS		Status;
+	ULONG			Bytes;
+	LONGLONG		Submitted;		// performance counter in EvtIoRead/EvtIoWrite
+	LONGLONG		Interrupt;		// in the ISR (or poller) that saw the channel done; 0 - never
+	LONGLONG		Completed;		// when the request was completed
+	volatile ULONG	Request;		// the handle's nth read/write, from 1; 0 - none
+	ULONG			Channel;		// 0 - write, 1 - read
+} HSAC_REQUEST_TIME, *PHSAC_REQUEST_TIME;
+
+typedef struct _HSAC_REQUEST_LOG {
+	ULONG				Next;			// number the handle's next request gets
+	ULONG				Reserved;
+	LONGLONG			Frequency;		// of the performance counter
+	HSAC_REQUEST_TIME	Entries[HSAC_REQUEST_TIMES];	// by slot
+} HSAC_REQUEST_LOG, *PHSAC_REQUEST_LOG;
 
 #endif
 
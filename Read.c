@@ -25,6 +25,74 @@ Environment:
 #include "Read.tmh"
 
 
+//-----------------------------------------------------------------------------
+//
+//-----------------------------------------------------------------------------
+static VOID
+HSACPollReadRequest(
+    IN PDEVICE_EXTENSION  DevExt,
+    IN WDFDEVICE          Device,
+    IN WDFDMATRANSACTION  DmaTransaction,
+    IN PFILE_CONTEXT      FileContext,
+    IN LONGLONG           BudgetTicks
+    )
+/*++
+
+Routine Description:
+
+    Poll mode: wait for the read here and complete it the way the DPC
+    would. A transfer split into several DMA operations is followed
+    through all of them within the one budget; once the budget is spent
+    the DPC completes the request instead.
+
+Arguments:
+
+    BudgetTicks - spin budget, performance counter ticks
+
+Return Value:
+
+--*/
+{
+    PTRANSACTION_CONTEXT    transContext = HSACGetTransactionContext(DmaTransaction);
+    LONGLONG                start = KeQueryPerformanceCounter(NULL).QuadPart;
+    LONGLONG                elapsed = 0;
+    NTSTATUS                status = STATUS_SUCCESS;
+    BOOLEAN                 transactionComplete;
+
+    while (HSACDmaChannelPoll(DevExt, DmaTransaction, BudgetTicks - elapsed)) {
+
+        if (ReadNoFence(&transContext->Cancelled) || transContext->Aborted) {
+            transactionComplete = WdfDmaTransactionDmaCompletedFinal( DmaTransaction,
+                WdfDmaTransactionGetCurrentDmaTransferLength( DmaTransaction ),
+                &status );
+            if (transContext->Aborted) {
+                status = STATUS_CANCELLED;
+            }
+        } else {
+            transactionComplete = WdfDmaTransactionDmaCompleted( DmaTransaction, &status );
+        }
+
+        elapsed = KeQueryPerformanceCounter(NULL).QuadPart - start;
+
+        if (transactionComplete) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
+                        "Completing polled Read request, status: #%x", status);
+#endif
+            HSACPollUpdate(FileContext, elapsed, TRUE);
+            HSACReadRequestComplete( DmaTransaction, Device, status );
+            return;
+        }
+
+        //
+        // DmaCompleted has queued the next DMA operation; the transaction
+        // is still Polled.
+        //
+    }
+
+    HSACPollUpdate(FileContext, BudgetTicks, FALSE);
+}
+
 //-----------------------------------------------------------------------------
 //
 //-----------------------------------------------------------------------------
@@ -59,6 +127,14 @@ Return Value:
 {
     NTSTATUS                status = STATUS_UNSUCCESSFUL;
     PDEVICE_EXTENSION       devExt;
+    WDFDMATRANSACTION       dmaTransaction = NULL;
+    PTRANSACTION_CONTEXT    transContext;
+    WDFFILEOBJECT           fileObject;
+    PFILE_CONTEXT           fileContext = NULL;
+    LONGLONG                pollTicks = 0;
+    LONGLONG                submitTime;
+
+    submitTime = KeQueryPerformanceCounter(NULL).QuadPart;
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
                 "--> HSACEvtIoRead: Request %p", Request);
@@ -69,6 +145,10 @@ Return Value:
     //
     devExt = HSACGetDeviceContext(WdfIoQueueGetDevice(Queue));
 
+    HSAC_STAMP_READ(devExt, HsacReadStageIoRead);
+    HSACFlightRecord(devExt, HSAC_FLIGHT_REQUEST, 1, 0, (ULONG) Length,
+                     (ULONGLONG) (ULONG_PTR) Request);
+
     do {
         //
         // Validate the Length parameter.
@@ -78,43 +158,81 @@ Return Value:
             break;
         }
 
+        //
+        // Take a DmaTransaction from the read channel's pool.
+        //
+        dmaTransaction = HSACDmaChannelAllocate(devExt, &devExt->ReadChannel, Request);
+        if (dmaTransaction == NULL) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
+                        "HSACDmaChannelAllocate: no free read transaction");
+#endif
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        transContext = HSACGetTransactionContext(dmaTransaction);
+
+        //
+        // A handle in poll mode completes its own reads (Poll.c).
+        //
+        fileObject = WdfRequestGetFileObject(Request);
+        if (fileObject != NULL) {
+            fileContext = HSACGetFileContext(fileObject);
+            pollTicks = HSACPollBudget(fileContext);
+            transContext->Polled = (pollTicks != 0);
+        }
+        HSACTimesStart(fileContext, transContext, submitTime);
+
 		if (devExt->dmaProfile == WdfDmaProfilePacket64)
 		{
 			size_t                  length = 0;
 			PVOID					pOutputBuffer = NULL;
-			status = WdfRequestRetrieveOutputBuffer(Request, 0, &pOutputBuffer, &length);
-//			if( !NT_SUCCESS(status)) {
-//#if (DBG != 0)
-//				TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
-//					"WdfRequestRetrieveOutputBuffer failed 0x%x\n", status);
-//#endif
-//			}
-			devExt->ReadSize = *(PULONG)pOutputBuffer;
-
-#if (CACHE_MODE != CACHE_NONE_MODE)
-			devExt->ReadBufIndex = *((PULONG)pOutputBuffer + 1);
+			//
+			// The header is {size, index}, or only the size in
+			// HSAC_CACHE_NONE, which has one buffer.
+			//
+			status = WdfRequestRetrieveOutputBuffer(Request,
+				(devExt->CacheMode == HSAC_CACHE_NONE) ? sizeof(ULONG) : 2 * sizeof(ULONG),
+				&pOutputBuffer, &length);
+			if( !NT_SUCCESS(status)) {
 #if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
-				"devExt->ReadBufIndex: %d, devExt->ReadSize: %d\n", devExt->ReadBufIndex, devExt->ReadSize);
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
+					"WdfRequestRetrieveOutputBuffer failed 0x%x\n", status);
 #endif
-#else
+				break;
+			}
+			transContext->PacketSize = *(PULONG)pOutputBuffer;
+
+			if (devExt->CacheMode != HSAC_CACHE_NONE) {
+				transContext->PacketIndex = *((PULONG)pOutputBuffer + 1);
 #if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
-				"devExt->ReadSize: %d\n", devExt->ReadSize);
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
+					"ReadBufIndex: %d, ReadSize: %d\n", transContext->PacketIndex, transContext->PacketSize);
 #endif
+			} else {
+				transContext->PacketIndex = 0;
+#if (DBG != 0)
+				TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
+					"ReadSize: %d\n", transContext->PacketSize);
 #endif
-
+			}
+			if (!HSACDmaChannelPacketValid(devExt, 1,
+					transContext->PacketIndex, transContext->PacketSize)) {
+				status = STATUS_INVALID_PARAMETER;
+				break;
+			}
+			//
+			// Only now, so that HSACDmaChannelFree gives the buffer back.
+			//
+			transContext->Packet     = TRUE;
 		}
 
-#ifdef ENABLE_CANCEL
-		// Mark the request is cancelable
-		WdfRequestMarkCancelable(Request, HSACEvtRequestCancelRead);
-#endif
         //
         // Initialize this new DmaTransaction.
         //
         status = WdfDmaTransactionInitializeUsingRequest(
-                                              devExt->ReadDmaTransaction,
+                                              dmaTransaction,
                                               Request,
                                               HSACEvtProgramReadDma,
                                               WdfDmaDirectionReadFromDevice );
@@ -141,24 +259,44 @@ Return Value:
             //TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
             //            "Setting a new MaxLen %d\n", length);
 
-            WdfDmaTransactionSetMaximumLength( devExt->ReadDmaTransaction, 
+            WdfDmaTransactionSetMaximumLength( dmaTransaction, 
                                                length );
         }
 #endif
 
+#ifdef ENABLE_CANCEL
+		//
+		// Mark the request is cancelable. If it has already been
+		// cancelled, fail it here.
+		//
+		status = WdfRequestMarkCancelableEx(Request, HSACEvtRequestCancelRead);
+		if (!NT_SUCCESS(status)) {
+			break;
+		}
+#endif
+
         //
         // Execute this DmaTransaction.
         //
-        status = WdfDmaTransactionExecute( devExt->ReadDmaTransaction, 
+        HSAC_STAMP_READ(devExt, HsacReadStageExecute);
+
+        status = WdfDmaTransactionExecute( dmaTransaction, 
                                            WDF_NO_CONTEXT);
 
         if(!NT_SUCCESS(status)) {
             //
-            // Couldn't execute this DmaTransaction, so fail Request.
+            // Couldn't execute this DmaTransaction, so fail Request,
+            // unless a cancel routine taken meanwhile is left to do it.
             //
 #if (DBG != 0)
             TraceEvents(TRACE_LEVEL_ERROR, DBG_READ,
                         "WdfDmaTransactionExecute failed: %!STATUS!", status);
+#endif
+#ifdef ENABLE_CANCEL
+			if (WdfRequestUnmarkCancelable(Request) == STATUS_CANCELLED &&
+				!HSACDmaChannelDropCompletion(dmaTransaction)) {
+				return;
+			}
 #endif
             break;
         }
@@ -166,17 +304,25 @@ Return Value:
         //
         // Indicate that Dma transaction has been started successfully.
         // The request will be complete by the Dpc routine when the DMA
-        // transaction completes.
+        // transaction completes, or right here in poll mode.
         //
         status = STATUS_SUCCESS;
 
+        if (pollTicks) {
+            HSACPollReadRequest(devExt, WdfIoQueueGetDevice(Queue),
+                                dmaTransaction, fileContext, pollTicks);
+        }
+
     } while (0);
 
     //
     // If there are errors, then clean up and complete the Request.
     //
     if (!NT_SUCCESS(status )) {
-        WdfDmaTransactionRelease(devExt->ReadDmaTransaction);
+        if (dmaTransaction != NULL) {
+            WdfDmaTransactionRelease(dmaTransaction);
+            HSACDmaChannelFree(devExt, dmaTransaction);
+        }
         WdfRequestComplete(Request, status);
     }
 #if (DBG != 0)
@@ -218,18 +364,9 @@ Return Value:
 --*/
 {
     PDEVICE_EXTENSION        devExt;
+    PTRANSACTION_CONTEXT     transContext;
     size_t                   offset;
-    PDMA_TRANSFER_ELEMENT    dteVA;
-	//ULONG_PTR                dteLALow;
-	//ULONG_PTR                dteLAHigh;
-	ULONG                dteLALow;
-	LONG                 dteLAHigh;
     BOOLEAN                  errors;
-    ULONG                    i;
-
-	ULONG transferSize;
-	ULONG dma1Ctl;
-	ULONG sgTransferSize = 0;
 
     UNREFERENCED_PARAMETER( Context );
     UNREFERENCED_PARAMETER( Direction );
@@ -243,42 +380,16 @@ Return Value:
     // Initialize locals
     //
     devExt = HSACGetDeviceContext(Device);
+    transContext = HSACGetTransactionContext(Transaction);
     errors = FALSE;
 
-	if (devExt->dmaProfile == WdfDmaProfilePacket64)
+	if (transContext->Packet)
 	{
-
-		WdfInterruptAcquireLock( devExt->Interrupt );
-
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR32,
-			devExt->pReadCommonBufferBaseLA[devExt->ReadBufIndex].LowPart );
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR64,
-			devExt->pReadCommonBufferBaseLA[devExt->ReadBufIndex].HighPart );
-#else
-#if (CACHE_MODE == PING_PANG)
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR32,
-			devExt->ReadCommonBufferBaseLA.LowPart + devExt->ReadBufIndex * devExt->MaximumTransferLength);
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR64,
-			devExt->ReadCommonBufferBaseLA.HighPart );
-#else if (CACHE_MODE == CACHE_NONE_MODE)
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR32,
-			devExt->ReadCommonBufferBaseLA.LowPart);
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR64,
-			devExt->ReadCommonBufferBaseLA.HighPart );
-#endif
-#endif
-
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_SIZE, devExt->ReadSize);
-		//devExt->ReadSize = 0;
-
-		dma1Ctl = DMA_CTRL_START;
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL, dma1Ctl);
-
 		//
-		// Release our interrupt spinlock
+		// The channel is programmed from the common buffer the request
+		// named when its turn comes.
 		//
-		WdfInterruptReleaseLock( devExt->Interrupt );
+		HSACDmaChannelQueue(devExt, Transaction);
 
 		return TRUE;
 	}
@@ -292,142 +403,33 @@ Return Value:
 //		"offset (%d)\n", offset);
 //#endif
 
-    //
-    // Setup the pointer to the next DMA_TRANSFER_ELEMENT
-    // for both virtual and physical address references.
-    //
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-	dteVA = (PDMA_TRANSFER_ELEMENT) devExt->pReadCommonBufferBase[0];
-	dteLALow = (devExt->pReadCommonBufferBaseLA[0].LowPart +
-		sizeof(DMA_TRANSFER_ELEMENT));
-	dteLAHigh = devExt->pReadCommonBufferBaseLA[0].HighPart;
-#else
-    dteVA = (PDMA_TRANSFER_ELEMENT) devExt->ReadCommonBufferBase;
-    dteLALow = (devExt->ReadCommonBufferBaseLA.LowPart +
-                        sizeof(DMA_TRANSFER_ELEMENT));
-	dteLAHigh = devExt->ReadCommonBufferBaseLA.HighPart;
-#endif
-
     //
     // Translate the System's SCATTER_GATHER_LIST elements
-    // into the device's DMA_TRANSFER_ELEMENT elements.
-    //
-    for (i=0; i < SgList->NumberOfElements; i++) {
-
-        //
-        // Construct this DTE.
-        //
-        dteVA->PageAddressLow  = SgList->Elements[i].Address.LowPart;
-        dteVA->PageAddressHigh = SgList->Elements[i].Address.HighPart;
-        dteVA->TransferSize    = SgList->Elements[i].Length;
-
-        dteVA->DescPtrLow.LastElement   = FALSE;
-        dteVA->DescPtrLow.LowAddress    = DESC_PTR_ADDR( dteLALow );
-		dteVA->DescPtrHigh.HighAddress  = dteLAHigh;
-        //
-        // If at end of SgList, then set LastElement bit in final NTE.
-        //
-
-		sgTransferSize += dteVA->TransferSize;
-
-        if (i == SgList->NumberOfElements - 1) {
-
-            dteVA->DescPtrLow.LastElement = TRUE;
-
-#if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
-				"\tDTE[%d] : Addr #%X%08X, Len %8d,LA #%X%08X, Last(%d)\n",
-				i,
-				dteVA->PageAddressHigh,
-				dteVA->PageAddressLow,
-				dteVA->TransferSize,
-				dteLAHigh,
-				dteLALow,
-				dteVA->DescPtrLow.LastElement );
-#endif
-            break;
-        }
-
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
-			"\tDTE[%d] : Addr #%X%08X, Len %8d,LA #%X%08X, Last(%d)\n",
-			i,
-			dteVA->PageAddressHigh,
-			dteVA->PageAddressLow,
-			dteVA->TransferSize,
-			dteLAHigh,
-			dteLALow,
-			dteVA->DescPtrLow.LastElement );
-#endif
-        //
-        // Adjust the next DMA_TRANSFER_ELEMEMT
-        //
-        dteVA++;
-        dteLALow += sizeof(DMA_TRANSFER_ELEMENT);
-    }
-
+    // into the device's DMA_TRANSFER_ELEMENT elements,
+    // in this transaction's DTE slot.
     //
-    // Start the DMA operation.
-    // Acquire this device's InterruptSpinLock.
-    //
-    WdfInterruptAcquireLock( devExt->Interrupt );
-
-	//
-	// DMA 0 Descriptor Pointer Register - (DMADPR0)
-	// Write the base LOGICAL address of the DMA_TRANSFER_ELEMENT list.
-	//
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR32,
-		/*DESC_PTR_ADDR( devExt->WriteCommonBufferBaseLA.LowPart )*/
-		devExt->pReadCommonBufferBaseLA[0].LowPart);
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR64,
-		devExt->pReadCommonBufferBaseLA[0].HighPart );
-
-	transferSize = SgList->NumberOfElements * sizeof(DMA_TRANSFER_ELEMENT);
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_SIZE, sgTransferSize/*transferSize*/);
+	if (!HSACDmaChannelBuildChain(transContext, SgList)) {
+		errors = TRUE;
+	}
 
 #if (DBG != 0)
 	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
-		"ReadCommonBufferBaseLA: #%X%08X Len %8d\n",
-		devExt->pReadCommonBufferBaseLA[0].HighPart,
-		devExt->pReadCommonBufferBaseLA[0].LowPart,
-		transferSize);
-#endif
-#else
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR32,
-		/*DESC_PTR_ADDR( devExt->WriteCommonBufferBaseLA.LowPart )*/
-		devExt->ReadCommonBufferBaseLA.LowPart);
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_ADDR64,
-		devExt->ReadCommonBufferBaseLA.HighPart );
-
-	transferSize = SgList->NumberOfElements * sizeof(DMA_TRANSFER_ELEMENT);
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_SIZE, sgTransferSize/*transferSize*/);
-
-#if (DBG != 0)
+		"Read DTE slot: #%X%08X, %d SG elements in %d DTEs\n",
+		transContext->DteLA.HighPart,
+		transContext->DteLA.LowPart,
+		SgList->NumberOfElements,
+		transContext->DteCount);
 	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
-		"ReadCommonBufferBaseLA: #%X%08X Len %8d\n",
-		devExt->ReadCommonBufferBaseLA.HighPart,
-		devExt->ReadCommonBufferBaseLA.LowPart,
-		transferSize);
-#endif
-
-#endif
-
-#if (DBG != 0)
-	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
-		"    HSACEvtProgramReadDma: Start a Read DMA operation, total size: %d", sgTransferSize);
+		"    HSACEvtProgramReadDma: Queue a Read DMA operation, total size: %d", transContext->TransferSize);
 #endif
 	//
-	// DMA 0 CSR Register - (DMACSR0)
-	// Start the DMA operation: Set Start bits. Enable Scatter/Gather Mode
+	// Hand the chain to the read channel. It is started now if DMA1 is
+	// idle; otherwise it is linked with the other waiting chains and
+	// started from the ISR when the running chain completes.
 	//
-	dma1Ctl = DMA_CTRL_START | DMA_CTRL_SG_ENA;
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA1_CTRL, dma1Ctl);
-
-    //
-    // Release our interrupt spinlock
-    //
-    WdfInterruptReleaseLock( devExt->Interrupt );
+	if (!errors) {
+		HSACDmaChannelQueue(devExt, Transaction);
+	}
 
     //
     // NOTE: This shows how to process errors which occur in the
@@ -488,6 +490,8 @@ Return Value:
     request = WdfDmaTransactionGetRequest(DmaTransaction);
 	devExt  = HSACGetDeviceContext(Device);
 
+	HSAC_STAMP_READ(devExt, HsacReadStageComplete);
+
 #ifdef ENABLE_CANCEL
 	if (request == NULL)
 	{
@@ -501,14 +505,20 @@ Return Value:
 	// after a request completes, so check here to see
 	// if EchoEvtRequestCancel cleared our saved
 	// request handle. 
-	Status = WdfRequestUnmarkCancelable(request);
-	if (Status == STATUS_CANCELLED)
+	//
+	// If it did, the cancel routine has run or will run; whichever of
+	// us drops the last completion owner completes the request.
+	//
+	if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED)
 	{
 #if (DBG != 0)
 		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
 			"WdfRequestUnmarkCancelable Status == STATUS_CANCELLED\n");
 #endif
-		return;
+		if (!HSACDmaChannelDropCompletion(DmaTransaction)) {
+			return;
+		}
+		Status = STATUS_CANCELLED;
 	}
 #endif
     //ASSERT(request);
@@ -516,7 +526,8 @@ Return Value:
     //
     // Get the final bytes transferred count.
     //
-    bytesTransferred =  WdfDmaTransactionGetBytesTransferred( DmaTransaction );
+    bytesTransferred = (Status == STATUS_CANCELLED) ? 0 :
+        WdfDmaTransactionGetBytesTransferred( DmaTransaction );
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
                 "HSACReadRequestComplete:  Request %p, Status %!STATUS!, "
@@ -524,7 +535,11 @@ Return Value:
                  request, Status, (int) bytesTransferred );
 #endif
 
+    HSACTimesRecord( request, HSACGetTransactionContext(DmaTransaction),
+                     Status, bytesTransferred );
+
     WdfDmaTransactionRelease(DmaTransaction);
+    HSACDmaChannelFree(devExt, DmaTransaction);
 
 //	if (devExt->dmaProfile == WdfDmaProfilePacket64)
 //	{
@@ -554,9 +569,9 @@ Routine Description:
 
 
     Called when an I/O request is cancelled after the driver has marked
-    the request cancellable. This callback is automatically synchronized
-    with the I/O callbacks since we have chosen to use frameworks Device
-    level locking.
+    the request cancellable. This callback is not synchronized with the
+    I/O callbacks or the DPC; HSACDmaChannelCancel and the transaction's
+    completion owners decide who completes the request.
 
 Arguments:
 
@@ -571,24 +586,42 @@ Return Value:
 	NTSTATUS            status = STATUS_SUCCESS;
 	WDFDEVICE			device;
 	PDEVICE_EXTENSION   devExt;
+	WDFDMATRANSACTION   dmaTransaction;
+	BOOLEAN             queued;
 	//PQUEUE_CONTEXT queueContext = QueueGetContext(WdfRequestGetIoQueue(Request));
 	device = WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request));
 	devExt  = HSACGetDeviceContext(device);
 
-	WdfDmaTransactionDmaCompleted( devExt->ReadDmaTransaction, &status );
-
-	WdfDmaTransactionRelease(devExt->ReadDmaTransaction);  
-
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_READ,
 		"HSACEvtRequestCancelRead called on Request 0x%p\n",  Request);
 #endif
+
+	//
+	// A transfer the channel is already running cannot be taken back;
+	// unless HSACReadRequestComplete has already given up the request,
+	// it completes it as cancelled once it is done.
+	//
+	dmaTransaction = HSACDmaChannelCancel(devExt, &devExt->ReadChannel, Request, &queued);
+	if (dmaTransaction == NULL) {
+		return;
+	}
+
+	if (queued) {
+		(VOID) WdfDmaTransactionDmaCompletedFinal( dmaTransaction, 0, &status );
+	} else if (!HSACDmaChannelDropCompletion(dmaTransaction)) {
+		return;
+	}
+
+	WdfDmaTransactionRelease(dmaTransaction);  
+	HSACDmaChannelFree(devExt, dmaTransaction);
     //
     // The following is race free by the callside or DPC side
     // synchronizing completion by calling
     // WdfRequestMarkCancelable(Queue, Request, FALSE) before
     // completion and not calling WdfRequestComplete if the
-    // return status == STATUS_CANCELLED.
+    // return status == STATUS_CANCELLED: the two then share the
+    // transaction's completion owners.
     //
     WdfRequestCompleteWithInformation(Request, STATUS_CANCELLED, 0L);
 
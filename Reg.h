@@ -97,6 +97,11 @@ typedef struct _DMA_TRANSFER_ELEMENT {
 #define DESC_PTR_ADDR_SHIFT (2)
 #define DESC_PTR_ADDR(a) (((ULONG) a) >> DESC_PTR_ADDR_SHIFT)
 
+//
+// A DTE's page must not cross a 4GB address boundary.
+//
+#define HSAC_DTE_BOUNDARY               (0x100000000ull)
+
 //-----------------------------------------------------------------------------   
 // Define the DMA Control Register (CR)
 //-----------------------------------------------------------------------------   
@@ -136,6 +141,14 @@ enum
 	CHAN_WAIT_CPL		= 0x1010,
 	CHAN_WAIT_DATA		= 0x1011
 };
+//
+// The channel state values above are written as binary digits. Use
+// CHAN_STATE_BITS to turn one into the 4-bit value found in
+// DMA_CTRL.ChannelState. Every "in progress" state has bit 3 set.
+//
+#define CHAN_STATE_BITS(s)	((((s) >> 9) & 0x8) | (((s) >> 6) & 0x4) | \
+							 (((s) >> 3) & 0x2) | ((s) & 0x1))
+#define CHAN_STATE_BUSY_MASK	0x8
 
 typedef struct _INT_REG_ {
 
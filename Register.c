@@ -0,0 +1,638 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Register.c
+
+Abstract:
+
+    Registered user buffers. IOCTL_REGISTER_BUFFER locks a buffer down,
+    has the framework map it with a DMA transaction of its own that is
+    executed once and held until the buffer is unregistered, and builds
+    its DTE chain in a common buffer of its own. IOCTL_REGISTERED_READ
+    and IOCTL_REGISTERED_WRITE name the buffer by ID: they take a pool
+    transaction only for its place on the channel lists and queue the
+    prebuilt chain, so a request costs the doorbell and no probe, map or
+    scatter/gather walk. A handle's buffers are unregistered when it is
+    closed.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Register.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACRegisterBuffer)
+#pragma alloc_text (PAGE, HSACUnregisterBuffer)
+#pragma alloc_text (PAGE, HSACEvtFileCleanup)
+#endif
+
+static VOID
+HSACRegisteredBufferRelease(
+    IN PHSAC_REGISTERED_BUFFER Registered
+    )
+/*++
+Routine Description:
+
+    Undo as much of HSACRegisterBuffer as got done and free the slot.
+    The entry is Setup.
+
+--*/
+{
+    NTSTATUS status;
+
+    if (Registered->Mapped) {
+        (VOID) WdfDmaTransactionDmaCompletedFinal( Registered->Transaction, 0, &status );
+        WdfDmaTransactionRelease( Registered->Transaction );
+        Registered->Mapped = FALSE;
+    }
+
+    if (Registered->Transaction) {
+        WdfObjectDelete( Registered->Transaction );
+        Registered->Transaction = NULL;
+    }
+
+    if (Registered->DteCommonBuffer) {
+        WdfObjectDelete( Registered->DteCommonBuffer );
+        Registered->DteCommonBuffer = NULL;
+    }
+
+    if (Registered->Mdl) {
+        MmUnlockPages( Registered->Mdl );
+        IoFreeMdl( Registered->Mdl );
+        Registered->Mdl = NULL;
+    }
+
+    Registered->FileObject = NULL;
+    Registered->Channel    = NULL;
+    Registered->Length     = 0;
+    Registered->LastDte    = NULL;
+    Registered->DteCount   = 0;
+
+    InterlockedExchange( &Registered->State, HSAC_REGISTERED_FREE );
+}
+
+NTSTATUS
+HSACRegisterBuffer(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject,
+    IN ULONG             Channel,
+    IN PVOID             Address,
+    IN ULONG             Length,
+    OUT PULONG           BufferId
+    )
+/*++
+Routine Description:
+
+    IOCTL_REGISTER_BUFFER. Called in the context of the process that owns
+    Address, as IOCTL_MAP_DMA_BUF_ADDR is. The enabler is 64-bit
+    scatter/gather and Length is at most MaximumTransferLength, so the
+    framework maps the whole buffer at once and calls
+    HSACEvtProgramRegisteredDma before WdfDmaTransactionExecute returns.
+
+Arguments:
+
+    Channel     0 - write (device reads the buffer), 1 - read
+    BufferId    Receives the ID the transfers name
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    PHSAC_REGISTERED_BUFFER registered = NULL;
+    PTRANSACTION_CONTEXT    transContext;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    PMDL                    mdl;
+    ULONG                   i;
+
+    PAGED_CODE();
+
+    if (FileObject == NULL || Channel > 1 || Address == NULL ||
+        Length == 0 || Length > DevExt->MaximumTransferLength) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < HSAC_MAX_REGISTERED_BUFFERS; i++) {
+        if (InterlockedCompareExchange( &DevExt->Registered[i].State,
+                HSAC_REGISTERED_SETUP, HSAC_REGISTERED_FREE ) == HSAC_REGISTERED_FREE) {
+            registered = &DevExt->Registered[i];
+            break;
+        }
+    }
+
+    if (registered == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    registered->FileObject = FileObject;
+    registered->Channel    = (Channel == 0) ? &DevExt->WriteChannel : &DevExt->ReadChannel;
+    registered->Length     = Length;
+
+    mdl = IoAllocateMdl( Address, Length, FALSE, FALSE, NULL );
+    if (mdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    status = STATUS_SUCCESS;
+
+    __try {
+        MmProbeAndLockPages( mdl, UserMode, (Channel == 1) ? IoWriteAccess : IoReadAccess );
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    if (!NT_SUCCESS(status)) {
+        IoFreeMdl( mdl );
+        goto Error;
+    }
+
+    registered->Mdl = mdl;
+
+    //
+    // One channel slot's worth of DTEs holds the chain of any buffer up
+    // to MaximumTransferLength.
+    //
+    status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+                                    registered->Channel->DteSlotSize,
+                                    WDF_NO_OBJECT_ATTRIBUTES,
+                                    &registered->DteCommonBuffer );
+    if (!NT_SUCCESS(status)) {
+        registered->DteCommonBuffer = NULL;
+        goto Error;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TRANSACTION_CONTEXT);
+
+    status = WdfDmaTransactionCreate( DevExt->DmaEnabler,
+                                      &attributes,
+                                      &registered->Transaction );
+    if (!NT_SUCCESS(status)) {
+        registered->Transaction = NULL;
+        goto Error;
+    }
+
+    transContext = HSACGetTransactionContext(registered->Transaction);
+    RtlZeroMemory(transContext, sizeof(TRANSACTION_CONTEXT));
+
+    transContext->Transaction = registered->Transaction;
+    transContext->Channel     = registered->Channel;
+    transContext->State       = HsacDmaAllocated;
+    transContext->DteVA       = (PDMA_TRANSFER_ELEMENT)
+        WdfCommonBufferGetAlignedVirtualAddress(registered->DteCommonBuffer);
+    transContext->DteLA       =
+        WdfCommonBufferGetAlignedLogicalAddress(registered->DteCommonBuffer);
+
+    status = WdfDmaTransactionInitialize( registered->Transaction,
+                                          HSACEvtProgramRegisteredDma,
+                                          (Channel == 1) ? WdfDmaDirectionReadFromDevice :
+                                                           WdfDmaDirectionWriteToDevice,
+                                          mdl,
+                                          MmGetMdlVirtualAddress(mdl),
+                                          Length );
+    if (!NT_SUCCESS(status)) {
+        goto Error;
+    }
+
+    status = WdfDmaTransactionExecute( registered->Transaction, WDF_NO_CONTEXT );
+    if (!NT_SUCCESS(status)) {
+        WdfDmaTransactionRelease( registered->Transaction );
+        goto Error;
+    }
+
+    registered->Mapped = TRUE;
+
+    if (transContext->DteCount == 0) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    registered->DteLA    = transContext->DteLA;
+    registered->LastDte  = transContext->LastDte;
+    registered->DteCount = transContext->DteCount;
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "Registered buffer %d: channel %d, %d bytes in %d DTEs at #0x%I64X",
+                i, Channel, Length, registered->DteCount, registered->DteLA.QuadPart);
+#endif
+
+    *BufferId = i;
+
+    InterlockedExchange( &registered->State, HSAC_REGISTERED_IDLE );
+
+    return STATUS_SUCCESS;
+
+Error:
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                "HSACRegisterBuffer(channel %d, %d bytes) failed: %!STATUS!",
+                Channel, Length, status);
+#endif
+    HSACRegisteredBufferRelease(registered);
+
+    return status;
+}
+
+BOOLEAN
+HSACEvtProgramRegisteredDma(
+    IN  WDFDMATRANSACTION       Transaction,
+    IN  WDFDEVICE               Device,
+    IN  WDFCONTEXT              Context,
+    IN  WDF_DMA_DIRECTION       Direction,
+    IN  PSCATTER_GATHER_LIST    SgList
+    )
+/*++
+Routine Description:
+
+    EvtProgramDma of a registered buffer's own transaction, called once
+    from HSACRegisterBuffer. Build the chain and start nothing; DteCount
+    is left 0 if it does not fit.
+
+--*/
+{
+    PTRANSACTION_CONTEXT transContext = HSACGetTransactionContext(Transaction);
+
+    UNREFERENCED_PARAMETER( Device );
+    UNREFERENCED_PARAMETER( Context );
+    UNREFERENCED_PARAMETER( Direction );
+
+    if (!HSACDmaChannelBuildChain(transContext, SgList)) {
+        transContext->DteCount = 0;
+    }
+
+    return TRUE;
+}
+
+NTSTATUS
+HSACUnregisterBuffer(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject,
+    IN ULONG             BufferId
+    )
+/*++
+Routine Description:
+
+    IOCTL_UNREGISTER_BUFFER. Only the handle that registered the buffer
+    may unregister it, and not while a transfer is using it.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    PHSAC_REGISTERED_BUFFER registered;
+    LONG                    state;
+
+    PAGED_CODE();
+
+    if (BufferId >= HSAC_MAX_REGISTERED_BUFFERS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    registered = &DevExt->Registered[BufferId];
+
+    state = InterlockedCompareExchange( &registered->State,
+        HSAC_REGISTERED_SETUP, HSAC_REGISTERED_IDLE );
+    if (state != HSAC_REGISTERED_IDLE) {
+        return (state == HSAC_REGISTERED_BUSY) ? STATUS_DEVICE_BUSY : STATUS_INVALID_PARAMETER;
+    }
+
+    if (registered->FileObject != FileObject) {
+        InterlockedExchange( &registered->State, HSAC_REGISTERED_IDLE );
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    HSACRegisteredBufferRelease(registered);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+HSACEvtFileCleanup(
+    IN WDFFILEOBJECT FileObject
+    )
+/*++
+Routine Description:
+
+    The last handle to FileObject is closed: unregister its buffers,
+    unmap its packet ring and stats page, stop its streams and free its
+    DMA buffers. A transfer already handed to the channel cannot be
+    called back, so a registered buffer still in use is waited for.
+
+--*/
+{
+    PDEVICE_EXTENSION       devExt;
+    PHSAC_REGISTERED_BUFFER registered;
+    LARGE_INTEGER           interval;
+    LONG                    state;
+    ULONG                   i;
+
+    PAGED_CODE();
+
+    devExt = HSACGetDeviceContext(WdfFileObjectGetDevice(FileObject));
+
+    interval.QuadPart = -10000;     // 1 ms
+
+    for (i = 0; i < HSAC_MAX_REGISTERED_BUFFERS; i++) {
+
+        registered = &devExt->Registered[i];
+
+        for (;;) {
+
+            state = InterlockedCompareExchange( &registered->State,
+                HSAC_REGISTERED_SETUP, HSAC_REGISTERED_IDLE );
+
+            if (state == HSAC_REGISTERED_IDLE) {
+                if (registered->FileObject == FileObject) {
+                    HSACRegisteredBufferRelease(registered);
+                } else {
+                    InterlockedExchange( &registered->State, HSAC_REGISTERED_IDLE );
+                }
+                break;
+            }
+
+            if (state != HSAC_REGISTERED_BUSY || registered->FileObject != FileObject) {
+                break;
+            }
+
+            KeDelayExecutionThread( KernelMode, FALSE, &interval );
+        }
+    }
+
+    //
+    // And its packet ring, if it has one (Ring.c).
+    //
+    (VOID) HSACRingUnmap(devExt, FileObject);
+
+    //
+    // And its streams (Stream.c).
+    //
+    (VOID) HSACStreamStop(devExt, FileObject, 0);
+    (VOID) HSACStreamStop(devExt, FileObject, 1);
+
+    //
+    // And its view of the stats page (Stats.c).
+    //
+    (VOID) HSACStatsUnmap(devExt, FileObject);
+
+    //
+    // And its DMA buffers (Heap.c).
+    //
+    HSACHeapRelease(devExt, FileObject);
+}
+
+VOID
+HSACEvtIoRegistered(
+    IN WDFQUEUE      Queue,
+    IN WDFREQUEST    Request,
+    IN size_t        OutputBufferLength,
+    IN size_t        InputBufferLength,
+    IN ULONG         IoControlCode
+    )
+/*++
+Routine Description:
+
+    IOCTL_REGISTERED_READ and IOCTL_REGISTERED_WRITE, forwarded to the
+    read or write queue by HSACEvtIoDeviceControl so that they count
+    against the channel's HSAC_MAX_OUTSTANDING_REQUESTS together with
+    ReadFile and WriteFile. Queue the buffer's prebuilt chain on the
+    channel; a handle in poll mode completes it here.
+
+--*/
+{
+    NTSTATUS                status;
+    PDEVICE_EXTENSION       devExt;
+    PHSAC_DMA_CHANNEL       channel;
+    PHSAC_REGISTERED_BUFFER registered = NULL;
+    PHSAC_REGISTERED_IO     io;
+    WDFDMATRANSACTION       dmaTransaction;
+    PTRANSACTION_CONTEXT    transContext;
+    WDFFILEOBJECT           fileObject;
+    PFILE_CONTEXT           fileContext;
+    PVOID                   pInputBuffer = NULL;
+    size_t                  length = 0;
+    LONGLONG                pollTicks;
+    LONGLONG                start;
+    LONG                    state;
+
+    UNREFERENCED_PARAMETER( OutputBufferLength );
+    UNREFERENCED_PARAMETER( InputBufferLength );
+
+    devExt  = HSACGetDeviceContext(WdfIoQueueGetDevice(Queue));
+    channel = (Queue == devExt->ReadQueue) ? &devExt->ReadChannel : &devExt->WriteChannel;
+
+    do {
+        if (IoControlCode != ((channel == &devExt->ReadChannel) ?
+                              IOCTL_REGISTERED_READ : IOCTL_REGISTERED_WRITE)) {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
+
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(HSAC_REGISTERED_IO),
+            &pInputBuffer, &length);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        io = (PHSAC_REGISTERED_IO) pInputBuffer;
+        fileObject = WdfRequestGetFileObject(Request);
+
+        if (io->BufferId >= HSAC_MAX_REGISTERED_BUFFERS || fileObject == NULL) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        registered = &devExt->Registered[io->BufferId];
+
+        state = InterlockedCompareExchange( &registered->State,
+            HSAC_REGISTERED_BUSY, HSAC_REGISTERED_IDLE );
+        if (state != HSAC_REGISTERED_IDLE) {
+            status = (state == HSAC_REGISTERED_BUSY) ?
+                STATUS_DEVICE_BUSY : STATUS_INVALID_PARAMETER;
+            registered = NULL;
+            break;
+        }
+
+        if (registered->FileObject != fileObject || registered->Channel != channel) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        //
+        // The queue presents no more requests than the pool holds.
+        //
+        dmaTransaction = HSACDmaChannelAllocate(devExt, channel, Request);
+        if (dmaTransaction == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        transContext = HSACGetTransactionContext(dmaTransaction);
+        transContext->Registered   = registered;
+        transContext->LastDte      = registered->LastDte;
+        transContext->TransferSize = registered->Length;
+        transContext->DteCount     = registered->DteCount;
+
+        fileContext = HSACGetFileContext(fileObject);
+        pollTicks = HSACPollBudget(fileContext);
+        transContext->Polled = (pollTicks != 0);
+
+#ifdef ENABLE_CANCEL
+        //
+        // Like a read or write, the request can be cancelled while
+        // moderation or a busy channel holds its chain on the Ready list.
+        //
+        status = WdfRequestMarkCancelableEx(Request, HSACEvtRequestCancelRegistered);
+        if (!NT_SUCCESS(status)) {
+            HSACDmaChannelFree(devExt, dmaTransaction);
+            break;
+        }
+#endif
+
+        HSACDmaChannelQueue(devExt, dmaTransaction);
+
+        if (pollTicks) {
+            start = KeQueryPerformanceCounter(NULL).QuadPart;
+
+            if (HSACDmaChannelPoll(devExt, dmaTransaction, pollTicks)) {
+                HSACPollUpdate(fileContext,
+                    KeQueryPerformanceCounter(NULL).QuadPart - start, TRUE);
+                HSACRegisteredRequestComplete(devExt, dmaTransaction,
+                    transContext->Aborted ? STATUS_CANCELLED : STATUS_SUCCESS);
+            } else {
+                HSACPollUpdate(fileContext, pollTicks, FALSE);
+            }
+        }
+
+        return;
+
+    } while (0);
+
+    if (registered) {
+        InterlockedExchange( &registered->State, HSAC_REGISTERED_IDLE );
+    }
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                "Registered %s failed: %!STATUS!",
+                (channel == &devExt->ReadChannel) ? "read" : "write", status);
+#endif
+
+    WdfRequestComplete(Request, status);
+}
+
+static VOID
+HSACRegisteredRequestFinish(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFDMATRANSACTION Transaction,
+    IN NTSTATUS          Status
+    )
+/*++
+Routine Description:
+
+    Return the pool transaction, hand the buffer back and complete the
+    request, with the buffer's length if it succeeded.
+
+--*/
+{
+    PTRANSACTION_CONTEXT    transContext = HSACGetTransactionContext(Transaction);
+    PHSAC_REGISTERED_BUFFER registered = transContext->Registered;
+    WDFREQUEST              request = transContext->Request;
+    ULONG                   length = transContext->TransferSize;
+
+    HSACDmaChannelFree(DevExt, Transaction);
+
+    InterlockedExchange( &registered->State, HSAC_REGISTERED_IDLE );
+
+    WdfRequestCompleteWithInformation(request, Status, NT_SUCCESS(Status) ? length : 0);
+}
+
+VOID
+HSACRegisteredRequestComplete(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFDMATRANSACTION Transaction,
+    IN NTSTATUS          Status
+    )
+/*++
+Routine Description:
+
+    A registered buffer's transfer is done (DPC or poller). If the
+    request's cancel routine has been taken, whichever of the two drops
+    the last completion owner completes it, as cancelled.
+
+--*/
+{
+    PTRANSACTION_CONTEXT    transContext = HSACGetTransactionContext(Transaction);
+
+    if (transContext->Channel == &DevExt->ReadChannel) {
+        HSAC_STAMP_READ(DevExt, HsacReadStageComplete);
+    }
+
+#ifdef ENABLE_CANCEL
+    if (WdfRequestUnmarkCancelable(transContext->Request) == STATUS_CANCELLED) {
+        if (!HSACDmaChannelDropCompletion(Transaction)) {
+            return;
+        }
+        Status = STATUS_CANCELLED;
+    }
+#endif
+
+    HSACRegisteredRequestFinish(DevExt, Transaction, Status);
+}
+
+VOID
+HSACEvtRequestCancelRegistered(
+    IN WDFREQUEST Request
+    )
+/*++
+Routine Description:
+
+    EvtRequestCancel for IOCTL_REGISTERED_READ and IOCTL_REGISTERED_WRITE,
+    which sit in the read or write queue. As for a read or write,
+    HSACDmaChannelCancel takes a chain that is only Ready off the
+    channel; one already started completes, as cancelled, when it is done.
+
+--*/
+{
+    WDFQUEUE                queue = WdfRequestGetIoQueue(Request);
+    PDEVICE_EXTENSION       devExt;
+    WDFDMATRANSACTION       dmaTransaction;
+    BOOLEAN                 queued;
+
+    devExt = HSACGetDeviceContext(WdfIoQueueGetDevice(queue));
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "HSACEvtRequestCancelRegistered called on Request 0x%p", Request);
+#endif
+
+    dmaTransaction = HSACDmaChannelCancel(devExt,
+        (queue == devExt->ReadQueue) ? &devExt->ReadChannel : &devExt->WriteChannel,
+        Request, &queued);
+    if (dmaTransaction == NULL) {
+        return;
+    }
+
+    if (!queued && !HSACDmaChannelDropCompletion(dmaTransaction)) {
+        return;
+    }
+
+    HSACRegisteredRequestFinish(devExt, dmaTransaction, STATUS_CANCELLED);
+}
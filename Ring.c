@@ -0,0 +1,490 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Ring.c
+
+Abstract:
+
+    Packet ring: a submission and a completion ring in one page shared
+    with the application (HSAC_PACKET_RING, Public.h). Packet mode
+    otherwise costs a ReadFile or WriteFile per common buffer; here one
+    IOCTL_PACKET_RING_ENTER starts every transfer posted since the last
+    one, and the DPC reports each transfer by writing its completion
+    entry, with no request to complete.
+
+    A ring transfer moves a common buffer, whose logical address is
+    known, so it is not mapped: it takes one of the ring's own packet
+    mode transactions and goes straight to HSACDmaChannelQueue. The
+    completion ring cannot overflow because an entry is only taken once
+    its completion has room.
+
+    Completion entries are written by both channels' DPCs, each at a
+    position it claims with an interlocked increment, and published by
+    writing Position last; the application reads them in order.
+
+    No request tracks a ring transfer, so the mapped ring holds the
+    device in D0 itself. When it leaves D0 anyway, the channel power-down
+    aborts the transfers and each is completed with STATUS_CANCELLED.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Ring.tmh"
+
+C_ASSERT(sizeof(HSAC_PACKET_RING) <= PAGE_SIZE);
+C_ASSERT((HSAC_RING_ENTRIES & (HSAC_RING_ENTRIES - 1)) == 0);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACRingMap)
+#pragma alloc_text (PAGE, HSACRingUnmap)
+#endif
+
+static VOID
+HSACRingRelease(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Undo as much of HSACRingMap as got done, and drop its power
+    reference. The ring is Setup and has nothing in flight.
+
+--*/
+{
+    PHSAC_RING ring = &DevExt->Ring;
+    ULONG      channel;
+    ULONG      i;
+
+    for (channel = 0; channel < 2; channel++) {
+        for (i = 0; i < HSAC_RING_TRANSACTIONS; i++) {
+            if (ring->Transactions[channel][i]) {
+                WdfObjectDelete( ring->Transactions[channel][i] );
+                ring->Transactions[channel][i] = NULL;
+            }
+        }
+        InitializeSListHead( &ring->FreeStack[channel] );
+        ring->Spare[channel] = NULL;
+    }
+
+    if (ring->UserAddress) {
+        MmUnmapLockedPages( ring->UserAddress, ring->Mdl );
+        ring->UserAddress = NULL;
+    }
+
+    if (ring->Mdl) {
+        IoFreeMdl( ring->Mdl );
+        ring->Mdl = NULL;
+    }
+
+    if (ring->CommonBuffer) {
+        WdfObjectDelete( ring->CommonBuffer );
+        ring->CommonBuffer = NULL;
+    }
+
+    ring->Shared     = NULL;
+    ring->FileObject = NULL;
+
+    WdfDeviceResumeIdle( DevExt->Device );
+
+    InterlockedExchange( &ring->State, HSAC_RING_FREE );
+}
+
+NTSTATUS
+HSACRingMap(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject,
+    OUT PVOID *          UserAddress
+    )
+/*++
+Routine Description:
+
+    IOCTL_MAP_PACKET_RING. Allocate the ring page, map it into the
+    calling process the way HSACMapUserAddress maps the common buffers,
+    and create the ring's transactions.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    PHSAC_RING              ring = &DevExt->Ring;
+    PTRANSACTION_CONTEXT    transContext;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    ULONG                   channel;
+    ULONG                   i;
+
+    PAGED_CODE();
+
+    if (FileObject == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if (InterlockedCompareExchange( &ring->State, HSAC_RING_SETUP,
+            HSAC_RING_FREE ) != HSAC_RING_FREE) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    //
+    // The request came through a power-managed queue, so the device is
+    // in D0; keep it there while the ring is mapped.
+    //
+    status = WdfDeviceStopIdle( DevExt->Device, FALSE );
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange( &ring->State, HSAC_RING_FREE );
+        return status;
+    }
+
+    ring->FileObject = FileObject;
+    ring->SqHead     = 0;
+    ring->CqReserved = 0;
+    ring->CqNext     = 0;
+    ring->InFlight   = 0;
+
+    status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+                                    ROUND_TO_PAGES(sizeof(HSAC_PACKET_RING)),
+                                    WDF_NO_OBJECT_ATTRIBUTES,
+                                    &ring->CommonBuffer );
+    if (!NT_SUCCESS(status)) {
+        ring->CommonBuffer = NULL;
+        goto Error;
+    }
+
+    ring->Shared = (PHSAC_PACKET_RING)
+        WdfCommonBufferGetAlignedVirtualAddress( ring->CommonBuffer );
+    RtlZeroMemory( ring->Shared, sizeof(HSAC_PACKET_RING) );
+
+    ring->Mdl = IoAllocateMdl( ring->Shared,
+                               ROUND_TO_PAGES(sizeof(HSAC_PACKET_RING)),
+                               FALSE,
+                               FALSE,
+                               NULL );
+    if (ring->Mdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    MmBuildMdlForNonPagedPool( ring->Mdl );
+
+    __try {
+        ring->UserAddress = MmMapLockedPagesSpecifyCache( ring->Mdl,
+                                                          UserMode,
+                                                          MmCached,
+                                                          NULL,
+                                                          FALSE,
+                                                          NormalPagePriority );
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        ring->UserAddress = NULL;
+    }
+
+    if (ring->UserAddress == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    for (channel = 0; channel < 2; channel++) {
+
+        InitializeSListHead( &ring->FreeStack[channel] );
+        ring->Spare[channel] = NULL;
+
+        for (i = 0; i < HSAC_RING_TRANSACTIONS; i++) {
+
+            WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TRANSACTION_CONTEXT);
+
+            status = WdfDmaTransactionCreate( DevExt->DmaEnabler,
+                                              &attributes,
+                                              &ring->Transactions[channel][i] );
+            if (!NT_SUCCESS(status)) {
+                ring->Transactions[channel][i] = NULL;
+                goto Error;
+            }
+
+            transContext = HSACGetTransactionContext(ring->Transactions[channel][i]);
+            RtlZeroMemory(transContext, sizeof(TRANSACTION_CONTEXT));
+
+            transContext->Transaction = ring->Transactions[channel][i];
+            transContext->Channel     = (channel == 0) ? &DevExt->WriteChannel :
+                                                         &DevExt->ReadChannel;
+            transContext->State       = HsacDmaAllocated;
+            transContext->Packet      = TRUE;
+            transContext->RingEntry   = TRUE;
+
+            InterlockedPushEntrySList( &ring->FreeStack[channel], &transContext->DoneEntry );
+        }
+    }
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "Packet ring mapped at 0x%p, %d entries",
+                ring->UserAddress, HSAC_RING_ENTRIES);
+#endif
+
+    *UserAddress = ring->UserAddress;
+
+    InterlockedExchange( &ring->State, HSAC_RING_MAPPED );
+
+    return STATUS_SUCCESS;
+
+Error:
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                "HSACRingMap failed: %!STATUS!", status);
+#endif
+    HSACRingRelease(DevExt);
+
+    return status;
+}
+
+NTSTATUS
+HSACRingUnmap(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject
+    )
+/*++
+Routine Description:
+
+    IOCTL_UNMAP_PACKET_RING, and the owner's EvtFileCleanup. Started
+    transfers cannot be called back, so wait for them to complete;
+    those the card has not finished after HSAC_DRAIN_TIMEOUT_MS are
+    taken back by aborting both channels. Completions they post are not
+    reaped. An IOCTL_PACKET_RING_ENTER of the same owner still running
+    after as long fails the unmap with STATUS_DEVICE_BUSY.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    PHSAC_RING      ring = &DevExt->Ring;
+    LARGE_INTEGER   interval;
+    LONG            state;
+    ULONG           waited;
+
+    PAGED_CODE();
+
+    interval.QuadPart = -10000;     // 1 ms
+
+    for (waited = 0; ; waited++) {
+
+        state = InterlockedCompareExchange( &ring->State, HSAC_RING_SETUP,
+            HSAC_RING_MAPPED );
+
+        if (state == HSAC_RING_MAPPED) {
+            break;
+        }
+        if (state != HSAC_RING_ENTERING || ring->FileObject != FileObject) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (waited == HSAC_DRAIN_TIMEOUT_MS) {
+            return STATUS_DEVICE_BUSY;
+        }
+
+        KeDelayExecutionThread( KernelMode, FALSE, &interval );
+    }
+
+    if (ring->FileObject != FileObject) {
+        InterlockedExchange( &ring->State, HSAC_RING_MAPPED );
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (waited = 0; ReadAcquire( &ring->InFlight ) != 0; waited++) {
+
+        if (waited == HSAC_DRAIN_TIMEOUT_MS) {
+            HSACDmaChannelAbort( DevExt, &DevExt->WriteChannel );
+            HSACDmaChannelAbort( DevExt, &DevExt->ReadChannel );
+        }
+
+        KeDelayExecutionThread( KernelMode, FALSE, &interval );
+    }
+
+    HSACRingRelease(DevExt);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+HSACRingPost(
+    IN PHSAC_RING       Ring,
+    IN ULONG            Sequence,
+    IN PHSAC_RING_SQE   Sqe,
+    IN ULONG            Bytes,
+    IN NTSTATUS         Status
+    )
+/*++
+Routine Description:
+
+    Write one completion entry. Its room was reserved when the
+    submission entry was taken.
+
+--*/
+{
+    ULONG           position = (ULONG) InterlockedIncrement( &Ring->CqNext ) - 1;
+    PHSAC_RING_CQE  cqe = &Ring->Shared->Cq[position & (HSAC_RING_ENTRIES - 1)];
+
+    cqe->Sequence  = Sequence;
+    cqe->Direction = Sqe->Direction;
+    cqe->Index     = Sqe->Index;
+    cqe->Bytes     = Bytes;
+    cqe->Status    = Status;
+
+    //
+    // The application reads Position first.
+    //
+    WriteULongRelease( &cqe->Position, position + 1 );
+}
+
+NTSTATUS
+HSACRingEnter(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject,
+    OUT PULONG           Submitted
+    )
+/*++
+Routine Description:
+
+    IOCTL_PACKET_RING_ENTER. Take submission entries in order and start
+    them, until the ring is empty, the next entry's channel has no free
+    transaction, or the completion ring has no room. An invalid entry is
+    completed at once with STATUS_INVALID_PARAMETER.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    PHSAC_RING              ring = &DevExt->Ring;
+    PTRANSACTION_CONTEXT    transContext;
+    PSLIST_ENTRY            entry;
+    HSAC_RING_SQE           sqe;
+    ULONG                   sqTail;
+    ULONG                   cqHead;
+    ULONG                   count = 0;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    if (InterlockedCompareExchange( &ring->State, HSAC_RING_ENTERING,
+            HSAC_RING_MAPPED ) != HSAC_RING_MAPPED) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (ring->FileObject != FileObject) {
+        InterlockedExchange( &ring->State, HSAC_RING_MAPPED );
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    //
+    // Read the entries only after the tail that covers them.
+    //
+    sqTail = ReadULongAcquire( &ring->Shared->SqTail );
+    cqHead = ReadULongAcquire( &ring->Shared->CqHead );
+
+    if (sqTail - ring->SqHead > HSAC_RING_ENTRIES) {
+        status = STATUS_INVALID_PARAMETER;
+        sqTail = ring->SqHead;
+    }
+
+    while (ring->SqHead != sqTail &&
+           ring->CqReserved - cqHead < HSAC_RING_ENTRIES) {
+
+        //
+        // Copy it: the application may rewrite the slot at any time.
+        //
+        sqe = ring->Shared->Sq[ring->SqHead & (HSAC_RING_ENTRIES - 1)];
+
+        if (((sqe.Index & HSAC_HEAP_HANDLE) == 0 &&
+             !NT_SUCCESS(HSACBuffersCommit(DevExt, sqe.Direction, sqe.Index, 1))) ||
+            !HSACDmaChannelPacketValid(DevExt, sqe.Direction, sqe.Index, sqe.Size)) {
+            ring->CqReserved++;
+            HSACRingPost(ring, ring->SqHead, &sqe, 0, STATUS_INVALID_PARAMETER);
+            ring->SqHead++;
+            continue;
+        }
+
+        if (ring->Spare[sqe.Direction] == NULL) {
+            ring->Spare[sqe.Direction] = InterlockedFlushSList( &ring->FreeStack[sqe.Direction] );
+            if (ring->Spare[sqe.Direction] == NULL) {
+                //
+                // It is checked again when the entry is taken.
+                //
+                HSACDmaChannelPacketDone(DevExt, sqe.Index);
+                break;
+            }
+        }
+
+        entry = ring->Spare[sqe.Direction];
+        ring->Spare[sqe.Direction] = entry->Next;
+
+        transContext = CONTAINING_RECORD(entry, TRANSACTION_CONTEXT, DoneEntry);
+        transContext->State        = HsacDmaAllocated;
+        transContext->PacketIndex  = sqe.Index;
+        transContext->PacketSize   = sqe.Size;
+        transContext->RingSequence = ring->SqHead;
+
+        ring->CqReserved++;
+        ring->SqHead++;
+        InterlockedIncrement( &ring->InFlight );
+
+        HSACDmaChannelQueue(DevExt, transContext->Transaction);
+        count++;
+    }
+
+    WriteULongRelease( &ring->Shared->SqHead, ring->SqHead );
+
+    *Submitted = count;
+
+    InterlockedExchange( &ring->State, HSAC_RING_MAPPED );
+
+    return status;
+}
+
+VOID
+HSACRingComplete(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFDMATRANSACTION Transaction,
+    IN NTSTATUS          Status
+    )
+/*++
+Routine Description:
+
+    A ring transfer is done (DPC): post its completion entry, give its
+    buffer back (HSACDmaChannelPacketDone) and put the transaction back
+    on its channel's FreeStack.
+
+--*/
+{
+    PHSAC_RING              ring = &DevExt->Ring;
+    PTRANSACTION_CONTEXT    transContext = HSACGetTransactionContext(Transaction);
+    HSAC_RING_SQE           sqe;
+
+    sqe.Direction = transContext->Channel->Index;
+    sqe.Index     = transContext->PacketIndex;
+    sqe.Size      = transContext->PacketSize;
+
+    HSACRingPost(ring, transContext->RingSequence, &sqe,
+                 NT_SUCCESS(Status) ? transContext->PacketSize : 0, Status);
+
+    HSACDmaChannelPacketDone(DevExt, sqe.Index);
+
+    transContext->State = HsacDmaFree;
+    InterlockedPushEntrySList( &ring->FreeStack[sqe.Direction], &transContext->DoneEntry );
+
+    //
+    // Last: HSACRingUnmap frees the ring once this reaches 0.
+    //
+    InterlockedDecrement( &ring->InFlight );
+}
@@ -0,0 +1,396 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Stats.c
+
+Abstract:
+
+    Driver statistics (HSAC_STATS, Public.h). The counters are kept in
+    every build, unlike the WPP traces: each channel's in its
+    HSAC_DMA_CHANNEL, the ISR's in the device extension. They are only
+    ever changed with interlocked operations, at the point the event
+    happens (Dma.c, IsrDpc.c), and take no lock to read.
+
+    While any handle has mapped it (IOCTL_MAP_STATS_PAGE), a timer
+    copies them into a page the monitoring process reads on its own
+    (HSAC_STATS_PAGE). The timer is the page's only writer and brackets
+    each copy with a sequence count, so a reader can tell a torn copy
+    and retry; nothing on the data path waits for either side.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Stats.tmh"
+
+C_ASSERT(sizeof(HSAC_STATS_PAGE) <= PAGE_SIZE);
+C_ASSERT(FIELD_OFFSET(HSAC_STATS_PAGE, Frequency) % sizeof(LONGLONG) == 0);
+C_ASSERT(sizeof(HSAC_STATS_PAGE) % sizeof(LONGLONG) == 0);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACStatsInitialize)
+#pragma alloc_text (PAGE, HSACStatsMap)
+#pragma alloc_text (PAGE, HSACStatsUnmap)
+#endif
+
+static VOID
+HSACStatsChannelSnapshot(
+    IN PHSAC_DMA_CHANNEL   Channel,
+    OUT PHSAC_CHANNEL_STATS Stats
+    )
+{
+    PHSAC_CHANNEL_STATS counters = &Channel->Stats;
+    ULONG               i;
+
+    Stats->Bytes                = ReadNoFence64(&counters->Bytes);
+    Stats->Transfers            = ReadNoFence64(&counters->Transfers);
+    Stats->Programs             = ReadNoFence64(&counters->Programs);
+    Stats->Interrupts           = ReadNoFence64(&counters->Interrupts);
+    Stats->DpcRuns              = ReadNoFence64(&counters->DpcRuns);
+    Stats->Completions          = ReadNoFence64(&counters->Completions);
+    Stats->Cancellations        = ReadNoFence64(&counters->Cancellations);
+    Stats->MaxCompletionsPerDpc = ReadNoFence(&counters->MaxCompletionsPerDpc);
+    Stats->MaxDtes              = ReadNoFence(&counters->MaxDtes);
+    Stats->InFlight             = ReadNoFence(&counters->InFlight);
+    Stats->Buffers              = ReadNoFence(&counters->Buffers);
+    Stats->LastInterruptTime    = ReadNoFence64(&counters->LastInterruptTime);
+    Stats->LastDpcTime          = ReadNoFence64(&counters->LastDpcTime);
+
+    for (i = 0; i < RTL_NUMBER_OF(Stats->ChannelStates); i++) {
+        Stats->ChannelStates[i] = ReadNoFence64(&counters->ChannelStates[i]);
+    }
+}
+
+VOID
+HSACStatsSnapshot(
+    IN PDEVICE_EXTENSION DevExt,
+    OUT PHSAC_STATS      Stats
+    )
+/*++
+Routine Description:
+
+    IOCTL_GET_STATS: copy the counters out as they stand.
+
+--*/
+{
+    Stats->Interrupts = ReadNoFence64(&DevExt->IsrCalls);
+    Stats->Spurious   = ReadNoFence64(&DevExt->IsrSpurious);
+
+    HSACStatsChannelSnapshot(&DevExt->WriteChannel, &Stats->Channel[0]);
+    HSACStatsChannelSnapshot(&DevExt->ReadChannel, &Stats->Channel[1]);
+
+    Stats->DeviceAddUs   = ReadNoFence64(&DevExt->DeviceAddUs);
+    Stats->DeviceStartUs = ReadNoFence64(&DevExt->DeviceStartUs);
+
+    Stats->HeapRegions = (LONG) ReadULongAcquire(&DevExt->HeapRegions);
+    Stats->HeapBuffers = ReadNoFence(&DevExt->HeapBuffers);
+    Stats->HeapBytes   = ReadNoFence64(&DevExt->HeapBytes);
+}
+
+LONGLONG
+HSACStatsElapsedUs(
+    IN LONGLONG Since
+    )
+/*++
+Routine Description:
+
+    Microseconds from the performance counter value Since to now.
+
+--*/
+{
+    LARGE_INTEGER   frequency;
+    LARGE_INTEGER   now = KeQueryPerformanceCounter( &frequency );
+
+    return (now.QuadPart - Since) * 1000000 / frequency.QuadPart;
+}
+
+static VOID
+HSACStatsPublish(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Copy a snapshot into the stats page. Readers copy the page while it
+    is written, so every word is stored whole, between an odd and the
+    next even Sequence. One copy at a time: if another is under way
+    this one is skipped, that one is as fresh.
+
+--*/
+{
+    PHSAC_STATS_PAGE    page = DevExt->StatsPage;
+    HSAC_STATS_PAGE     snapshot;
+    PLONGLONG           from;
+    PLONGLONG           to;
+    ULONG               sequence;
+    ULONG               i;
+
+    if (InterlockedCompareExchange( &DevExt->StatsPublishing, 1, 0 ) != 0) {
+        return;
+    }
+
+    snapshot.Published = KeQueryPerformanceCounter( (PLARGE_INTEGER) &snapshot.Frequency ).QuadPart;
+    HSACStatsSnapshot( DevExt, &snapshot.Stats );
+
+    sequence = InterlockedIncrement( (volatile LONG *) &page->Sequence );
+    KeMemoryBarrier();
+
+    from = &snapshot.Frequency;
+    to   = &page->Frequency;
+
+    for (i = 0;
+         i < (sizeof(HSAC_STATS_PAGE) - FIELD_OFFSET(HSAC_STATS_PAGE, Frequency)) /
+             sizeof(LONGLONG);
+         i++) {
+        WriteNoFence64( &to[i], from[i] );
+    }
+
+    WriteULongRelease( &page->Sequence, sequence + 1 );
+
+    InterlockedExchange( &DevExt->StatsPublishing, 0 );
+}
+
+NTSTATUS
+HSACStatsInitialize(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    Create the stats page and its timer. Called from HSACInitializeDMA;
+    the page is not mapped anywhere until IOCTL_MAP_STATS_PAGE.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    WDF_TIMER_CONFIG        timerConfig;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+
+    PAGED_CODE();
+
+    if (!DevExt->StatsTimer) {
+
+        WDF_TIMER_CONFIG_INIT(&timerConfig, HSACEvtStatsTimer);
+        timerConfig.AutomaticSerialization = FALSE;
+
+        WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+        attributes.ParentObject = DevExt->Device;
+
+        status = WdfTimerCreate( &timerConfig, &attributes, &DevExt->StatsTimer );
+        if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                        "WdfTimerCreate(stats) failed: %!STATUS!", status);
+#endif
+            DevExt->StatsTimer = NULL;
+            return status;
+        }
+    }
+
+    if (DevExt->StatsCommonBuffer) {
+        return STATUS_SUCCESS;
+    }
+
+    status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+                                    ROUND_TO_PAGES(sizeof(HSAC_STATS_PAGE)),
+                                    WDF_NO_OBJECT_ATTRIBUTES,
+                                    &DevExt->StatsCommonBuffer );
+    if (!NT_SUCCESS(status)) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_PNP,
+                    "WdfCommonBufferCreate(stats) failed: %!STATUS!", status);
+#endif
+        DevExt->StatsCommonBuffer = NULL;
+        return status;
+    }
+
+    DevExt->StatsPage = (PHSAC_STATS_PAGE)
+        WdfCommonBufferGetAlignedVirtualAddress( DevExt->StatsCommonBuffer );
+    RtlZeroMemory( DevExt->StatsPage, sizeof(HSAC_STATS_PAGE) );
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HSACStatsMap(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject,
+    OUT PVOID *          UserAddress
+    )
+/*++
+Routine Description:
+
+    IOCTL_MAP_STATS_PAGE. Map the stats page read-only into the caller
+    the way the packet ring is mapped, fill it in, and keep the timer
+    running while any handle has it.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS        status;
+    PFILE_CONTEXT   fileContext;
+
+    PAGED_CODE();
+
+    if (FileObject == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    fileContext = HSACGetFileContext(FileObject);
+
+    if (InterlockedCompareExchange( &fileContext->StatsState, HSAC_STATS_SETUP,
+            HSAC_STATS_UNMAPPED ) != HSAC_STATS_UNMAPPED) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    fileContext->StatsMdl = IoAllocateMdl( DevExt->StatsPage,
+                                           ROUND_TO_PAGES(sizeof(HSAC_STATS_PAGE)),
+                                           FALSE,
+                                           FALSE,
+                                           NULL );
+    if (fileContext->StatsMdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    MmBuildMdlForNonPagedPool( fileContext->StatsMdl );
+
+    __try {
+        fileContext->StatsUserAddress = MmMapLockedPagesSpecifyCache(
+            fileContext->StatsMdl,
+            UserMode,
+            MmCached,
+            NULL,
+            FALSE,
+            (MM_PAGE_PRIORITY) (NormalPagePriority | MdlMappingNoWrite) );
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        fileContext->StatsUserAddress = NULL;
+    }
+
+    if (fileContext->StatsUserAddress == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    //
+    // The first mapping starts the timer; until it fires the caller sees
+    // this copy rather than an empty page.
+    //
+    if (InterlockedIncrement( &DevExt->StatsMappings ) == 1) {
+        WdfTimerStart( DevExt->StatsTimer,
+                       -10000 * HSAC_STATS_PAGE_PERIOD );
+    }
+    HSACStatsPublish( DevExt );
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "Stats page mapped at 0x%p", fileContext->StatsUserAddress);
+#endif
+
+    *UserAddress = fileContext->StatsUserAddress;
+
+    InterlockedExchange( &fileContext->StatsState, HSAC_STATS_MAPPED );
+
+    return STATUS_SUCCESS;
+
+Error:
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                "HSACStatsMap failed: %!STATUS!", status);
+#endif
+    if (fileContext->StatsMdl) {
+        IoFreeMdl( fileContext->StatsMdl );
+        fileContext->StatsMdl = NULL;
+    }
+
+    InterlockedExchange( &fileContext->StatsState, HSAC_STATS_UNMAPPED );
+
+    return status;
+}
+
+NTSTATUS
+HSACStatsUnmap(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject
+    )
+/*++
+Routine Description:
+
+    IOCTL_UNMAP_STATS_PAGE, and EvtFileCleanup. The timer stops by
+    itself once no handle has the page.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    PFILE_CONTEXT   fileContext;
+
+    PAGED_CODE();
+
+    if (FileObject == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    fileContext = HSACGetFileContext(FileObject);
+
+    if (InterlockedCompareExchange( &fileContext->StatsState, HSAC_STATS_SETUP,
+            HSAC_STATS_MAPPED ) != HSAC_STATS_MAPPED) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    MmUnmapLockedPages( fileContext->StatsUserAddress, fileContext->StatsMdl );
+    IoFreeMdl( fileContext->StatsMdl );
+
+    fileContext->StatsUserAddress = NULL;
+    fileContext->StatsMdl         = NULL;
+
+    InterlockedDecrement( &DevExt->StatsMappings );
+
+    InterlockedExchange( &fileContext->StatsState, HSAC_STATS_UNMAPPED );
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+HSACEvtStatsTimer(
+    IN WDFTIMER Timer
+    )
+/*++
+Routine Description:
+
+    Refresh the stats page, and come back in HSAC_STATS_PAGE_PERIOD
+    milliseconds while anyone has it mapped.
+
+--*/
+{
+    PDEVICE_EXTENSION   devExt;
+
+    devExt = HSACGetDeviceContext(WdfTimerGetParentObject(Timer));
+
+    HSACStatsPublish( devExt );
+
+    if (ReadAcquire( &devExt->StatsMappings ) > 0) {
+        WdfTimerStart( Timer, -10000 * HSAC_STATS_PAGE_PERIOD );
+    }
+}
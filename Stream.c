@@ -0,0 +1,602 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Stream.c
+
+Abstract:
+
+    Streaming: a channel cycles through a set of common buffers on its
+    own. Each completion is reported in a page shared with the
+    application (HSAC_STREAM_PAGE, Public.h), and the DPC that reports
+    it arms the channel with the next buffer at once: for capture (read
+    channel) the next one the application has released, for playback
+    (write channel) the next one it has filled. A late application costs
+    buffers of slack rather than data. Only when every buffer is waiting
+    for the application does the channel run dry; that is counted in the
+    page as an overflow or an underrun, with when it happened.
+
+    The stream keeps up to HSAC_STREAM_TRANSACTIONS packet mode transfers
+    on the channel's Ready list, so the ISR restarts the channel back to
+    back. Everything after the start is done by the channel's DPC; while
+    the stream is stalled a timer queues the DPC every millisecond to
+    look at the application's index again.
+
+    A running stream keeps the device out of idle power-down. If the
+    device leaves D0 anyway (sleep, stop, removal) the stream halts: its
+    armed buffers are taken back from the card and it arms no more until
+    its owner stops it.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Stream.tmh"
+
+C_ASSERT(sizeof(HSAC_STREAM_PAGE) <= PAGE_SIZE);
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, HSACStreamStart)
+#pragma alloc_text (PAGE, HSACStreamStop)
+#endif
+
+static VOID
+HSACStreamRelease(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PHSAC_STREAM      Stream
+    )
+/*++
+Routine Description:
+
+    Undo as much of HSACStreamStart as got done, down to its power
+    reference. The stream is Setup and has nothing in flight.
+
+--*/
+{
+    ULONG   i;
+
+    for (i = 0; i < HSAC_STREAM_TRANSACTIONS; i++) {
+        if (Stream->Transactions[i]) {
+            WdfObjectDelete( Stream->Transactions[i] );
+            Stream->Transactions[i] = NULL;
+        }
+    }
+    Stream->IdleCount = 0;
+
+    if (Stream->UserAddress) {
+        MmUnmapLockedPages( Stream->UserAddress, Stream->Mdl );
+        Stream->UserAddress = NULL;
+    }
+
+    if (Stream->Mdl) {
+        IoFreeMdl( Stream->Mdl );
+        Stream->Mdl = NULL;
+    }
+
+    if (Stream->CommonBuffer) {
+        WdfObjectDelete( Stream->CommonBuffer );
+        Stream->CommonBuffer = NULL;
+    }
+
+    Stream->Shared     = NULL;
+    Stream->FileObject = NULL;
+
+    WdfDeviceResumeIdle( DevExt->Device );
+
+    InterlockedExchange( &Stream->State, HSAC_STREAM_FREE );
+}
+
+static VOID
+HSACStreamSetHalted(
+    IN PHSAC_STREAM Stream,
+    IN NTSTATUS     Status
+    )
+/*++
+Routine Description:
+
+    The driver has given up on a Running stream: arm nothing more and
+    tell the application why, in the page. It stays Halted until its
+    owner stops it. Caller holds InFlight.
+
+--*/
+{
+    if (InterlockedCompareExchange( &Stream->State, HSAC_STREAM_HALTED,
+            HSAC_STREAM_RUNNING ) == HSAC_STREAM_RUNNING) {
+
+        WriteRelease( &Stream->Shared->Status, Status );
+
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_WARNING, DBG_DPC,
+                    "Stream on DMA channel %d halted at buffer %d: %!STATUS!",
+                    Stream->Channel->Index, Stream->Armed, Status);
+#endif
+    }
+}
+
+NTSTATUS
+HSACStreamStart(
+    IN PDEVICE_EXTENSION  DevExt,
+    IN WDFFILEOBJECT      FileObject,
+    IN PHSAC_STREAM_START Start,
+    OUT PVOID *           UserAddress
+    )
+/*++
+Routine Description:
+
+    IOCTL_START_STREAM. Map the stream page into the caller the way the
+    packet ring is mapped, create the stream's transactions, and leave
+    arming the channel to its DPC. The device is kept in D0 until the
+    stream is stopped.
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    NTSTATUS                status;
+    PHSAC_STREAM            stream;
+    PTRANSACTION_CONTEXT    transContext;
+    WDF_OBJECT_ATTRIBUTES   attributes;
+    WDF_TIMER_CONFIG        timerConfig;
+    ULONG                   i;
+
+    PAGED_CODE();
+
+    if (FileObject == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    if (Start->Buffers == 0 || Start->Buffers > HSAC_STREAM_BUFFERS ||
+        !NT_SUCCESS(HSACBuffersCommit(DevExt, Start->Channel, 0, Start->Buffers)) ||
+        !HSACDmaChannelPacketValid(DevExt, Start->Channel,
+                                   Start->Buffers - 1, Start->BufferSize)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    stream = &DevExt->Stream[Start->Channel];
+
+    if (InterlockedCompareExchange( &stream->State, HSAC_STREAM_SETUP,
+            HSAC_STREAM_FREE ) != HSAC_STREAM_FREE) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    //
+    // The request came through a power-managed queue, so the device is
+    // in D0; do not let it idle out under the stream.
+    //
+    status = WdfDeviceStopIdle( DevExt->Device, FALSE );
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange( &stream->State, HSAC_STREAM_FREE );
+        return status;
+    }
+
+    stream->FileObject = FileObject;
+    stream->Channel    = (Start->Channel == 0) ? &DevExt->WriteChannel :
+                                                 &DevExt->ReadChannel;
+    stream->Buffers    = Start->Buffers;
+    stream->BufferSize = Start->BufferSize;
+    stream->Armed      = 0;
+    stream->Stalled    = FALSE;
+    stream->IdleCount  = 0;
+
+    //
+    // The timer outlives the stream; it only ever queues the DPC.
+    //
+    if (!stream->Timer) {
+
+        WDF_TIMER_CONFIG_INIT(&timerConfig, HSACEvtStreamTimer);
+        timerConfig.AutomaticSerialization = FALSE;
+
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, STREAM_TIMER_CONTEXT);
+        attributes.ParentObject = DevExt->Device;
+
+        status = WdfTimerCreate( &timerConfig, &attributes, &stream->Timer );
+        if (!NT_SUCCESS(status)) {
+            stream->Timer = NULL;
+            goto Error;
+        }
+
+        HSACGetStreamTimerContext(stream->Timer)->Stream = stream;
+    }
+
+    status = WdfCommonBufferCreate( DevExt->DmaEnabler,
+                                    ROUND_TO_PAGES(sizeof(HSAC_STREAM_PAGE)),
+                                    WDF_NO_OBJECT_ATTRIBUTES,
+                                    &stream->CommonBuffer );
+    if (!NT_SUCCESS(status)) {
+        stream->CommonBuffer = NULL;
+        goto Error;
+    }
+
+    stream->Shared = (PHSAC_STREAM_PAGE)
+        WdfCommonBufferGetAlignedVirtualAddress( stream->CommonBuffer );
+    RtlZeroMemory( stream->Shared, sizeof(HSAC_STREAM_PAGE) );
+
+    stream->Shared->Buffers    = stream->Buffers;
+    stream->Shared->BufferSize = stream->BufferSize;
+
+    stream->Mdl = IoAllocateMdl( stream->Shared,
+                                 ROUND_TO_PAGES(sizeof(HSAC_STREAM_PAGE)),
+                                 FALSE,
+                                 FALSE,
+                                 NULL );
+    if (stream->Mdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    MmBuildMdlForNonPagedPool( stream->Mdl );
+
+    __try {
+        stream->UserAddress = MmMapLockedPagesSpecifyCache( stream->Mdl,
+                                                            UserMode,
+                                                            MmCached,
+                                                            NULL,
+                                                            FALSE,
+                                                            NormalPagePriority );
+    } __except(EXCEPTION_EXECUTE_HANDLER) {
+        stream->UserAddress = NULL;
+    }
+
+    if (stream->UserAddress == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Error;
+    }
+
+    for (i = 0; i < HSAC_STREAM_TRANSACTIONS; i++) {
+
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, TRANSACTION_CONTEXT);
+
+        status = WdfDmaTransactionCreate( DevExt->DmaEnabler,
+                                          &attributes,
+                                          &stream->Transactions[i] );
+        if (!NT_SUCCESS(status)) {
+            stream->Transactions[i] = NULL;
+            goto Error;
+        }
+
+        transContext = HSACGetTransactionContext(stream->Transactions[i]);
+        RtlZeroMemory(transContext, sizeof(TRANSACTION_CONTEXT));
+
+        transContext->Transaction = stream->Transactions[i];
+        transContext->Channel     = stream->Channel;
+        transContext->State       = HsacDmaAllocated;
+        transContext->Packet      = TRUE;
+        transContext->Streamed    = TRUE;
+
+        stream->Idle[stream->IdleCount++] = stream->Transactions[i];
+    }
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "Stream on DMA channel %d: %d buffers of %d bytes, page at 0x%p",
+                Start->Channel, stream->Buffers, stream->BufferSize,
+                stream->UserAddress);
+#endif
+
+    *UserAddress = stream->UserAddress;
+
+    InterlockedExchange( &stream->State, HSAC_STREAM_RUNNING );
+
+    WdfInterruptAcquireLock( stream->Channel->Interrupt );
+    HSACDmaChannelQueueDpc( stream->Channel );
+    WdfInterruptReleaseLock( stream->Channel->Interrupt );
+
+    return STATUS_SUCCESS;
+
+Error:
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTLS,
+                "HSACStreamStart failed: %!STATUS!", status);
+#endif
+    HSACStreamRelease(DevExt, stream);
+
+    return status;
+}
+
+NTSTATUS
+HSACStreamStop(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFFILEOBJECT     FileObject,
+    IN ULONG             Channel
+    )
+/*++
+Routine Description:
+
+    IOCTL_STOP_STREAM, and the owner's EvtFileCleanup, for a Running or
+    Halted stream. Wait for its armed transfers, and for any DPC looking
+    at the stream, before tearing it down; transfers the card has not
+    finished after HSAC_DRAIN_TIMEOUT_MS are taken back by aborting the
+    channel. A device leaving D0 aborts them anyway (HSACStreamHalt).
+
+Return Value:
+
+     NTSTATUS
+
+--*/
+{
+    PHSAC_STREAM    stream;
+    LARGE_INTEGER   interval;
+    LONG            state;
+    ULONG           waited;
+
+    PAGED_CODE();
+
+    if (Channel > 1) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    stream = &DevExt->Stream[Channel];
+
+    state = InterlockedCompareExchange( &stream->State, HSAC_STREAM_SETUP,
+                                        HSAC_STREAM_RUNNING );
+    if (state == HSAC_STREAM_HALTED) {
+        state = InterlockedCompareExchange( &stream->State, HSAC_STREAM_SETUP,
+                                            HSAC_STREAM_HALTED );
+    }
+
+    if (state != HSAC_STREAM_RUNNING && state != HSAC_STREAM_HALTED) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (stream->FileObject != FileObject) {
+        InterlockedExchange( &stream->State, state );
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    interval.QuadPart = -10000;     // 1 ms
+
+    for (waited = 0; ReadAcquire( &stream->InFlight ) != 0; waited++) {
+
+        if (waited == HSAC_DRAIN_TIMEOUT_MS) {
+            HSACDmaChannelAbort( DevExt, stream->Channel );
+        }
+
+        KeDelayExecutionThread( KernelMode, FALSE, &interval );
+    }
+
+    WdfTimerStop( stream->Timer, TRUE );
+
+#if (DBG != 0)
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTLS,
+                "Stream on DMA channel %d stopped after %d buffers, %d overflows, %d underruns",
+                Channel, stream->Armed, stream->Shared->Overflows,
+                stream->Shared->Underruns);
+#endif
+
+    HSACStreamRelease(DevExt, stream);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+HSACStreamArm(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PHSAC_STREAM      Stream
+    )
+/*++
+Routine Description:
+
+    Hand the channel every buffer the application has released (capture)
+    or filled (playback), as far as there are idle transactions. If the
+    channel is left with nothing to do, count the overflow or underrun
+    and look again in a millisecond. Channel DPC, with InFlight held.
+
+--*/
+{
+    PHSAC_STREAM_PAGE       shared = Stream->Shared;
+    PTRANSACTION_CONTEXT    transContext;
+    WDFDMATRANSACTION       transaction;
+    BOOLEAN                 capture = (Stream->Channel->Index == 1);
+    ULONG                   available;
+    ULONG                   size;
+
+    if (ReadAcquire( &Stream->State ) != HSAC_STREAM_RUNNING) {
+        return;
+    }
+
+    if (capture) {
+        available = ReadULongAcquire( &shared->Consumer ) + Stream->Buffers - Stream->Armed;
+    } else {
+        available = ReadULongAcquire( &shared->Producer ) - Stream->Armed;
+    }
+
+    //
+    // An index the application has moved the wrong way is not followed.
+    //
+    if (available > Stream->Buffers) {
+        available = 0;
+    }
+
+    for (; Stream->IdleCount != 0 && available != 0; available--) {
+
+        transaction  = Stream->Idle[--Stream->IdleCount];
+        transContext = HSACGetTransactionContext(transaction);
+
+        transContext->StreamSequence = Stream->Armed;
+        transContext->PacketIndex    = Stream->Armed % Stream->Buffers;
+        transContext->PacketSize     = Stream->BufferSize;
+
+        //
+        // Playback sends what the application put in the buffer.
+        //
+        if (!capture) {
+            size = shared->Bytes[transContext->PacketIndex];
+            if (size != 0 && size < Stream->BufferSize) {
+                transContext->PacketSize = size;
+            }
+        }
+
+        Stream->Armed++;
+        Stream->Stalled = FALSE;
+
+        InterlockedIncrement( &Stream->InFlight );
+        HSACDmaChannelQueue( DevExt, transaction );
+    }
+
+    if (Stream->IdleCount != HSAC_STREAM_TRANSACTIONS) {
+        return;
+    }
+
+    //
+    // Playback has not begun until the first buffer is filled.
+    //
+    if (!Stream->Stalled && (capture || Stream->Armed != 0)) {
+
+        Stream->Stalled = TRUE;
+
+        //
+        // The application may be reading these as they change.
+        //
+        if (capture) {
+            WriteULongRelease( &shared->OverflowProducer, Stream->Armed );
+            WriteRelease64( &shared->OverflowTime,
+                            KeQueryPerformanceCounter(NULL).QuadPart );
+            WriteULongRelease( &shared->Overflows, shared->Overflows + 1 );
+        } else {
+            WriteULongRelease( &shared->UnderrunConsumer, Stream->Armed );
+            WriteRelease64( &shared->UnderrunTime,
+                            KeQueryPerformanceCounter(NULL).QuadPart );
+            WriteULongRelease( &shared->Underruns, shared->Underruns + 1 );
+        }
+
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_WARNING, DBG_DPC,
+                    "Stream on DMA channel %d ran dry at buffer %d",
+                    Stream->Channel->Index, Stream->Armed);
+#endif
+    }
+
+    WdfTimerStart( Stream->Timer, -10000 );     // 1 ms
+}
+
+VOID
+HSACStreamComplete(
+    IN PDEVICE_EXTENSION DevExt,
+    IN WDFDMATRANSACTION Transaction,
+    IN NTSTATUS          Status
+    )
+/*++
+Routine Description:
+
+    A stream buffer is done (DPC). Publish it, by advancing Producer for
+    capture or Consumer for playback, and re-arm the channel. The channel
+    completes in order, so the index only moves forward. A buffer the
+    driver took back from the card halts the stream.
+
+--*/
+{
+    PTRANSACTION_CONTEXT    transContext = HSACGetTransactionContext(Transaction);
+    PHSAC_STREAM            stream = &DevExt->Stream[transContext->Channel->Index];
+
+    //
+    // The application reads the index first.
+    //
+    if (stream->Channel->Index == 1) {
+        stream->Shared->Bytes[transContext->PacketIndex] =
+            NT_SUCCESS(Status) ? transContext->PacketSize : 0;
+        WriteULongRelease( &stream->Shared->Producer, transContext->StreamSequence + 1 );
+    } else {
+        WriteULongRelease( &stream->Shared->Consumer, transContext->StreamSequence + 1 );
+    }
+
+    transContext->State = HsacDmaAllocated;
+    stream->Idle[stream->IdleCount++] = Transaction;
+
+    if (!NT_SUCCESS(Status)) {
+        HSACStreamSetHalted(stream, Status);
+    }
+
+    HSACStreamArm(DevExt, stream);
+
+    InterlockedDecrement( &stream->InFlight );
+}
+
+VOID
+HSACStreamRefill(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PHSAC_DMA_CHANNEL Channel
+    )
+/*++
+Routine Description:
+
+    Called at the end of each run of the channel's DPC: arm a stream
+    that has just started, or whose application has caught up.
+
+--*/
+{
+    PHSAC_STREAM    stream = &DevExt->Stream[Channel->Index];
+
+    if (ReadAcquire( &stream->State ) != HSAC_STREAM_RUNNING) {
+        return;
+    }
+
+    //
+    // Checked again under InFlight, which HSACStreamStop waits out.
+    //
+    InterlockedIncrement( &stream->InFlight );
+    HSACStreamArm(DevExt, stream);
+    InterlockedDecrement( &stream->InFlight );
+}
+
+VOID
+HSACEvtStreamTimer(
+    IN WDFTIMER Timer
+    )
+/*++
+Routine Description:
+
+    A stalled stream: run the channel's DPC, which looks at the
+    application's index again.
+
+--*/
+{
+    PHSAC_STREAM    stream = HSACGetStreamTimerContext(Timer)->Stream;
+
+    WdfInterruptAcquireLock( stream->Channel->Interrupt );
+    HSACDmaChannelQueueDpc( stream->Channel );
+    WdfInterruptReleaseLock( stream->Channel->Interrupt );
+}
+
+VOID
+HSACStreamHalt(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+Routine Description:
+
+    D0Exit, before the channels are powered down: a stream does not
+    outlive the device leaving D0. Halt the Running ones and stop their
+    timers; HSACDmaChannelPowerDown then hands their armed transfers back
+    to the DPC, so their owners' stops do not wait on the card.
+
+--*/
+{
+    PHSAC_STREAM    stream;
+    ULONG           i;
+
+    for (i = 0; i < 2; i++) {
+
+        stream = &DevExt->Stream[i];
+
+        InterlockedIncrement( &stream->InFlight );
+        HSACStreamSetHalted(stream, STATUS_CANCELLED);
+        InterlockedDecrement( &stream->InFlight );
+
+        if (stream->Timer) {
+            WdfTimerStop( stream->Timer, TRUE );
+        }
+    }
+}
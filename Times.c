@@ -0,0 +1,164 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    Times.c
+
+Abstract:
+
+    Request times: each read and write carries the performance counter
+    of its EvtIoRead/EvtIoWrite and of the ISR that retired its transfer
+    in its TRANSACTION_CONTEXT, and leaves them with its completion time
+    in its handle's log (HSAC_REQUEST_TIME, Public.h), which the
+    application reads back with IOCTL_GET_REQUEST_TIMES.
+
+    A log entry is written like a flight recorder slot (Flight.c): its
+    Request is cleared while it is rewritten and set last, and the copy
+    keeps an entry only if Request reads the same on both sides of it.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include "precomp.h"
+
+#include "Times.tmh"
+
+C_ASSERT(sizeof(HSAC_REQUEST_TIME) == 5 * sizeof(LONGLONG));
+C_ASSERT(FIELD_OFFSET(HSAC_REQUEST_TIME, Request) == 4 * sizeof(LONGLONG));
+
+VOID
+HSACTimesStart(
+    IN PFILE_CONTEXT        FileContext,
+    IN PTRANSACTION_CONTEXT TransContext,
+    IN LONGLONG             SubmitTime
+    )
+/*++
+Routine Description:
+
+    Number a read or write on its handle and stamp its submission time.
+    Called from EvtIoRead/EvtIoWrite once the request has a transaction;
+    FileContext is NULL for a request with no handle, which is not
+    logged.
+
+--*/
+{
+    TransContext->SubmitTime    = SubmitTime;
+    TransContext->InterruptTime = 0;
+    TransContext->RequestNumber = (FileContext != NULL) ?
+        (ULONG) InterlockedIncrement( &FileContext->Requests ) : 0;
+}
+
+VOID
+HSACTimesRecord(
+    IN WDFREQUEST           Request,
+    IN PTRANSACTION_CONTEXT TransContext,
+    IN NTSTATUS             Status,
+    IN size_t               Bytes
+    )
+/*++
+Routine Description:
+
+    Log a read or write in its handle's HSAC_REQUEST_TIME entry. Called
+    from HSACReadRequestComplete/HSACWriteRequestComplete, before the
+    transaction goes back to its pool and the request is completed.
+
+--*/
+{
+    WDFFILEOBJECT       fileObject;
+    PFILE_CONTEXT       fileContext;
+    PHSAC_REQUEST_TIME  slot;
+    HSAC_REQUEST_TIME   entry;
+    PLONGLONG           words;
+
+    if (TransContext->RequestNumber == 0) {
+        return;
+    }
+
+    fileObject = WdfRequestGetFileObject( Request );
+    if (fileObject == NULL) {
+        return;
+    }
+    fileContext = HSACGetFileContext( fileObject );
+
+    slot = &fileContext->Times[(TransContext->RequestNumber - 1) % HSAC_REQUEST_TIMES];
+
+    entry.Status    = Status;
+    entry.Bytes     = (ULONG) Bytes;
+    entry.Submitted = TransContext->SubmitTime;
+    entry.Interrupt = TransContext->InterruptTime;
+    entry.Completed = KeQueryPerformanceCounter( NULL ).QuadPart;
+
+    InterlockedExchange( (volatile LONG *) &slot->Request, 0 );
+
+    words = (PLONGLONG) slot;
+    WriteNoFence64( &words[0], ((PLONGLONG) &entry)[0] );
+    WriteNoFence64( &words[1], ((PLONGLONG) &entry)[1] );
+    WriteNoFence64( &words[2], ((PLONGLONG) &entry)[2] );
+    WriteNoFence64( &words[3], ((PLONGLONG) &entry)[3] );
+    WriteNoFence( (volatile LONG *) &slot->Channel,
+                  (TransContext->Channel != NULL) ? (LONG) TransContext->Channel->Index : 0 );
+
+    WriteULongRelease( &slot->Request, TransContext->RequestNumber );
+}
+
+VOID
+HSACTimesCopy(
+    IN PFILE_CONTEXT        FileContext,
+    OUT PHSAC_REQUEST_LOG   Log
+    )
+/*++
+Routine Description:
+
+    IOCTL_GET_REQUEST_TIMES: copy out the handle's log while its
+    requests keep completing.
+
+--*/
+{
+    PHSAC_REQUEST_TIME  slot;
+    PLONGLONG           words;
+    PLONGLONG           copy;
+    LARGE_INTEGER       frequency;
+    ULONG               request;
+    ULONG               i;
+
+    KeQueryPerformanceCounter( &frequency );
+
+    Log->Reserved  = 0;
+    Log->Frequency = frequency.QuadPart;
+
+    for (i = 0; i < HSAC_REQUEST_TIMES; i++) {
+
+        slot  = &FileContext->Times[i];
+        words = (PLONGLONG) slot;
+        copy  = (PLONGLONG) &Log->Entries[i];
+
+        request = ReadULongAcquire( &slot->Request );
+
+        copy[0] = ReadNoFence64( &words[0] );
+        copy[1] = ReadNoFence64( &words[1] );
+        copy[2] = ReadNoFence64( &words[2] );
+        copy[3] = ReadNoFence64( &words[3] );
+        Log->Entries[i].Channel = (ULONG) ReadNoFence( (volatile LONG *) &slot->Channel );
+
+        KeMemoryBarrier();
+
+        Log->Entries[i].Request =
+            (ReadNoFence( (volatile LONG *) &slot->Request ) == (LONG) request) ?
+                request : 0;
+    }
+
+    //
+    // As in HSACFlightDump, Next is read last.
+    //
+    Log->Next = (ULONG) ReadNoFence( &FileContext->Requests ) + 1;
+}
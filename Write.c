@@ -25,6 +25,73 @@ Environment:
 #include "Write.tmh"
 
 
+//-----------------------------------------------------------------------------
+//
+//-----------------------------------------------------------------------------
+static VOID
+HSACPollWriteRequest(
+    IN PDEVICE_EXTENSION  DevExt,
+    IN WDFDMATRANSACTION  DmaTransaction,
+    IN PFILE_CONTEXT      FileContext,
+    IN LONGLONG           BudgetTicks
+    )
+/*++
+
+Routine Description:
+
+    Poll mode: wait for the write here and complete it the way the DPC
+    would. A transfer split into several DMA operations is followed
+    through all of them within the one budget; once the budget is spent
+    the DPC completes the request instead.
+
+Arguments:
+
+    BudgetTicks - spin budget, performance counter ticks
+
+Return Value:
+
+--*/
+{
+    PTRANSACTION_CONTEXT    transContext = HSACGetTransactionContext(DmaTransaction);
+    LONGLONG                start = KeQueryPerformanceCounter(NULL).QuadPart;
+    LONGLONG                elapsed = 0;
+    NTSTATUS                status = STATUS_SUCCESS;
+    BOOLEAN                 transactionComplete;
+
+    while (HSACDmaChannelPoll(DevExt, DmaTransaction, BudgetTicks - elapsed)) {
+
+        if (ReadNoFence(&transContext->Cancelled) || transContext->Aborted) {
+            transactionComplete = WdfDmaTransactionDmaCompletedFinal( DmaTransaction,
+                WdfDmaTransactionGetCurrentDmaTransferLength( DmaTransaction ),
+                &status );
+            if (transContext->Aborted) {
+                status = STATUS_CANCELLED;
+            }
+        } else {
+            transactionComplete = WdfDmaTransactionDmaCompleted( DmaTransaction, &status );
+        }
+
+        elapsed = KeQueryPerformanceCounter(NULL).QuadPart - start;
+
+        if (transactionComplete) {
+#if (DBG != 0)
+            TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
+                        "Completing polled Write request, status: #%x", status);
+#endif
+            HSACPollUpdate(FileContext, elapsed, TRUE);
+            HSACWriteRequestComplete( DmaTransaction, status );
+            return;
+        }
+
+        //
+        // DmaCompleted has queued the next DMA operation; the transaction
+        // is still Polled.
+        //
+    }
+
+    HSACPollUpdate(FileContext, BudgetTicks, FALSE);
+}
+
 //-----------------------------------------------------------------------------
 //
 //-----------------------------------------------------------------------------
@@ -61,7 +128,14 @@ Return Value:
 {
     NTSTATUS          status = STATUS_UNSUCCESSFUL;
     PDEVICE_EXTENSION devExt = NULL;
-
+    WDFDMATRANSACTION dmaTransaction = NULL;
+    PTRANSACTION_CONTEXT transContext;
+    WDFFILEOBJECT     fileObject;
+    PFILE_CONTEXT     fileContext = NULL;
+    LONGLONG          pollTicks = 0;
+    LONGLONG          submitTime;
+
+    submitTime = KeQueryPerformanceCounter(NULL).QuadPart;
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
                 "--> HSACEvtIoWrite: Request %p", Request);
@@ -71,6 +145,9 @@ Return Value:
     //
     devExt = HSACGetDeviceContext(WdfIoQueueGetDevice(Queue));
 
+    HSACFlightRecord(devExt, HSAC_FLIGHT_REQUEST, 0, 0, (ULONG) Length,
+                     (ULONGLONG) (ULONG_PTR) Request);
+
     //
     // Validate the Length parameter.
     //
@@ -79,41 +156,80 @@ Return Value:
         goto CleanUp;
     }
 
+    //
+    // Take a DmaTransaction from the write channel's pool.
+    //
+    dmaTransaction = HSACDmaChannelAllocate(devExt, &devExt->WriteChannel, Request);
+    if (dmaTransaction == NULL) {
+#if (DBG != 0)
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+                    "HSACDmaChannelAllocate: no free write transaction");
+#endif
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto CleanUp;
+    }
+
+    //
+    // Retreive this DmaTransaction's context ptr (aka TRANSACTION_CONTEXT)
+    // and fill it in with info.
+    //
+    transContext = HSACGetTransactionContext( dmaTransaction );
+
+    //
+    // A handle in poll mode completes its own writes (Poll.c).
+    //
+    fileObject = WdfRequestGetFileObject(Request);
+    if (fileObject != NULL) {
+        fileContext = HSACGetFileContext(fileObject);
+        pollTicks = HSACPollBudget(fileContext);
+        transContext->Polled = (pollTicks != 0);
+    }
+    HSACTimesStart(fileContext, transContext, submitTime);
+
 	if (devExt->dmaProfile == WdfDmaProfilePacket64)
 	{
 		PVOID					pInputBuffer = NULL;
 		size_t                  InputBufferlength = 0;
-		status = WdfRequestRetrieveInputBuffer(Request, 0, &pInputBuffer, &InputBufferlength);
-//		if( !NT_SUCCESS(status)) {
-//#if (DBG != 0)
-//			TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
-//				"WdfRequestRetrieveOutputBuffer failed 0x%x\n", status);
-//#endif
-//		}
+		//
+		// The header is {size, index}, or only the size in
+		// HSAC_CACHE_NONE, which has one buffer.
+		//
+		status = WdfRequestRetrieveInputBuffer(Request,
+			(devExt->CacheMode == HSAC_CACHE_NONE) ? sizeof(ULONG) : 2 * sizeof(ULONG),
+			&pInputBuffer, &InputBufferlength);
+		if( !NT_SUCCESS(status)) {
+#if (DBG != 0)
+			TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
+				"WdfRequestRetrieveInputBuffer failed 0x%x\n", status);
+#endif
+			goto CleanUp;
+		}
 		//RtlCopyMemory(devExt->WriteCommonBufferBase, pInputBuffer, InputBufferlength);
-		devExt->WriteSize = *(PULONG)pInputBuffer;
+		transContext->PacketSize = *(PULONG)pInputBuffer;
 
-#if (CACHE_MODE != CACHE_NONE_MODE)
-		devExt->WriteBufIndex = *((PULONG)pInputBuffer + 1);
+		if (devExt->CacheMode != HSAC_CACHE_NONE) {
+			transContext->PacketIndex = *((PULONG)pInputBuffer + 1);
 #if (DBG != 0)
 			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
-			"--> devExt->WriteBufIndex: %d, devExt->WriteSize: %d", devExt->WriteBufIndex, devExt->WriteSize);
+				"--> WriteBufIndex: %d, WriteSize: %d", transContext->PacketIndex, transContext->PacketSize);
 #endif
-
-#else
+		} else {
+			transContext->PacketIndex = 0;
 #if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
-			"--> HSACEvtIoWrite: WriteSize %d", devExt->WriteSize);
-#endif
-
+			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
+				"--> HSACEvtIoWrite: WriteSize %d", transContext->PacketSize);
 #endif
-
+		}
+		if (!HSACDmaChannelPacketValid(devExt, 0,
+				transContext->PacketIndex, transContext->PacketSize)) {
+			status = STATUS_INVALID_PARAMETER;
+			goto CleanUp;
+		}
+		//
+		// Only now, so that HSACDmaChannelFree gives the buffer back.
+		//
+		transContext->Packet     = TRUE;
 	}
-
-#ifdef ENABLE_CANCEL
-	// Mark the request is cancelable
-	WdfRequestMarkCancelable(Request, HSACEvtRequestCancelWrite);
-#endif
     //
     // Following code illustrates two different ways of initializing a DMA
     // transaction object. If ASSOC_WRITE_REQUEST_WITH_DMA_TRANSACTION is
@@ -128,7 +244,7 @@ Return Value:
     // for handling client Requests.
     //
     status = WdfDmaTransactionInitializeUsingRequest(
-                                           devExt->WriteDmaTransaction,
+                                           dmaTransaction,
                                            Request,
                                            HSACEvtProgramWriteDma,
                                            WdfDmaDirectionWriteToDevice );
@@ -159,7 +275,6 @@ Return Value:
     //       WdfDmaTransactionInitialize directly.
     //
     {
-        PTRANSACTION_CONTEXT  transContext;
         PMDL                  mdl;
         PVOID                 virtualAddress;
         ULONG                 length;
@@ -179,7 +294,7 @@ Return Value:
         virtualAddress = MmGetMdlVirtualAddress(mdl);
         length = MmGetMdlByteCount(mdl);
 
-        status = WdfDmaTransactionInitialize( devExt->WriteDmaTransaction,
+        status = WdfDmaTransactionInitialize( dmaTransaction,
                                               HSACEvtProgramWriteDma,
                                               WdfDmaDirectionWriteToDevice,
                                               mdl,
@@ -193,13 +308,6 @@ Return Value:
 #endif
               goto CleanUp;
         }
-
-        //
-        // Retreive this DmaTransaction's context ptr (aka TRANSACTION_CONTEXT)
-        // and fill it in with info.
-        //
-        transContext = HSACGetTransactionContext( devExt->WriteDmaTransaction );
-        transContext->Request = Request;
     }
 #endif
 
@@ -216,42 +324,68 @@ Return Value:
             //TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
             //            "Setting a new MaxLen %d", length);
 
-            WdfDmaTransactionSetMaximumLength( devExt->WriteDmaTransaction, length );
+            WdfDmaTransactionSetMaximumLength( dmaTransaction, length );
         }
 #endif
 
+#ifdef ENABLE_CANCEL
+	//
+	// Mark the request is cancelable. If it has already been
+	// cancelled, fail it here.
+	//
+	status = WdfRequestMarkCancelableEx(Request, HSACEvtRequestCancelWrite);
+	if (!NT_SUCCESS(status)) {
+		goto CleanUp;
+	}
+#endif
+
     //
     // Execute this DmaTransaction transaction.
     //
 		
-    status = WdfDmaTransactionExecute( devExt->WriteDmaTransaction, 
+    status = WdfDmaTransactionExecute( dmaTransaction, 
                                        WDF_NO_CONTEXT);
 
     if(!NT_SUCCESS(status)) {
 
         //
-        // Couldn't execute this DmaTransaction, so fail Request.
+        // Couldn't execute this DmaTransaction, so fail Request,
+        // unless a cancel routine taken meanwhile is left to do it.
         //
 #if (DBG != 0)
         TraceEvents(TRACE_LEVEL_ERROR, DBG_WRITE,
                     "WdfDmaTransactionExecute failed: %!STATUS!", status);
+#endif
+#ifdef ENABLE_CANCEL
+		if (WdfRequestUnmarkCancelable(Request) == STATUS_CANCELLED &&
+			!HSACDmaChannelDropCompletion(dmaTransaction)) {
+			return;
+		}
 #endif
         goto CleanUp;
     }
 
     //
     // Indicate that Dma transaction has been started successfully. The request
-    // will be complete by the Dpc routine when the DMA transaction completes.
+    // will be complete by the Dpc routine when the DMA transaction completes,
+    // or right here in poll mode.
     //
     status = STATUS_SUCCESS;
 
+    if (pollTicks) {
+        HSACPollWriteRequest(devExt, dmaTransaction, fileContext, pollTicks);
+    }
+
 CleanUp:
 
     //
     // If there are errors, then clean up and complete the Request.
     //
     if (!NT_SUCCESS(status)) {
-        WdfDmaTransactionRelease(devExt->WriteDmaTransaction);        
+        if (dmaTransaction != NULL) {
+            WdfDmaTransactionRelease(dmaTransaction);        
+            HSACDmaChannelFree(devExt, dmaTransaction);
+        }
         WdfRequestComplete(Request, status);
     }
 #if (DBG != 0)
@@ -284,19 +418,9 @@ Return Value:
 --*/
 {
     PDEVICE_EXTENSION        devExt;
+    PTRANSACTION_CONTEXT     transContext;
     size_t                   offset;
-    PDMA_TRANSFER_ELEMENT    dteVA;
- //   ULONG_PTR                dteLALow;
-	//ULONG_PTR                dteLAHigh;
-	ULONG                dteLALow;
-	LONG                 dteLAHigh;
     BOOLEAN                  errors;
-    ULONG                    i;
-
-	ULONG transferSize;
-	ULONG dma0Ctl;
-	// ԷŵУͲforѭм
-	ULONG sgTransferSize = 0;
 
     UNREFERENCED_PARAMETER( Context );
     UNREFERENCED_PARAMETER( Direction );
@@ -308,37 +432,16 @@ Return Value:
     // Initialize locals
     //
     devExt = HSACGetDeviceContext(Device);
+    transContext = HSACGetTransactionContext(Transaction);
     errors = FALSE;
 
-	if (devExt->dmaProfile == WdfDmaProfilePacket64)
+	if (transContext->Packet)
 	{
-		WdfInterruptAcquireLock( devExt->Interrupt );
-
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR32,
-			devExt->pWriteCommonBufferBaseLA[devExt->WriteBufIndex].LowPart);
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR64,
-			devExt->pWriteCommonBufferBaseLA[devExt->WriteBufIndex].HighPart );
-#else
-#if (CACHE_MODE == PING_PANG)
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR32,
-			devExt->WriteCommonBufferBaseLA.LowPart + devExt->WriteBufIndex * devExt->MaximumTransferLength );
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR64,
-			devExt->WriteCommonBufferBaseLA.HighPart );
-#else if (CACHE_MODE == CACHE_NONE_MODE)
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR32,
-			devExt->WriteCommonBufferBaseLA.LowPart );
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR64,
-			devExt->WriteCommonBufferBaseLA.HighPart );
-#endif
-#endif
-
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_SIZE, devExt->WriteSize);
-
-		dma0Ctl = DMA_CTRL_START;
-		WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL, dma0Ctl);
-
-		WdfInterruptReleaseLock( devExt->Interrupt );
+		//
+		// The channel is programmed from the common buffer the request
+		// named when its turn comes.
+		//
+		HSACDmaChannelQueue(devExt, Transaction);
 
 		return TRUE;
 	}
@@ -351,142 +454,33 @@ Return Value:
 //	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
 //		"offset (%d)\n", offset);
 //#endif
-    //
-    // Setup the pointer to the next DMA_TRANSFER_ELEMENT
-    // for both virtual and physical address references.
-    //
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-	dteVA = (PDMA_TRANSFER_ELEMENT) devExt->pWriteCommonBufferBase[0];
-	dteLALow = (devExt->pWriteCommonBufferBaseLA[0].LowPart +
-		sizeof(DMA_TRANSFER_ELEMENT));
-	dteLAHigh = devExt->pWriteCommonBufferBaseLA[0].HighPart;
-#else
-    dteVA = (PDMA_TRANSFER_ELEMENT) devExt->WriteCommonBufferBase;
-    dteLALow = (devExt->WriteCommonBufferBaseLA.LowPart +
-                        sizeof(DMA_TRANSFER_ELEMENT));
-	dteLAHigh = devExt->WriteCommonBufferBaseLA.HighPart;
-#endif
     //
     // Translate the System's SCATTER_GATHER_LIST elements
-    // into the device's DMA_TRANSFER_ELEMENT elements.
-    //
-    for (i=0; i < SgList->NumberOfElements; i++) {
-
-        //
-        // Construct this DTE.
-        //
-		dteVA->PageAddressLow  = SgList->Elements[i].Address.LowPart;
-		dteVA->PageAddressHigh = SgList->Elements[i].Address.HighPart;
-		dteVA->TransferSize    = SgList->Elements[i].Length;
-
-		dteVA->DescPtrLow.LastElement   = FALSE;
-		dteVA->DescPtrLow.LowAddress    = DESC_PTR_ADDR( dteLALow );
-		dteVA->DescPtrHigh.HighAddress  = dteLAHigh;//0;
-		//
-		// If at end of SgList, then set LastElement bit in final NTE.
-		//
-
-		sgTransferSize += dteVA->TransferSize;
-
-		if (i == SgList->NumberOfElements - 1) {
-
-			dteVA->DescPtrLow.LastElement = TRUE;
-
-#if (DBG != 0)
-			TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
-				"\tDTE[%d] : Addr #%X%08X, Len %8d,LA #%X%08X, Last(%d)\n",
-				i,
-				dteVA->PageAddressHigh,
-				dteVA->PageAddressLow,
-				dteVA->TransferSize,
-				dteLAHigh,
-				dteLALow,
-				dteVA->DescPtrLow.LastElement );
-#endif
-            break;
-        }
-
-#if (DBG != 0)
-		TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
-			"\tDTE[%d] : Addr #%X%08X, Len %8d,LA #%X%08X, Last(%d)\n",
-			i,
-			dteVA->PageAddressHigh,
-			dteVA->PageAddressLow,
-			dteVA->TransferSize,
-			dteLAHigh,
-			dteLALow,
-			dteVA->DescPtrLow.LastElement );
-#endif
-
-        //
-        // Adjust the next DMA_TRANSFER_ELEMEMT
-        //
-        dteVA++;
-        dteLALow += sizeof(DMA_TRANSFER_ELEMENT);
-    }
-
-    //
-    // Start the DMA operation.
-    // Acquire this device's InterruptSpinLock.
-    //
-    WdfInterruptAcquireLock( devExt->Interrupt );
-
-    //
-    // DMA 0 Descriptor Pointer Register - (DMADPR0)
-    // Write the base LOGICAL address of the DMA_TRANSFER_ELEMENT list.
+    // into the device's DMA_TRANSFER_ELEMENT elements,
+    // in this transaction's DTE slot.
     //
-#if (CACHE_MODE == MULTI_DISCRETE_CACHE)
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR32,
-		/*DESC_PTR_ADDR( devExt->WriteCommonBufferBaseLA.LowPart )*/
-		devExt->pWriteCommonBufferBaseLA[0].LowPart );
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR64,
-		devExt->pWriteCommonBufferBaseLA[0].HighPart );
-
-	transferSize = SgList->NumberOfElements * sizeof(DMA_TRANSFER_ELEMENT);
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_SIZE, sgTransferSize/*transferSize*/);
+	if (!HSACDmaChannelBuildChain(transContext, SgList)) {
+		errors = TRUE;
+	}
 
 #if (DBG != 0)
 	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
-		"WriteCommonBufferBaseLA: #%X%08X Len %8d\n",
-		devExt->pWriteCommonBufferBaseLA[0].HighPart,
-		devExt->pWriteCommonBufferBaseLA[0].LowPart,
-		transferSize);
-#endif
-
-#else
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR32,
-                              /*DESC_PTR_ADDR( devExt->WriteCommonBufferBaseLA.LowPart )*/
-							  devExt->WriteCommonBufferBaseLA.LowPart );
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_ADDR64,
-							  devExt->WriteCommonBufferBaseLA.HighPart );
-
-	transferSize = SgList->NumberOfElements * sizeof(DMA_TRANSFER_ELEMENT);
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_SIZE, sgTransferSize/*transferSize*/);
-
-#if (DBG != 0)
+		"Write DTE slot: #%X%08X, %d SG elements in %d DTEs\n",
+		transContext->DteLA.HighPart,
+		transContext->DteLA.LowPart,
+		SgList->NumberOfElements,
+		transContext->DteCount);
 	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
-		"WriteCommonBufferBaseLA: #%X%08X Len %8d\n",
-		devExt->WriteCommonBufferBaseLA.HighPart,
-		devExt->WriteCommonBufferBaseLA.LowPart,
-		transferSize);
+		"    HSACEvtProgramWriteDma: Queue a Write DMA operation, total size: %d", transContext->TransferSize);
 #endif
-#endif
-
-#if (DBG != 0)
-    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
-                "    HSACEvtProgramWriteDma: Start a Write DMA operation total size: %d", sgTransferSize);
-#endif
-    //
-    // DMA 0 CSR Register - (DMACSR0)
-    // Start the DMA operation: Set Start bits. Enable Scatter/Gather Mode
-    //
-	dma0Ctl = DMA_CTRL_START | DMA_CTRL_SG_ENA;
-	WRITE_REGISTER_ULONG( (PULONG) &devExt->Regs->DMA0_CTRL, dma0Ctl);
-
-    //
-    // Release our interrupt spinlock
-    //
-    WdfInterruptReleaseLock( devExt->Interrupt );
+	//
+	// Hand the chain to the write channel. It is started now if DMA0 is
+	// idle; otherwise it is linked with the other waiting chains and
+	// started from the ISR when the running chain completes.
+	//
+	if (!errors) {
+		HSACDmaChannelQueue(devExt, Transaction);
+	}
 
     //
     // NOTE: This shows how to process errors which occur in the
@@ -550,13 +544,13 @@ Return Value:
 #else
     //
     // If CreateDirect was used then there will be no assoc. Request.
+    // The transaction keeps it until freed: a cancel routine still to
+    // run looks it up by request.
     //
     {
         PTRANSACTION_CONTEXT transContext = HSACGetTransactionContext(DmaTransaction);
 
         request = transContext->Request;
-        transContext->Request = NULL;
-        
     }
 #if (DBG != 0)
 	TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE,
@@ -574,23 +568,34 @@ Return Value:
 	// after a request completes, so check here to see
 	// if EchoEvtRequestCancel cleared our saved
 	// request handle. 
-	Status = WdfRequestUnmarkCancelable(request);
-	if (Status == STATUS_CANCELLED)
+	//
+	// If it did, the cancel routine has run or will run; whichever of
+	// us drops the last completion owner completes the request.
+	//
+	if (WdfRequestUnmarkCancelable(request) == STATUS_CANCELLED)
 	{
-		return;
+		if (!HSACDmaChannelDropCompletion(DmaTransaction)) {
+			return;
+		}
+		Status = STATUS_CANCELLED;
 	}
 #endif
     //
     // Get the final bytes transferred count.
     //
-    bytesTransferred =  WdfDmaTransactionGetBytesTransferred( DmaTransaction );
+    bytesTransferred = (Status == STATUS_CANCELLED) ? 0 :
+        WdfDmaTransactionGetBytesTransferred( DmaTransaction );
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
                 "HSACWriteRequestComplete:  Request %p, Status %!STATUS!, "
                 "bytes transferred %d\n",
                  request, Status, (int) bytesTransferred );
 #endif
+    HSACTimesRecord( request, HSACGetTransactionContext(DmaTransaction),
+                     Status, bytesTransferred );
+
     WdfDmaTransactionRelease(DmaTransaction);        
+    HSACDmaChannelFree(devExt, DmaTransaction);
 
 	WdfRequestCompleteWithInformation( request, Status, bytesTransferred);
 
@@ -606,9 +611,9 @@ Routine Description:
 
 
     Called when an I/O request is cancelled after the driver has marked
-    the request cancellable. This callback is automatically synchronized
-    with the I/O callbacks since we have chosen to use frameworks Device
-    level locking.
+    the request cancellable. This callback is not synchronized with the
+    I/O callbacks or the DPC; HSACDmaChannelCancel and the transaction's
+    completion owners decide who completes the request.
 
 Arguments:
 
@@ -623,23 +628,41 @@ Return Value:
 	NTSTATUS            status = STATUS_SUCCESS;
 	WDFDEVICE			device;
 	PDEVICE_EXTENSION   devExt;
+	WDFDMATRANSACTION   dmaTransaction;
+	BOOLEAN             queued;
     //PQUEUE_CONTEXT queueContext = QueueGetContext(WdfRequestGetIoQueue(Request));
 	device = WdfIoQueueGetDevice(WdfRequestGetIoQueue(Request));
 	devExt  = HSACGetDeviceContext(device);
 
-	WdfDmaTransactionDmaCompleted( devExt->WriteDmaTransaction, &status );
-
-	WdfDmaTransactionRelease(devExt->WriteDmaTransaction);  
-
 #if (DBG != 0)
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_WRITE, "HSACEvtRequestCancelWrite called on Request 0x%p\n",  Request);
 #endif
+
+	//
+	// A transfer the channel is already running cannot be taken back;
+	// unless HSACWriteRequestComplete has already given up the request,
+	// it completes it as cancelled once it is done.
+	//
+	dmaTransaction = HSACDmaChannelCancel(devExt, &devExt->WriteChannel, Request, &queued);
+	if (dmaTransaction == NULL) {
+		return;
+	}
+
+	if (queued) {
+		(VOID) WdfDmaTransactionDmaCompletedFinal( dmaTransaction, 0, &status );
+	} else if (!HSACDmaChannelDropCompletion(dmaTransaction)) {
+		return;
+	}
+
+	WdfDmaTransactionRelease(dmaTransaction);  
+	HSACDmaChannelFree(devExt, dmaTransaction);
     //
     // The following is race free by the callside or DPC side
     // synchronizing completion by calling
     // WdfRequestMarkCancelable(Queue, Request, FALSE) before
     // completion and not calling WdfRequestComplete if the
-    // return status == STATUS_CANCELLED.
+    // return status == STATUS_CANCELLED: the two then share the
+    // transaction's completion owners.
     //
     WdfRequestCompleteWithInformation(Request, STATUS_CANCELLED, 0L);
 
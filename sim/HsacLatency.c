@@ -0,0 +1,427 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    HsacLatency.c
+
+Abstract:
+
+    Per-stage latency of a single read request. One read is outstanding
+    at a time; for each one the driver's HSAC_STAMP_READ timestamps
+    (see Private.h) are collected at completion and turned into the time
+    spent in each stage. The driver's own per-request record is read back
+    after each one and checked against it:
+
+        queue       submit                  -> HSACEvtIoRead
+        ioread      HSACEvtIoRead           -> WdfDmaTransactionExecute
+        program     WdfDmaTransactionExecute-> DMA1_CTRL start written
+        device      DMA1_CTRL start         -> ISR recognition
+        dpc         ISR recognition         -> DPC dispatch
+        dpcwork     DPC dispatch            -> HSACReadRequestComplete
+        complete    HSACReadRequestComplete -> request completed
+        total       submit                  -> request completed
+        reported    HSACEvtIoRead           -> ISR, from the driver's
+                                               IOCTL_GET_REQUEST_TIMES entry
+
+    p50/p99/p99.9 are printed for each stage and each transfer size from
+    4KB to HSAC_MAXIMUM_TRANSFER_LENGTH.
+
+        hsaclat [-n reads-per-size] [-s size] [-p] [-P mode:us]
+
+    -s limits the run to one size, -p uses packet mode (common buffer 0)
+    instead of scatter/gather. -P sets the handle's IOCTL_SET_POLL_MODE
+    (1 - always poll, 2 - adaptive) with a spin budget in microseconds;
+    polled reads are retired by the issuing thread, so "device" ends when
+    the poll sees INT_STATE and "dpc" is the time to take the request
+    back. The number of reads completed by the poll is printed per size.
+
+Environment:
+
+    User mode (Linux, pthreads)
+
+--*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "precomp.h"
+#include "HsacSim.h"
+
+#define HSAC_LAT_MIN_SIZE       (4 * 1024)
+
+enum {
+    HsacLatQueue = 0,
+    HsacLatIoRead,
+    HsacLatProgram,
+    HsacLatDevice,
+    HsacLatDpc,
+    HsacLatDpcWork,
+    HsacLatComplete,
+    HsacLatTotal,
+    HsacLatReported,
+    HsacLatMax
+};
+
+static const char * HsacLatNames[HsacLatMax] = {
+    "queue", "ioread", "program", "device", "dpc", "dpcwork", "complete", "total",
+    "reported"
+};
+
+typedef struct _HSAC_LAT_WAIT {
+
+    pthread_mutex_t     Lock;
+    pthread_cond_t      Cond;
+    BOOLEAN             Done;
+    NTSTATUS            Status;
+    LONGLONG            Completed;
+    LONGLONG            Stamps[HsacReadStageMax];
+    PDEVICE_EXTENSION   DevExt;
+
+} HSAC_LAT_WAIT, * PHSAC_LAT_WAIT;
+
+static LONGLONG
+HsacLatNow(
+    VOID
+    )
+{
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+static VOID
+HsacLatCompletion(
+    PVOID Context,
+    WDFREQUEST Request,
+    NTSTATUS Status,
+    ULONG_PTR Information
+    )
+/*++
+
+Routine Description:
+
+    Runs inside the driver's WdfRequestComplete, so the read stamps in the
+    device extension still belong to this request.
+
+--*/
+{
+    PHSAC_LAT_WAIT  wait = (PHSAC_LAT_WAIT) Context;
+    LONGLONG        now = HsacLatNow();
+
+    UNREFERENCED_PARAMETER(Request);
+    UNREFERENCED_PARAMETER(Information);
+
+    pthread_mutex_lock(&wait->Lock);
+    memcpy(wait->Stamps, wait->DevExt->ReadStamps, sizeof(wait->Stamps));
+    wait->Completed = now;
+    wait->Status    = Status;
+    wait->Done      = TRUE;
+    pthread_cond_signal(&wait->Cond);
+    pthread_mutex_unlock(&wait->Lock);
+}
+
+static int
+HsacLatCompare(
+    const void * A,
+    const void * B
+    )
+{
+    LONGLONG a = *(const LONGLONG *) A;
+    LONGLONG b = *(const LONGLONG *) B;
+
+    return (a > b) - (a < b);
+}
+
+static double
+HsacLatPercentile(
+    const LONGLONG * Sorted,
+    ULONG Count,
+    double Fraction
+    )
+{
+    ULONG index = (ULONG) (Fraction * Count + 0.999999);
+
+    if (index == 0) {
+        index = 1;
+    }
+    if (index > Count) {
+        index = Count;
+    }
+
+    return Sorted[index - 1] / 1000.0;
+}
+
+static NTSTATUS
+HsacLatRunSize(
+    WDFDEVICE Device,
+    WDFFILEOBJECT File,
+    ULONG Size,
+    ULONG Count,
+    BOOLEAN Packet
+    )
+{
+    PDEVICE_EXTENSION   devExt = HSACGetDeviceContext(Device);
+    HSAC_LAT_WAIT       wait;
+    PHSAC_REQUEST_LOG   log;
+    PHSAC_REQUEST_TIME  entry;
+    LONGLONG          * samples[HsacLatMax];
+    PUCHAR              buffer;
+    ULONG               length;
+    PFILE_CONTEXT       fileContext = HSACGetFileContext(File);
+    ULONG               pollHits = fileContext->PollHits;
+    NTSTATUS            status = STATUS_SUCCESS;
+    ULONG               i, s;
+
+    length = Packet ? 2 * sizeof(ULONG) : Size;
+    buffer = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(length));
+    log    = (PHSAC_REQUEST_LOG) malloc(sizeof(HSAC_REQUEST_LOG));
+
+    for (s = 0; s < HsacLatMax; s++) {
+        samples[s] = (LONGLONG *) calloc(Count, sizeof(LONGLONG));
+        if (!samples[s]) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if (!buffer || !log || !NT_SUCCESS(status)) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    memset(&wait, 0, sizeof(wait));
+    pthread_mutex_init(&wait.Lock, NULL);
+    pthread_cond_init(&wait.Cond, NULL);
+    wait.DevExt = devExt;
+
+    for (i = 0; i < Count; i++) {
+
+        LONGLONG submitted;
+
+        if (Packet) {
+            ((PULONG) buffer)[0] = Size;
+            ((PULONG) buffer)[1] = 0;
+        }
+
+        wait.Done = FALSE;
+        submitted = HsacLatNow();
+
+        status = WdfShimSubmitFileRequest(File, WdfRequestTypeRead, 0,
+                                          NULL, 0, buffer, length,
+                                          HsacLatCompletion, &wait, NULL);
+        if (status == STATUS_INSUFFICIENT_RESOURCES ||
+            status == STATUS_INVALID_PARAMETER) {
+            //
+            // Never reached the device; the completion routine is not called.
+            //
+            break;
+        }
+
+        pthread_mutex_lock(&wait.Lock);
+        while (!wait.Done) {
+            pthread_cond_wait(&wait.Cond, &wait.Lock);
+        }
+        pthread_mutex_unlock(&wait.Lock);
+
+        if (!NT_SUCCESS(wait.Status)) {
+            fprintf(stderr, "read of %u bytes failed 0x%08x\n", Size, wait.Status);
+            status = wait.Status;
+            break;
+        }
+
+        samples[HsacLatQueue][i]    = wait.Stamps[HsacReadStageIoRead] - submitted;
+        samples[HsacLatIoRead][i]   = wait.Stamps[HsacReadStageExecute] - wait.Stamps[HsacReadStageIoRead];
+        samples[HsacLatProgram][i]  = wait.Stamps[HsacReadStageProgrammed] - wait.Stamps[HsacReadStageExecute];
+        samples[HsacLatDevice][i]   = wait.Stamps[HsacReadStageIsr] - wait.Stamps[HsacReadStageProgrammed];
+        samples[HsacLatDpc][i]      = wait.Stamps[HsacReadStageDpc] - wait.Stamps[HsacReadStageIsr];
+        samples[HsacLatDpcWork][i]  = wait.Stamps[HsacReadStageComplete] - wait.Stamps[HsacReadStageDpc];
+        samples[HsacLatComplete][i] = wait.Completed - wait.Stamps[HsacReadStageComplete];
+        samples[HsacLatTotal][i]    = wait.Completed - submitted;
+
+        //
+        // The read just completed is the handle's last numbered request.
+        //
+        status = WdfShimSubmitFileRequestSynchronously(File, WdfRequestTypeDeviceControl,
+                                                       IOCTL_GET_REQUEST_TIMES,
+                                                       NULL, 0, log, sizeof(*log), NULL);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "IOCTL_GET_REQUEST_TIMES failed 0x%08x\n", status);
+            break;
+        }
+
+        entry = &log->Entries[(log->Next - 2) % HSAC_REQUEST_TIMES];
+        if (entry->Request != log->Next - 1 || entry->Channel != 1 ||
+            entry->Bytes != length || !NT_SUCCESS(entry->Status) ||
+            entry->Submitted < submitted ||
+            entry->Interrupt < entry->Submitted ||
+            entry->Completed < entry->Interrupt ||
+            entry->Completed > wait.Completed) {
+            fprintf(stderr, "read %u: bad request times entry\n", log->Next - 1);
+            status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+
+        samples[HsacLatReported][i] = entry->Interrupt - entry->Submitted;
+        status = STATUS_SUCCESS;
+
+    }
+
+    pthread_cond_destroy(&wait.Cond);
+    pthread_mutex_destroy(&wait.Lock);
+
+    if (NT_SUCCESS(status)) {
+
+        printf("%8u", Size);
+
+        for (s = 0; s < HsacLatMax; s++) {
+            qsort(samples[s], Count, sizeof(LONGLONG), HsacLatCompare);
+            printf("  %8.1f %8.1f %8.1f",
+                   HsacLatPercentile(samples[s], Count, 0.50),
+                   HsacLatPercentile(samples[s], Count, 0.99),
+                   HsacLatPercentile(samples[s], Count, 0.999));
+        }
+
+        printf("  %8u\n", fileContext->PollHits - pollHits);
+    }
+
+Exit:
+    for (s = 0; s < HsacLatMax; s++) {
+        free(samples[s]);
+    }
+    free(buffer);
+    free(log);
+
+    return status;
+}
+
+int
+main(
+    int argc,
+    char * argv[]
+    )
+{
+    HSAC_SIM_CONFIG     config;
+    PHSAC_SIM           sim;
+    WDFDEVICE           device = NULL;
+    WDFFILEOBJECT       file = NULL;
+    HSAC_POLL_MODE      pollMode;
+    NTSTATUS            status;
+    ULONG               count = 1000;
+    ULONG               onlySize = 0;
+    BOOLEAN             packet = FALSE;
+    ULONG               size;
+    ULONG               profile;
+    int                 i;
+
+    pollMode.Mode     = HSAC_POLL_OFF;
+    pollMode.BudgetUs = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            onlySize = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            packet = TRUE;
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%u:%u", &pollMode.Mode, &pollMode.BudgetUs) == 2) {
+            i++;
+        } else {
+            fprintf(stderr, "usage: %s [-n reads-per-size] [-s size] [-p] [-P mode:us]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    if (count == 0 ||
+        (onlySize && ((onlySize & 7) || onlySize > HSAC_MAXIMUM_TRANSFER_LENGTH))) {
+        fprintf(stderr, "invalid count or size\n");
+        return 2;
+    }
+
+    HsacSimConfigInit(&config);
+    sim = HsacSimCreate(&config);
+    if (!sim) {
+        fprintf(stderr, "HsacSimCreate failed\n");
+        return 1;
+    }
+
+    WdfShimBindSimulator(sim, 0);
+
+    status = WdfShimDriverLoad(DriverEntry);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "DriverEntry failed 0x%08x\n", status);
+        HsacSimDestroy(sim);
+        return 1;
+    }
+
+    status = WdfShimDeviceAdd(&device);
+    if (NT_SUCCESS(status)) {
+        status = WdfShimDeviceStart(device);
+    }
+
+    if (NT_SUCCESS(status)) {
+        status = WdfShimFileOpen(device, &file);
+    }
+
+    if (NT_SUCCESS(status) && pollMode.Mode != HSAC_POLL_OFF) {
+        status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                       IOCTL_SET_POLL_MODE,
+                                                       &pollMode, sizeof(pollMode),
+                                                       NULL, 0, NULL);
+    }
+
+    if (NT_SUCCESS(status) && packet) {
+        profile = WdfDmaProfilePacket64;
+        status = WdfShimSubmitRequestSynchronously(device, WdfRequestTypeDeviceControl,
+                                                   IOCTL_SET_DMA_PROFILE,
+                                                   &profile, sizeof(profile),
+                                                   NULL, 0, NULL);
+    }
+
+    if (NT_SUCCESS(status)) {
+
+        printf("%s reads, %u per size, microseconds p50/p99/p99.9",
+               packet ? "packet" : "scatter/gather", count);
+        if (pollMode.Mode != HSAC_POLL_OFF) {
+            printf(", %s poll %u us", pollMode.Mode == HSAC_POLL_ADAPTIVE ?
+                   "adaptive" : "always", pollMode.BudgetUs);
+        }
+        printf("\n%8s", "size");
+        for (i = 0; i < HsacLatMax; i++) {
+            printf("  %-26s", HsacLatNames[i]);
+        }
+        printf("  %8s\n", "polled");
+
+        if (onlySize) {
+            status = HsacLatRunSize(device, file, onlySize, count, packet);
+        }
+
+        for (size = HSAC_LAT_MIN_SIZE;
+             !onlySize && size <= HSAC_MAXIMUM_TRANSFER_LENGTH && NT_SUCCESS(status);
+             size *= 2) {
+            status = HsacLatRunSize(device, file, size, count, packet);
+        }
+    } else {
+        fprintf(stderr, "device setup failed 0x%08x\n", status);
+    }
+
+    if (file) {
+        WdfShimFileClose(file);
+    }
+
+    if (device) {
+        WdfShimDeviceRemove(device);
+    }
+
+    WdfShimDriverUnload();
+    HsacSimDestroy(sim);
+
+    return NT_SUCCESS(status) ? 0 : 1;
+}
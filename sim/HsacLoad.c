@@ -0,0 +1,3764 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    HsacLoad.c
+
+Abstract:
+
+    Loads the driver into the framework shim on top of the card model,
+    runs write/read loopback traffic through it in scatter/gather mode,
+    on registered buffers, in packet mode (one request per buffer, in
+    every cache mode, in batches, in hardware chains and through the
+    packet ring), on DMA
+    buffers of mixed sizes from the driver's heap, in playback and
+    capture streams, prints the driver's statistics, and unloads it
+    again.
+
+        hsacload [-n iterations] [-s bytes] [-q depth] [-m count:us] [-d]
+                 [-M] [-a writecpu:readcpu] [-b count:bytes] [-p]
+
+    Each write lands in the model's DDR and the following read of the
+    same size returns it, so every iteration checks the data end to end.
+
+    With -q the scatter/gather pass keeps up to depth writes, and then
+    depth reads, outstanding at once instead of one request at a time.
+    -m sets interrupt moderation (IOCTL_SET_INT_MODERATION) on both
+    channels for that pass; it reports interrupts per request.
+
+    -d adds a duplex pass: a stream of writes and a stream of reads, each
+    with depth requests in flight, timed alone and then running at the
+    same time from two threads. DMA0 and DMA1 are independent engines,
+    so together they should come close to the sum of the two.
+
+    -M grants the card one MSI message per channel, so each channel has
+    its own interrupt, and -a pins the write and read channels' DPCs to
+    the given processors (IOCTL_SET_DPC_AFFINITY).
+
+    -b gives each channel count common buffers of the given size through
+    the device's registry values instead of the default geometry; the
+    packet passes clamp their transfers to it. Either way the buffers
+    are resized, used and put back once the packet pass has run.
+
+    The driver only allocates a common buffer when it is first used, so
+    none may exist when the device has just started; -p sets the
+    device's PrewarmBuffers value instead, and they are allocated in
+    the background from then on.
+
+Environment:
+
+    User mode (Linux, pthreads)
+
+--*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "precomp.h"
+#include "HsacSim.h"
+
+#define HSAC_LOAD_SRAM_SIZE     (64 * 1024)
+#define HSAC_LOAD_STREAM_BUFFERS    16
+#define HSAC_LOAD_GEOMETRY_COUNT    8
+#define HSAC_LOAD_HEAP_BUFFERS      16
+#define HSAC_LOAD_CACHE_SIZE        (256 * 1024)
+
+typedef struct _HSAC_LOAD_OPTIONS {
+
+    ULONG       Iterations;
+    ULONG       Size;
+    ULONG       Depth;
+    ULONG       ModerationCount;
+    ULONG       ModerationDelay;
+    BOOLEAN     Duplex;
+    ULONG       Messages;
+    ULONG       DpcProcessor[2];    // write, read; ~0 - not set
+    ULONG       Buffers;            // common buffers of both channels
+    ULONG       BufferSize;         // bytes in each
+    BOOLEAN     Prewarm;            // PrewarmBuffers set
+    PHSAC_SIM   Sim;
+
+} HSAC_LOAD_OPTIONS, * PHSAC_LOAD_OPTIONS;
+
+typedef struct _HSAC_LOAD_BATCH {
+
+    pthread_mutex_t     Lock;
+    pthread_cond_t      Cond;
+    ULONG               Pending;
+    NTSTATUS            Status;
+    ULONG               Short;
+    ULONG               Cancelled;
+
+} HSAC_LOAD_BATCH, * PHSAC_LOAD_BATCH;
+
+typedef struct _HSAC_LOAD_STREAM {
+
+    WDFDEVICE           Device;
+    WDF_REQUEST_TYPE    Type;
+    PHSAC_LOAD_OPTIONS  Options;
+    PUCHAR              Buffers[HSAC_MAX_OUTSTANDING_REQUESTS];
+    NTSTATUS            Status;
+    double              Seconds;
+
+} HSAC_LOAD_STREAM, * PHSAC_LOAD_STREAM;
+
+typedef struct _HSAC_LOAD_FLIGHT {
+
+    ULONG               Rings;
+    ULONG               Events[HSAC_FLIGHT_COMPLETE + 1];   // kept, by type
+    ULONG               Misplaced;      // in the wrong slot, or from the future
+    LONGLONG            Latest;         // ISR
+    LONGLONG            Frequency;
+
+} HSAC_LOAD_FLIGHT, * PHSAC_LOAD_FLIGHT;
+
+typedef struct _HSAC_LOAD_MONITOR {
+
+    WDFFILEOBJECT       File;
+    PHSAC_STATS_PAGE    Page;
+    pthread_t           Thread;
+    volatile LONG       Stop;
+    ULONG               Snapshots;
+    ULONG               Retries;
+    ULONG               Regressions;    // a counter went backwards
+    HSAC_STATS          Last;
+    LONGLONG            Published;
+    ULONG               Dumps;
+    ULONG               Misplaced;      // over all the flight recorder dumps
+
+} HSAC_LOAD_MONITOR, * PHSAC_LOAD_MONITOR;
+
+static VOID
+HsacLoadFill(
+    PUCHAR Buffer,
+    ULONG Length,
+    ULONG Seed
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        Buffer[i] = (UCHAR) (Seed * 131 + i * 7 + (i >> 11));
+    }
+}
+
+static double
+HsacLoadSeconds(
+    VOID
+    )
+{
+    LARGE_INTEGER freq;
+    LARGE_INTEGER now = KeQueryPerformanceCounter(&freq);
+
+    return (double) now.QuadPart / (double) freq.QuadPart;
+}
+
+static NTSTATUS
+HsacLoadIoctl(
+    WDFDEVICE Device,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    ULONG InputLength,
+    PVOID OutputBuffer,
+    ULONG OutputLength
+    )
+{
+    return WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeDeviceControl,
+                                             IoControlCode,
+                                             InputBuffer, InputLength,
+                                             OutputBuffer, OutputLength,
+                                             NULL);
+}
+
+static VOID
+HsacLoadBatchCompletion(
+    PVOID Context,
+    WDFREQUEST Request,
+    NTSTATUS Status,
+    ULONG_PTR Information
+    )
+{
+    PHSAC_LOAD_BATCH batch = (PHSAC_LOAD_BATCH) Context;
+
+    UNREFERENCED_PARAMETER(Request);
+
+    pthread_mutex_lock(&batch->Lock);
+    if (!NT_SUCCESS(Status) && NT_SUCCESS(batch->Status)) {
+        batch->Status = Status;
+    }
+    if (NT_SUCCESS(Status) && Information == 0) {
+        batch->Short++;
+    }
+    if (--batch->Pending == 0) {
+        pthread_cond_signal(&batch->Cond);
+    }
+    pthread_mutex_unlock(&batch->Lock);
+}
+
+static VOID
+HsacLoadCancelCompletion(
+    PVOID Context,
+    WDFREQUEST Request,
+    NTSTATUS Status,
+    ULONG_PTR Information
+    )
+{
+    PHSAC_LOAD_BATCH batch = (PHSAC_LOAD_BATCH) Context;
+
+    UNREFERENCED_PARAMETER(Request);
+
+    pthread_mutex_lock(&batch->Lock);
+    if (Status == STATUS_CANCELLED) {
+        batch->Cancelled++;
+        if (Information != 0) {
+            batch->Short++;
+        }
+    } else {
+        if (!NT_SUCCESS(Status) && NT_SUCCESS(batch->Status)) {
+            batch->Status = Status;
+        }
+        if (NT_SUCCESS(Status) && Information == 0) {
+            batch->Short++;
+        }
+    }
+    if (--batch->Pending == 0) {
+        pthread_cond_signal(&batch->Cond);
+    }
+    pthread_mutex_unlock(&batch->Lock);
+}
+
+static NTSTATUS
+HsacLoadSubmitBatch(
+    WDFDEVICE Device,
+    WDF_REQUEST_TYPE Type,
+    PUCHAR * Buffers,
+    ULONG Count,
+    ULONG Size
+    )
+/*++
+
+Routine Description:
+
+    Submit Count reads or writes without waiting for each other and wait
+    for all of them.
+
+--*/
+{
+    HSAC_LOAD_BATCH batch;
+    NTSTATUS        status = STATUS_SUCCESS;
+    ULONG           i;
+
+    memset(&batch, 0, sizeof(batch));
+    pthread_mutex_init(&batch.Lock, NULL);
+    pthread_cond_init(&batch.Cond, NULL);
+    batch.Pending = Count;
+
+    for (i = 0; i < Count; i++) {
+
+        if (Type == WdfRequestTypeWrite) {
+            status = WdfShimSubmitRequest(Device, Type, 0, Buffers[i], Size, NULL, 0,
+                                          HsacLoadBatchCompletion, &batch, NULL);
+        } else {
+            status = WdfShimSubmitRequest(Device, Type, 0, NULL, 0, Buffers[i], Size,
+                                          HsacLoadBatchCompletion, &batch, NULL);
+        }
+
+        if (status == STATUS_INSUFFICIENT_RESOURCES ||
+            status == STATUS_INVALID_PARAMETER) {
+            //
+            // Not submitted: account for the completions that will not come.
+            //
+            pthread_mutex_lock(&batch.Lock);
+            batch.Pending -= Count - i;
+            pthread_mutex_unlock(&batch.Lock);
+            break;
+        }
+        status = STATUS_SUCCESS;
+    }
+
+    pthread_mutex_lock(&batch.Lock);
+    while (batch.Pending) {
+        pthread_cond_wait(&batch.Cond, &batch.Lock);
+    }
+    pthread_mutex_unlock(&batch.Lock);
+
+    pthread_cond_destroy(&batch.Cond);
+    pthread_mutex_destroy(&batch.Lock);
+
+    if (NT_SUCCESS(status)) {
+        status = batch.Status;
+    }
+    if (NT_SUCCESS(status) && batch.Short) {
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadQueued(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Scatter/gather loopback with Options->Depth requests in flight: a
+    batch of writes, then a batch of reads that must return them in
+    order.
+
+--*/
+{
+    PUCHAR      out[HSAC_MAX_OUTSTANDING_REQUESTS];
+    PUCHAR      in[HSAC_MAX_OUTSTANDING_REQUESTS];
+    NTSTATUS    status = STATUS_SUCCESS;
+    HSAC_INT_MODERATION moderation;
+    HSAC_SIM_COUNTERS   before, after;
+    double      start, elapsed;
+    ULONG       done;
+    ULONG       count;
+    ULONG       i;
+
+    memset(out, 0, sizeof(out));
+    memset(in, 0, sizeof(in));
+
+    for (i = 0; i < Options->Depth; i++) {
+        out[i] = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(Options->Size));
+        in[i]  = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(Options->Size));
+        if (!out[i] || !in[i]) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+    }
+
+    for (i = 0; i < 2 && Options->ModerationCount > 1; i++) {
+        moderation.Channel = i;
+        moderation.Count   = Options->ModerationCount;
+        moderation.DelayUs = Options->ModerationDelay;
+        status = HsacLoadIoctl(Device, IOCTL_SET_INT_MODERATION,
+                               &moderation, sizeof(moderation), NULL, 0);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "sg: IOCTL_SET_INT_MODERATION failed 0x%08x\n", status);
+            goto Exit;
+        }
+    }
+
+    HsacSimGetCounters(Options->Sim, &before);
+    start = HsacLoadSeconds();
+
+    for (done = 0; done < Options->Iterations; done += count) {
+
+        count = Options->Iterations - done;
+        if (count > Options->Depth) {
+            count = Options->Depth;
+        }
+
+        for (i = 0; i < count; i++) {
+            HsacLoadFill(out[i], Options->Size, done + i);
+            memset(in[i], 0, Options->Size);
+        }
+
+        status = HsacLoadSubmitBatch(Device, WdfRequestTypeWrite, out, count, Options->Size);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "sg: writes %u..%u failed 0x%08x\n", done, done + count - 1, status);
+            break;
+        }
+
+        status = HsacLoadSubmitBatch(Device, WdfRequestTypeRead, in, count, Options->Size);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "sg: reads %u..%u failed 0x%08x\n", done, done + count - 1, status);
+            break;
+        }
+
+        for (i = 0; i < count; i++) {
+            if (memcmp(out[i], in[i], Options->Size) != 0) {
+                fprintf(stderr, "sg: data mismatch in iteration %u\n", done + i);
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+        }
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+    HsacSimGetCounters(Options->Sim, &after);
+
+    if (NT_SUCCESS(status)) {
+        printf("sg q%u:  %u x %u bytes write+read in %.3f s (%.1f MB/s per direction)"
+               ", %.2f interrupts/request",
+               Options->Depth, Options->Iterations, Options->Size, elapsed,
+               (double) Options->Iterations * Options->Size / elapsed / 1e6,
+               (double) (after.Interrupts - before.Interrupts) / (2.0 * Options->Iterations));
+        if (Options->ModerationCount > 1) {
+            printf(" (moderation %u/%uus)", Options->ModerationCount,
+                   Options->ModerationDelay);
+        }
+        printf("\n");
+    }
+
+    //
+    // Leave the packet pass unmoderated.
+    //
+    for (i = 0; i < 2 && Options->ModerationCount > 1; i++) {
+        moderation.Channel = i;
+        moderation.Count   = 1;
+        moderation.DelayUs = 0;
+        HsacLoadIoctl(Device, IOCTL_SET_INT_MODERATION,
+                      &moderation, sizeof(moderation), NULL, 0);
+    }
+
+Exit:
+    for (i = 0; i < Options->Depth; i++) {
+        free(out[i]);
+        free(in[i]);
+    }
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadCancel(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Submit HSAC_MAX_OUTSTANDING_REQUESTS scatter/gather writes (or
+    reads), give them 0 to 3 ms, and cancel them all, newest first: some
+    are cancelled in the queue, some on the Ready list, and some while
+    the channel runs them or its DPC completes them. Each must complete
+    exactly once, either in full or as cancelled.
+
+--*/
+{
+    PUCHAR              buffers[HSAC_MAX_OUTSTANDING_REQUESTS];
+    WDFREQUEST          requests[HSAC_MAX_OUTSTANDING_REQUESTS];
+    HSAC_LOAD_BATCH     batch;
+    WDF_REQUEST_TYPE    type;
+    NTSTATUS            status = STATUS_SUCCESS;
+    ULONG               submitted = 0;
+    ULONG               cancelled = 0;
+    ULONG               count;
+    ULONG               round;
+    ULONG               i;
+
+    memset(buffers, 0, sizeof(buffers));
+
+    for (i = 0; i < HSAC_MAX_OUTSTANDING_REQUESTS; i++) {
+        buffers[i] = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(Options->Size));
+        if (!buffers[i]) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        HsacLoadFill(buffers[i], Options->Size, i);
+    }
+
+    for (round = 0; round < Options->Iterations && NT_SUCCESS(status); round++) {
+
+        type = (round & 1) ? WdfRequestTypeRead : WdfRequestTypeWrite;
+
+        memset(&batch, 0, sizeof(batch));
+        pthread_mutex_init(&batch.Lock, NULL);
+        pthread_cond_init(&batch.Cond, NULL);
+        batch.Pending = HSAC_MAX_OUTSTANDING_REQUESTS;
+
+        for (count = 0; count < HSAC_MAX_OUTSTANDING_REQUESTS; count++) {
+
+            if (type == WdfRequestTypeWrite) {
+                status = WdfShimSubmitRequest(Device, type, 0, buffers[count], Options->Size,
+                                              NULL, 0, HsacLoadCancelCompletion, &batch,
+                                              &requests[count]);
+            } else {
+                status = WdfShimSubmitRequest(Device, type, 0, NULL, 0,
+                                              buffers[count], Options->Size,
+                                              HsacLoadCancelCompletion, &batch,
+                                              &requests[count]);
+            }
+
+            if (status == STATUS_INSUFFICIENT_RESOURCES ||
+                status == STATUS_INVALID_PARAMETER) {
+                pthread_mutex_lock(&batch.Lock);
+                batch.Pending -= HSAC_MAX_OUTSTANDING_REQUESTS - count;
+                pthread_mutex_unlock(&batch.Lock);
+                break;
+            }
+            status = STATUS_SUCCESS;
+        }
+
+        //
+        // Give three rounds in four 1 to 3 ms to reach the channel.
+        //
+        usleep((round & 3) * 1000);
+
+        for (i = count; i > 0; i--) {
+            WdfShimCancelRequest(requests[i - 1]);
+        }
+
+        pthread_mutex_lock(&batch.Lock);
+        while (batch.Pending) {
+            pthread_cond_wait(&batch.Cond, &batch.Lock);
+        }
+        pthread_mutex_unlock(&batch.Lock);
+
+        for (i = 0; i < count; i++) {
+            WdfObjectDereference(requests[i]);
+        }
+
+        pthread_cond_destroy(&batch.Cond);
+        pthread_mutex_destroy(&batch.Lock);
+
+        submitted += count;
+        cancelled += batch.Cancelled;
+
+        if (NT_SUCCESS(status)) {
+            status = batch.Status;
+        }
+        if (NT_SUCCESS(status) && batch.Short) {
+            status = STATUS_UNSUCCESSFUL;
+        }
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "cancel: round %u failed 0x%08x (%u short)\n",
+                    round, status, batch.Short);
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+        printf("cancel: %u requests, %u cancelled\n", submitted, cancelled);
+    }
+
+Exit:
+    for (i = 0; i < HSAC_MAX_OUTSTANDING_REQUESTS; i++) {
+        free(buffers[i]);
+    }
+
+    return status;
+}
+
+static VOID
+HsacLoadWaitInFlight(
+    WDFDEVICE Device,
+    ULONG Channel,
+    LONG Count
+    )
+/*++
+
+Routine Description:
+
+    Give the driver up to 10 ms to have Count transfers on Channel.
+
+--*/
+{
+    HSAC_STATS  stats;
+    ULONG       wait;
+
+    for (wait = 0; wait < 100; wait++) {
+        if (!NT_SUCCESS(HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0,
+                                      &stats, sizeof(stats))) ||
+            stats.Channel[Channel].InFlight >= Count) {
+            break;
+        }
+        usleep(100);
+    }
+}
+
+static NTSTATUS
+HsacLoadCancelRegistered(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Cancel registered reads once interrupt moderation holds them on the
+    Ready list. Each must complete once and hand its buffer back, or the
+    next read fails with STATUS_DEVICE_BUSY, and the driver must cancel
+    at least one rather than let the moderation delay run out. Closing
+    the handle must not then wait for the buffer.
+
+--*/
+{
+    PUCHAR                  in;
+    WDFFILEOBJECT           file;
+    WDFREQUEST              request;
+    HSAC_REGISTER_BUFFER    reg;
+    HSAC_REGISTERED_IO      io;
+    HSAC_INT_MODERATION     moderation;
+    HSAC_LOAD_BATCH         batch;
+    HSAC_STATS              before, stats;
+    ULONG_PTR               information;
+    NTSTATUS                status;
+    ULONG                   cancelled = 0;
+    ULONG                   i;
+
+    in = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(Options->Size));
+    if (!in) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "cancel: open failed 0x%08x\n", status);
+        free(in);
+        return status;
+    }
+
+    reg.Channel = 1;
+    reg.Length  = Options->Size;
+    reg.Address = (ULONGLONG) (ULONG_PTR) in;
+
+    status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                   IOCTL_REGISTER_BUFFER,
+                                                   &reg, sizeof(reg),
+                                                   &io.BufferId, sizeof(io.BufferId),
+                                                   &information);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "cancel: IOCTL_REGISTER_BUFFER failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    moderation.Channel = 1;
+    moderation.Count   = HSAC_MAX_OUTSTANDING_REQUESTS;
+    moderation.DelayUs = HSAC_INT_MODERATION_MAX_DELAY_US;
+    status = HsacLoadIoctl(Device, IOCTL_SET_INT_MODERATION,
+                           &moderation, sizeof(moderation), NULL, 0);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "cancel: IOCTL_SET_INT_MODERATION failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &before, sizeof(before));
+
+    for (i = 0; i < 16 && NT_SUCCESS(status); i++) {
+
+        memset(&batch, 0, sizeof(batch));
+        pthread_mutex_init(&batch.Lock, NULL);
+        pthread_cond_init(&batch.Cond, NULL);
+        batch.Pending = 1;
+
+        status = WdfShimSubmitFileRequest(file, WdfRequestTypeDeviceControl,
+                                          IOCTL_REGISTERED_READ, &io, sizeof(io), NULL, 0,
+                                          HsacLoadCancelCompletion, &batch, &request);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "cancel: registered read %u failed 0x%08x\n", i, status);
+            pthread_cond_destroy(&batch.Cond);
+            pthread_mutex_destroy(&batch.Lock);
+            break;
+        }
+
+        //
+        // Cancel once the driver holds the read on the channel, not while
+        // it still sits in the queue.
+        //
+        HsacLoadWaitInFlight(Device, 1, 1);
+        WdfShimCancelRequest(request);
+
+        pthread_mutex_lock(&batch.Lock);
+        while (batch.Pending) {
+            pthread_cond_wait(&batch.Cond, &batch.Lock);
+        }
+        pthread_mutex_unlock(&batch.Lock);
+
+        WdfObjectDereference(request);
+        status = batch.Status;
+        if (NT_SUCCESS(status) && batch.Short) {
+            status = STATUS_UNSUCCESSFUL;
+        }
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "cancel: registered read %u failed 0x%08x\n", i, status);
+        }
+
+        cancelled += batch.Cancelled;
+
+        pthread_cond_destroy(&batch.Cond);
+        pthread_mutex_destroy(&batch.Lock);
+    }
+
+    moderation.Count   = 1;
+    moderation.DelayUs = 0;
+    (VOID) HsacLoadIoctl(Device, IOCTL_SET_INT_MODERATION,
+                         &moderation, sizeof(moderation), NULL, 0);
+
+    if (NT_SUCCESS(status)) {
+        status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &stats, sizeof(stats));
+    }
+    if (NT_SUCCESS(status) &&
+        stats.Channel[1].Cancellations == before.Channel[1].Cancellations) {
+        fprintf(stderr, "cancel: no registered read was cancelled on the channel\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    if (NT_SUCCESS(status)) {
+        printf("cancel: %u registered reads, %u cancelled, %lld on the channel\n",
+               i, cancelled,
+               stats.Channel[1].Cancellations - before.Channel[1].Cancellations);
+    }
+
+Exit:
+    //
+    // The buffer is unregistered by closing the handle.
+    //
+    WdfShimFileClose(file);
+
+    free(in);
+
+    return status;
+}
+
+static PVOID
+HsacLoadStreamThread(
+    PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Run Options->Iterations reads or writes, Options->Depth at a time,
+    and time them.
+
+--*/
+{
+    PHSAC_LOAD_STREAM   stream = (PHSAC_LOAD_STREAM) Context;
+    PHSAC_LOAD_OPTIONS  options = stream->Options;
+    double              start;
+    ULONG               done;
+    ULONG               count;
+
+    stream->Status = STATUS_SUCCESS;
+    start = HsacLoadSeconds();
+
+    for (done = 0; done < options->Iterations; done += count) {
+
+        count = options->Iterations - done;
+        if (count > options->Depth) {
+            count = options->Depth;
+        }
+
+        stream->Status = HsacLoadSubmitBatch(stream->Device, stream->Type,
+                                             stream->Buffers, count, options->Size);
+        if (!NT_SUCCESS(stream->Status)) {
+            fprintf(stderr, "duplex: %s %u..%u failed 0x%08x\n",
+                    (stream->Type == WdfRequestTypeWrite) ? "writes" : "reads",
+                    done, done + count - 1, stream->Status);
+            break;
+        }
+    }
+
+    stream->Seconds = HsacLoadSeconds() - start;
+
+    return NULL;
+}
+
+static NTSTATUS
+HsacLoadDuplex(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Time a write stream and a read stream on their own, then both at
+    once. The data is not checked: the reads race the writes for the
+    same DDR.
+
+--*/
+{
+    HSAC_LOAD_STREAM    streams[2];
+    pthread_t           threads[2];
+    double              alone[2];
+    double              start, together;
+    double              bytes = (double) Options->Iterations * Options->Size;
+    NTSTATUS            status = STATUS_SUCCESS;
+    ULONG               i, j;
+
+    memset(streams, 0, sizeof(streams));
+
+    for (i = 0; i < 2; i++) {
+        streams[i].Device  = Device;
+        streams[i].Type    = (i == 0) ? WdfRequestTypeWrite : WdfRequestTypeRead;
+        streams[i].Options = Options;
+
+        for (j = 0; j < Options->Depth; j++) {
+            streams[i].Buffers[j] = (PUCHAR) aligned_alloc(PAGE_SIZE,
+                                                           ROUND_TO_PAGES(Options->Size));
+            if (!streams[i].Buffers[j]) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto Exit;
+            }
+            HsacLoadFill(streams[i].Buffers[j], Options->Size, j);
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        HsacLoadStreamThread(&streams[i]);
+        if (!NT_SUCCESS(streams[i].Status)) {
+            status = streams[i].Status;
+            goto Exit;
+        }
+        alone[i] = streams[i].Seconds;
+    }
+
+    start = HsacLoadSeconds();
+
+    for (i = 0; i < 2; i++) {
+        if (pthread_create(&threads[i], NULL, HsacLoadStreamThread, &streams[i]) != 0) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+    }
+    for (j = 0; j < i; j++) {
+        pthread_join(threads[j], NULL);
+        if (NT_SUCCESS(status)) {
+            status = streams[j].Status;
+        }
+    }
+
+    together = HsacLoadSeconds() - start;
+
+    if (NT_SUCCESS(status)) {
+        printf("duplex q%u: %u x %u bytes, write %.1f MB/s, read %.1f MB/s alone;"
+               " %.1f MB/s together (%.0f%% of the sum)\n",
+               Options->Depth, Options->Iterations, Options->Size,
+               bytes / alone[0] / 1e6, bytes / alone[1] / 1e6,
+               2.0 * bytes / together / 1e6,
+               100.0 * (2.0 * bytes / together) / (bytes / alone[0] + bytes / alone[1]));
+    }
+
+Exit:
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < Options->Depth; j++) {
+            free(streams[i].Buffers[j]);
+        }
+    }
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadScatterGather(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Loop user buffers through the card with the default
+    (scatter/gather) profile, and report how many DTEs the card walked
+    per request.
+
+--*/
+{
+    PUCHAR              out;
+    PUCHAR              in;
+    ULONG_PTR           information;
+    NTSTATUS            status = STATUS_SUCCESS;
+    HSAC_SIM_COUNTERS   before, after;
+    double              start, elapsed;
+    ULONG               i;
+
+    out = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(Options->Size));
+    in  = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(Options->Size));
+
+    if (!out || !in) {
+        free(out);
+        free(in);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    HsacSimGetCounters(Options->Sim, &before);
+    start = HsacLoadSeconds();
+
+    for (i = 0; i < Options->Iterations; i++) {
+
+        HsacLoadFill(out, Options->Size, i);
+        memset(in, 0, Options->Size);
+
+        status = WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeWrite, 0,
+                                                   out, Options->Size, NULL, 0,
+                                                   &information);
+        if (!NT_SUCCESS(status) || information != Options->Size) {
+            fprintf(stderr, "sg: write %u failed 0x%08x (%zu bytes)\n",
+                    i, status, (size_t) information);
+            status = NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+            break;
+        }
+
+        status = WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeRead, 0,
+                                                   NULL, 0, in, Options->Size,
+                                                   &information);
+        if (!NT_SUCCESS(status) || information != Options->Size) {
+            fprintf(stderr, "sg: read %u failed 0x%08x (%zu bytes)\n",
+                    i, status, (size_t) information);
+            status = NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+            break;
+        }
+
+        if (memcmp(out, in, Options->Size) != 0) {
+            fprintf(stderr, "sg: data mismatch in iteration %u\n", i);
+            status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+    HsacSimGetCounters(Options->Sim, &after);
+
+    if (NT_SUCCESS(status)) {
+        printf("sg:     %u x %u bytes write+read in %.3f s (%.1f MB/s per direction)"
+               ", %.1f DTEs/request\n",
+               Options->Iterations, Options->Size, elapsed,
+               (double) Options->Iterations * Options->Size / elapsed / 1e6,
+               (double) (after.Descriptors[0] + after.Descriptors[1] -
+                         before.Descriptors[0] - before.Descriptors[1]) /
+               (2.0 * Options->Iterations));
+    }
+
+    free(out);
+    free(in);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadRegistered(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    The scatter/gather loop again, on buffers registered once
+    (IOCTL_REGISTER_BUFFER) and then moved by ID, so no request maps or
+    describes its buffer.
+
+--*/
+{
+    PUCHAR                  out;
+    PUCHAR                  in;
+    WDFFILEOBJECT           file;
+    HSAC_REGISTER_BUFFER    reg;
+    HSAC_REGISTERED_IO      io[2];
+    ULONG                   ids[2];
+    ULONG_PTR               information;
+    NTSTATUS                status;
+    double                  start, elapsed;
+    ULONG                   i, registered = 0;
+
+    out = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(Options->Size));
+    in  = (PUCHAR) aligned_alloc(PAGE_SIZE, ROUND_TO_PAGES(Options->Size));
+
+    if (!out || !in) {
+        free(out);
+        free(in);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "reg: open failed 0x%08x\n", status);
+        free(out);
+        free(in);
+        return status;
+    }
+
+    for (i = 0; i < 2; i++) {
+        reg.Channel = i;
+        reg.Length  = Options->Size;
+        reg.Address = (ULONGLONG) (ULONG_PTR) (i == 0 ? out : in);
+
+        status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                       IOCTL_REGISTER_BUFFER,
+                                                       &reg, sizeof(reg),
+                                                       &ids[i], sizeof(ids[i]),
+                                                       &information);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "reg: IOCTL_REGISTER_BUFFER (channel %u) failed 0x%08x\n",
+                    i, status);
+            goto Exit;
+        }
+        io[i].BufferId = ids[i];
+        registered++;
+    }
+
+    start = HsacLoadSeconds();
+
+    for (i = 0; i < Options->Iterations; i++) {
+
+        HsacLoadFill(out, Options->Size, i);
+        memset(in, 0, Options->Size);
+
+        status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                       IOCTL_REGISTERED_WRITE,
+                                                       &io[0], sizeof(io[0]), NULL, 0,
+                                                       &information);
+        if (!NT_SUCCESS(status) || information != Options->Size) {
+            fprintf(stderr, "reg: write %u failed 0x%08x (%zu bytes)\n",
+                    i, status, (size_t) information);
+            status = NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+            break;
+        }
+
+        status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                       IOCTL_REGISTERED_READ,
+                                                       &io[1], sizeof(io[1]), NULL, 0,
+                                                       &information);
+        if (!NT_SUCCESS(status) || information != Options->Size) {
+            fprintf(stderr, "reg: read %u failed 0x%08x (%zu bytes)\n",
+                    i, status, (size_t) information);
+            status = NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+            break;
+        }
+
+        if (memcmp(out, in, Options->Size) != 0) {
+            fprintf(stderr, "reg: data mismatch in iteration %u\n", i);
+            status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+
+    if (NT_SUCCESS(status)) {
+        printf("reg:    %u x %u bytes write+read in %.3f s (%.1f MB/s per direction)\n",
+               Options->Iterations, Options->Size, elapsed,
+               (double) Options->Iterations * Options->Size / elapsed / 1e6);
+    }
+
+Exit:
+    //
+    // The write buffer is unregistered explicitly, the read buffer by
+    // closing the handle.
+    //
+    if (registered > 0) {
+        NTSTATUS unregStatus;
+
+        unregStatus = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                            IOCTL_UNREGISTER_BUFFER,
+                                                            &io[0], sizeof(io[0]), NULL, 0,
+                                                            &information);
+        if (!NT_SUCCESS(unregStatus)) {
+            fprintf(stderr, "reg: IOCTL_UNREGISTER_BUFFER failed 0x%08x\n", unregStatus);
+            status = NT_SUCCESS(status) ? unregStatus : status;
+        }
+    }
+
+    WdfShimFileClose(file);
+
+    free(out);
+    free(in);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadPacket(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Same loopback through the driver's common buffers: switch to
+    WdfDmaProfilePacket64, map the buffers, and pass {size, index}
+    headers in the read/write requests.
+
+--*/
+{
+    PUCHAR      readBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PUCHAR      writeBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    ULONG       header[2];
+    ULONG       profile;
+    ULONG       which;
+    ULONG       size;
+    ULONG_PTR   information;
+    NTSTATUS    status;
+    double      start, elapsed;
+    ULONG       i;
+
+    size = Options->Size & ~7u;
+    if (size > Options->BufferSize) {
+        size = Options->BufferSize;
+    }
+
+    profile = WdfDmaProfilePacket64;
+    status = HsacLoadIoctl(Device, IOCTL_SET_DMA_PROFILE, &profile, sizeof(profile), NULL, 0);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "packet: IOCTL_SET_DMA_PROFILE failed 0x%08x\n", status);
+        return status;
+    }
+
+    which = 0;
+    status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                           readBuffers, sizeof(readBuffers));
+    if (NT_SUCCESS(status)) {
+        which = 1;
+        status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                               writeBuffers, sizeof(writeBuffers));
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "packet: IOCTL_MAP_DMA_BUF_ADDR failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    start = HsacLoadSeconds();
+
+    for (i = 0; i < Options->Iterations; i++) {
+
+        ULONG w = i % Options->Buffers;
+        ULONG r = (i * 7 + 3) % Options->Buffers;
+
+        HsacLoadFill(writeBuffers[w], size, i);
+
+        header[0] = size;
+        header[1] = w;
+        status = WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeWrite, 0,
+                                                   header, sizeof(header), NULL, 0,
+                                                   &information);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "packet: write %u failed 0x%08x\n", i, status);
+            break;
+        }
+
+        header[0] = size;
+        header[1] = r;
+        status = WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeRead, 0,
+                                                   NULL, 0, header, sizeof(header),
+                                                   &information);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "packet: read %u failed 0x%08x\n", i, status);
+            break;
+        }
+
+        if (memcmp(writeBuffers[w], readBuffers[r], size) != 0) {
+            fprintf(stderr, "packet: data mismatch in iteration %u\n", i);
+            status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+
+    if (NT_SUCCESS(status)) {
+        printf("packet: %u x %u bytes write+read in %.3f s (%.1f MB/s per direction)\n",
+               Options->Iterations, size, elapsed,
+               (double) Options->Iterations * size / elapsed / 1e6);
+    }
+
+    (VOID) HsacLoadIoctl(Device, IOCTL_UNMAP_DMA_BUF_ADDR, NULL, 0, NULL, 0);
+
+Exit:
+    profile = WdfDmaProfileScatterGather64Duplex;
+    (VOID) HsacLoadIoctl(Device, IOCTL_SET_DMA_PROFILE, &profile, sizeof(profile), NULL, 0);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadBufferGeometry(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Learn the channels' common buffers (IOCTL_GET_BUFFER_GEOMETRY). The
+    packet passes write and read the same buffer numbers, so they use
+    as many buffers, as big, as both channels have.
+
+--*/
+{
+    HSAC_BUFFER_GEOMETRY    geometry;
+    ULONG                   channel;
+    NTSTATUS                status;
+
+    Options->Buffers    = HSAC_MAX_TRANSFER_BUFFERS;
+    Options->BufferSize = HSAC_MAXIMUM_TRANSFER_LENGTH;
+
+    for (channel = 0; channel < 2; channel++) {
+
+        status = HsacLoadIoctl(Device, IOCTL_GET_BUFFER_GEOMETRY,
+                               &channel, sizeof(channel), &geometry, sizeof(geometry));
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "IOCTL_GET_BUFFER_GEOMETRY(channel %u) failed 0x%08x\n",
+                    channel, status);
+            return status;
+        }
+
+        if (geometry.Count < Options->Buffers) {
+            Options->Buffers = geometry.Count;
+        }
+        if (geometry.Size < Options->BufferSize) {
+            Options->BufferSize = geometry.Size;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+HsacLoadLazy(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Before anything has used them, no common buffer may have been
+    allocated unless the device prewarms them. Print how many are, and
+    how long the device took to add and to start.
+
+--*/
+{
+    HSAC_STATS  stats;
+    NTSTATUS    status;
+    LONG        allocated;
+
+    status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &stats, sizeof(stats));
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "lazy: IOCTL_GET_STATS failed 0x%08x\n", status);
+        return status;
+    }
+
+    allocated = stats.Channel[0].Buffers + stats.Channel[1].Buffers;
+
+    printf("lazy:   %d of %u buffers allocated at start%s, device add %lld us, start %lld us\n",
+           allocated, 2 * Options->Buffers, Options->Prewarm ? " (prewarming)" : "",
+           stats.DeviceAddUs, stats.DeviceStartUs);
+
+    if (!Options->Prewarm && allocated != 0) {
+        fprintf(stderr, "lazy: %d buffers allocated before any was used\n", allocated);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+HsacLoadGeometry(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Resize the common buffers: IOCTL_SET_BUFFER_GEOMETRY has to fail
+    while they are mapped, then both channels get HSAC_LOAD_GEOMETRY_COUNT
+    buffers of a quarter of the size, the packet loopback runs on them,
+    a write past the end of a buffer has to be refused, and the old
+    geometry goes back.
+
+--*/
+{
+    HSAC_LOAD_OPTIONS       resized = *Options;
+    HSAC_BUFFER_GEOMETRY    original[2];
+    HSAC_BUFFER_GEOMETRY    geometry;
+    HSAC_BUFFER_GEOMETRY    result;
+    PUCHAR                  buffers[HSAC_MAX_TRANSFER_BUFFERS];
+    ULONG                   header[2];
+    ULONG                   profile;
+    ULONG                   which;
+    ULONG_PTR               information;
+    NTSTATUS                status;
+    NTSTATUS                restoreStatus = STATUS_SUCCESS;
+
+    for (which = 0; which < 2; which++) {
+        status = HsacLoadIoctl(Device, IOCTL_GET_BUFFER_GEOMETRY, &which, sizeof(which),
+                               &original[which], sizeof(original[which]));
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "geometry: IOCTL_GET_BUFFER_GEOMETRY failed 0x%08x\n", status);
+            return status;
+        }
+    }
+
+    geometry.Channel = 1;
+    geometry.Count   = HSAC_LOAD_GEOMETRY_COUNT;
+    geometry.Size    = Options->BufferSize / 4;
+
+    which = 0;
+    status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                           buffers, sizeof(buffers));
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "geometry: IOCTL_MAP_DMA_BUF_ADDR failed 0x%08x\n", status);
+        return status;
+    }
+    status = HsacLoadIoctl(Device, IOCTL_SET_BUFFER_GEOMETRY,
+                           &geometry, sizeof(geometry), NULL, 0);
+    (VOID) HsacLoadIoctl(Device, IOCTL_UNMAP_DMA_BUF_ADDR, NULL, 0, NULL, 0);
+
+    if (status != STATUS_DEVICE_BUSY) {
+        fprintf(stderr, "geometry: resize while mapped returned 0x%08x\n", status);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    resized.Buffers    = HSAC_LOAD_GEOMETRY_COUNT;
+    resized.BufferSize = HSAC_MAXIMUM_TRANSFER_LENGTH;
+
+    for (geometry.Channel = 0; geometry.Channel < 2; geometry.Channel++) {
+
+        status = HsacLoadIoctl(Device, IOCTL_SET_BUFFER_GEOMETRY,
+                               &geometry, sizeof(geometry), &result, sizeof(result));
+        if (!NT_SUCCESS(status) || result.Count != geometry.Count ||
+            result.Size < geometry.Size) {
+            fprintf(stderr, "geometry: IOCTL_SET_BUFFER_GEOMETRY(channel %u)"
+                    " failed 0x%08x\n", geometry.Channel, status);
+            if (NT_SUCCESS(status)) {
+                status = STATUS_UNSUCCESSFUL;
+            }
+            goto Restore;
+        }
+
+        if (result.Size < resized.BufferSize) {
+            resized.BufferSize = result.Size;
+        }
+    }
+
+    status = HsacLoadPacket(Device, &resized);
+    if (!NT_SUCCESS(status)) {
+        goto Restore;
+    }
+
+    //
+    // The driver checks packet headers against the buffers it has now.
+    //
+    profile = WdfDmaProfilePacket64;
+    status = HsacLoadIoctl(Device, IOCTL_SET_DMA_PROFILE, &profile, sizeof(profile), NULL, 0);
+    if (NT_SUCCESS(status)) {
+        header[0] = resized.BufferSize + PAGE_SIZE;
+        header[1] = 0;
+        status = WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeWrite, 0,
+                                                   header, sizeof(header), NULL, 0,
+                                                   &information);
+        status = NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : STATUS_SUCCESS;
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "geometry: a write past the end of a buffer went through\n");
+        }
+
+        profile = WdfDmaProfileScatterGather64Duplex;
+        (VOID) HsacLoadIoctl(Device, IOCTL_SET_DMA_PROFILE, &profile, sizeof(profile), NULL, 0);
+    }
+
+Restore:
+    for (which = 0; which < 2; which++) {
+
+        restoreStatus = HsacLoadIoctl(Device, IOCTL_SET_BUFFER_GEOMETRY,
+                                      &original[which], sizeof(original[which]), NULL, 0);
+        if (!NT_SUCCESS(restoreStatus)) {
+            fprintf(stderr, "geometry: restoring channel %u failed 0x%08x\n",
+                    which, restoreStatus);
+            break;
+        }
+    }
+
+    if (NT_SUCCESS(status) && NT_SUCCESS(restoreStatus)) {
+        printf("geometry: %u x %u bytes per channel, resized to %u x %u and back\n",
+               Options->Buffers, Options->BufferSize,
+               resized.Buffers, resized.BufferSize);
+    }
+
+    return NT_SUCCESS(status) ? restoreStatus : status;
+}
+
+static NTSTATUS
+HsacLoadCacheModeRun(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options,
+    ULONG Mode,
+    PULONG Transfers
+    )
+/*++
+
+Routine Description:
+
+    Switch the device to cache Mode, give both channels small buffers,
+    and run the packet loopback on them. A contiguous mode maps each
+    channel's buffers at one address, one after the other, and the
+    model has to count one common buffer per channel. In HSAC_CACHE_NONE
+    the headers are only the size.
+
+--*/
+{
+    HSAC_BUFFER_GEOMETRY    geometry;
+    HSAC_BUFFER_GEOMETRY    result;
+    HSAC_STATS              stats;
+    PUCHAR                  readBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PUCHAR                  writeBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    ULONG                   header[2];
+    ULONG                   headerSize;
+    ULONG                   mode;
+    ULONG                   count;
+    ULONG                   size;
+    ULONG                   profile;
+    ULONG                   which;
+    ULONG_PTR               information;
+    NTSTATUS                status;
+    ULONG                   i;
+
+    status = HsacLoadIoctl(Device, IOCTL_SET_CACHE_MODE, &Mode, sizeof(Mode), NULL, 0);
+    if (NT_SUCCESS(status)) {
+        status = HsacLoadIoctl(Device, IOCTL_GET_CACHE_MODE, NULL, 0, &mode, sizeof(mode));
+    }
+    if (!NT_SUCCESS(status) || mode != Mode) {
+        fprintf(stderr, "cache: switching to mode 0x%x failed 0x%08x\n", Mode, status);
+        return NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+    }
+
+    count = (Mode == HSAC_CACHE_MULTI || Mode == HSAC_CACHE_NONE) ?
+                1 : HSAC_LOAD_GEOMETRY_COUNT;
+
+    geometry.Count = HSAC_LOAD_GEOMETRY_COUNT;
+    geometry.Size  = HSAC_LOAD_CACHE_SIZE;
+
+    for (geometry.Channel = 0; geometry.Channel < 2; geometry.Channel++) {
+
+        //
+        // A single buffer mode takes no more than one.
+        //
+        if (count == 1) {
+            geometry.Count = 2;
+            status = HsacLoadIoctl(Device, IOCTL_SET_BUFFER_GEOMETRY,
+                                   &geometry, sizeof(geometry), NULL, 0);
+            if (status != STATUS_INVALID_PARAMETER) {
+                fprintf(stderr, "cache: mode 0x%x took 2 buffers: 0x%08x\n", Mode, status);
+                return STATUS_UNSUCCESSFUL;
+            }
+            geometry.Count = 1;
+        }
+
+        status = HsacLoadIoctl(Device, IOCTL_SET_BUFFER_GEOMETRY,
+                               &geometry, sizeof(geometry), &result, sizeof(result));
+        if (!NT_SUCCESS(status) || result.Count != count || result.Size != geometry.Size) {
+            fprintf(stderr, "cache: mode 0x%x, IOCTL_SET_BUFFER_GEOMETRY(channel %u)"
+                    " failed 0x%08x\n", Mode, geometry.Channel, status);
+            return NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : status;
+        }
+    }
+
+    size = Options->Size & ~7u;
+    if (size > HSAC_LOAD_CACHE_SIZE) {
+        size = HSAC_LOAD_CACHE_SIZE;
+    }
+    headerSize = (Mode == HSAC_CACHE_NONE) ? sizeof(ULONG) : sizeof(header);
+
+    profile = WdfDmaProfilePacket64;
+    status = HsacLoadIoctl(Device, IOCTL_SET_DMA_PROFILE, &profile, sizeof(profile), NULL, 0);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "cache: IOCTL_SET_DMA_PROFILE failed 0x%08x\n", status);
+        return status;
+    }
+
+    memset(readBuffers, 0, sizeof(readBuffers));
+    memset(writeBuffers, 0, sizeof(writeBuffers));
+
+    which = 0;
+    status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                           readBuffers, sizeof(readBuffers));
+    if (NT_SUCCESS(status)) {
+        which = 1;
+        status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                               writeBuffers, sizeof(writeBuffers));
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "cache: IOCTL_MAP_DMA_BUF_ADDR failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    if (Mode != HSAC_CACHE_MULTI_DISCRETE) {
+        if (readBuffers[1] != NULL || writeBuffers[1] != NULL) {
+            fprintf(stderr, "cache: mode 0x%x mapped more than one address\n", Mode);
+            status = STATUS_UNSUCCESSFUL;
+            goto Unmap;
+        }
+        for (i = 1; i < count; i++) {
+            readBuffers[i]  = readBuffers[0] + i * HSAC_LOAD_CACHE_SIZE;
+            writeBuffers[i] = writeBuffers[0] + i * HSAC_LOAD_CACHE_SIZE;
+        }
+    }
+
+    status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &stats, sizeof(stats));
+    if (NT_SUCCESS(status) &&
+        (stats.Channel[0].Buffers != (LONG) ((Mode == HSAC_CACHE_MULTI_DISCRETE) ? count : 1) ||
+         stats.Channel[1].Buffers != stats.Channel[0].Buffers)) {
+        fprintf(stderr, "cache: mode 0x%x has %d write and %d read common buffers\n",
+                Mode, stats.Channel[0].Buffers, stats.Channel[1].Buffers);
+        status = STATUS_UNSUCCESSFUL;
+    }
+    if (!NT_SUCCESS(status)) {
+        goto Unmap;
+    }
+
+    for (i = 0; i < 2 * count + 1; i++) {
+
+        ULONG w = i % count;
+        ULONG r = (i * 3 + 1) % count;
+
+        HsacLoadFill(writeBuffers[w], size, i + Mode);
+
+        header[0] = size;
+        header[1] = w;
+        status = WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeWrite, 0,
+                                                   header, headerSize, NULL, 0,
+                                                   &information);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "cache: mode 0x%x, write %u failed 0x%08x\n", Mode, i, status);
+            break;
+        }
+
+        header[0] = size;
+        header[1] = r;
+        status = WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeRead, 0,
+                                                   NULL, 0, header, headerSize,
+                                                   &information);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "cache: mode 0x%x, read %u failed 0x%08x\n", Mode, i, status);
+            break;
+        }
+
+        if (memcmp(writeBuffers[w], readBuffers[r], size) != 0) {
+            fprintf(stderr, "cache: mode 0x%x, data mismatch in iteration %u\n", Mode, i);
+            status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+
+        *Transfers += 2;
+    }
+
+    //
+    // The driver checks the index against the buffers the mode has.
+    //
+    if (NT_SUCCESS(status) && Mode != HSAC_CACHE_NONE) {
+        header[0] = size;
+        header[1] = count;
+        status = WdfShimSubmitRequestSynchronously(Device, WdfRequestTypeWrite, 0,
+                                                   header, sizeof(header), NULL, 0,
+                                                   &information);
+        status = NT_SUCCESS(status) ? STATUS_UNSUCCESSFUL : STATUS_SUCCESS;
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "cache: mode 0x%x took a write to buffer %u\n", Mode, count);
+        }
+    }
+
+Unmap:
+    (VOID) HsacLoadIoctl(Device, IOCTL_UNMAP_DMA_BUF_ADDR, NULL, 0, NULL, 0);
+
+Exit:
+    profile = WdfDmaProfileScatterGather64Duplex;
+    (VOID) HsacLoadIoctl(Device, IOCTL_SET_DMA_PROFILE, &profile, sizeof(profile), NULL, 0);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadCacheModes(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Run the loopback in every cache mode (IOCTL_SET_CACHE_MODE), which
+    has to fail while the buffers are mapped, then put the device's
+    mode and geometry back.
+
+--*/
+{
+    static ULONG            modes[] = {
+        HSAC_CACHE_PING_PANG, HSAC_CACHE_MULTI, HSAC_CACHE_NONE, HSAC_CACHE_MULTI_DISCRETE
+    };
+    HSAC_BUFFER_GEOMETRY    original[2];
+    PUCHAR                  buffers[HSAC_MAX_TRANSFER_BUFFERS];
+    ULONG                   originalMode;
+    ULONG                   transfers = 0;
+    ULONG                   which;
+    NTSTATUS                status;
+    NTSTATUS                restoreStatus;
+    double                  start, elapsed;
+    ULONG                   i;
+
+    status = HsacLoadIoctl(Device, IOCTL_GET_CACHE_MODE, NULL, 0,
+                           &originalMode, sizeof(originalMode));
+    for (which = 0; which < 2 && NT_SUCCESS(status); which++) {
+        status = HsacLoadIoctl(Device, IOCTL_GET_BUFFER_GEOMETRY, &which, sizeof(which),
+                               &original[which], sizeof(original[which]));
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "cache: reading the mode and geometry failed 0x%08x\n", status);
+        return status;
+    }
+
+    which = 0;
+    status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                           buffers, sizeof(buffers));
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "cache: IOCTL_MAP_DMA_BUF_ADDR failed 0x%08x\n", status);
+        return status;
+    }
+    status = HsacLoadIoctl(Device, IOCTL_SET_CACHE_MODE, &modes[0], sizeof(modes[0]), NULL, 0);
+    (VOID) HsacLoadIoctl(Device, IOCTL_UNMAP_DMA_BUF_ADDR, NULL, 0, NULL, 0);
+
+    if (status != STATUS_DEVICE_BUSY) {
+        fprintf(stderr, "cache: switching mode while mapped returned 0x%08x\n", status);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    start = HsacLoadSeconds();
+
+    status = STATUS_SUCCESS;
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]) && NT_SUCCESS(status); i++) {
+        status = HsacLoadCacheModeRun(Device, Options, modes[i], &transfers);
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+
+    restoreStatus = HsacLoadIoctl(Device, IOCTL_SET_CACHE_MODE,
+                                  &originalMode, sizeof(originalMode), NULL, 0);
+    for (which = 0; which < 2 && NT_SUCCESS(restoreStatus); which++) {
+        restoreStatus = HsacLoadIoctl(Device, IOCTL_SET_BUFFER_GEOMETRY,
+                                      &original[which], sizeof(original[which]), NULL, 0);
+    }
+    if (!NT_SUCCESS(restoreStatus)) {
+        fprintf(stderr, "cache: restoring mode 0x%x failed 0x%08x\n",
+                originalMode, restoreStatus);
+    }
+
+    if (NT_SUCCESS(status) && NT_SUCCESS(restoreStatus)) {
+        printf("cache:  %u modes, %u packet transfers in %.3f s, back to mode 0x%x\n",
+               (ULONG) (sizeof(modes) / sizeof(modes[0])), transfers, elapsed, originalMode);
+    }
+
+    return NT_SUCCESS(status) ? restoreStatus : status;
+}
+
+static NTSTATUS
+HsacLoadBatchRun(
+    WDFDEVICE Device,
+    ULONG IoControlCode,
+    ULONG Channel,
+    ULONG First,
+    ULONG Count,
+    ULONG Size,
+    ULONG Buffers
+    )
+/*++
+
+Routine Description:
+
+    One IOCTL_PACKET_BATCH or IOCTL_PACKET_CHAIN of Count transfers on
+    Channel, iterations First.. of the packet pass's buffer pattern over
+    Buffers common buffers.
+
+--*/
+{
+    UCHAR               input[FIELD_OFFSET(HSAC_PACKET_BATCH, Entries) +
+                              HSAC_MAX_BATCH_ENTRIES * sizeof(HSAC_PACKET_ENTRY)];
+    HSAC_PACKET_RESULT  results[HSAC_MAX_BATCH_ENTRIES];
+    PHSAC_PACKET_BATCH  batch = (PHSAC_PACKET_BATCH) input;
+    NTSTATUS            status;
+    ULONG               i;
+
+    batch->Count = Count;
+    for (i = 0; i < Count; i++) {
+        batch->Entries[i].Channel = Channel;
+        batch->Entries[i].Index   = (Channel == 0) ?
+            (First + i) % Buffers :
+            ((First + i) * 7 + 3) % Buffers;
+        batch->Entries[i].Size    = Size;
+    }
+
+    status = HsacLoadIoctl(Device, IoControlCode,
+                           batch, FIELD_OFFSET(HSAC_PACKET_BATCH, Entries) +
+                                  Count * sizeof(HSAC_PACKET_ENTRY),
+                           results, Count * sizeof(HSAC_PACKET_RESULT));
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "batch: IOCTL_PACKET_%s failed 0x%08x\n",
+                (IoControlCode == IOCTL_PACKET_CHAIN) ? "CHAIN" : "BATCH", status);
+        return status;
+    }
+
+    for (i = 0; i < Count; i++) {
+        if (!NT_SUCCESS(results[i].Status) || results[i].Bytes != Size) {
+            fprintf(stderr, "batch: entry %u failed 0x%08x (%u bytes)\n",
+                    First + i, results[i].Status, results[i].Bytes);
+            return NT_SUCCESS(results[i].Status) ? STATUS_UNSUCCESSFUL : results[i].Status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+HsacLoadBatch(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options,
+    ULONG IoControlCode
+    )
+/*++
+
+Routine Description:
+
+    The packet loopback with IOCTL_PACKET_BATCH, or IOCTL_PACKET_CHAIN:
+    each request writes, or reads back, up to half of the common
+    buffers.
+
+--*/
+{
+    PUCHAR              readBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PUCHAR              writeBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    ULONG               which;
+    ULONG               size;
+    ULONG               batch;
+    ULONG               requests = 0;
+    NTSTATUS            status;
+    double              start, elapsed;
+    ULONG               i, j;
+
+    size = Options->Size & ~7u;
+    if (size > Options->BufferSize) {
+        size = Options->BufferSize;
+    }
+
+    which = 0;
+    status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                           readBuffers, sizeof(readBuffers));
+    if (NT_SUCCESS(status)) {
+        which = 1;
+        status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                               writeBuffers, sizeof(writeBuffers));
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "batch: IOCTL_MAP_DMA_BUF_ADDR failed 0x%08x\n", status);
+        return status;
+    }
+
+    start = HsacLoadSeconds();
+
+    for (i = 0; i < Options->Iterations; i += batch) {
+
+        batch = Options->Iterations - i;
+        if (batch > Options->Buffers / 2) {
+            batch = Options->Buffers / 2;
+        }
+        if (batch > HSAC_MAX_BATCH_ENTRIES) {
+            batch = HSAC_MAX_BATCH_ENTRIES;
+        }
+
+        for (j = 0; j < batch; j++) {
+            HsacLoadFill(writeBuffers[(i + j) % Options->Buffers], size, i + j);
+        }
+
+        status = HsacLoadBatchRun(Device, IoControlCode, 0, i, batch, size, Options->Buffers);
+        if (NT_SUCCESS(status)) {
+            status = HsacLoadBatchRun(Device, IoControlCode, 1, i, batch, size, Options->Buffers);
+        }
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+        requests += 2;
+
+        for (j = 0; j < batch; j++) {
+            if (memcmp(writeBuffers[(i + j) % Options->Buffers],
+                       readBuffers[((i + j) * 7 + 3) % Options->Buffers], size) != 0) {
+                fprintf(stderr, "batch: data mismatch in iteration %u\n", i + j);
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+        }
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+
+    if (NT_SUCCESS(status)) {
+        printf("%s  %u x %u bytes write+read in %.3f s (%.1f MB/s per direction)"
+               ", %.1f transfers/request\n",
+               (IoControlCode == IOCTL_PACKET_CHAIN) ? "chain:" : "batch:",
+               Options->Iterations, size, elapsed,
+               (double) Options->Iterations * size / elapsed / 1e6,
+               2.0 * Options->Iterations / (requests ? requests : 1));
+    }
+
+    (VOID) HsacLoadIoctl(Device, IOCTL_UNMAP_DMA_BUF_ADDR, NULL, 0, NULL, 0);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadRingDrain(
+    WDFFILEOBJECT File,
+    PHSAC_PACKET_RING Ring,
+    ULONG Count,
+    PULONG Enters
+    )
+/*++
+
+Routine Description:
+
+    Enter the ring until the Count entries posted last have all
+    completed, reaping as they come. Once an enter takes nothing (both
+    channels busy) the next waits until something has been reaped.
+
+--*/
+{
+    ULONG_PTR   information;
+    ULONG       submitted = 1;
+    ULONG       head = Ring->CqHead;
+    ULONG       reaped = 0;
+    NTSTATUS    status;
+
+    while (reaped < Count) {
+
+        if (submitted != 0 &&
+            __atomic_load_n(&Ring->SqHead, __ATOMIC_ACQUIRE) != Ring->SqTail) {
+            status = WdfShimSubmitFileRequestSynchronously(File, WdfRequestTypeDeviceControl,
+                                                           IOCTL_PACKET_RING_ENTER,
+                                                           NULL, 0,
+                                                           &submitted, sizeof(submitted),
+                                                           &information);
+            if (!NT_SUCCESS(status)) {
+                fprintf(stderr, "ring: IOCTL_PACKET_RING_ENTER failed 0x%08x\n", status);
+                return status;
+            }
+            (*Enters)++;
+        }
+
+        if (__atomic_load_n(&Ring->Cq[head & (HSAC_RING_ENTRIES - 1)].Position,
+                            __ATOMIC_ACQUIRE) != head + 1) {
+            sched_yield();
+            continue;
+        }
+
+        while (__atomic_load_n(&Ring->Cq[head & (HSAC_RING_ENTRIES - 1)].Position,
+                               __ATOMIC_ACQUIRE) == head + 1) {
+
+            PHSAC_RING_CQE cqe = &Ring->Cq[head & (HSAC_RING_ENTRIES - 1)];
+
+            if (!NT_SUCCESS(cqe->Status)) {
+                fprintf(stderr, "ring: entry %u failed 0x%08x\n", cqe->Sequence, cqe->Status);
+                return cqe->Status;
+            }
+            head++;
+            reaped++;
+            submitted = 1;
+        }
+
+        __atomic_store_n(&Ring->CqHead, head, __ATOMIC_RELEASE);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+HsacLoadRing(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    The packet loopback through the packet ring: post a batch of writes
+    of the common buffers, enter and reap until they are done, then the
+    same for a batch of reads, and check the data.
+
+--*/
+{
+    PUCHAR              readBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PUCHAR              writeBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PHSAC_PACKET_RING   ring = NULL;
+    WDFFILEOBJECT       file;
+    ULONGLONG           address;
+    ULONG               which;
+    ULONG               size;
+    ULONG               batch;
+    ULONG               enters = 0;
+    ULONG_PTR           information;
+    NTSTATUS            status;
+    double              start, elapsed;
+    ULONG               i, j;
+
+    size = Options->Size & ~7u;
+    if (size > Options->BufferSize) {
+        size = Options->BufferSize;
+    }
+
+    which = 0;
+    status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                           readBuffers, sizeof(readBuffers));
+    if (NT_SUCCESS(status)) {
+        which = 1;
+        status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                               writeBuffers, sizeof(writeBuffers));
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "ring: IOCTL_MAP_DMA_BUF_ADDR failed 0x%08x\n", status);
+        return status;
+    }
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "ring: open failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                   IOCTL_MAP_PACKET_RING, NULL, 0,
+                                                   &address, sizeof(address),
+                                                   &information);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "ring: IOCTL_MAP_PACKET_RING failed 0x%08x\n", status);
+        WdfShimFileClose(file);
+        goto Exit;
+    }
+    ring = (PHSAC_PACKET_RING) (ULONG_PTR) address;
+
+    //
+    // The mapped ring keeps the device from idling out of D0.
+    //
+    if (WdfShimDeviceIdleReferences(Device) != 1) {
+        fprintf(stderr, "ring: %d idle references while mapped\n",
+                WdfShimDeviceIdleReferences(Device));
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    start = HsacLoadSeconds();
+
+    for (i = 0; i < Options->Iterations && NT_SUCCESS(status); i += batch) {
+
+        batch = Options->Iterations - i;
+        if (batch > HSAC_RING_ENTRIES / 2) {
+            batch = HSAC_RING_ENTRIES / 2;
+        }
+        if (batch > Options->Buffers / 2) {
+            batch = Options->Buffers / 2;
+        }
+
+        for (j = 0; j < batch; j++) {
+            PHSAC_RING_SQE sqe = &ring->Sq[(ring->SqTail + j) & (HSAC_RING_ENTRIES - 1)];
+
+            HsacLoadFill(writeBuffers[(i + j) % Options->Buffers], size, i + j);
+            sqe->Direction = 0;
+            sqe->Index     = (i + j) % Options->Buffers;
+            sqe->Size      = size;
+        }
+        __atomic_store_n(&ring->SqTail, ring->SqTail + batch, __ATOMIC_RELEASE);
+
+        status = HsacLoadRingDrain(file, ring, batch, &enters);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        for (j = 0; j < batch; j++) {
+            PHSAC_RING_SQE sqe = &ring->Sq[(ring->SqTail + j) & (HSAC_RING_ENTRIES - 1)];
+
+            sqe->Direction = 1;
+            sqe->Index     = ((i + j) * 7 + 3) % Options->Buffers;
+            sqe->Size      = size;
+        }
+        __atomic_store_n(&ring->SqTail, ring->SqTail + batch, __ATOMIC_RELEASE);
+
+        status = HsacLoadRingDrain(file, ring, batch, &enters);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        for (j = 0; j < batch; j++) {
+            if (memcmp(writeBuffers[(i + j) % Options->Buffers],
+                       readBuffers[((i + j) * 7 + 3) % Options->Buffers], size) != 0) {
+                fprintf(stderr, "ring: data mismatch in iteration %u\n", i + j);
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+        }
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+
+    if (NT_SUCCESS(status)) {
+        printf("ring:   %u x %u bytes write+read in %.3f s (%.1f MB/s per direction)"
+               ", %.0f transfers/s, %.1f per enter\n",
+               Options->Iterations, size, elapsed,
+               (double) Options->Iterations * size / elapsed / 1e6,
+               2.0 * Options->Iterations / elapsed,
+               2.0 * Options->Iterations / (enters ? enters : 1));
+    }
+
+    //
+    // Closing the handle unmaps the ring.
+    //
+    WdfShimFileClose(file);
+
+    if (NT_SUCCESS(status) && WdfShimDeviceIdleReferences(Device) != 0) {
+        fprintf(stderr, "ring: idle reference kept after the ring was unmapped\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+Exit:
+    (VOID) HsacLoadIoctl(Device, IOCTL_UNMAP_DMA_BUF_ADDR, NULL, 0, NULL, 0);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadHeapBatch(
+    WDFDEVICE Device,
+    ULONG Channel,
+    HSAC_DMA_BUFFER Buffers[],
+    ULONG Sizes[],
+    ULONG Count,
+    PHSAC_PACKET_RESULT Results
+    )
+/*++
+
+Routine Description:
+
+    One IOCTL_PACKET_BATCH of Count transfers on Channel, each naming a
+    heap buffer by its handle.
+
+--*/
+{
+    UCHAR               input[FIELD_OFFSET(HSAC_PACKET_BATCH, Entries) +
+                              HSAC_MAX_BATCH_ENTRIES * sizeof(HSAC_PACKET_ENTRY)];
+    PHSAC_PACKET_BATCH  batch = (PHSAC_PACKET_BATCH) input;
+    ULONG               i;
+
+    batch->Count = Count;
+    for (i = 0; i < Count; i++) {
+        batch->Entries[i].Channel = Channel;
+        batch->Entries[i].Index   = Buffers[i].Handle;
+        batch->Entries[i].Size    = Sizes[i];
+    }
+
+    return HsacLoadIoctl(Device, IOCTL_PACKET_BATCH,
+                         batch, FIELD_OFFSET(HSAC_PACKET_BATCH, Entries) +
+                                Count * sizeof(HSAC_PACKET_ENTRY),
+                         Results, Count * sizeof(HSAC_PACKET_RESULT));
+}
+
+static NTSTATUS
+HsacLoadHeapBusy(
+    WDFDEVICE Device,
+    WDFFILEOBJECT File,
+    PHSAC_DMA_BUFFER WriteBuffer,
+    PHSAC_DMA_BUFFER ReadBuffer,
+    ULONG Size
+    )
+/*++
+
+Routine Description:
+
+    Free a heap buffer while a read into it is still queued. Packet mode
+    transfers are never held for interrupt moderation, but one stays on
+    the Ready list behind a plain read that is. IOCTL_FREE_DMA_BUFFER has
+    to refuse with STATUS_DEVICE_BUSY, and the read still has to land.
+    Two writes of as many bytes go first to keep the loopback in step.
+
+--*/
+{
+    UCHAR                   input[FIELD_OFFSET(HSAC_PACKET_BATCH, Entries) +
+                                  sizeof(HSAC_PACKET_ENTRY)];
+    PHSAC_PACKET_BATCH      packets = (PHSAC_PACKET_BATCH) input;
+    HSAC_PACKET_RESULT      result;
+    HSAC_INT_MODERATION     moderation;
+    HSAC_LOAD_BATCH         batch;
+    PUCHAR                  held;
+    NTSTATUS                status = STATUS_SUCCESS;
+    NTSTATUS                freeStatus = STATUS_SUCCESS;
+    ULONG                   i;
+
+    for (i = 0; i < 2 && NT_SUCCESS(status); i++) {
+        status = HsacLoadHeapBatch(Device, 0, WriteBuffer, &Size, 1, &result);
+        if (NT_SUCCESS(status) && (!NT_SUCCESS(result.Status) || result.Bytes != Size)) {
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap: write before the busy free failed 0x%08x\n", status);
+        return status;
+    }
+
+    held = (PUCHAR) malloc(Size);
+    if (!held) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    moderation.Channel = 1;
+    moderation.Count   = HSAC_MAX_OUTSTANDING_REQUESTS;
+    moderation.DelayUs = HSAC_INT_MODERATION_MAX_DELAY_US;
+    status = HsacLoadIoctl(Device, IOCTL_SET_INT_MODERATION,
+                           &moderation, sizeof(moderation), NULL, 0);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap: IOCTL_SET_INT_MODERATION failed 0x%08x\n", status);
+        free(held);
+        return status;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    pthread_mutex_init(&batch.Lock, NULL);
+    pthread_cond_init(&batch.Cond, NULL);
+    batch.Pending = 2;
+
+    packets->Count = 1;
+    packets->Entries[0].Channel = 1;
+    packets->Entries[0].Index   = ReadBuffer->Handle;
+    packets->Entries[0].Size    = Size;
+
+    //
+    // The plain read has to be on the channel first, or the batch starts
+    // at once.
+    //
+    status = WdfShimSubmitRequest(Device, WdfRequestTypeRead, 0, NULL, 0, held, Size,
+                                  HsacLoadBatchCompletion, &batch, NULL);
+    if (NT_SUCCESS(status)) {
+        HsacLoadWaitInFlight(Device, 1, 1);
+        status = WdfShimSubmitFileRequest(File, WdfRequestTypeDeviceControl,
+                                          IOCTL_PACKET_BATCH, packets, sizeof(input),
+                                          &result, sizeof(result),
+                                          HsacLoadBatchCompletion, &batch, NULL);
+        pthread_mutex_lock(&batch.Lock);
+        batch.Pending -= NT_SUCCESS(status) ? 0 : 1;
+        pthread_mutex_unlock(&batch.Lock);
+    } else {
+        batch.Pending = 0;
+    }
+
+    if (NT_SUCCESS(status)) {
+        HsacLoadWaitInFlight(Device, 1, 2);
+    }
+
+    if (NT_SUCCESS(status)) {
+        freeStatus = WdfShimSubmitFileRequestSynchronously(File,
+            WdfRequestTypeDeviceControl, IOCTL_FREE_DMA_BUFFER,
+            &ReadBuffer->Handle, sizeof(ULONG), NULL, 0, NULL);
+    }
+
+    pthread_mutex_lock(&batch.Lock);
+    while (batch.Pending) {
+        pthread_cond_wait(&batch.Cond, &batch.Lock);
+    }
+    pthread_mutex_unlock(&batch.Lock);
+
+    if (NT_SUCCESS(status)) {
+        status = batch.Status;
+    }
+    if (NT_SUCCESS(status) && (batch.Short || !NT_SUCCESS(result.Status) ||
+                               result.Bytes != Size)) {
+        status = NT_SUCCESS(result.Status) ? STATUS_UNSUCCESSFUL : result.Status;
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap: reads around the busy free failed 0x%08x\n", status);
+    } else if (freeStatus != STATUS_DEVICE_BUSY) {
+        fprintf(stderr, "heap: freeing a buffer a queued transfer names returned 0x%08x\n",
+                freeStatus);
+        status = STATUS_UNSUCCESSFUL;
+    } else if (memcmp((PVOID) (ULONG_PTR) WriteBuffer->Address, held, Size) != 0 ||
+               memcmp((PVOID) (ULONG_PTR) WriteBuffer->Address,
+                      (PVOID) (ULONG_PTR) ReadBuffer->Address, Size) != 0) {
+        fprintf(stderr, "heap: data mismatch around the busy free\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    pthread_cond_destroy(&batch.Cond);
+    pthread_mutex_destroy(&batch.Lock);
+
+    moderation.Count   = 1;
+    moderation.DelayUs = 0;
+    (VOID) HsacLoadIoctl(Device, IOCTL_SET_INT_MODERATION,
+                         &moderation, sizeof(moderation), NULL, 0);
+
+    free(held);
+
+    return status;
+}
+
+static PVOID
+HsacLoadHeapCloseThread(
+    PVOID Context
+    )
+{
+    WdfShimFileClose((WDFFILEOBJECT) Context);
+
+    return NULL;
+}
+
+static NTSTATUS
+HsacLoadHeapClose(
+    WDFDEVICE Device,
+    ULONG Size
+    )
+/*++
+
+Routine Description:
+
+    Close a handle while a read into one of its heap buffers is still
+    queued, held behind a plain read as in HsacLoadHeapBusy. The close
+    waits for the read while another handle allocates and frees a
+    buffer. Both reads still have to complete, and no buffer may be
+    left afterwards.
+
+--*/
+{
+    UCHAR                   input[FIELD_OFFSET(HSAC_PACKET_BATCH, Entries) +
+                                  sizeof(HSAC_PACKET_ENTRY)];
+    PHSAC_PACKET_BATCH      packets = (PHSAC_PACKET_BATCH) input;
+    HSAC_DMA_BUFFER         buffers[2];
+    HSAC_DMA_BUFFER         other;
+    HSAC_DMA_ALLOC          alloc = { 0, 0 };
+    HSAC_PACKET_RESULT      result;
+    HSAC_INT_MODERATION     moderation;
+    HSAC_LOAD_BATCH         batch;
+    HSAC_STATS              stats;
+    WDFFILEOBJECT           file;
+    WDFFILEOBJECT           otherFile;
+    pthread_t               thread;
+    PUCHAR                  held;
+    NTSTATUS                status;
+    ULONG                   i;
+
+    held = (PUCHAR) malloc(Size);
+    if (!held) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap close: open failed 0x%08x\n", status);
+        free(held);
+        return status;
+    }
+    status = WdfShimFileOpen(Device, &otherFile);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap close: open failed 0x%08x\n", status);
+        WdfShimFileClose(file);
+        free(held);
+        return status;
+    }
+
+    alloc.Size = Size;
+    for (i = 0; i < 2 && NT_SUCCESS(status); i++) {
+        status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                       IOCTL_ALLOC_DMA_BUFFER,
+                                                       &alloc, sizeof(alloc),
+                                                       &buffers[i], sizeof(buffers[i]), NULL);
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap close: IOCTL_ALLOC_DMA_BUFFER failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    //
+    // Two writes first, to keep the loopback in step.
+    //
+    HsacLoadFill((PUCHAR) (ULONG_PTR) buffers[0].Address, Size, 0);
+    for (i = 0; i < 2 && NT_SUCCESS(status); i++) {
+        status = HsacLoadHeapBatch(Device, 0, &buffers[0], &Size, 1, &result);
+        if (NT_SUCCESS(status) && (!NT_SUCCESS(result.Status) || result.Bytes != Size)) {
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap close: write before the close failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    moderation.Channel = 1;
+    moderation.Count   = HSAC_MAX_OUTSTANDING_REQUESTS;
+    moderation.DelayUs = HSAC_INT_MODERATION_MAX_DELAY_US;
+    status = HsacLoadIoctl(Device, IOCTL_SET_INT_MODERATION,
+                           &moderation, sizeof(moderation), NULL, 0);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap close: IOCTL_SET_INT_MODERATION failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    pthread_mutex_init(&batch.Lock, NULL);
+    pthread_cond_init(&batch.Cond, NULL);
+    batch.Pending = 2;
+
+    packets->Count = 1;
+    packets->Entries[0].Channel = 1;
+    packets->Entries[0].Index   = buffers[1].Handle;
+    packets->Entries[0].Size    = Size;
+
+    //
+    // The read naming the buffer goes through the other handle, so that
+    // closing this one does not cancel it.
+    //
+    status = WdfShimSubmitRequest(Device, WdfRequestTypeRead, 0, NULL, 0, held, Size,
+                                  HsacLoadBatchCompletion, &batch, NULL);
+    if (NT_SUCCESS(status)) {
+        HsacLoadWaitInFlight(Device, 1, 1);
+        status = WdfShimSubmitFileRequest(otherFile, WdfRequestTypeDeviceControl,
+                                          IOCTL_PACKET_BATCH, packets, sizeof(input),
+                                          &result, sizeof(result),
+                                          HsacLoadBatchCompletion, &batch, NULL);
+        pthread_mutex_lock(&batch.Lock);
+        batch.Pending -= NT_SUCCESS(status) ? 0 : 1;
+        pthread_mutex_unlock(&batch.Lock);
+    } else {
+        batch.Pending = 0;
+    }
+
+    if (NT_SUCCESS(status)) {
+        HsacLoadWaitInFlight(Device, 1, 2);
+
+        if (pthread_create(&thread, NULL, HsacLoadHeapCloseThread, file) != 0) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        } else {
+            alloc.Size = Size;
+            status = WdfShimSubmitFileRequestSynchronously(otherFile,
+                WdfRequestTypeDeviceControl, IOCTL_ALLOC_DMA_BUFFER,
+                &alloc, sizeof(alloc), &other, sizeof(other), NULL);
+            if (NT_SUCCESS(status)) {
+                status = WdfShimSubmitFileRequestSynchronously(otherFile,
+                    WdfRequestTypeDeviceControl, IOCTL_FREE_DMA_BUFFER,
+                    &other.Handle, sizeof(ULONG), NULL, 0, NULL);
+            }
+            if (!NT_SUCCESS(status)) {
+                fprintf(stderr, "heap close: another handle's allocation during the close"
+                        " failed 0x%08x\n", status);
+            }
+
+            pthread_join(thread, NULL);
+            file = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&batch.Lock);
+    while (batch.Pending) {
+        pthread_cond_wait(&batch.Cond, &batch.Lock);
+    }
+    pthread_mutex_unlock(&batch.Lock);
+
+    if (NT_SUCCESS(status)) {
+        status = batch.Status;
+    }
+    if (NT_SUCCESS(status) && (batch.Short || !NT_SUCCESS(result.Status) ||
+                               result.Bytes != Size)) {
+        status = NT_SUCCESS(result.Status) ? STATUS_UNSUCCESSFUL : result.Status;
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap close: reads around the close failed 0x%08x\n", status);
+    }
+
+    pthread_cond_destroy(&batch.Cond);
+    pthread_mutex_destroy(&batch.Lock);
+
+    moderation.Count   = 1;
+    moderation.DelayUs = 0;
+    (VOID) HsacLoadIoctl(Device, IOCTL_SET_INT_MODERATION,
+                         &moderation, sizeof(moderation), NULL, 0);
+
+Exit:
+    if (file) {
+        WdfShimFileClose(file);
+    }
+    WdfShimFileClose(otherFile);
+    free(held);
+
+    if (NT_SUCCESS(status)) {
+        status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &stats, sizeof(stats));
+        if (NT_SUCCESS(status) && (stats.HeapBuffers != 0 || stats.HeapBytes != 0)) {
+            fprintf(stderr, "heap close: %d buffers, %lld bytes left after the close\n",
+                    stats.HeapBuffers, stats.HeapBytes);
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadHeapRun(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    HsacLoadHeap, with the common buffers out of the way.
+
+--*/
+{
+    static const ULONG  sizes[] = { 64, 4096, 4104, 20000, 65536, 300000, 1048576, ~0u };
+    HSAC_DMA_BUFFER     writeBuffers[HSAC_LOAD_HEAP_BUFFERS];
+    HSAC_DMA_BUFFER     readBuffers[HSAC_LOAD_HEAP_BUFFERS];
+    HSAC_PACKET_RESULT  results[HSAC_LOAD_HEAP_BUFFERS];
+    HSAC_STATS          stats;
+    HSAC_DMA_ALLOC      alloc = { 0, 0 };
+    ULONG               size[HSAC_LOAD_HEAP_BUFFERS];
+    ULONG               rounds;
+    ULONG               regions;
+    ULONGLONG           asked = 0, given = 0, moved = 0;
+    WDFFILEOBJECT       file;
+    NTSTATUS            status;
+    double              start, elapsed;
+    ULONG               i, j;
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap: open failed 0x%08x\n", status);
+        return status;
+    }
+
+    for (i = 0; i < 2 * HSAC_LOAD_HEAP_BUFFERS && NT_SUCCESS(status); i++) {
+
+        PHSAC_DMA_BUFFER buffer = (i < HSAC_LOAD_HEAP_BUFFERS) ?
+            &writeBuffers[i] : &readBuffers[i - HSAC_LOAD_HEAP_BUFFERS];
+
+        j = i % HSAC_LOAD_HEAP_BUFFERS;
+        size[j] = sizes[j % RTL_NUMBER_OF(sizes)];
+        if (size[j] > Options->Size) {
+            size[j] = Options->Size;
+        }
+        size[j] &= ~7u;
+
+        alloc.Size = size[j];
+        status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                       IOCTL_ALLOC_DMA_BUFFER,
+                                                       &alloc, sizeof(alloc),
+                                                       buffer, sizeof(*buffer), NULL);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "heap: IOCTL_ALLOC_DMA_BUFFER(%u) failed 0x%08x\n",
+                    alloc.Size, status);
+            break;
+        }
+
+        if (!(buffer->Handle & HSAC_HEAP_HANDLE) || buffer->Address == 0 ||
+            buffer->Size < alloc.Size || buffer->Size < HSAC_HEAP_MIN_BLOCK ||
+            (buffer->Size & (buffer->Size - 1)) != 0 ||
+            memchr((PVOID) (ULONG_PTR) buffer->Address, 0, 1) == NULL ||
+            memcmp((PVOID) (ULONG_PTR) buffer->Address,
+                   (PUCHAR) (ULONG_PTR) buffer->Address + 1, buffer->Size - 1) != 0) {
+            fprintf(stderr, "heap: %u bytes asked, handle 0x%08x of %u bytes at 0x%llx,"
+                    " not zeroed or not a power of two pages\n",
+                    alloc.Size, buffer->Handle, buffer->Size, buffer->Address);
+            status = STATUS_UNSUCCESSFUL;
+            break;
+        }
+
+        asked += alloc.Size;
+        given += buffer->Size;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        WdfShimFileClose(file);
+        return status;
+    }
+
+    rounds = Options->Iterations / HSAC_LOAD_HEAP_BUFFERS;
+    if (rounds == 0) {
+        rounds = 1;
+    }
+
+    start = HsacLoadSeconds();
+
+    for (i = 0; i < rounds && NT_SUCCESS(status); i++) {
+
+        for (j = 0; j < HSAC_LOAD_HEAP_BUFFERS; j++) {
+            HsacLoadFill((PUCHAR) (ULONG_PTR) writeBuffers[j].Address, size[j],
+                         i * HSAC_LOAD_HEAP_BUFFERS + j);
+        }
+
+        status = HsacLoadHeapBatch(Device, 0, writeBuffers, size,
+                                   HSAC_LOAD_HEAP_BUFFERS, results);
+        for (j = 0; j < HSAC_LOAD_HEAP_BUFFERS && NT_SUCCESS(status); j++) {
+            if (!NT_SUCCESS(results[j].Status) || results[j].Bytes != size[j]) {
+                status = NT_SUCCESS(results[j].Status) ? STATUS_UNSUCCESSFUL : results[j].Status;
+            }
+        }
+        if (NT_SUCCESS(status)) {
+            status = HsacLoadHeapBatch(Device, 1, readBuffers, size,
+                                       HSAC_LOAD_HEAP_BUFFERS, results);
+        }
+        for (j = 0; j < HSAC_LOAD_HEAP_BUFFERS && NT_SUCCESS(status); j++) {
+            if (!NT_SUCCESS(results[j].Status) || results[j].Bytes != size[j]) {
+                status = NT_SUCCESS(results[j].Status) ? STATUS_UNSUCCESSFUL : results[j].Status;
+            }
+        }
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "heap: batch %u failed 0x%08x\n", i, status);
+            break;
+        }
+
+        for (j = 0; j < HSAC_LOAD_HEAP_BUFFERS; j++) {
+            if (memcmp((PVOID) (ULONG_PTR) writeBuffers[j].Address,
+                       (PVOID) (ULONG_PTR) readBuffers[j].Address, size[j]) != 0) {
+                fprintf(stderr, "heap: data mismatch in batch %u, buffer %u\n", i, j);
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+            moved += size[j];
+        }
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+
+    //
+    // Past the end of a buffer, then a freed one.
+    //
+    if (NT_SUCCESS(status)) {
+
+        size[0] = writeBuffers[0].Size + 8;
+        if (NT_SUCCESS(HsacLoadHeapBatch(Device, 0, writeBuffers, size, 1, results)) &&
+            NT_SUCCESS(results[0].Status)) {
+            fprintf(stderr, "heap: a %u byte transfer from a %u byte buffer was not refused\n",
+                    size[0], writeBuffers[0].Size);
+            status = STATUS_UNSUCCESSFUL;
+        }
+        size[0] = writeBuffers[0].Size;
+    }
+
+    //
+    // And one still in use.
+    //
+    if (NT_SUCCESS(status)) {
+        status = HsacLoadHeapBusy(Device, file, &writeBuffers[0], &readBuffers[0], size[0]);
+    }
+
+    for (i = 0; i < HSAC_LOAD_HEAP_BUFFERS; i++) {
+        NTSTATUS freeStatus = WdfShimSubmitFileRequestSynchronously(file,
+            WdfRequestTypeDeviceControl, IOCTL_FREE_DMA_BUFFER,
+            &readBuffers[i].Handle, sizeof(ULONG), NULL, 0, NULL);
+
+        if (!NT_SUCCESS(freeStatus) && NT_SUCCESS(status)) {
+            fprintf(stderr, "heap: IOCTL_FREE_DMA_BUFFER failed 0x%08x\n", freeStatus);
+            status = freeStatus;
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+        if (NT_SUCCESS(WdfShimSubmitFileRequestSynchronously(file,
+                WdfRequestTypeDeviceControl, IOCTL_FREE_DMA_BUFFER,
+                &readBuffers[0].Handle, sizeof(ULONG), NULL, 0, NULL)) ||
+            (NT_SUCCESS(HsacLoadHeapBatch(Device, 1, readBuffers, size, 1, results)) &&
+             NT_SUCCESS(results[0].Status))) {
+            fprintf(stderr, "heap: a freed handle was taken\n");
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    //
+    // Closing the handle frees the write buffers.
+    //
+    WdfShimFileClose(file);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    //
+    // Every buffer merged back: each region is whole again, and can be
+    // had in one piece without adding another.
+    //
+    status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &stats, sizeof(stats));
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap: IOCTL_GET_STATS failed 0x%08x\n", status);
+        return status;
+    }
+    if (stats.HeapBuffers != 0 || stats.HeapBytes != 0 ||
+        stats.HeapRegions == 0 || stats.HeapRegions > HSAC_HEAP_REGIONS) {
+        fprintf(stderr, "heap: %d buffers, %lld bytes left in %d regions after close\n",
+                stats.HeapBuffers, stats.HeapBytes, stats.HeapRegions);
+        return STATUS_UNSUCCESSFUL;
+    }
+    regions = (ULONG) stats.HeapRegions;
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "heap: open failed 0x%08x\n", status);
+        return status;
+    }
+
+    alloc.Size = HSAC_HEAP_REGION_SIZE;
+    for (i = 0; i < regions && NT_SUCCESS(status); i++) {
+        status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                       IOCTL_ALLOC_DMA_BUFFER,
+                                                       &alloc, sizeof(alloc),
+                                                       &writeBuffers[0], sizeof(writeBuffers[0]),
+                                                       NULL);
+    }
+    if (NT_SUCCESS(status)) {
+        status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &stats, sizeof(stats));
+    }
+    if (!NT_SUCCESS(status) || (ULONG) stats.HeapRegions != regions) {
+        fprintf(stderr, "heap: whole region %u of %u: 0x%08x, %d regions\n",
+                i, regions, status, stats.HeapRegions);
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    WdfShimFileClose(file);
+
+    //
+    // And closed with a buffer still in use.
+    //
+    if (NT_SUCCESS(status)) {
+        status = HsacLoadHeapClose(Device, size[0]);
+    }
+
+    if (NT_SUCCESS(status)) {
+        printf("heap:   %u buffers, %.1f MB asked, %.1f MB given (%.1f MB as common buffers)"
+               " in %u regions; %.1f MB write+read in %.3f s (%.1f MB/s per direction)\n",
+               2 * HSAC_LOAD_HEAP_BUFFERS, (double) asked / 1e6, (double) given / 1e6,
+               2.0 * HSAC_LOAD_HEAP_BUFFERS * Options->BufferSize / 1e6, regions,
+               (double) moved / 1e6, elapsed, (double) moved / elapsed / 1e6);
+    }
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadHeap(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    The packet loopback on buffers from IOCTL_ALLOC_DMA_BUFFER, of sizes
+    from 64 bytes up to the transfer size: each batch writes them all
+    and reads them back into as many more. Then a transfer past the end
+    of a buffer, freeing one a transfer still names (HsacLoadHeapBusy)
+    and a freed handle have to be refused, the handle is
+    closed with buffers still allocated, and a new one has to get every
+    region back whole. Last, a handle is closed with a buffer a transfer
+    still names (HsacLoadHeapClose). The common buffers are not needed
+    meanwhile, so each channel keeps only one page of them.
+
+--*/
+{
+    HSAC_BUFFER_GEOMETRY    original[2];
+    HSAC_BUFFER_GEOMETRY    geometry;
+    NTSTATUS                status;
+    ULONG                   i, j;
+
+    for (i = 0; i < 2; i++) {
+        status = HsacLoadIoctl(Device, IOCTL_GET_BUFFER_GEOMETRY, &i, sizeof(i),
+                               &original[i], sizeof(original[i]));
+        if (NT_SUCCESS(status)) {
+            geometry.Channel = i;
+            geometry.Count   = 1;
+            geometry.Size    = HSAC_HEAP_MIN_BLOCK;
+            status = HsacLoadIoctl(Device, IOCTL_SET_BUFFER_GEOMETRY,
+                                   &geometry, sizeof(geometry), NULL, 0);
+        }
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "heap: shrinking channel %u's common buffers failed 0x%08x\n",
+                    i, status);
+            goto Restore;
+        }
+    }
+
+    status = HsacLoadHeapRun(Device, Options);
+
+Restore:
+    for (j = 0; j < i; j++) {
+        NTSTATUS restoreStatus = HsacLoadIoctl(Device, IOCTL_SET_BUFFER_GEOMETRY,
+                                               &original[j], sizeof(original[j]), NULL, 0);
+
+        if (!NT_SUCCESS(restoreStatus) && NT_SUCCESS(status)) {
+            fprintf(stderr, "heap: restoring channel %u's common buffers failed 0x%08x\n",
+                    j, restoreStatus);
+            status = restoreStatus;
+        }
+    }
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadPlayback(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Streaming playback: fill HSAC_LOAD_STREAM_BUFFERS write buffers
+    with the pattern as the driver sends them, then read it back from
+    the card in chains and check it. Halfway through the writer sleeps,
+    so the stream underruns and has to resume by itself.
+
+--*/
+{
+    PUCHAR              readBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PUCHAR              writeBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PUCHAR              expected = NULL;
+    PHSAC_STREAM_PAGE   page;
+    HSAC_STREAM_START   startStream;
+    WDFFILEOBJECT       file;
+    ULONGLONG           address;
+    ULONG               which;
+    ULONG               size;
+    ULONG               batch;
+    ULONG               producer;
+    ULONG               channel;
+    ULONG               underruns;
+    ULONG_PTR           information;
+    NTSTATUS            status;
+    double              start, elapsed;
+    ULONG               i, j;
+
+    size = Options->Size & ~7u;
+    if (size > Options->BufferSize) {
+        size = Options->BufferSize;
+    }
+
+    which = 0;
+    status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                           readBuffers, sizeof(readBuffers));
+    if (NT_SUCCESS(status)) {
+        which = 1;
+        status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                               writeBuffers, sizeof(writeBuffers));
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "playback: IOCTL_MAP_DMA_BUF_ADDR failed 0x%08x\n", status);
+        return status;
+    }
+
+    expected = (PUCHAR) malloc(size);
+    if (expected == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "playback: open failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    startStream.Channel    = 0;
+    startStream.Buffers    = HSAC_LOAD_STREAM_BUFFERS;
+    startStream.BufferSize = size;
+
+    start = HsacLoadSeconds();
+
+    status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                   IOCTL_START_STREAM,
+                                                   &startStream, sizeof(startStream),
+                                                   &address, sizeof(address),
+                                                   &information);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "playback: IOCTL_START_STREAM failed 0x%08x\n", status);
+        WdfShimFileClose(file);
+        goto Exit;
+    }
+    page = (PHSAC_STREAM_PAGE) (ULONG_PTR) address;
+
+    for (producer = 0; producer < Options->Iterations; producer++) {
+
+        while (producer - __atomic_load_n(&page->Consumer, __ATOMIC_ACQUIRE) ==
+               HSAC_LOAD_STREAM_BUFFERS) {
+            sched_yield();
+        }
+
+        which = producer % HSAC_LOAD_STREAM_BUFFERS;
+        HsacLoadFill(writeBuffers[which], size, producer);
+        page->Bytes[which] = size;
+
+        __atomic_store_n(&page->Producer, producer + 1, __ATOMIC_RELEASE);
+
+        if (producer == Options->Iterations / 2) {
+            usleep(5000);
+        }
+    }
+
+    while (__atomic_load_n(&page->Consumer, __ATOMIC_ACQUIRE) != Options->Iterations) {
+        sched_yield();
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+
+    //
+    // The last buffer leaves the stream dry, which counts too.
+    //
+    underruns = __atomic_load_n(&page->Underruns, __ATOMIC_ACQUIRE);
+
+    channel = 0;
+    (VOID) WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                 IOCTL_STOP_STREAM,
+                                                 &channel, sizeof(channel),
+                                                 NULL, 0, &information);
+    WdfShimFileClose(file);
+
+    for (i = 0; i < Options->Iterations && NT_SUCCESS(status); i += batch) {
+
+        batch = Options->Iterations - i;
+        if (batch > Options->Buffers / 2) {
+            batch = Options->Buffers / 2;
+        }
+        if (batch > HSAC_MAX_BATCH_ENTRIES) {
+            batch = HSAC_MAX_BATCH_ENTRIES;
+        }
+
+        status = HsacLoadBatchRun(Device, IOCTL_PACKET_CHAIN, 1, i, batch, size, Options->Buffers);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        for (j = 0; j < batch; j++) {
+            HsacLoadFill(expected, size, i + j);
+            if (memcmp(readBuffers[((i + j) * 7 + 3) % Options->Buffers],
+                       expected, size) != 0) {
+                fprintf(stderr, "playback: data mismatch in buffer %u\n", i + j);
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+        printf("playback: %u x %u bytes in %.3f s (%.1f MB/s), %u underruns\n",
+               Options->Iterations, size, elapsed,
+               (double) Options->Iterations * size / elapsed / 1e6, underruns);
+    }
+
+Exit:
+    free(expected);
+    (VOID) HsacLoadIoctl(Device, IOCTL_UNMAP_DMA_BUF_ADDR, NULL, 0, NULL, 0);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadCapture(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Streaming capture: write the pattern to the card in chains, start a
+    capture stream over HSAC_LOAD_STREAM_BUFFERS read buffers, and
+    check each buffer as the driver publishes it. Halfway through the
+    reader sleeps, so the stream stalls and has to resume by itself.
+
+--*/
+{
+    PUCHAR              readBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PUCHAR              writeBuffers[HSAC_MAX_TRANSFER_BUFFERS];
+    PUCHAR              expected = NULL;
+    PHSAC_STREAM_PAGE   page;
+    HSAC_STREAM_START   startStream;
+    WDFFILEOBJECT       file;
+    ULONGLONG           address;
+    ULONG               which;
+    ULONG               size;
+    ULONG               batch;
+    ULONG               producer;
+    ULONG               consumer;
+    ULONG               channel;
+    ULONG_PTR           information;
+    NTSTATUS            status;
+    double              start, elapsed;
+    ULONG               i, j;
+
+    size = Options->Size & ~7u;
+    if (size > Options->BufferSize) {
+        size = Options->BufferSize;
+    }
+
+    which = 0;
+    status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                           readBuffers, sizeof(readBuffers));
+    if (NT_SUCCESS(status)) {
+        which = 1;
+        status = HsacLoadIoctl(Device, IOCTL_MAP_DMA_BUF_ADDR, &which, sizeof(which),
+                               writeBuffers, sizeof(writeBuffers));
+    }
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "capture: IOCTL_MAP_DMA_BUF_ADDR failed 0x%08x\n", status);
+        return status;
+    }
+
+    expected = (PUCHAR) malloc(size);
+    if (expected == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    for (i = 0; i < Options->Iterations; i += batch) {
+
+        batch = Options->Iterations - i;
+        if (batch > Options->Buffers / 2) {
+            batch = Options->Buffers / 2;
+        }
+        if (batch > HSAC_MAX_BATCH_ENTRIES) {
+            batch = HSAC_MAX_BATCH_ENTRIES;
+        }
+
+        for (j = 0; j < batch; j++) {
+            HsacLoadFill(writeBuffers[(i + j) % Options->Buffers], size, i + j);
+        }
+
+        status = HsacLoadBatchRun(Device, IOCTL_PACKET_CHAIN, 0, i, batch, size, Options->Buffers);
+        if (!NT_SUCCESS(status)) {
+            goto Exit;
+        }
+    }
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "capture: open failed 0x%08x\n", status);
+        goto Exit;
+    }
+
+    startStream.Channel    = 1;
+    startStream.Buffers    = HSAC_LOAD_STREAM_BUFFERS;
+    startStream.BufferSize = size;
+
+    start = HsacLoadSeconds();
+
+    status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                   IOCTL_START_STREAM,
+                                                   &startStream, sizeof(startStream),
+                                                   &address, sizeof(address),
+                                                   &information);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "capture: IOCTL_START_STREAM failed 0x%08x\n", status);
+        WdfShimFileClose(file);
+        goto Exit;
+    }
+    page = (PHSAC_STREAM_PAGE) (ULONG_PTR) address;
+
+    //
+    // The running stream keeps the device from idling out of D0.
+    //
+    if (WdfShimDeviceIdleReferences(Device) != 1) {
+        fprintf(stderr, "capture: %d idle references while streaming\n",
+                WdfShimDeviceIdleReferences(Device));
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    for (consumer = 0; consumer < Options->Iterations && NT_SUCCESS(status); ) {
+
+        producer = __atomic_load_n(&page->Producer, __ATOMIC_ACQUIRE);
+        if (producer == consumer) {
+            sched_yield();
+            continue;
+        }
+
+        for (; consumer != producer && consumer < Options->Iterations; consumer++) {
+
+            which = consumer % HSAC_LOAD_STREAM_BUFFERS;
+            HsacLoadFill(expected, size, consumer);
+
+            if (page->Bytes[which] != size ||
+                memcmp(readBuffers[which], expected, size) != 0) {
+                fprintf(stderr, "capture: data mismatch in buffer %u\n", consumer);
+                status = STATUS_UNSUCCESSFUL;
+                break;
+            }
+
+            __atomic_store_n(&page->Consumer, consumer + 1, __ATOMIC_RELEASE);
+
+            if (consumer == Options->Iterations / 2) {
+                usleep(5000);
+            }
+        }
+    }
+
+    elapsed = HsacLoadSeconds() - start;
+
+    if (NT_SUCCESS(status)) {
+        printf("capture: %u x %u bytes in %.3f s (%.1f MB/s), %u overflows,"
+               " last at buffer %u\n",
+               Options->Iterations, size, elapsed,
+               (double) Options->Iterations * size / elapsed / 1e6,
+               __atomic_load_n(&page->Overflows, __ATOMIC_ACQUIRE),
+               __atomic_load_n(&page->OverflowProducer, __ATOMIC_ACQUIRE));
+    }
+
+    channel = 1;
+    (VOID) WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                 IOCTL_STOP_STREAM,
+                                                 &channel, sizeof(channel),
+                                                 NULL, 0, &information);
+    WdfShimFileClose(file);
+
+    if (NT_SUCCESS(status) && WdfShimDeviceIdleReferences(Device) != 0) {
+        fprintf(stderr, "capture: idle reference kept after the stream stopped\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+Exit:
+    free(expected);
+    (VOID) HsacLoadIoctl(Device, IOCTL_UNMAP_DMA_BUF_ADDR, NULL, 0, NULL, 0);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadStopPlayback(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Stop the device under a playback stream that has every buffer filled,
+    as removal would, and check that the stream let go: it held the
+    device's idle reference while running, it halted with the buffers
+    the card had not sent taken back, and closing its handle neither
+    waits on the card nor keeps the reference. Leaves the device stopped.
+
+--*/
+{
+    PHSAC_STREAM_PAGE   page;
+    HSAC_STREAM_START   startStream;
+    WDFFILEOBJECT       file;
+    ULONGLONG           address;
+    ULONG               size;
+    ULONG               sent;
+    ULONG               which;
+    ULONG_PTR           information;
+    NTSTATUS            status;
+    double              start;
+
+    size = Options->Size & ~7u;
+    if (size > Options->BufferSize) {
+        size = Options->BufferSize;
+    }
+
+    status = WdfShimFileOpen(Device, &file);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "stop playback: open failed 0x%08x\n", status);
+        return status;
+    }
+
+    startStream.Channel    = 0;
+    startStream.Buffers    = HSAC_LOAD_STREAM_BUFFERS;
+    startStream.BufferSize = size;
+
+    status = WdfShimSubmitFileRequestSynchronously(file, WdfRequestTypeDeviceControl,
+                                                   IOCTL_START_STREAM,
+                                                   &startStream, sizeof(startStream),
+                                                   &address, sizeof(address),
+                                                   &information);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "stop playback: IOCTL_START_STREAM failed 0x%08x\n", status);
+        WdfShimFileClose(file);
+        return status;
+    }
+    page = (PHSAC_STREAM_PAGE) (ULONG_PTR) address;
+
+    if (WdfShimDeviceIdleReferences(Device) != 1) {
+        fprintf(stderr, "stop playback: %d idle references while streaming\n",
+                WdfShimDeviceIdleReferences(Device));
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    for (which = 0; which < HSAC_LOAD_STREAM_BUFFERS; which++) {
+        page->Bytes[which] = size;
+    }
+    __atomic_store_n(&page->Producer, HSAC_LOAD_STREAM_BUFFERS, __ATOMIC_RELEASE);
+
+    //
+    // Stop once the stream has buffers on the card.
+    //
+    HsacLoadWaitInFlight(Device, 0, 2);
+
+    WdfShimDeviceStop(Device);
+
+    sent = __atomic_load_n(&page->Consumer, __ATOMIC_ACQUIRE);
+
+    if (NT_SUCCESS(status) &&
+        __atomic_load_n(&page->Status, __ATOMIC_ACQUIRE) != STATUS_CANCELLED) {
+        fprintf(stderr, "stop playback: stream status 0x%08x after the device stopped\n",
+                __atomic_load_n(&page->Status, __ATOMIC_ACQUIRE));
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    //
+    // Halted: what is filled now is not sent.
+    //
+    __atomic_store_n(&page->Producer, HSAC_LOAD_STREAM_BUFFERS + 1, __ATOMIC_RELEASE);
+    usleep(5000);
+
+    if (NT_SUCCESS(status) &&
+        __atomic_load_n(&page->Consumer, __ATOMIC_ACQUIRE) != sent) {
+        fprintf(stderr, "stop playback: buffers sent after the device stopped\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    start = HsacLoadSeconds();
+    WdfShimFileClose(file);
+
+    if (NT_SUCCESS(status) && HsacLoadSeconds() - start >= 1.0) {
+        fprintf(stderr, "stop playback: close took %.3f s\n", HsacLoadSeconds() - start);
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    if (NT_SUCCESS(status) && WdfShimDeviceIdleReferences(Device) != 0) {
+        fprintf(stderr, "stop playback: idle reference kept after the stream stopped\n");
+        status = STATUS_UNSUCCESSFUL;
+    }
+
+    if (NT_SUCCESS(status)) {
+        printf("stop playback: %u of %u buffers sent or taken back at the stop\n",
+               sent, HSAC_LOAD_STREAM_BUFFERS);
+    }
+
+    return status;
+}
+
+static VOID
+HsacLoadStats(
+    WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Print the driver's IOCTL_GET_STATS counters for the whole run.
+
+--*/
+{
+    HSAC_STATS  stats;
+    NTSTATUS    status;
+    LONGLONG    errors;
+    ULONG       channel;
+    ULONG       i;
+
+    status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &stats, sizeof(stats));
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "stats: IOCTL_GET_STATS failed 0x%08x\n", status);
+        return;
+    }
+
+    for (channel = 0; channel < 2; channel++) {
+
+        PHSAC_CHANNEL_STATS s = &stats.Channel[channel];
+
+        errors = 0;
+        for (i = 1; i < RTL_NUMBER_OF(s->ChannelStates); i++) {
+            errors += s->ChannelStates[i];
+        }
+
+        printf("stats:  %s %.1f MB, %lld transfers, %lld programs, %lld interrupts,"
+               " %lld DPCs (%.1f, max %d completions each), max %d DTEs,"
+               " %lld cancelled, %lld errors\n",
+               (channel == 0) ? "write" : "read ",
+               (double) s->Bytes / 1e6, s->Transfers, s->Programs, s->Interrupts,
+               s->DpcRuns, s->DpcRuns ? (double) s->Completions / s->DpcRuns : 0.0,
+               s->MaxCompletionsPerDpc, s->MaxDtes, s->Cancellations, errors);
+    }
+
+    printf("stats:  %d write and %d read common buffers allocated\n",
+           stats.Channel[0].Buffers, stats.Channel[1].Buffers);
+    printf("stats:  %d heap regions, %d heap buffers (%lld bytes) allocated\n",
+           stats.HeapRegions, stats.HeapBuffers, stats.HeapBytes);
+
+    printf("stats:  %lld interrupts, %lld spurious\n", stats.Interrupts, stats.Spurious);
+}
+
+static VOID
+HsacLoadMonitorRead(
+    PHSAC_LOAD_MONITOR Monitor,
+    PHSAC_STATS_PAGE Snapshot
+    )
+/*++
+
+Routine Description:
+
+    Copy the stats page the way Public.h says a reader must: retry
+    while the driver is writing it or wrote it during the copy.
+
+--*/
+{
+    PLONGLONG   from = &Monitor->Page->Frequency;
+    PLONGLONG   to = &Snapshot->Frequency;
+    ULONG       words;
+    ULONG       sequence;
+    ULONG       i;
+
+    words = (sizeof(HSAC_STATS_PAGE) - FIELD_OFFSET(HSAC_STATS_PAGE, Frequency)) /
+            sizeof(LONGLONG);
+
+    for (;;) {
+
+        sequence = __atomic_load_n(&Monitor->Page->Sequence, __ATOMIC_ACQUIRE);
+
+        if ((sequence & 1) == 0) {
+
+            for (i = 0; i < words; i++) {
+                to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+            }
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (__atomic_load_n(&Monitor->Page->Sequence, __ATOMIC_RELAXED) == sequence) {
+                Snapshot->Sequence = sequence;
+                return;
+            }
+        }
+
+        Monitor->Retries++;
+        sched_yield();
+    }
+}
+
+static NTSTATUS
+HsacLoadFlight(
+    WDFFILEOBJECT File,
+    PHSAC_LOAD_FLIGHT Flight
+    )
+/*++
+
+Routine Description:
+
+    Read every processor's flight recorder ring with
+    IOCTL_GET_FLIGHT_RECORD and count what it kept. Each event must be
+    in the slot its Sequence gives, and older than the ring's Next.
+
+--*/
+{
+    PHSAC_FLIGHT_RECORD record;
+    PHSAC_FLIGHT_EVENT  event;
+    ULONG_PTR           information;
+    NTSTATUS            status;
+    ULONG               processor;
+    ULONG               i;
+
+    memset(Flight, 0, sizeof(*Flight));
+
+    record = (PHSAC_FLIGHT_RECORD) malloc(sizeof(*record));
+    if (record == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (processor = 0; ; processor++) {
+
+        status = WdfShimSubmitFileRequestSynchronously(File, WdfRequestTypeDeviceControl,
+                                                       IOCTL_GET_FLIGHT_RECORD,
+                                                       &processor, sizeof(processor),
+                                                       record, sizeof(*record),
+                                                       &information);
+        if (status == STATUS_NO_MORE_ENTRIES && processor > 0) {
+            status = STATUS_SUCCESS;
+            break;
+        }
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "flight: IOCTL_GET_FLIGHT_RECORD failed 0x%08x\n", status);
+            break;
+        }
+
+        Flight->Rings++;
+        Flight->Frequency = record->Frequency;
+
+        for (i = 0; i < HSAC_FLIGHT_EVENTS; i++) {
+
+            event = &record->Events[i];
+            if (event->Sequence == 0) {
+                continue;
+            }
+
+            if ((event->Sequence - 1) % HSAC_FLIGHT_EVENTS != i ||
+                (LONG) (record->Next - event->Sequence) <= 0 ||
+                event->Type == 0 || event->Type > HSAC_FLIGHT_COMPLETE) {
+                Flight->Misplaced++;
+                continue;
+            }
+
+            Flight->Events[event->Type]++;
+            if (event->Type == HSAC_FLIGHT_ISR && event->Time > Flight->Latest) {
+                Flight->Latest = event->Time;
+            }
+        }
+    }
+
+    free(record);
+
+    return status;
+}
+
+static void *
+HsacLoadMonitorThread(
+    void * Context
+    )
+/*++
+
+Routine Description:
+
+    A monitoring process: sample the stats page every millisecond while
+    the passes run, and check that no counter ever goes backwards. Every
+    100th sample also reads the flight recorder, as it is being written.
+
+--*/
+{
+    PHSAC_LOAD_MONITOR  monitor = (PHSAC_LOAD_MONITOR) Context;
+    HSAC_STATS_PAGE     snapshot;
+    HSAC_LOAD_FLIGHT    flight;
+    ULONG               channel;
+
+    while (!__atomic_load_n(&monitor->Stop, __ATOMIC_ACQUIRE)) {
+
+        HsacLoadMonitorRead(monitor, &snapshot);
+
+        if (snapshot.Stats.Interrupts < monitor->Last.Interrupts) {
+            monitor->Regressions++;
+        }
+        for (channel = 0; channel < 2; channel++) {
+            if (snapshot.Stats.Channel[channel].Bytes <
+                    monitor->Last.Channel[channel].Bytes ||
+                snapshot.Stats.Channel[channel].Completions <
+                    monitor->Last.Channel[channel].Completions) {
+                monitor->Regressions++;
+            }
+        }
+
+        monitor->Last      = snapshot.Stats;
+        monitor->Published = snapshot.Published;
+        monitor->Snapshots++;
+
+        if (monitor->Snapshots % 100 == 0 &&
+            NT_SUCCESS(HsacLoadFlight(monitor->File, &flight))) {
+            monitor->Dumps++;
+            monitor->Misplaced += flight.Misplaced;
+        }
+
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+static NTSTATUS
+HsacLoadMonitorStart(
+    WDFDEVICE Device,
+    PHSAC_LOAD_MONITOR Monitor
+    )
+/*++
+
+Routine Description:
+
+    Map the stats page on a handle of its own and start sampling it.
+
+--*/
+{
+    ULONGLONG   address;
+    ULONG_PTR   information;
+    NTSTATUS    status;
+
+    memset(Monitor, 0, sizeof(*Monitor));
+
+    status = WdfShimFileOpen(Device, &Monitor->File);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "page: open failed 0x%08x\n", status);
+        return status;
+    }
+
+    status = WdfShimSubmitFileRequestSynchronously(Monitor->File, WdfRequestTypeDeviceControl,
+                                                   IOCTL_MAP_STATS_PAGE,
+                                                   NULL, 0,
+                                                   &address, sizeof(address),
+                                                   &information);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "page: IOCTL_MAP_STATS_PAGE failed 0x%08x\n", status);
+        WdfShimFileClose(Monitor->File);
+        return status;
+    }
+    Monitor->Page = (PHSAC_STATS_PAGE) (ULONG_PTR) address;
+
+    if (pthread_create(&Monitor->Thread, NULL, HsacLoadMonitorThread, Monitor) != 0) {
+        fprintf(stderr, "page: pthread_create failed\n");
+        WdfShimFileClose(Monitor->File);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+HsacLoadMonitorStop(
+    WDFDEVICE Device,
+    PHSAC_LOAD_MONITOR Monitor
+    )
+/*++
+
+Routine Description:
+
+    Stop sampling and compare a last page snapshot with IOCTL_GET_STATS,
+    taken after it: the page may only be behind.
+
+--*/
+{
+    HSAC_STATS_PAGE snapshot;
+    HSAC_STATS      stats;
+    NTSTATUS        status;
+    ULONG           channel;
+
+    __atomic_store_n(&Monitor->Stop, 1, __ATOMIC_RELEASE);
+    pthread_join(Monitor->Thread, NULL);
+
+    usleep(3000 * HSAC_STATS_PAGE_PERIOD);
+
+    HsacLoadMonitorRead(Monitor, &snapshot);
+
+    status = HsacLoadIoctl(Device, IOCTL_GET_STATS, NULL, 0, &stats, sizeof(stats));
+
+    if (NT_SUCCESS(status)) {
+        if (snapshot.Stats.Interrupts > stats.Interrupts) {
+            Monitor->Regressions++;
+        }
+        for (channel = 0; channel < 2; channel++) {
+            if (snapshot.Stats.Channel[channel].Bytes > stats.Channel[channel].Bytes) {
+                Monitor->Regressions++;
+            }
+        }
+
+        printf("page:   %u snapshots, %u retried, %u out of order;"
+               " %lld of %lld interrupts published, in flight %d/%d,"
+               " last ISR %.1f ms before the copy\n",
+               Monitor->Snapshots, Monitor->Retries, Monitor->Regressions,
+               snapshot.Stats.Interrupts, stats.Interrupts,
+               snapshot.Stats.Channel[0].InFlight, snapshot.Stats.Channel[1].InFlight,
+               (double) (snapshot.Published -
+                         (snapshot.Stats.Channel[0].LastInterruptTime >
+                              snapshot.Stats.Channel[1].LastInterruptTime ?
+                          snapshot.Stats.Channel[0].LastInterruptTime :
+                          snapshot.Stats.Channel[1].LastInterruptTime)) *
+                   1e3 / snapshot.Frequency);
+
+        if (Monitor->Regressions) {
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+
+        HSAC_LOAD_FLIGHT flight;
+
+        status = HsacLoadFlight(Monitor->File, &flight);
+        if (NT_SUCCESS(status)) {
+
+            printf("flight: %u rings, %u requests, %u programs, %u ISRs, %u retirements,"
+                   " %u/%u DPCs, %u completions kept; %u misplaced in %u dumps"
+                   " while running, %u now; last ISR %.1f ms ago\n",
+                   flight.Rings, flight.Events[HSAC_FLIGHT_REQUEST],
+                   flight.Events[HSAC_FLIGHT_PROGRAM], flight.Events[HSAC_FLIGHT_ISR],
+                   flight.Events[HSAC_FLIGHT_RETIRE], flight.Events[HSAC_FLIGHT_DPC_START],
+                   flight.Events[HSAC_FLIGHT_DPC_END], flight.Events[HSAC_FLIGHT_COMPLETE],
+                   Monitor->Misplaced, Monitor->Dumps, flight.Misplaced,
+                   (double) (KeQueryPerformanceCounter(NULL).QuadPart - flight.Latest) *
+                       1e3 / flight.Frequency);
+
+            if (Monitor->Misplaced || flight.Misplaced ||
+                flight.Events[HSAC_FLIGHT_PROGRAM] == 0 ||
+                flight.Events[HSAC_FLIGHT_ISR] == 0) {
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+    }
+
+    (VOID) WdfShimSubmitFileRequestSynchronously(Monitor->File, WdfRequestTypeDeviceControl,
+                                                 IOCTL_UNMAP_STATS_PAGE,
+                                                 NULL, 0, NULL, 0, NULL);
+    WdfShimFileClose(Monitor->File);
+
+    return status;
+}
+
+static NTSTATUS
+HsacLoadDpcAffinity(
+    WDFDEVICE Device,
+    PHSAC_LOAD_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Pin the write and read channels' DPCs with IOCTL_SET_DPC_AFFINITY,
+    after checking that a processor group no machine has is refused.
+
+--*/
+{
+    HSAC_DPC_AFFINITY   affinity;
+    NTSTATUS            status = STATUS_SUCCESS;
+    ULONG               cpu;
+
+    memset(&affinity, 0, sizeof(affinity));
+    affinity.Processor.Group = 0xffff;
+
+    status = HsacLoadIoctl(Device, IOCTL_SET_DPC_AFFINITY,
+                           &affinity, sizeof(affinity), NULL, 0);
+    if (status != STATUS_INVALID_PARAMETER) {
+        fprintf(stderr, "IOCTL_SET_DPC_AFFINITY(group %u) returned 0x%08x\n",
+                affinity.Processor.Group, status);
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    for (affinity.Channel = 0; affinity.Channel < 2; affinity.Channel++) {
+
+        cpu = Options->DpcProcessor[affinity.Channel];
+        affinity.Processor.Group  = (USHORT) (cpu / 64);
+        affinity.Processor.Number = (UCHAR) (cpu % 64);
+
+        status = HsacLoadIoctl(Device, IOCTL_SET_DPC_AFFINITY,
+                               &affinity, sizeof(affinity), NULL, 0);
+        if (!NT_SUCCESS(status)) {
+            fprintf(stderr, "IOCTL_SET_DPC_AFFINITY(channel %u, cpu %u) failed 0x%08x\n",
+                    affinity.Channel, cpu, status);
+            break;
+        }
+    }
+
+    return status;
+}
+
+int
+main(
+    int argc,
+    char * argv[]
+    )
+{
+    HSAC_LOAD_OPTIONS   options;
+    HSAC_LOAD_MONITOR   monitor = { 0 };
+    ULONG               bufferCount = 0;
+    ULONG               bufferSize = 0;
+    HSAC_SIM_CONFIG     config;
+    PHSAC_SIM           sim;
+    WDFDEVICE           device;
+    NTSTATUS            status;
+    int                 i;
+
+    options.Iterations = 64;
+    options.Size       = 1024 * 1024;
+    options.Depth      = 1;
+    options.ModerationCount = 1;
+    options.ModerationDelay = 0;
+    options.Duplex          = FALSE;
+    options.Messages        = 1;
+    options.DpcProcessor[0] = ~0u;
+    options.DpcProcessor[1] = ~0u;
+    options.Prewarm         = FALSE;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            options.Iterations = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            options.Size = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            options.Depth = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%u:%u", &options.ModerationCount,
+                          &options.ModerationDelay) == 2) {
+            i++;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            options.Duplex = TRUE;
+        } else if (strcmp(argv[i], "-M") == 0) {
+            options.Messages = 2;
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%u:%u", &options.DpcProcessor[0],
+                          &options.DpcProcessor[1]) == 2) {
+            i++;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc &&
+                   sscanf(argv[i + 1], "%u:%u", &bufferCount, &bufferSize) == 2) {
+            i++;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            options.Prewarm = TRUE;
+        } else {
+            fprintf(stderr, "usage: %s [-n iterations] [-s bytes] [-q depth] [-m count:us]"
+                    " [-d] [-M] [-a writecpu:readcpu] [-b count:bytes] [-p]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (options.Size == 0 || (options.Size & 7) ||
+        options.Size > HSAC_MAXIMUM_TRANSFER_LENGTH) {
+        fprintf(stderr, "size must be a non-zero multiple of 8, at most %u\n",
+                HSAC_MAXIMUM_TRANSFER_LENGTH);
+        return 2;
+    }
+
+    if (options.Depth == 0 || options.Depth > HSAC_MAX_OUTSTANDING_REQUESTS) {
+        fprintf(stderr, "depth must be 1..%u\n", HSAC_MAX_OUTSTANDING_REQUESTS);
+        return 2;
+    }
+
+    if (options.ModerationCount == 0 ||
+        options.ModerationCount > HSAC_MAX_OUTSTANDING_REQUESTS ||
+        (options.ModerationCount > 1 &&
+         (options.ModerationDelay == 0 ||
+          options.ModerationDelay > HSAC_INT_MODERATION_MAX_DELAY_US))) {
+        fprintf(stderr, "moderation must be 1..%u requests, 1..%u us\n",
+                HSAC_MAX_OUTSTANDING_REQUESTS, HSAC_INT_MODERATION_MAX_DELAY_US);
+        return 2;
+    }
+
+    //
+    // The stream passes take HSAC_LOAD_STREAM_BUFFERS buffers, and the
+    // read pattern (i * 7 + 3) only visits every buffer if 7 does not
+    // divide their number.
+    //
+    if (bufferCount != 0 &&
+        (bufferCount < HSAC_LOAD_STREAM_BUFFERS || bufferCount > HSAC_MAX_TRANSFER_BUFFERS ||
+         bufferCount % 7 == 0 ||
+         bufferSize == 0 || bufferSize > HSAC_MAXIMUM_TRANSFER_LENGTH)) {
+        fprintf(stderr, "buffers must be %u..%u, not a multiple of 7, of 1..%u bytes\n",
+                HSAC_LOAD_STREAM_BUFFERS, HSAC_MAX_TRANSFER_BUFFERS,
+                HSAC_MAXIMUM_TRANSFER_LENGTH);
+        return 2;
+    }
+
+    HsacSimConfigInit(&config);
+    sim = HsacSimCreate(&config);
+    if (!sim) {
+        fprintf(stderr, "HsacSimCreate failed\n");
+        return 1;
+    }
+    options.Sim = sim;
+
+    WdfShimBindSimulator(sim, HSAC_LOAD_SRAM_SIZE);
+    WdfShimSetInterruptMessages(options.Messages);
+
+    status = WdfShimDriverLoad(DriverEntry);
+    if (!NT_SUCCESS(status)) {
+        fprintf(stderr, "DriverEntry failed 0x%08x\n", status);
+        HsacSimDestroy(sim);
+        return 1;
+    }
+
+    if (bufferCount != 0) {
+        (VOID) WdfShimSetRegistryValue("WriteBufferCount", bufferCount);
+        (VOID) WdfShimSetRegistryValue("WriteBufferSize", bufferSize);
+        (VOID) WdfShimSetRegistryValue("ReadBufferCount", bufferCount);
+        (VOID) WdfShimSetRegistryValue("ReadBufferSize", bufferSize);
+    }
+    if (options.Prewarm) {
+        (VOID) WdfShimSetRegistryValue("PrewarmBuffers", 1);
+    }
+
+    status = WdfShimDeviceAdd(&device);
+    if (NT_SUCCESS(status)) {
+
+        status = WdfShimDeviceStart(device);
+        if (NT_SUCCESS(status)) {
+
+            status = HsacLoadMonitorStart(device, &monitor);
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadBufferGeometry(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadLazy(device, &options);
+            }
+            if (NT_SUCCESS(status) && options.DpcProcessor[0] != ~0u) {
+                status = HsacLoadDpcAffinity(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadScatterGather(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadRegistered(device, &options);
+            }
+            if (NT_SUCCESS(status) && (options.Depth > 1 || options.ModerationCount > 1)) {
+                status = HsacLoadQueued(device, &options);
+            }
+            if (NT_SUCCESS(status) && options.Duplex) {
+                status = HsacLoadDuplex(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadPacket(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadGeometry(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadCacheModes(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadBatch(device, &options, IOCTL_PACKET_BATCH);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadBatch(device, &options, IOCTL_PACKET_CHAIN);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadRing(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadHeap(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadPlayback(device, &options);
+            }
+
+            //
+            // Last: a capture stream runs ahead of what was written, and
+            // cancelled transfers leave the card's write and read
+            // positions wherever they stopped.
+            //
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadCapture(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadCancel(device, &options);
+            }
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadCancelRegistered(device, &options);
+            }
+
+            if (monitor.Page) {
+                NTSTATUS monitorStatus = HsacLoadMonitorStop(device, &monitor);
+
+                if (NT_SUCCESS(status)) {
+                    status = monitorStatus;
+                }
+            }
+
+            HsacLoadStats(device);
+
+            //
+            // Last of all, since it takes the device down: a stop under
+            // a running playback stream.
+            //
+            if (NT_SUCCESS(status)) {
+                status = HsacLoadStopPlayback(device, &options);
+            }
+
+            WdfShimDeviceStop(device);
+        } else {
+            fprintf(stderr, "device start failed 0x%08x\n", status);
+        }
+
+        WdfShimDeviceRemove(device);
+    } else {
+        fprintf(stderr, "device add failed 0x%08x\n", status);
+    }
+
+    WdfShimDriverUnload();
+    HsacSimDestroy(sim);
+
+    return NT_SUCCESS(status) ? 0 : 1;
+}
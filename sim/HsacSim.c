@@ -0,0 +1,751 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    HsacSim.c
+
+Abstract:
+
+    Cycle-approximate model of the HSAC DMA engines.
+
+    Each DMA channel has a worker thread. Writing DMA_CTRL_START to
+    DMAx_CTRL snapshots DMAx_ADDR32/ADDR64/SIZE and hands the transfer to
+    the worker, which walks either one packet (SGEnable clear) or a chain
+    of DMA_TRANSFER_ELEMENTs in host memory (SGEnable set), copies data
+    between host memory and the modelled DDR, and paces itself against
+    the configured link bandwidth and latencies. On completion the
+    channel state is written back into DMAx_CTRL.ChannelState and the
+    channel's bit is latched in INT_STATE (write 1 to clear).
+
+    Interrupts are delivered once per latch event, the way the board's
+    MSI does it, on a separate interrupt thread. With one message per
+    channel enabled each channel's message has its own latch and thread.
+
+Environment:
+
+    User mode (Linux, pthreads)
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "HsacSim.h"
+
+#define HSAC_SIM_REG_COUNT          (sizeof(HSAC_REGS) / sizeof(unsigned int))
+#define HSAC_SIM_VERSION            0x53494d01      // "SIM" rev 1
+#define HSAC_SIM_MAX_DESCRIPTORS    (1024 * 1024)   // guard against loops
+
+#define REG_INDEX(field)    (offsetof(HSAC_REGS, field) / sizeof(unsigned int))
+
+typedef struct _HSAC_SIM_CHANNEL {
+
+    PHSAC_SIM           Sim;
+    int                 Index;
+    pthread_t           Thread;
+    pthread_cond_t      Cond;
+
+    int                 StartPending;
+    int                 Busy;
+    int                 AbortRequested;
+
+    //
+    // Snapshot of the channel registers taken at the START doorbell.
+    //
+    unsigned int        Addr32;
+    unsigned int        Addr64;
+    unsigned int        Size;
+    unsigned int        Ctrl;
+
+    size_t              DdrCursor;
+
+} HSAC_SIM_CHANNEL, * PHSAC_SIM_CHANNEL;
+
+typedef struct _HSAC_SIM_MESSAGE {
+
+    PHSAC_SIM           Sim;
+    unsigned int        Index;
+    pthread_t           Thread;
+
+    unsigned long long  Generation;
+    unsigned long long  Delivered;
+    uint64_t            LatchNs;
+
+} HSAC_SIM_MESSAGE, * PHSAC_SIM_MESSAGE;
+
+struct _HSAC_SIM {
+
+    HSAC_SIM_CONFIG     Config;
+
+    volatile unsigned int RegFile[HSAC_SIM_REG_COUNT] __attribute__((aligned(64)));
+
+    unsigned char     * Ddr;
+
+    pthread_mutex_t     Lock;
+    pthread_cond_t      IntCond;
+    int                 Stop;
+
+    HSAC_SIM_CHANNEL    Channel[HSAC_DMA_CHANNELS];
+
+    PFN_HSAC_SIM_INTERRUPT Isr;
+    void              * IsrContext;
+    unsigned int        IsrActive;      // deliveries inside Isr
+    unsigned int        Messages;
+    HSAC_SIM_MESSAGE    Message[HSAC_DMA_CHANNELS];
+
+    HSAC_SIM_COUNTERS   Counters;
+};
+
+static const unsigned int ChannelCtrlIndex[HSAC_DMA_CHANNELS] = {
+    REG_INDEX(DMA0_CTRL), REG_INDEX(DMA1_CTRL)
+};
+static const unsigned int ChannelAddr32Index[HSAC_DMA_CHANNELS] = {
+    REG_INDEX(DMA0_ADDR32), REG_INDEX(DMA1_ADDR32)
+};
+static const unsigned int ChannelAddr64Index[HSAC_DMA_CHANNELS] = {
+    REG_INDEX(DMA0_ADDR64), REG_INDEX(DMA1_ADDR64)
+};
+static const unsigned int ChannelSizeIndex[HSAC_DMA_CHANNELS] = {
+    REG_INDEX(DMA0_SIZE), REG_INDEX(DMA1_SIZE)
+};
+static const unsigned int ChannelIntBit[HSAC_DMA_CHANNELS] = {
+    DMA0IntActive, DMA1IntActive
+};
+
+uint64_t
+HsacSimNowNs(
+    void
+    )
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void
+HsacSimWaitUntil(
+    uint64_t Deadline
+    )
+/*++
+
+Routine Description:
+
+    Pace the model. Long waits sleep, the last few microseconds yield so
+    that short transfers keep sub-microsecond resolution without pinning
+    a core on small build machines.
+
+--*/
+{
+    for (;;) {
+        uint64_t now = HsacSimNowNs();
+
+        if (now >= Deadline) {
+            return;
+        }
+
+        if (Deadline - now > 20000) {
+            struct timespec ts;
+            uint64_t        sleepNs = Deadline - now - 10000;
+
+            ts.tv_sec  = (time_t) (sleepNs / 1000000000ull);
+            ts.tv_nsec = (long) (sleepNs % 1000000000ull);
+            nanosleep(&ts, NULL);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+static void
+HsacSimSetChannelState(
+    PHSAC_SIM Sim,
+    int Channel,
+    unsigned int State
+    )
+{
+    unsigned int index = ChannelCtrlIndex[Channel];
+    unsigned int ctrl  = Sim->RegFile[index];
+
+    ctrl &= ~(unsigned int) DMA_CTRL_CH_STATUS;
+    ctrl |= (CHAN_STATE_BITS(State) << 8) & DMA_CTRL_CH_STATUS;
+
+    __atomic_store_n(&Sim->RegFile[index], ctrl, __ATOMIC_RELEASE);
+}
+
+static void
+HsacSimCopy(
+    PHSAC_SIM Sim,
+    PHSAC_SIM_CHANNEL Channel,
+    unsigned char * Host,
+    size_t Length
+    )
+/*++
+
+Routine Description:
+
+    Move Length bytes between host memory and the channel's DDR cursor.
+    DMA0 is "to device" (host -> DDR), DMA1 is "from device" (DDR -> host).
+
+--*/
+{
+    while (Length) {
+        size_t chunk = Sim->Config.DdrSize - Channel->DdrCursor;
+
+        if (chunk > Length) {
+            chunk = Length;
+        }
+
+        if (Channel->Index == 0) {
+            memcpy(Sim->Ddr + Channel->DdrCursor, Host, chunk);
+        } else {
+            memcpy(Host, Sim->Ddr + Channel->DdrCursor, chunk);
+        }
+
+        Host   += chunk;
+        Length -= chunk;
+        Channel->DdrCursor += chunk;
+        if (Channel->DdrCursor == Sim->Config.DdrSize) {
+            Channel->DdrCursor = 0;
+        }
+    }
+}
+
+static int
+HsacSimCheckPage(
+    PHSAC_SIM Sim,
+    uint64_t Address,
+    unsigned int Size
+    )
+/*++
+
+Routine Description:
+
+    Apply the DMA_TRANSFER_ELEMENT rules from Reg.h: 8-byte aligned page
+    address and size, and a page must not cross a 4GB boundary.
+
+--*/
+{
+    if (!Sim->Config.StrictDescriptors) {
+        return 1;
+    }
+
+    if ((Address & 7) || (Size & 7) || Size == 0) {
+        return 0;
+    }
+
+    if ((Address >> 32) != ((Address + Size - 1) >> 32)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+static unsigned int
+HsacSimRunTransfer(
+    PHSAC_SIM Sim,
+    PHSAC_SIM_CHANNEL Channel,
+    uint64_t * Bytes,
+    uint64_t * Descriptors
+    )
+/*++
+
+Routine Description:
+
+    Execute one started transfer. Returns the final channel state.
+
+--*/
+{
+    uint64_t    deadline;
+    uint64_t    address;
+    double      nsPerByte;
+
+    nsPerByte = (Sim->Config.LinkBytesPerNs > 0.0) ?
+                1.0 / Sim->Config.LinkBytesPerNs : 0.0;
+
+    deadline = HsacSimNowNs() + Sim->Config.StartLatencyNs;
+    address  = ((uint64_t) Channel->Addr64 << 32) | Channel->Addr32;
+
+    if (!(Channel->Ctrl & DMA_CTRL_SG_ENA)) {
+
+        if (address == 0 || !HsacSimCheckPage(Sim, address, Channel->Size)) {
+            return CHAN_CPL_UR;
+        }
+
+        HsacSimCopy(Sim, Channel, (unsigned char *) (uintptr_t) address,
+                    Channel->Size);
+        deadline += (uint64_t) (Channel->Size * nsPerByte);
+        HsacSimWaitUntil(deadline);
+
+        *Bytes += Channel->Size;
+        return CHAN_SUCCESS;
+    }
+
+    for (;;) {
+        DMA_TRANSFER_ELEMENT dte;
+        uint64_t             page;
+
+        if (__atomic_load_n(&Channel->AbortRequested, __ATOMIC_ACQUIRE)) {
+            return CHAN_STOPPED;
+        }
+
+        if (*Descriptors >= HSAC_SIM_MAX_DESCRIPTORS || address == 0) {
+            return CHAN_CPL_UR;
+        }
+
+        deadline += Sim->Config.DescriptorFetchNs;
+        memcpy(&dte, (const void *) (uintptr_t) address, sizeof(dte));
+        (*Descriptors)++;
+
+        page = ((uint64_t) dte.PageAddressHigh << 32) | dte.PageAddressLow;
+
+        if (!HsacSimCheckPage(Sim, page, dte.TransferSize)) {
+            return CHAN_CPL_UR;
+        }
+
+        HsacSimCopy(Sim, Channel, (unsigned char *) (uintptr_t) page,
+                    dte.TransferSize);
+        deadline += (uint64_t) (dte.TransferSize * nsPerByte);
+        *Bytes   += dte.TransferSize;
+
+        HsacSimWaitUntil(deadline);
+
+        if (dte.DescPtrLow.LastElement) {
+            return CHAN_SUCCESS;
+        }
+
+        address = ((uint64_t) dte.DescPtrHigh.HighAddress << 32) |
+                  ((uint64_t) dte.DescPtrLow.LowAddress << DESC_PTR_ADDR_SHIFT);
+    }
+}
+
+static void *
+HsacSimChannelThread(
+    void * Context
+    )
+{
+    PHSAC_SIM_CHANNEL   channel = (PHSAC_SIM_CHANNEL) Context;
+    PHSAC_SIM           sim = channel->Sim;
+
+    pthread_mutex_lock(&sim->Lock);
+
+    for (;;) {
+        unsigned int        state;
+        uint64_t            bytes = 0;
+        uint64_t            descriptors = 0;
+        PHSAC_SIM_MESSAGE   message;
+
+        while (!sim->Stop && !channel->StartPending) {
+            pthread_cond_wait(&channel->Cond, &sim->Lock);
+        }
+
+        if (sim->Stop) {
+            break;
+        }
+
+        channel->StartPending = 0;
+        pthread_mutex_unlock(&sim->Lock);
+
+        state = HsacSimRunTransfer(sim, channel, &bytes, &descriptors);
+
+        pthread_mutex_lock(&sim->Lock);
+
+        channel->Busy = 0;
+        channel->AbortRequested = 0;
+
+        sim->Counters.Transfers[channel->Index]++;
+        sim->Counters.Bytes[channel->Index] += bytes;
+        sim->Counters.Descriptors[channel->Index] += descriptors;
+        if (state != CHAN_SUCCESS) {
+            sim->Counters.Errors[channel->Index]++;
+        }
+
+        HsacSimSetChannelState(sim, channel->Index, state);
+
+        __atomic_or_fetch(&sim->RegFile[REG_INDEX(INT_STATE)],
+                          ChannelIntBit[channel->Index], __ATOMIC_RELEASE);
+        message = &sim->Message[(sim->Messages > 1) ? channel->Index : 0];
+        message->LatchNs = HsacSimNowNs();
+        message->Generation++;
+        pthread_cond_broadcast(&sim->IntCond);
+    }
+
+    pthread_mutex_unlock(&sim->Lock);
+    return NULL;
+}
+
+static unsigned int
+HsacSimMessageBits(
+    PHSAC_SIM Sim,
+    unsigned int Message
+    )
+/*++
+
+Routine Description:
+
+    INT_STATE bits signalled on Message. Sim->Lock held.
+
+--*/
+{
+    unsigned int bits = 0;
+    int          ch;
+
+    for (ch = 0; ch < HSAC_DMA_CHANNELS; ch++) {
+        if (Sim->Messages > 1 ? (unsigned int) ch == Message : Message == 0) {
+            bits |= ChannelIntBit[ch];
+        }
+    }
+
+    return bits;
+}
+
+static void *
+HsacSimInterruptThread(
+    void * Context
+    )
+{
+    PHSAC_SIM_MESSAGE   message = (PHSAC_SIM_MESSAGE) Context;
+    PHSAC_SIM           sim = message->Sim;
+
+    pthread_mutex_lock(&sim->Lock);
+
+    for (;;) {
+        unsigned long long      generation;
+        uint64_t                deliverAt;
+        PFN_HSAC_SIM_INTERRUPT  isr;
+        void                  * isrContext;
+
+        while (!sim->Stop &&
+               !(sim->Isr &&
+                 message->Generation != message->Delivered &&
+                 (sim->RegFile[REG_INDEX(INT_STATE)] &
+                  HsacSimMessageBits(sim, message->Index)) != 0)) {
+            pthread_cond_wait(&sim->IntCond, &sim->Lock);
+        }
+
+        if (sim->Stop) {
+            break;
+        }
+
+        generation = message->Generation;
+        deliverAt  = message->LatchNs + sim->Config.InterruptLatencyNs;
+        isr        = sim->Isr;
+        isrContext = sim->IsrContext;
+        message->Delivered = generation;
+        sim->Counters.Interrupts++;
+        sim->IsrActive++;
+
+        pthread_mutex_unlock(&sim->Lock);
+
+        HsacSimWaitUntil(deliverAt);
+        isr(isrContext, message->Index);
+
+        pthread_mutex_lock(&sim->Lock);
+
+        sim->IsrActive--;
+        pthread_cond_broadcast(&sim->IntCond);
+    }
+
+    pthread_mutex_unlock(&sim->Lock);
+    return NULL;
+}
+
+void
+HsacSimConfigInit(
+    PHSAC_SIM_CONFIG Config
+    )
+/*++
+
+Routine Description:
+
+    Defaults approximate a Gen2 x4 link: ~1.6 GB/s of payload per
+    direction, ~1us from doorbell to first data and ~2us interrupt
+    latency.
+
+--*/
+{
+    memset(Config, 0, sizeof(*Config));
+
+    Config->DdrSize             = 64 * 1024 * 1024;
+    Config->LinkBytesPerNs      = 1.6;
+    Config->StartLatencyNs      = 1000;
+    Config->DescriptorFetchNs   = 250;
+    Config->InterruptLatencyNs  = 2000;
+    Config->StrictDescriptors   = 1;
+}
+
+PHSAC_SIM
+HsacSimCreate(
+    const HSAC_SIM_CONFIG * Config
+    )
+{
+    PHSAC_SIM   sim;
+    size_t      i;
+    int         ch;
+
+    sim = (PHSAC_SIM) aligned_alloc(64, (sizeof(*sim) + 63) & ~(size_t) 63);
+    if (!sim) {
+        return NULL;
+    }
+
+    memset(sim, 0, sizeof(*sim));
+    sim->Config = *Config;
+
+    if (sim->Config.DdrSize == 0) {
+        sim->Config.DdrSize = 64 * 1024 * 1024;
+    }
+
+    sim->Ddr = (unsigned char *) malloc(sim->Config.DdrSize);
+    if (!sim->Ddr) {
+        free(sim);
+        return NULL;
+    }
+
+    //
+    // Give reads a recognizable pattern.
+    //
+    for (i = 0; i < sim->Config.DdrSize; i++) {
+        sim->Ddr[i] = (unsigned char) (i ^ (i >> 8));
+    }
+
+    sim->RegFile[REG_INDEX(VERSION_REG)] = HSAC_SIM_VERSION;
+    sim->RegFile[REG_INDEX(ID)] = (HSAC_PCI_DEVICE_ID << 16) | HSAC_PCI_VENDOR_ID;
+
+    pthread_mutex_init(&sim->Lock, NULL);
+    pthread_cond_init(&sim->IntCond, NULL);
+
+    for (ch = 0; ch < HSAC_DMA_CHANNELS; ch++) {
+        sim->Channel[ch].Sim = sim;
+        sim->Channel[ch].Index = ch;
+        pthread_cond_init(&sim->Channel[ch].Cond, NULL);
+        pthread_create(&sim->Channel[ch].Thread, NULL,
+                       HsacSimChannelThread, &sim->Channel[ch]);
+    }
+
+    sim->Messages = 1;
+    for (ch = 0; ch < HSAC_DMA_CHANNELS; ch++) {
+        sim->Message[ch].Sim = sim;
+        sim->Message[ch].Index = ch;
+        pthread_create(&sim->Message[ch].Thread, NULL,
+                       HsacSimInterruptThread, &sim->Message[ch]);
+    }
+
+    return sim;
+}
+
+void
+HsacSimDestroy(
+    PHSAC_SIM Sim
+    )
+{
+    int ch;
+
+    if (!Sim) {
+        return;
+    }
+
+    pthread_mutex_lock(&Sim->Lock);
+    Sim->Stop = 1;
+    for (ch = 0; ch < HSAC_DMA_CHANNELS; ch++) {
+        Sim->Channel[ch].AbortRequested = 1;
+        pthread_cond_broadcast(&Sim->Channel[ch].Cond);
+    }
+    pthread_cond_broadcast(&Sim->IntCond);
+    pthread_mutex_unlock(&Sim->Lock);
+
+    for (ch = 0; ch < HSAC_DMA_CHANNELS; ch++) {
+        pthread_join(Sim->Channel[ch].Thread, NULL);
+        pthread_cond_destroy(&Sim->Channel[ch].Cond);
+        pthread_join(Sim->Message[ch].Thread, NULL);
+    }
+
+    pthread_cond_destroy(&Sim->IntCond);
+    pthread_mutex_destroy(&Sim->Lock);
+
+    free(Sim->Ddr);
+    free(Sim);
+}
+
+PHSAC_REGS
+HsacSimGetRegs(
+    PHSAC_SIM Sim
+    )
+{
+    return (PHSAC_REGS) Sim->RegFile;
+}
+
+unsigned char *
+HsacSimGetDdr(
+    PHSAC_SIM Sim
+    )
+{
+    return Sim->Ddr;
+}
+
+int
+HsacSimOwnsRegister(
+    PHSAC_SIM Sim,
+    const volatile void * Register
+    )
+{
+    const volatile unsigned char * p = (const volatile unsigned char *) Register;
+    const volatile unsigned char * base = (const volatile unsigned char *) Sim->RegFile;
+
+    return p >= base && p < base + sizeof(Sim->RegFile);
+}
+
+unsigned int
+HsacSimReadRegister(
+    PHSAC_SIM Sim,
+    const volatile void * Register
+    )
+{
+    (void) Sim;
+    return __atomic_load_n((const volatile unsigned int *) Register,
+                           __ATOMIC_ACQUIRE);
+}
+
+void
+HsacSimWriteRegister(
+    PHSAC_SIM Sim,
+    volatile void * Register,
+    unsigned int Value
+    )
+/*++
+
+Routine Description:
+
+    Register write side effects:
+
+      DMAx_CTRL   START snapshots the channel registers and starts the
+                  worker. ABORT stops a running chain at the next
+                  descriptor. START/ABORT self-clear; ChannelState is
+                  read-only.
+      INT_STATE   Write 1 to clear.
+      others      Plain storage.
+
+--*/
+{
+    unsigned int index;
+    int          ch;
+
+    index = (unsigned int) (((const volatile unsigned char *) Register -
+                             (const volatile unsigned char *) Sim->RegFile) /
+                            sizeof(unsigned int));
+
+    pthread_mutex_lock(&Sim->Lock);
+
+    if (index == REG_INDEX(INT_STATE)) {
+
+        __atomic_and_fetch(&Sim->RegFile[index], ~Value, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&Sim->Lock);
+        return;
+    }
+
+    for (ch = 0; ch < HSAC_DMA_CHANNELS; ch++) {
+
+        PHSAC_SIM_CHANNEL channel = &Sim->Channel[ch];
+        unsigned int      stored;
+
+        if (index != ChannelCtrlIndex[ch]) {
+            continue;
+        }
+
+        stored  = Value & ~(unsigned int) (DMA_CTRL_START | DMA_CTRL_ABORT |
+                                           DMA_CTRL_CH_STATUS);
+        stored |= Sim->RegFile[index] & DMA_CTRL_CH_STATUS;
+        __atomic_store_n(&Sim->RegFile[index], stored, __ATOMIC_RELEASE);
+
+        if ((Value & DMA_CTRL_ABORT) && channel->Busy) {
+            __atomic_store_n(&channel->AbortRequested, 1, __ATOMIC_RELEASE);
+        }
+
+        if ((Value & DMA_CTRL_START) && !channel->Busy) {
+
+            channel->Addr32 = Sim->RegFile[ChannelAddr32Index[ch]];
+            channel->Addr64 = Sim->RegFile[ChannelAddr64Index[ch]];
+            channel->Size   = Sim->RegFile[ChannelSizeIndex[ch]];
+            channel->Ctrl   = Value;
+            channel->Busy   = 1;
+            channel->StartPending = 1;
+
+            HsacSimSetChannelState(Sim, ch, CHAN_BUSY);
+            pthread_cond_signal(&channel->Cond);
+        }
+
+        pthread_mutex_unlock(&Sim->Lock);
+        return;
+    }
+
+    __atomic_store_n(&Sim->RegFile[index], Value, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&Sim->Lock);
+}
+
+void
+HsacSimConnectInterrupt(
+    PHSAC_SIM Sim,
+    PFN_HSAC_SIM_INTERRUPT Handler,
+    void * Context
+    )
+{
+    pthread_mutex_lock(&Sim->Lock);
+    Sim->Isr = Handler;
+    Sim->IsrContext = Context;
+    pthread_cond_broadcast(&Sim->IntCond);
+    pthread_mutex_unlock(&Sim->Lock);
+}
+
+void
+HsacSimDisconnectInterrupt(
+    PHSAC_SIM Sim
+    )
+{
+    pthread_mutex_lock(&Sim->Lock);
+    Sim->Isr = NULL;
+    Sim->IsrContext = NULL;
+
+    //
+    // A delivery already under way may still be in the handler; the
+    // caller is about to free what it uses.
+    //
+    while (Sim->IsrActive) {
+        pthread_cond_wait(&Sim->IntCond, &Sim->Lock);
+    }
+    pthread_mutex_unlock(&Sim->Lock);
+}
+
+void
+HsacSimSetMessages(
+    PHSAC_SIM Sim,
+    unsigned int Messages
+    )
+{
+    pthread_mutex_lock(&Sim->Lock);
+    Sim->Messages = (Messages >= HSAC_DMA_CHANNELS) ? HSAC_DMA_CHANNELS : 1;
+    pthread_cond_broadcast(&Sim->IntCond);
+    pthread_mutex_unlock(&Sim->Lock);
+}
+
+void
+HsacSimGetCounters(
+    PHSAC_SIM Sim,
+    PHSAC_SIM_COUNTERS Counters
+    )
+{
+    pthread_mutex_lock(&Sim->Lock);
+    *Counters = Sim->Counters;
+    pthread_mutex_unlock(&Sim->Lock);
+}
@@ -0,0 +1,155 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    HsacSim.h
+
+Abstract:
+
+    Software model of the HSAC card. The model exposes the HSAC_REGS
+    layout from Reg.h as a memory-backed register block, runs DMA0
+    (to device) and DMA1 (from device) on their own worker threads and
+    delivers INT_STATE interrupts to a connected handler.
+
+    "Logical" addresses programmed into the model are host virtual
+    addresses, so a user-mode driver build can hand it pointers directly.
+
+Environment:
+
+    User mode (Linux, pthreads)
+
+--*/
+
+#ifndef HSAC_SIM_H
+#define HSAC_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../Reg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _HSAC_SIM HSAC_SIM, * PHSAC_SIM;
+
+//
+// Called on the model's interrupt thread once per latch event, like a
+// message-signalled interrupt: bits the handler leaves set in INT_STATE
+// do not raise another call until a new completion latches. Message is
+// always 0 unless HsacSimSetMessages enabled one message per channel.
+//
+typedef void (*PFN_HSAC_SIM_INTERRUPT)(void * Context, unsigned int Message);
+
+typedef struct _HSAC_SIM_CONFIG {
+
+    size_t          DdrSize;            // on-board DDR modelled (bytes)
+    double          LinkBytesPerNs;     // payload bandwidth per direction
+    unsigned int    StartLatencyNs;     // doorbell to first read request
+    unsigned int    DescriptorFetchNs;  // cost of fetching one DTE
+    unsigned int    InterruptLatencyNs; // INT_STATE latch to handler call
+    int             StrictDescriptors;  // fail DTEs that break Reg.h rules
+
+} HSAC_SIM_CONFIG, * PHSAC_SIM_CONFIG;
+
+typedef struct _HSAC_SIM_COUNTERS {
+
+    uint64_t        Transfers[HSAC_DMA_CHANNELS];
+    uint64_t        Bytes[HSAC_DMA_CHANNELS];
+    uint64_t        Descriptors[HSAC_DMA_CHANNELS];
+    uint64_t        Errors[HSAC_DMA_CHANNELS];
+    uint64_t        Interrupts;
+
+} HSAC_SIM_COUNTERS, * PHSAC_SIM_COUNTERS;
+
+void
+HsacSimConfigInit(
+    PHSAC_SIM_CONFIG Config
+    );
+
+PHSAC_SIM
+HsacSimCreate(
+    const HSAC_SIM_CONFIG * Config
+    );
+
+void
+HsacSimDestroy(
+    PHSAC_SIM Sim
+    );
+
+PHSAC_REGS
+HsacSimGetRegs(
+    PHSAC_SIM Sim
+    );
+
+unsigned char *
+HsacSimGetDdr(
+    PHSAC_SIM Sim
+    );
+
+int
+HsacSimOwnsRegister(
+    PHSAC_SIM Sim,
+    const volatile void * Register
+    );
+
+unsigned int
+HsacSimReadRegister(
+    PHSAC_SIM Sim,
+    const volatile void * Register
+    );
+
+void
+HsacSimWriteRegister(
+    PHSAC_SIM Sim,
+    volatile void * Register,
+    unsigned int Value
+    );
+
+void
+HsacSimConnectInterrupt(
+    PHSAC_SIM Sim,
+    PFN_HSAC_SIM_INTERRUPT Handler,
+    void * Context
+    );
+
+void
+HsacSimDisconnectInterrupt(
+    PHSAC_SIM Sim
+    );
+
+//
+// Number of MSI messages the host enabled: 1 (the default) signals every
+// channel on message 0; HSAC_DMA_CHANNELS signals channel n on message n,
+// each from an interrupt thread of its own.
+//
+void
+HsacSimSetMessages(
+    PHSAC_SIM Sim,
+    unsigned int Messages
+    );
+
+void
+HsacSimGetCounters(
+    PHSAC_SIM Sim,
+    PHSAC_SIM_COUNTERS Counters
+    );
+
+uint64_t
+HsacSimNowNs(
+    void
+    );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // HSAC_SIM_H
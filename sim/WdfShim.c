@@ -0,0 +1,4351 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    WdfShim.c
+
+Abstract:
+
+    User-mode implementation of the framework subset declared in
+    WdfShim.h. Objects form the same parent/child tree as in KMDF and
+    deleting a parent deletes its children, so a full add/start/stop/
+    remove/unload cycle releases everything the driver allocated.
+
+    Threads:
+
+      - one dispatcher per I/O queue, presenting requests to the queue
+        callbacks under the queue's synchronization lock;
+      - the card model's interrupt thread, which runs the ISRs under
+        their interrupt locks;
+      - one DpcForIsr thread per interrupt object.
+
+Environment:
+
+    User mode (Linux, pthreads)
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "WdfShim.h"
+#include "HsacSim.h"
+
+//
+// Fake bus addresses handed out in the resource list. MmMapIoSpace turns
+// them back into the card model's register file and the SRAM backing.
+//
+#define WDF_SHIM_BAR0_PA            0xF0000000ull
+#define WDF_SHIM_BAR2_PA            0xF1000000ull
+
+#define WDF_SHIM_MAX_QUEUES         16
+#define WDF_SHIM_MAX_INTERRUPTS     8
+#define WDF_SHIM_MAX_RESOURCES      (2 + WDF_SHIM_MAX_MESSAGES)
+
+//
+// How long WdfShimDeviceStop waits for presented requests to complete.
+//
+#define WDF_SHIM_STOP_TIMEOUT_MS    5000
+
+typedef enum _WDF_SHIM_OBJECT_TYPE {
+    WdfShimObjectDriver = 1,
+    WdfShimObjectDevice,
+    WdfShimObjectQueue,
+    WdfShimObjectRequest,
+    WdfShimObjectInterrupt,
+    WdfShimObjectDmaEnabler,
+    WdfShimObjectDmaTransaction,
+    WdfShimObjectCommonBuffer,
+    WdfShimObjectTimer,
+    WdfShimObjectFile,
+    WdfShimObjectDpc,
+    WdfShimObjectMemory,
+    WdfShimObjectKey,
+    WdfShimObjectWorkItem,
+    WdfShimObjectWaitLock
+} WDF_SHIM_OBJECT_TYPE;
+
+typedef struct _WDF_SHIM_CONTEXT {
+
+    struct _WDF_SHIM_CONTEXT           * Next;
+    const WDF_OBJECT_CONTEXT_TYPE_INFO * TypeInfo;
+    PFN_WDF_OBJECT_CONTEXT_CLEANUP      EvtCleanup;
+    PFN_WDF_OBJECT_CONTEXT_DESTROY      EvtDestroy;
+    max_align_t                         Data[];
+
+} WDF_SHIM_CONTEXT, * PWDF_SHIM_CONTEXT;
+
+typedef struct _WDF_SHIM_OBJECT {
+
+    WDF_SHIM_OBJECT_TYPE            Type;
+    volatile LONG                   RefCount;
+    BOOLEAN                         Deleted;
+
+    struct _WDF_SHIM_OBJECT       * Parent;
+    LIST_ENTRY                      ChildList;
+    LIST_ENTRY                      SiblingLink;
+
+    PFN_WDF_OBJECT_CONTEXT_CLEANUP  EvtCleanup;
+    PFN_WDF_OBJECT_CONTEXT_DESTROY  EvtDestroy;
+    WDF_SYNCHRONIZATION_SCOPE       SyncScope;
+    PWDF_SHIM_CONTEXT               Contexts;
+
+    //
+    // Dispose runs when the object is deleted (stop threads, detach from
+    // the owner); Release runs when the last reference goes away.
+    //
+    VOID                         (* Dispose)(struct _WDF_SHIM_OBJECT * Object);
+    VOID                         (* Release)(struct _WDF_SHIM_OBJECT * Object);
+
+} WDF_SHIM_OBJECT, * PWDF_SHIM_OBJECT;
+
+typedef struct _WDF_SHIM_DEVICE WDF_SHIM_DEVICE, * PWDF_SHIM_DEVICE;
+
+typedef struct _WDF_SHIM_DRIVER {
+
+    WDF_SHIM_OBJECT     Object;
+    WDF_DRIVER_CONFIG   Config;
+    PDRIVER_OBJECT      WdmDriver;
+    PWDF_SHIM_DEVICE    LastDevice;
+
+} WDF_SHIM_DRIVER, * PWDF_SHIM_DRIVER;
+
+struct WDFDEVICE_INIT__ {
+
+    WDF_DEVICE_IO_TYPE              IoType;
+    WDF_PNPPOWER_EVENT_CALLBACKS    PnpPower;
+    WDF_FILEOBJECT_CONFIG           FileConfig;
+    WDF_OBJECT_ATTRIBUTES           FileAttributes;
+
+};
+
+typedef struct _WDF_SHIM_RESOURCE_LIST {
+
+    ULONG                           Count;
+    CM_PARTIAL_RESOURCE_DESCRIPTOR  Descriptors[WDF_SHIM_MAX_RESOURCES];
+
+} WDF_SHIM_RESOURCE_LIST, * PWDF_SHIM_RESOURCE_LIST;
+
+typedef struct _WDF_SHIM_QUEUE WDF_SHIM_QUEUE, * PWDF_SHIM_QUEUE;
+typedef struct _WDF_SHIM_INTERRUPT WDF_SHIM_INTERRUPT, * PWDF_SHIM_INTERRUPT;
+
+struct _WDF_SHIM_DEVICE {
+
+    WDF_SHIM_OBJECT                 Object;
+
+    WDF_DEVICE_IO_TYPE              IoType;
+    WDF_PNPPOWER_EVENT_CALLBACKS    PnpPower;
+    ULONG                           AlignmentRequirement;
+
+    WDF_FILEOBJECT_CONFIG           FileConfig;
+    WDF_OBJECT_ATTRIBUTES           FileAttributes;
+
+    //
+    // Device-level synchronization lock (WdfSynchronizationScopeDevice).
+    // Recursive, because the framework calls back into the driver from
+    // inside driver calls (e.g. EvtRequestCancel from MarkCancelable).
+    //
+    pthread_mutex_t                 SyncLock;
+
+    PWDF_SHIM_QUEUE                 Dispatch[WdfRequestTypeMax];
+    PWDF_SHIM_QUEUE                 Queues[WDF_SHIM_MAX_QUEUES];
+    PWDF_SHIM_INTERRUPT             Interrupts[WDF_SHIM_MAX_INTERRUPTS];
+
+    volatile LONG                   Started;
+    volatile LONG                   IdleReferences; // WdfDeviceStopIdle, not yet resumed
+
+    WDF_SHIM_RESOURCE_LIST          Resources;
+    ULONG                           Messages;       // 0 - line-based interrupt
+    PVOID                           Sram;
+
+};
+
+struct _WDF_SHIM_QUEUE {
+
+    WDF_SHIM_OBJECT         Object;
+    PWDF_SHIM_DEVICE        Device;
+    WDF_IO_QUEUE_CONFIG     Config;
+
+    pthread_mutex_t         Lock;
+    pthread_cond_t          Cond;
+    pthread_mutex_t         CallbackLock;   // WdfSynchronizationScopeQueue
+    pthread_t               Thread;
+    BOOLEAN                 Stop;
+    BOOLEAN                 Stopped;        // WdfIoQueueStopSynchronously
+
+    LIST_ENTRY              PendingList;
+    ULONG                   InFlight;
+
+};
+
+typedef enum _WDF_SHIM_REQUEST_STATE {
+    WdfShimRequestCreated = 0,
+    WdfShimRequestQueued,
+    WdfShimRequestPresented,
+    WdfShimRequestCompleted
+} WDF_SHIM_REQUEST_STATE;
+
+typedef struct _WDF_SHIM_FILE {
+
+    WDF_SHIM_OBJECT                 Object;
+    PWDF_SHIM_DEVICE                Device;
+
+} WDF_SHIM_FILE, * PWDF_SHIM_FILE;
+
+typedef struct _WDF_SHIM_REQUEST {
+
+    WDF_SHIM_OBJECT                 Object;
+    LIST_ENTRY                      QueueLink;
+    PWDF_SHIM_QUEUE                 Queue;
+    PWDF_SHIM_FILE                  File;
+    WDF_SHIM_REQUEST_STATE          State;
+    BOOLEAN                         InFlight;
+
+    WDF_REQUEST_TYPE                Type;
+    ULONG                           IoControlCode;
+
+    PVOID                           InputBuffer;
+    size_t                          InputLength;
+    PVOID                           OutputBuffer;
+    size_t                          OutputLength;
+    MDL                             InputMdl;
+    MDL                             OutputMdl;
+    BOOLEAN                         HasInputMdl;
+    BOOLEAN                         HasOutputMdl;
+
+    //
+    // METHOD_BUFFERED / *_DIRECT input copy and where it goes back to.
+    //
+    PVOID                           SystemBuffer;
+    PVOID                           UserOutputBuffer;
+    size_t                          UserOutputLength;
+
+    ULONG_PTR                       Information;
+
+    PFN_WDF_REQUEST_CANCEL          CancelRoutine;
+    BOOLEAN                         Cancelled;
+    BOOLEAN                         CancelRoutineTaken;
+
+    PFN_WDF_SHIM_REQUEST_COMPLETION Completion;
+    PVOID                           CompletionContext;
+
+} WDF_SHIM_REQUEST, * PWDF_SHIM_REQUEST;
+
+struct _WDF_SHIM_INTERRUPT {
+
+    WDF_SHIM_OBJECT         Object;
+    PWDF_SHIM_DEVICE        Device;
+    WDF_INTERRUPT_CONFIG    Config;
+
+    pthread_mutex_t         Lock;           // interrupt spin lock
+    BOOLEAN                 Connected;
+    ULONG                   MessageId;      // message resource it is connected to
+
+    pthread_mutex_t         DpcLock;
+    pthread_cond_t          DpcCond;
+    pthread_t               DpcThread;
+    BOOLEAN                 DpcQueued;
+    BOOLEAN                 DpcRunning;
+    BOOLEAN                 DpcStop;
+
+};
+
+typedef struct _WDF_SHIM_TIMER {
+
+    WDF_SHIM_OBJECT         Object;
+    WDF_TIMER_CONFIG        Config;
+    PWDF_SHIM_DEVICE        Device;         // for AutomaticSerialization
+
+    pthread_mutex_t         Lock;
+    pthread_cond_t          Cond;
+    pthread_t               Thread;
+    struct timespec         Due;            // CLOCK_MONOTONIC
+    BOOLEAN                 Armed;
+    BOOLEAN                 Running;
+    BOOLEAN                 Stop;
+
+} WDF_SHIM_TIMER, * PWDF_SHIM_TIMER;
+
+typedef struct _WDF_SHIM_DPC {
+
+    WDF_SHIM_OBJECT         Object;
+    WDF_DPC_CONFIG          Config;
+    PWDF_SHIM_DEVICE        Device;         // for AutomaticSerialization
+    KDPC                    Dpc;
+
+    pthread_mutex_t         Lock;
+    pthread_cond_t          Cond;
+    pthread_t               Thread;
+    LONG                    Processor;      // where Thread runs, -1 for any
+    BOOLEAN                 Queued;
+    BOOLEAN                 Running;
+    BOOLEAN                 Stop;
+    LIST_ENTRY              Link;           // on WdfShimDpcs
+
+} WDF_SHIM_DPC, * PWDF_SHIM_DPC;
+
+typedef struct _WDF_SHIM_WORKITEM {
+
+    WDF_SHIM_OBJECT         Object;
+    WDF_WORKITEM_CONFIG     Config;
+    PWDF_SHIM_DEVICE        Device;         // for AutomaticSerialization
+
+    pthread_mutex_t         Lock;
+    pthread_cond_t          Cond;
+    pthread_t               Thread;
+    BOOLEAN                 Queued;
+    BOOLEAN                 Running;
+    BOOLEAN                 Stop;
+
+} WDF_SHIM_WORKITEM, * PWDF_SHIM_WORKITEM;
+
+typedef struct _WDF_SHIM_WAITLOCK {
+
+    WDF_SHIM_OBJECT         Object;
+    pthread_mutex_t         Lock;
+
+} WDF_SHIM_WAITLOCK, * PWDF_SHIM_WAITLOCK;
+
+typedef struct _WDF_SHIM_DMA_ENABLER {
+
+    WDF_SHIM_OBJECT         Object;
+    PWDF_SHIM_DEVICE        Device;
+    WDF_DMA_ENABLER_CONFIG  Config;
+
+} WDF_SHIM_DMA_ENABLER, * PWDF_SHIM_DMA_ENABLER;
+
+typedef struct _WDF_SHIM_COMMON_BUFFER {
+
+    WDF_SHIM_OBJECT         Object;
+    PVOID                   Memory;
+    size_t                  Length;
+
+} WDF_SHIM_COMMON_BUFFER, * PWDF_SHIM_COMMON_BUFFER;
+
+typedef struct _WDF_SHIM_MEMORY {
+
+    WDF_SHIM_OBJECT         Object;
+    PVOID                   Buffer;
+    size_t                  Length;
+
+} WDF_SHIM_MEMORY, * PWDF_SHIM_MEMORY;
+
+typedef struct _WDF_SHIM_DMA_TRANSACTION {
+
+    WDF_SHIM_OBJECT         Object;
+    PWDF_SHIM_DMA_ENABLER   Enabler;
+
+    BOOLEAN                 Initialized;
+    PFN_WDF_PROGRAM_DMA     EvtProgramDma;
+    WDF_DMA_DIRECTION       Direction;
+    PWDF_SHIM_REQUEST       Request;
+    WDFCONTEXT              Context;
+
+    PUCHAR                  VirtualAddress;
+    size_t                  Length;
+    size_t                  Transferred;
+    size_t                  CurrentLength;
+    size_t                  MaximumLength;
+
+    PSCATTER_GATHER_LIST    SgList;
+    ULONG                   SgCapacity;
+
+} WDF_SHIM_DMA_TRANSACTION, * PWDF_SHIM_DMA_TRANSACTION;
+
+static pthread_mutex_t  WdfShimTreeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  WdfShimCancelLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t  WdfShimDpcsLock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_ENTRY       WdfShimDpcs = { &WdfShimDpcs, &WdfShimDpcs };
+
+static PWDF_SHIM_DRIVER WdfShimDriver;
+static PHSAC_SIM        WdfShimSim;
+static ULONG            WdfShimSramSize;
+static ULONG            WdfShimMessages;
+
+static UCHAR            WdfShimWdmDriverObject[64];
+static WCHAR            WdfShimRegistryPathBuffer[] = {
+    'H', 'S', 'A', 'C', 0
+};
+
+static struct {
+    char    Name[64];
+    ULONG   Value;
+}                       WdfShimRegistry[WDF_SHIM_MAX_REGISTRY_VALUES];
+static ULONG            WdfShimRegistryValues;
+
+//-----------------------------------------------------------------------------
+// Objects
+//-----------------------------------------------------------------------------
+
+static PWDF_SHIM_CONTEXT
+WdfShimAllocateContext(
+    const WDF_OBJECT_ATTRIBUTES * Attributes
+    )
+{
+    PWDF_SHIM_CONTEXT   context;
+    size_t              size;
+
+    size = Attributes->ContextTypeInfo->ContextSize;
+    if (Attributes->ContextSizeOverride > size) {
+        size = Attributes->ContextSizeOverride;
+    }
+
+    context = (PWDF_SHIM_CONTEXT) calloc(1, sizeof(*context) + size);
+    if (context) {
+        context->TypeInfo = Attributes->ContextTypeInfo;
+    }
+
+    return context;
+}
+
+static PVOID
+WdfShimObjectAllocate(
+    size_t Size,
+    WDF_SHIM_OBJECT_TYPE Type,
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    PWDF_SHIM_OBJECT DefaultParent
+    )
+/*++
+
+Routine Description:
+
+    Allocate an object of Size bytes (header first), attach its typed
+    context and link it under its parent. The caller owns the single
+    reference the object starts with.
+
+--*/
+{
+    PWDF_SHIM_OBJECT object;
+
+    object = (PWDF_SHIM_OBJECT) calloc(1, Size);
+    if (!object) {
+        return NULL;
+    }
+
+    object->Type      = Type;
+    object->RefCount  = 1;
+    object->Parent    = DefaultParent;
+    object->SyncScope = WdfSynchronizationScopeInheritFromParent;
+    InitializeListHead(&object->ChildList);
+    InitializeListHead(&object->SiblingLink);
+
+    if (Attributes) {
+
+        if (Attributes->ParentObject) {
+            object->Parent = (PWDF_SHIM_OBJECT) Attributes->ParentObject;
+        }
+
+        object->SyncScope = Attributes->SynchronizationScope;
+
+        if (Attributes->ContextTypeInfo) {
+
+            object->Contexts = WdfShimAllocateContext(Attributes);
+            if (!object->Contexts) {
+                free(object);
+                return NULL;
+            }
+            object->Contexts->EvtCleanup = Attributes->EvtCleanupCallback;
+            object->Contexts->EvtDestroy = Attributes->EvtDestroyCallback;
+
+        } else {
+
+            object->EvtCleanup = Attributes->EvtCleanupCallback;
+            object->EvtDestroy = Attributes->EvtDestroyCallback;
+        }
+    }
+
+    if (object->Parent) {
+        pthread_mutex_lock(&WdfShimTreeLock);
+        InsertTailList(&object->Parent->ChildList, &object->SiblingLink);
+        pthread_mutex_unlock(&WdfShimTreeLock);
+    }
+
+    return object;
+}
+
+static VOID
+WdfShimObjectRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_CONTEXT context;
+
+    if (Object->Release) {
+        Object->Release(Object);
+    }
+
+    if (Object->EvtDestroy) {
+        Object->EvtDestroy(Object);
+    }
+
+    for (context = Object->Contexts; context; context = context->Next) {
+        if (context->EvtDestroy) {
+            context->EvtDestroy(Object);
+        }
+    }
+
+    while (Object->Contexts) {
+        context = Object->Contexts;
+        Object->Contexts = context->Next;
+        free(context);
+    }
+
+    free(Object);
+}
+
+static VOID
+WdfShimObjectDelete(
+    PWDF_SHIM_OBJECT Object
+    )
+/*++
+
+Routine Description:
+
+    Delete children (newest first), run the cleanup callbacks and the
+    type's Dispose, detach from the parent and drop the creation
+    reference.
+
+--*/
+{
+    PWDF_SHIM_CONTEXT context;
+
+    if (Object->Deleted) {
+        return;
+    }
+    Object->Deleted = TRUE;
+
+    pthread_mutex_lock(&WdfShimTreeLock);
+    while (!IsListEmpty(&Object->ChildList)) {
+
+        PWDF_SHIM_OBJECT child = CONTAINING_RECORD(Object->ChildList.Blink,
+                                                   WDF_SHIM_OBJECT,
+                                                   SiblingLink);
+        pthread_mutex_unlock(&WdfShimTreeLock);
+        WdfShimObjectDelete(child);
+        pthread_mutex_lock(&WdfShimTreeLock);
+    }
+    pthread_mutex_unlock(&WdfShimTreeLock);
+
+    if (Object->EvtCleanup) {
+        Object->EvtCleanup(Object);
+    }
+
+    for (context = Object->Contexts; context; context = context->Next) {
+        if (context->EvtCleanup) {
+            context->EvtCleanup(Object);
+        }
+    }
+
+    if (Object->Dispose) {
+        Object->Dispose(Object);
+    }
+
+    pthread_mutex_lock(&WdfShimTreeLock);
+    RemoveEntryList(&Object->SiblingLink);
+    InitializeListHead(&Object->SiblingLink);
+    pthread_mutex_unlock(&WdfShimTreeLock);
+
+    WdfObjectDereference(Object);
+}
+
+PVOID
+WdfObjectGetTypedContextWorker(
+    WDFOBJECT Handle,
+    const WDF_OBJECT_CONTEXT_TYPE_INFO * TypeInfo
+    )
+{
+    PWDF_SHIM_CONTEXT context;
+
+    if (!Handle) {
+        return NULL;
+    }
+
+    for (context = ((PWDF_SHIM_OBJECT) Handle)->Contexts;
+         context;
+         context = context->Next) {
+
+        if (context->TypeInfo == TypeInfo ||
+            strcmp(context->TypeInfo->ContextName, TypeInfo->ContextName) == 0) {
+            return context->Data;
+        }
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+WdfObjectAllocateContext(
+    WDFOBJECT Handle,
+    PWDF_OBJECT_ATTRIBUTES ContextAttributes,
+    PVOID * Context
+    )
+{
+    PWDF_SHIM_OBJECT    object = (PWDF_SHIM_OBJECT) Handle;
+    PWDF_SHIM_CONTEXT   context;
+    PVOID               existing;
+
+    if (!ContextAttributes || !ContextAttributes->ContextTypeInfo) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    existing = WdfObjectGetTypedContextWorker(Handle, ContextAttributes->ContextTypeInfo);
+    if (existing) {
+        if (Context) {
+            *Context = existing;
+        }
+        return STATUS_OBJECT_NAME_EXISTS;
+    }
+
+    context = WdfShimAllocateContext(ContextAttributes);
+    if (!context) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    context->EvtCleanup = ContextAttributes->EvtCleanupCallback;
+    context->EvtDestroy = ContextAttributes->EvtDestroyCallback;
+
+    pthread_mutex_lock(&WdfShimTreeLock);
+    context->Next = object->Contexts;
+    object->Contexts = context;
+    pthread_mutex_unlock(&WdfShimTreeLock);
+
+    if (Context) {
+        *Context = context->Data;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfObjectDelete(
+    WDFOBJECT Object
+    )
+{
+    if (Object) {
+        WdfShimObjectDelete((PWDF_SHIM_OBJECT) Object);
+    }
+}
+
+VOID
+WdfObjectReference(
+    WDFOBJECT Handle
+    )
+{
+    InterlockedIncrement(&((PWDF_SHIM_OBJECT) Handle)->RefCount);
+}
+
+VOID
+WdfObjectDereference(
+    WDFOBJECT Handle
+    )
+{
+    PWDF_SHIM_OBJECT object = (PWDF_SHIM_OBJECT) Handle;
+
+    if (InterlockedDecrement(&object->RefCount) == 0) {
+        WdfShimObjectRelease(object);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Kernel support routines
+//-----------------------------------------------------------------------------
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+    PLARGE_INTEGER PerformanceFrequency
+    )
+{
+    LARGE_INTEGER   counter;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    counter.QuadPart = (LONGLONG) ts.tv_sec * 1000000000ll + ts.tv_nsec;
+
+    if (PerformanceFrequency) {
+        PerformanceFrequency->QuadPart = 1000000000ll;
+    }
+
+    return counter;
+}
+
+ULONG
+KeQueryActiveProcessorCount(
+    PKAFFINITY ActiveProcessors
+    )
+/*++
+
+Routine Description:
+
+    The processors this process may run on (the first 64 of them).
+
+--*/
+{
+    cpu_set_t   set;
+    KAFFINITY   affinity = 0;
+    ULONG       count = 0;
+    ULONG       cpu;
+
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        CPU_SET(0, &set);
+    }
+
+    for (cpu = 0; cpu < sizeof(KAFFINITY) * 8; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            affinity |= (KAFFINITY) 1 << cpu;
+            count++;
+        }
+    }
+
+    if (ActiveProcessors) {
+        *ActiveProcessors = affinity;
+    }
+
+    return count;
+}
+
+ULONG
+KeGetCurrentProcessorNumber(
+    VOID
+    )
+{
+    int cpu = sched_getcpu();
+
+    return (cpu < 0) ? 0 : (ULONG) cpu;
+}
+
+VOID
+KeSetTargetProcessorDpc(
+    PRKDPC Dpc,
+    CCHAR Number
+    )
+{
+    __atomic_store_n(&Dpc->Number, (LONG) (UCHAR) Number, __ATOMIC_RELAXED);
+}
+
+ULONG
+KeGetProcessorIndexFromNumber(
+    PPROCESSOR_NUMBER ProcNumber
+    )
+/*++
+
+Routine Description:
+
+    The index of a processor this process may run on, or
+    INVALID_PROCESSOR_INDEX.
+
+--*/
+{
+    cpu_set_t   set;
+    ULONG       index;
+
+    if (ProcNumber->Reserved != 0 || ProcNumber->Number >= sizeof(KAFFINITY) * 8) {
+        return INVALID_PROCESSOR_INDEX;
+    }
+
+    index = (ULONG) ProcNumber->Group * sizeof(KAFFINITY) * 8 + ProcNumber->Number;
+
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        CPU_SET(0, &set);
+    }
+
+    if (index >= CPU_SETSIZE || !CPU_ISSET(index, &set)) {
+        return INVALID_PROCESSOR_INDEX;
+    }
+
+    return index;
+}
+
+NTSTATUS
+KeSetTargetProcessorDpcEx(
+    PKDPC Dpc,
+    PPROCESSOR_NUMBER ProcNumber
+    )
+{
+    ULONG index = KeGetProcessorIndexFromNumber(ProcNumber);
+
+    if (index == INVALID_PROCESSOR_INDEX) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    __atomic_store_n(&Dpc->Number, (LONG) index, __ATOMIC_RELAXED);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+KeDelayExecutionThread(
+    KPROCESSOR_MODE WaitMode,
+    BOOLEAN Alertable,
+    PLARGE_INTEGER Interval
+    )
+{
+    struct timespec delay;
+    LONGLONG        ticks = -Interval->QuadPart;
+
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    if (ticks < 0) {
+        ticks = 0;
+    }
+
+    delay.tv_sec  = (time_t) (ticks / 10000000);
+    delay.tv_nsec = (long) (ticks % 10000000) * 100;
+
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+    }
+
+    return STATUS_SUCCESS;
+}
+
+PMDL
+IoAllocateMdl(
+    PVOID VirtualAddress,
+    ULONG Length,
+    BOOLEAN SecondaryBuffer,
+    BOOLEAN ChargeQuota,
+    PVOID Irp
+    )
+{
+    PMDL mdl;
+
+    UNREFERENCED_PARAMETER(SecondaryBuffer);
+    UNREFERENCED_PARAMETER(ChargeQuota);
+    UNREFERENCED_PARAMETER(Irp);
+
+    mdl = (PMDL) malloc(sizeof(*mdl));
+    if (mdl) {
+        mdl->VirtualAddress = VirtualAddress;
+        mdl->ByteCount = Length;
+    }
+
+    return mdl;
+}
+
+VOID
+IoFreeMdl(
+    PMDL Mdl
+    )
+{
+    free(Mdl);
+}
+
+PVOID
+MmMapLockedPagesSpecifyCache(
+    PMDL Mdl,
+    KPROCESSOR_MODE AccessMode,
+    MEMORY_CACHING_TYPE CacheType,
+    PVOID RequestedAddress,
+    ULONG BugCheckOnFailure,
+    MM_PAGE_PRIORITY Priority
+    )
+{
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(CacheType);
+    UNREFERENCED_PARAMETER(RequestedAddress);
+    UNREFERENCED_PARAMETER(BugCheckOnFailure);
+    UNREFERENCED_PARAMETER(Priority);
+
+    return Mdl->VirtualAddress;
+}
+
+VOID
+MmUnmapLockedPages(
+    PVOID BaseAddress,
+    PMDL Mdl
+    )
+{
+    UNREFERENCED_PARAMETER(BaseAddress);
+    UNREFERENCED_PARAMETER(Mdl);
+}
+
+PVOID
+MmMapIoSpace(
+    PHYSICAL_ADDRESS PhysicalAddress,
+    SIZE_T NumberOfBytes,
+    MEMORY_CACHING_TYPE CacheType
+    )
+{
+    PWDF_SHIM_DEVICE device;
+
+    UNREFERENCED_PARAMETER(CacheType);
+
+    if (!WdfShimSim || !WdfShimDriver || !WdfShimDriver->LastDevice) {
+        return NULL;
+    }
+
+    device = WdfShimDriver->LastDevice;
+
+    if ((ULONGLONG) PhysicalAddress.QuadPart == WDF_SHIM_BAR0_PA &&
+        NumberOfBytes <= sizeof(HSAC_REGS)) {
+        return HsacSimGetRegs(WdfShimSim);
+    }
+
+    if ((ULONGLONG) PhysicalAddress.QuadPart == WDF_SHIM_BAR2_PA &&
+        NumberOfBytes <= WdfShimSramSize) {
+        return device->Sram;
+    }
+
+    return NULL;
+}
+
+VOID
+MmUnmapIoSpace(
+    PVOID BaseAddress,
+    SIZE_T NumberOfBytes
+    )
+{
+    UNREFERENCED_PARAMETER(BaseAddress);
+    UNREFERENCED_PARAMETER(NumberOfBytes);
+}
+
+ULONG
+WdfShimReadRegisterUlong(
+    volatile ULONG * Register
+    )
+{
+    if (WdfShimSim && HsacSimOwnsRegister(WdfShimSim, Register)) {
+        return HsacSimReadRegister(WdfShimSim, Register);
+    }
+
+    return *Register;
+}
+
+VOID
+WdfShimWriteRegisterUlong(
+    volatile ULONG * Register,
+    ULONG Value
+    )
+{
+    if (WdfShimSim && HsacSimOwnsRegister(WdfShimSim, Register)) {
+        HsacSimWriteRegister(WdfShimSim, Register, Value);
+        return;
+    }
+
+    *Register = Value;
+}
+
+//-----------------------------------------------------------------------------
+// Driver
+//-----------------------------------------------------------------------------
+
+NTSTATUS
+WdfDriverCreate(
+    PDRIVER_OBJECT DriverObject,
+    PUNICODE_STRING RegistryPath,
+    PWDF_OBJECT_ATTRIBUTES DriverAttributes,
+    PWDF_DRIVER_CONFIG DriverConfig,
+    WDFDRIVER * Driver
+    )
+{
+    PWDF_SHIM_DRIVER driver;
+
+    UNREFERENCED_PARAMETER(RegistryPath);
+
+    if (WdfShimDriver) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    driver = (PWDF_SHIM_DRIVER) WdfShimObjectAllocate(sizeof(*driver),
+                                                       WdfShimObjectDriver,
+                                                       DriverAttributes,
+                                                       NULL);
+    if (!driver) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    driver->Config    = *DriverConfig;
+    driver->WdmDriver = DriverObject;
+    WdfShimDriver     = driver;
+
+    if (Driver) {
+        *Driver = driver;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+PDRIVER_OBJECT
+WdfDriverWdmGetDriverObject(
+    WDFDRIVER Driver
+    )
+{
+    return ((PWDF_SHIM_DRIVER) Driver)->WdmDriver;
+}
+
+//-----------------------------------------------------------------------------
+// Device
+//-----------------------------------------------------------------------------
+
+static WDF_SYNCHRONIZATION_SCOPE
+WdfShimDeviceScope(
+    PWDF_SHIM_DEVICE Device
+    )
+{
+    //
+    // The driver object's scope (and so the default) is None.
+    //
+    if (Device->Object.SyncScope == WdfSynchronizationScopeInheritFromParent) {
+        return WdfSynchronizationScopeNone;
+    }
+
+    return Device->Object.SyncScope;
+}
+
+static pthread_mutex_t *
+WdfShimQueueSyncLock(
+    PWDF_SHIM_QUEUE Queue
+    )
+/*++
+
+Routine Description:
+
+    Lock held around the queue's I/O and cancel callbacks.
+
+--*/
+{
+    WDF_SYNCHRONIZATION_SCOPE scope = Queue->Object.SyncScope;
+
+    if (scope == WdfSynchronizationScopeInheritFromParent) {
+        scope = WdfShimDeviceScope(Queue->Device);
+    }
+
+    switch (scope) {
+    case WdfSynchronizationScopeDevice:
+        return &Queue->Device->SyncLock;
+    case WdfSynchronizationScopeQueue:
+        return &Queue->CallbackLock;
+    default:
+        return NULL;
+    }
+}
+
+static VOID
+WdfShimDeviceDispose(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_DEVICE device = (PWDF_SHIM_DEVICE) Object;
+
+    if (WdfShimDriver && WdfShimDriver->LastDevice == device) {
+        WdfShimDriver->LastDevice = NULL;
+    }
+}
+
+static VOID
+WdfShimDeviceRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_DEVICE device = (PWDF_SHIM_DEVICE) Object;
+
+    free(device->Sram);
+    pthread_mutex_destroy(&device->SyncLock);
+}
+
+VOID
+WdfDeviceInitSetIoType(
+    PWDFDEVICE_INIT DeviceInit,
+    WDF_DEVICE_IO_TYPE IoType
+    )
+{
+    DeviceInit->IoType = IoType;
+}
+
+VOID
+WdfDeviceInitSetFileObjectConfig(
+    PWDFDEVICE_INIT DeviceInit,
+    PWDF_FILEOBJECT_CONFIG FileObjectConfig,
+    PWDF_OBJECT_ATTRIBUTES FileObjectAttributes
+    )
+{
+    DeviceInit->FileConfig = *FileObjectConfig;
+    if (FileObjectAttributes) {
+        DeviceInit->FileAttributes = *FileObjectAttributes;
+    }
+}
+
+VOID
+WdfDeviceInitSetPnpPowerEventCallbacks(
+    PWDFDEVICE_INIT DeviceInit,
+    PWDF_PNPPOWER_EVENT_CALLBACKS PnpPowerEventCallbacks
+    )
+{
+    DeviceInit->PnpPower = *PnpPowerEventCallbacks;
+}
+
+NTSTATUS
+WdfDeviceCreate(
+    PWDFDEVICE_INIT * DeviceInit,
+    PWDF_OBJECT_ATTRIBUTES DeviceAttributes,
+    WDFDEVICE * Device
+    )
+{
+    PWDF_SHIM_DEVICE    device;
+    pthread_mutexattr_t attr;
+
+    if (!WdfShimDriver || !DeviceInit || !*DeviceInit) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    device = (PWDF_SHIM_DEVICE) WdfShimObjectAllocate(sizeof(*device),
+                                                       WdfShimObjectDevice,
+                                                       DeviceAttributes,
+                                                       &WdfShimDriver->Object);
+    if (!device) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    device->IoType   = (*DeviceInit)->IoType;
+    device->PnpPower = (*DeviceInit)->PnpPower;
+    device->FileConfig     = (*DeviceInit)->FileConfig;
+    device->FileAttributes = (*DeviceInit)->FileAttributes;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&device->SyncLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    device->Object.Dispose = WdfShimDeviceDispose;
+    device->Object.Release = WdfShimDeviceRelease;
+
+    //
+    // The framework owns the init structure from here on.
+    //
+    free(*DeviceInit);
+    *DeviceInit = NULL;
+
+    WdfShimDriver->LastDevice = device;
+    *Device = device;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDeviceCreateDeviceInterface(
+    WDFDEVICE Device,
+    const GUID * InterfaceClassGUID,
+    PUNICODE_STRING ReferenceString
+    )
+{
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(InterfaceClassGUID);
+    UNREFERENCED_PARAMETER(ReferenceString);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDeviceAssignS0IdleSettings(
+    WDFDEVICE Device,
+    PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS Settings
+    )
+{
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(Settings);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDeviceStopIdle(
+    WDFDEVICE Device,
+    BOOLEAN WaitForD0
+    )
+/*++
+
+Routine Description:
+
+    The shim never idles a device out of D0; it only counts the
+    references, so that a test can see them taken and given back.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(WaitForD0);
+
+    InterlockedIncrement(&((PWDF_SHIM_DEVICE) Device)->IdleReferences);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfDeviceResumeIdle(
+    WDFDEVICE Device
+    )
+{
+    if (InterlockedDecrement(&((PWDF_SHIM_DEVICE) Device)->IdleReferences) < 0) {
+        fprintf(stderr, "WdfShim: WdfDeviceResumeIdle without WdfDeviceStopIdle\n");
+    }
+}
+
+LONG
+WdfShimDeviceIdleReferences(
+    WDFDEVICE Device
+    )
+{
+    return InterlockedCompareExchange(&((PWDF_SHIM_DEVICE) Device)->IdleReferences, 0, 0);
+}
+
+NTSTATUS
+WdfDeviceAssignSxWakeSettings(
+    WDFDEVICE Device,
+    PWDF_DEVICE_POWER_POLICY_WAKE_SETTINGS Settings
+    )
+{
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(Settings);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfDeviceSetAlignmentRequirement(
+    WDFDEVICE Device,
+    ULONG AlignmentRequirement
+    )
+{
+    ((PWDF_SHIM_DEVICE) Device)->AlignmentRequirement = AlignmentRequirement;
+}
+
+ULONG
+WdfDeviceGetAlignmentRequirement(
+    WDFDEVICE Device
+    )
+{
+    return ((PWDF_SHIM_DEVICE) Device)->AlignmentRequirement;
+}
+
+NTSTATUS
+WdfDeviceConfigureRequestDispatching(
+    WDFDEVICE Device,
+    WDFQUEUE Queue,
+    WDF_REQUEST_TYPE RequestType
+    )
+{
+    PWDF_SHIM_DEVICE device = (PWDF_SHIM_DEVICE) Device;
+
+    if ((ULONG) RequestType >= WdfRequestTypeMax) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (device->Dispatch[RequestType]) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    device->Dispatch[RequestType] = (PWDF_SHIM_QUEUE) Queue;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDeviceOpenRegistryKey(
+    WDFDEVICE Device,
+    ULONG DeviceInstanceKeyType,
+    ACCESS_MASK DesiredAccess,
+    PWDF_OBJECT_ATTRIBUTES KeyAttributes,
+    WDFKEY * Key
+    )
+{
+    PWDF_SHIM_OBJECT key;
+
+    (void) DesiredAccess;
+
+    if (DeviceInstanceKeyType != PLUGPLAY_REGKEY_DEVICE) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    key = WdfShimObjectAllocate(sizeof(*key), WdfShimObjectKey, KeyAttributes,
+                                &((PWDF_SHIM_DEVICE) Device)->Object);
+    if (!key) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *Key = key;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRegistryQueryULong(
+    WDFKEY Key,
+    PCUNICODE_STRING ValueName,
+    PULONG Value
+    )
+/*++
+
+Routine Description:
+
+    Look the value up by name, case-insensitively as the registry does.
+    The names set by the harness are ASCII.
+
+--*/
+{
+    ULONG length = ValueName->Length / sizeof(WCHAR);
+    ULONG i, c;
+
+    (void) Key;
+
+    for (i = 0; i < WdfShimRegistryValues; i++) {
+
+        const char * name = WdfShimRegistry[i].Name;
+
+        if (strlen(name) != length) {
+            continue;
+        }
+        for (c = 0; c < length; c++) {
+            if (ValueName->Buffer[c] > 0x7F ||
+                tolower((UCHAR) ValueName->Buffer[c]) != tolower((UCHAR) name[c])) {
+                break;
+            }
+        }
+        if (c == length) {
+            *Value = WdfShimRegistry[i].Value;
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+VOID
+WdfRegistryClose(
+    WDFKEY Key
+    )
+{
+    WdfObjectDelete(Key);
+}
+
+PDEVICE_OBJECT
+WdfDeviceWdmGetDeviceObject(
+    WDFDEVICE Device
+    )
+{
+    return (PDEVICE_OBJECT) Device;
+}
+
+PDEVICE_OBJECT
+WdfDeviceWdmGetPhysicalDevice(
+    WDFDEVICE Device
+    )
+{
+    return (PDEVICE_OBJECT) &((PWDF_SHIM_DEVICE) Device)->Resources;
+}
+
+ULONG
+WdfCmResourceListGetCount(
+    WDFCMRESLIST List
+    )
+{
+    return ((PWDF_SHIM_RESOURCE_LIST) List)->Count;
+}
+
+PCM_PARTIAL_RESOURCE_DESCRIPTOR
+WdfCmResourceListGetDescriptor(
+    WDFCMRESLIST List,
+    ULONG Index
+    )
+{
+    PWDF_SHIM_RESOURCE_LIST list = (PWDF_SHIM_RESOURCE_LIST) List;
+
+    if (Index >= list->Count) {
+        return NULL;
+    }
+
+    return &list->Descriptors[Index];
+}
+
+//-----------------------------------------------------------------------------
+// Requests
+//-----------------------------------------------------------------------------
+
+static VOID
+WdfShimRequestRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    free(((PWDF_SHIM_REQUEST) Object)->SystemBuffer);
+}
+
+static VOID
+WdfShimCallCancelRoutine(
+    PWDF_SHIM_REQUEST Request,
+    PFN_WDF_REQUEST_CANCEL CancelRoutine
+    )
+{
+    pthread_mutex_t * lock = NULL;
+
+    if (Request->Queue) {
+        lock = WdfShimQueueSyncLock(Request->Queue);
+    }
+
+    if (lock) {
+        pthread_mutex_lock(lock);
+    }
+
+    CancelRoutine(Request);
+
+    if (lock) {
+        pthread_mutex_unlock(lock);
+    }
+}
+
+WDFQUEUE
+WdfRequestGetIoQueue(
+    WDFREQUEST Request
+    )
+{
+    return ((PWDF_SHIM_REQUEST) Request)->Queue;
+}
+
+WDFFILEOBJECT
+WdfRequestGetFileObject(
+    WDFREQUEST Request
+    )
+{
+    return ((PWDF_SHIM_REQUEST) Request)->File;
+}
+
+WDFDEVICE
+WdfFileObjectGetDevice(
+    WDFFILEOBJECT FileObject
+    )
+{
+    return ((PWDF_SHIM_FILE) FileObject)->Device;
+}
+
+VOID
+WdfRequestSetInformation(
+    WDFREQUEST Request,
+    ULONG_PTR Information
+    )
+{
+    ((PWDF_SHIM_REQUEST) Request)->Information = Information;
+}
+
+ULONG_PTR
+WdfRequestGetInformation(
+    WDFREQUEST Request
+    )
+{
+    return ((PWDF_SHIM_REQUEST) Request)->Information;
+}
+
+VOID
+WdfRequestComplete(
+    WDFREQUEST Request,
+    NTSTATUS Status
+    )
+{
+    WdfRequestCompleteWithInformation(Request, Status,
+                                      ((PWDF_SHIM_REQUEST) Request)->Information);
+}
+
+VOID
+WdfRequestCompleteWithInformation(
+    WDFREQUEST Request,
+    NTSTATUS Status,
+    ULONG_PTR Information
+    )
+/*++
+
+Routine Description:
+
+    Plays the I/O manager's completion: copy METHOD_BUFFERED output back,
+    let the queue present its next request, notify the submitter and drop
+    the I/O manager's reference.
+
+--*/
+{
+    PWDF_SHIM_REQUEST   request = (PWDF_SHIM_REQUEST) Request;
+    PWDF_SHIM_QUEUE     queue = request->Queue;
+
+    pthread_mutex_lock(&WdfShimCancelLock);
+    ASSERT(request->State != WdfShimRequestCompleted);
+    request->State = WdfShimRequestCompleted;
+    request->CancelRoutine = NULL;
+    pthread_mutex_unlock(&WdfShimCancelLock);
+
+    request->Information = Information;
+
+    if (NT_SUCCESS(Status) && request->UserOutputBuffer &&
+        request->SystemBuffer == request->OutputBuffer) {
+
+        size_t length = Information;
+
+        if (length > request->UserOutputLength) {
+            length = request->UserOutputLength;
+        }
+        memcpy(request->UserOutputBuffer, request->SystemBuffer, length);
+    }
+
+    if (queue && request->InFlight) {
+        pthread_mutex_lock(&queue->Lock);
+        request->InFlight = FALSE;
+        queue->InFlight--;
+        pthread_cond_broadcast(&queue->Cond);
+        pthread_mutex_unlock(&queue->Lock);
+    }
+
+    if (request->Completion) {
+        request->Completion(request->CompletionContext, Request, Status, Information);
+    }
+
+    WdfObjectDereference(Request);
+}
+
+VOID
+WdfRequestMarkCancelable(
+    WDFREQUEST Request,
+    PFN_WDF_REQUEST_CANCEL EvtRequestCancel
+    )
+{
+    PWDF_SHIM_REQUEST request = (PWDF_SHIM_REQUEST) Request;
+
+    pthread_mutex_lock(&WdfShimCancelLock);
+
+    request->CancelRoutineTaken = FALSE;
+
+    if (request->Cancelled) {
+        //
+        // Already cancelled: the framework calls EvtRequestCancel before
+        // returning. The caller already holds the queue's sync lock.
+        //
+        request->CancelRoutineTaken = TRUE;
+        pthread_mutex_unlock(&WdfShimCancelLock);
+        EvtRequestCancel(Request);
+        return;
+    }
+
+    request->CancelRoutine = EvtRequestCancel;
+    pthread_mutex_unlock(&WdfShimCancelLock);
+}
+
+NTSTATUS
+WdfRequestMarkCancelableEx(
+    WDFREQUEST Request,
+    PFN_WDF_REQUEST_CANCEL EvtRequestCancel
+    )
+{
+    PWDF_SHIM_REQUEST   request = (PWDF_SHIM_REQUEST) Request;
+    NTSTATUS            status = STATUS_SUCCESS;
+
+    pthread_mutex_lock(&WdfShimCancelLock);
+
+    request->CancelRoutineTaken = FALSE;
+
+    if (request->Cancelled) {
+        //
+        // Unlike WdfRequestMarkCancelable, the routine is not called; the
+        // caller completes the request itself.
+        //
+        status = STATUS_CANCELLED;
+    } else {
+        request->CancelRoutine = EvtRequestCancel;
+    }
+
+    pthread_mutex_unlock(&WdfShimCancelLock);
+
+    return status;
+}
+
+NTSTATUS
+WdfRequestUnmarkCancelable(
+    WDFREQUEST Request
+    )
+{
+    PWDF_SHIM_REQUEST   request = (PWDF_SHIM_REQUEST) Request;
+    NTSTATUS            status = STATUS_SUCCESS;
+
+    pthread_mutex_lock(&WdfShimCancelLock);
+
+    if (request->CancelRoutineTaken) {
+        status = STATUS_CANCELLED;
+    } else {
+        request->CancelRoutine = NULL;
+    }
+
+    pthread_mutex_unlock(&WdfShimCancelLock);
+
+    return status;
+}
+
+BOOLEAN
+WdfRequestIsCanceled(
+    WDFREQUEST Request
+    )
+{
+    return ((PWDF_SHIM_REQUEST) Request)->Cancelled;
+}
+
+static NTSTATUS
+WdfShimRetrieveBuffer(
+    PVOID Buffer,
+    size_t BufferLength,
+    size_t MinimumRequiredLength,
+    PVOID * Out,
+    size_t * Length
+    )
+{
+    if (!Buffer || BufferLength == 0 || BufferLength < MinimumRequiredLength) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *Out = Buffer;
+    if (Length) {
+        *Length = BufferLength;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestRetrieveInputBuffer(
+    WDFREQUEST Request,
+    size_t MinimumRequiredLength,
+    PVOID * Buffer,
+    size_t * Length
+    )
+{
+    PWDF_SHIM_REQUEST request = (PWDF_SHIM_REQUEST) Request;
+
+    if (request->Type == WdfRequestTypeRead) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    return WdfShimRetrieveBuffer(request->InputBuffer, request->InputLength,
+                                 MinimumRequiredLength, Buffer, Length);
+}
+
+NTSTATUS
+WdfRequestRetrieveOutputBuffer(
+    WDFREQUEST Request,
+    size_t MinimumRequiredSize,
+    PVOID * Buffer,
+    size_t * Length
+    )
+{
+    PWDF_SHIM_REQUEST request = (PWDF_SHIM_REQUEST) Request;
+
+    if (request->Type == WdfRequestTypeWrite) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    return WdfShimRetrieveBuffer(request->OutputBuffer, request->OutputLength,
+                                 MinimumRequiredSize, Buffer, Length);
+}
+
+NTSTATUS
+WdfRequestRetrieveInputWdmMdl(
+    WDFREQUEST Request,
+    PMDL * Mdl
+    )
+{
+    PWDF_SHIM_REQUEST request = (PWDF_SHIM_REQUEST) Request;
+
+    if (!request->HasInputMdl) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    *Mdl = &request->InputMdl;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestRetrieveOutputWdmMdl(
+    WDFREQUEST Request,
+    PMDL * Mdl
+    )
+{
+    PWDF_SHIM_REQUEST request = (PWDF_SHIM_REQUEST) Request;
+
+    if (!request->HasOutputMdl) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    *Mdl = &request->OutputMdl;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfRequestForwardToIoQueue(
+    WDFREQUEST Request,
+    WDFQUEUE DestinationQueue
+    )
+/*++
+
+Routine Description:
+
+    Take a presented request back from its queue, letting that queue
+    present its next one, and queue it on DestinationQueue, which
+    presents it under its own dispatch limits.
+
+--*/
+{
+    PWDF_SHIM_REQUEST   request = (PWDF_SHIM_REQUEST) Request;
+    PWDF_SHIM_QUEUE     source = request->Queue;
+    PWDF_SHIM_QUEUE     queue = (PWDF_SHIM_QUEUE) DestinationQueue;
+
+    if (!queue || queue == source || queue->Device != source->Device) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    pthread_mutex_lock(&source->Lock);
+    if (request->InFlight) {
+        request->InFlight = FALSE;
+        source->InFlight--;
+        pthread_cond_broadcast(&source->Cond);
+    }
+    pthread_mutex_unlock(&source->Lock);
+
+    pthread_mutex_lock(&queue->Lock);
+    request->Queue = queue;
+    request->State = WdfShimRequestQueued;
+    InsertTailList(&queue->PendingList, &request->QueueLink);
+    pthread_cond_broadcast(&queue->Cond);
+    pthread_mutex_unlock(&queue->Lock);
+
+    return STATUS_SUCCESS;
+}
+
+//-----------------------------------------------------------------------------
+// Queues
+//-----------------------------------------------------------------------------
+
+static VOID
+WdfShimQueuePresent(
+    PWDF_SHIM_QUEUE Queue,
+    PWDF_SHIM_REQUEST Request
+    )
+{
+    PWDF_IO_QUEUE_CONFIG    config = &Queue->Config;
+    pthread_mutex_t       * lock = WdfShimQueueSyncLock(Queue);
+
+    if (lock) {
+        pthread_mutex_lock(lock);
+    }
+
+    switch (Request->Type) {
+
+    case WdfRequestTypeRead:
+        if (config->EvtIoRead) {
+            config->EvtIoRead(Queue, Request, Request->OutputLength);
+            goto Presented;
+        }
+        break;
+
+    case WdfRequestTypeWrite:
+        if (config->EvtIoWrite) {
+            config->EvtIoWrite(Queue, Request, Request->InputLength);
+            goto Presented;
+        }
+        break;
+
+    case WdfRequestTypeDeviceControl:
+        if (config->EvtIoDeviceControl) {
+            config->EvtIoDeviceControl(Queue, Request,
+                                       Request->UserOutputBuffer ?
+                                           Request->UserOutputLength :
+                                           Request->OutputLength,
+                                       Request->InputLength,
+                                       Request->IoControlCode);
+            goto Presented;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+
+Presented:
+    if (lock) {
+        pthread_mutex_unlock(lock);
+    }
+}
+
+static BOOLEAN
+WdfShimQueueCanPresent(
+    PWDF_SHIM_QUEUE Queue
+    )
+{
+    ULONG limit;
+
+    if (IsListEmpty(&Queue->PendingList)) {
+        return FALSE;
+    }
+
+    if (Queue->Config.PowerManaged && !Queue->Device->Started) {
+        return FALSE;
+    }
+
+    if (Queue->Stopped) {
+        return FALSE;
+    }
+
+    switch (Queue->Config.DispatchType) {
+    case WdfIoQueueDispatchSequential:
+        limit = 1;
+        break;
+    case WdfIoQueueDispatchParallel:
+        limit = Queue->Config.Settings.Parallel.NumberOfPresentedRequests;
+        break;
+    default:
+        return FALSE;
+    }
+
+    return (BOOLEAN) (Queue->InFlight < limit);
+}
+
+static PVOID
+WdfShimQueueThread(
+    PVOID Context
+    )
+{
+    PWDF_SHIM_QUEUE queue = (PWDF_SHIM_QUEUE) Context;
+
+    pthread_mutex_lock(&queue->Lock);
+
+    for (;;) {
+        PWDF_SHIM_REQUEST request;
+
+        while (!queue->Stop && !WdfShimQueueCanPresent(queue)) {
+            pthread_cond_wait(&queue->Cond, &queue->Lock);
+        }
+
+        if (queue->Stop) {
+            break;
+        }
+
+        request = CONTAINING_RECORD(RemoveHeadList(&queue->PendingList),
+                                    WDF_SHIM_REQUEST, QueueLink);
+        request->State    = WdfShimRequestPresented;
+        request->InFlight = TRUE;
+        queue->InFlight++;
+
+        pthread_mutex_unlock(&queue->Lock);
+        WdfShimQueuePresent(queue, request);
+        pthread_mutex_lock(&queue->Lock);
+    }
+
+    pthread_mutex_unlock(&queue->Lock);
+    return NULL;
+}
+
+static VOID
+WdfShimQueueDispose(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_QUEUE queue = (PWDF_SHIM_QUEUE) Object;
+    ULONG           i;
+
+    pthread_mutex_lock(&queue->Lock);
+    queue->Stop = TRUE;
+    pthread_cond_broadcast(&queue->Cond);
+    pthread_mutex_unlock(&queue->Lock);
+
+    pthread_join(queue->Thread, NULL);
+
+    //
+    // Purge whatever was never presented.
+    //
+    for (;;) {
+        PWDF_SHIM_REQUEST request;
+
+        pthread_mutex_lock(&queue->Lock);
+        if (IsListEmpty(&queue->PendingList)) {
+            pthread_mutex_unlock(&queue->Lock);
+            break;
+        }
+        request = CONTAINING_RECORD(RemoveHeadList(&queue->PendingList),
+                                    WDF_SHIM_REQUEST, QueueLink);
+        request->State = WdfShimRequestPresented;
+        pthread_mutex_unlock(&queue->Lock);
+
+        WdfRequestComplete(request, STATUS_CANCELLED);
+    }
+
+    for (i = 0; i < WdfRequestTypeMax; i++) {
+        if (queue->Device->Dispatch[i] == queue) {
+            queue->Device->Dispatch[i] = NULL;
+        }
+    }
+
+    for (i = 0; i < WDF_SHIM_MAX_QUEUES; i++) {
+        if (queue->Device->Queues[i] == queue) {
+            queue->Device->Queues[i] = NULL;
+        }
+    }
+}
+
+static VOID
+WdfShimQueueRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_QUEUE queue = (PWDF_SHIM_QUEUE) Object;
+
+    pthread_cond_destroy(&queue->Cond);
+    pthread_mutex_destroy(&queue->Lock);
+    pthread_mutex_destroy(&queue->CallbackLock);
+}
+
+NTSTATUS
+WdfIoQueueCreate(
+    WDFDEVICE Device,
+    PWDF_IO_QUEUE_CONFIG Config,
+    PWDF_OBJECT_ATTRIBUTES QueueAttributes,
+    WDFQUEUE * Queue
+    )
+{
+    PWDF_SHIM_DEVICE    device = (PWDF_SHIM_DEVICE) Device;
+    PWDF_SHIM_QUEUE     queue;
+    pthread_mutexattr_t attr;
+    ULONG               slot;
+
+    for (slot = 0; slot < WDF_SHIM_MAX_QUEUES; slot++) {
+        if (!device->Queues[slot]) {
+            break;
+        }
+    }
+
+    if (slot == WDF_SHIM_MAX_QUEUES) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (Config->DispatchType == WdfIoQueueDispatchParallel &&
+        Config->Settings.Parallel.NumberOfPresentedRequests == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    queue = (PWDF_SHIM_QUEUE) WdfShimObjectAllocate(sizeof(*queue),
+                                                     WdfShimObjectQueue,
+                                                     QueueAttributes,
+                                                     &device->Object);
+    if (!queue) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    queue->Device = device;
+    queue->Config = *Config;
+    InitializeListHead(&queue->PendingList);
+
+    pthread_mutex_init(&queue->Lock, NULL);
+    pthread_cond_init(&queue->Cond, NULL);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&queue->CallbackLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    queue->Object.Dispose = WdfShimQueueDispose;
+    queue->Object.Release = WdfShimQueueRelease;
+
+    if (pthread_create(&queue->Thread, NULL, WdfShimQueueThread, queue) != 0) {
+        queue->Object.Dispose = NULL;
+        WdfShimObjectDelete(&queue->Object);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    device->Queues[slot] = queue;
+
+    if (Config->DefaultQueue) {
+        ULONG i;
+
+        for (i = 0; i < WdfRequestTypeMax; i++) {
+            if (!device->Dispatch[i]) {
+                device->Dispatch[i] = queue;
+            }
+        }
+    }
+
+    if (Queue) {
+        *Queue = queue;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+WDFDEVICE
+WdfIoQueueGetDevice(
+    WDFQUEUE Queue
+    )
+{
+    return ((PWDF_SHIM_QUEUE) Queue)->Device;
+}
+
+VOID
+WdfIoQueueStopSynchronously(
+    WDFQUEUE Queue
+    )
+/*++
+
+Routine Description:
+
+    Stop presenting requests and wait until the driver has completed or
+    forwarded every request already presented. New requests stay queued.
+
+--*/
+{
+    PWDF_SHIM_QUEUE queue = (PWDF_SHIM_QUEUE) Queue;
+
+    pthread_mutex_lock(&queue->Lock);
+    queue->Stopped = TRUE;
+    while (queue->InFlight) {
+        pthread_cond_wait(&queue->Cond, &queue->Lock);
+    }
+    pthread_mutex_unlock(&queue->Lock);
+}
+
+VOID
+WdfIoQueueStart(
+    WDFQUEUE Queue
+    )
+{
+    PWDF_SHIM_QUEUE queue = (PWDF_SHIM_QUEUE) Queue;
+
+    pthread_mutex_lock(&queue->Lock);
+    queue->Stopped = FALSE;
+    pthread_cond_broadcast(&queue->Cond);
+    pthread_mutex_unlock(&queue->Lock);
+}
+
+//-----------------------------------------------------------------------------
+// Interrupts
+//-----------------------------------------------------------------------------
+
+static PVOID
+WdfShimDpcThread(
+    PVOID Context
+    )
+{
+    PWDF_SHIM_INTERRUPT interrupt = (PWDF_SHIM_INTERRUPT) Context;
+    PWDF_SHIM_DEVICE    device = interrupt->Device;
+
+    pthread_mutex_lock(&interrupt->DpcLock);
+
+    for (;;) {
+        pthread_mutex_t * lock = NULL;
+
+        while (!interrupt->DpcStop && !interrupt->DpcQueued) {
+            pthread_cond_wait(&interrupt->DpcCond, &interrupt->DpcLock);
+        }
+
+        if (interrupt->DpcStop) {
+            break;
+        }
+
+        interrupt->DpcQueued  = FALSE;
+        interrupt->DpcRunning = TRUE;
+        pthread_mutex_unlock(&interrupt->DpcLock);
+
+        if (interrupt->Config.AutomaticSerialization &&
+            WdfShimDeviceScope(device) != WdfSynchronizationScopeNone) {
+            lock = &device->SyncLock;
+        }
+
+        if (lock) {
+            pthread_mutex_lock(lock);
+        }
+
+        interrupt->Config.EvtInterruptDpc(interrupt, device);
+
+        if (lock) {
+            pthread_mutex_unlock(lock);
+        }
+
+        pthread_mutex_lock(&interrupt->DpcLock);
+        interrupt->DpcRunning = FALSE;
+        pthread_cond_broadcast(&interrupt->DpcCond);
+    }
+
+    pthread_mutex_unlock(&interrupt->DpcLock);
+    return NULL;
+}
+
+static VOID
+WdfShimDeviceInterrupt(
+    PVOID Context,
+    unsigned int Message
+    )
+/*++
+
+Routine Description:
+
+    Card model interrupt handler. A line-based interrupt is offered to
+    each connected ISR of the device, under its interrupt lock, until one
+    claims it; a message goes only to the interrupt connected to it.
+
+--*/
+{
+    PWDF_SHIM_DEVICE    device = (PWDF_SHIM_DEVICE) Context;
+    ULONG               i;
+
+    for (i = 0; i < WDF_SHIM_MAX_INTERRUPTS; i++) {
+
+        PWDF_SHIM_INTERRUPT interrupt = device->Interrupts[i];
+        BOOLEAN             recognized = FALSE;
+
+        if (!interrupt ||
+            (device->Messages && interrupt->MessageId != Message)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&interrupt->Lock);
+        if (interrupt->Connected) {
+            recognized = interrupt->Config.EvtInterruptIsr(interrupt,
+                device->Messages ? interrupt->MessageId : 0);
+        }
+        pthread_mutex_unlock(&interrupt->Lock);
+
+        if (recognized) {
+            break;
+        }
+    }
+}
+
+static VOID
+WdfShimInterruptDispose(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_INTERRUPT interrupt = (PWDF_SHIM_INTERRUPT) Object;
+    ULONG               i;
+
+    pthread_mutex_lock(&interrupt->DpcLock);
+    interrupt->DpcStop = TRUE;
+    pthread_cond_broadcast(&interrupt->DpcCond);
+    pthread_mutex_unlock(&interrupt->DpcLock);
+
+    pthread_join(interrupt->DpcThread, NULL);
+
+    for (i = 0; i < WDF_SHIM_MAX_INTERRUPTS; i++) {
+        if (interrupt->Device->Interrupts[i] == interrupt) {
+            interrupt->Device->Interrupts[i] = NULL;
+        }
+    }
+}
+
+static VOID
+WdfShimInterruptRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_INTERRUPT interrupt = (PWDF_SHIM_INTERRUPT) Object;
+
+    pthread_cond_destroy(&interrupt->DpcCond);
+    pthread_mutex_destroy(&interrupt->DpcLock);
+    pthread_mutex_destroy(&interrupt->Lock);
+}
+
+NTSTATUS
+WdfInterruptCreate(
+    WDFDEVICE Device,
+    PWDF_INTERRUPT_CONFIG Configuration,
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    WDFINTERRUPT * Interrupt
+    )
+{
+    PWDF_SHIM_DEVICE    device = (PWDF_SHIM_DEVICE) Device;
+    PWDF_SHIM_INTERRUPT interrupt;
+    ULONG               slot;
+
+    if (!Configuration->EvtInterruptIsr) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (slot = 0; slot < WDF_SHIM_MAX_INTERRUPTS; slot++) {
+        if (!device->Interrupts[slot]) {
+            break;
+        }
+    }
+
+    if (slot == WDF_SHIM_MAX_INTERRUPTS) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    interrupt = (PWDF_SHIM_INTERRUPT) WdfShimObjectAllocate(sizeof(*interrupt),
+                                                             WdfShimObjectInterrupt,
+                                                             Attributes,
+                                                             &device->Object);
+    if (!interrupt) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    interrupt->Device = device;
+    interrupt->Config = *Configuration;
+
+    pthread_mutex_init(&interrupt->Lock, NULL);
+    pthread_mutex_init(&interrupt->DpcLock, NULL);
+    pthread_cond_init(&interrupt->DpcCond, NULL);
+
+    interrupt->Object.Dispose = WdfShimInterruptDispose;
+    interrupt->Object.Release = WdfShimInterruptRelease;
+
+    if (pthread_create(&interrupt->DpcThread, NULL, WdfShimDpcThread, interrupt) != 0) {
+        interrupt->Object.Dispose = NULL;
+        WdfShimObjectDelete(&interrupt->Object);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    device->Interrupts[slot] = interrupt;
+    *Interrupt = interrupt;
+
+    return STATUS_SUCCESS;
+}
+
+WDFDEVICE
+WdfInterruptGetDevice(
+    WDFINTERRUPT Interrupt
+    )
+{
+    return ((PWDF_SHIM_INTERRUPT) Interrupt)->Device;
+}
+
+VOID
+WdfInterruptAcquireLock(
+    WDFINTERRUPT Interrupt
+    )
+{
+    pthread_mutex_lock(&((PWDF_SHIM_INTERRUPT) Interrupt)->Lock);
+}
+
+VOID
+WdfInterruptReleaseLock(
+    WDFINTERRUPT Interrupt
+    )
+{
+    pthread_mutex_unlock(&((PWDF_SHIM_INTERRUPT) Interrupt)->Lock);
+}
+
+BOOLEAN
+WdfInterruptQueueDpcForIsr(
+    WDFINTERRUPT Interrupt
+    )
+{
+    PWDF_SHIM_INTERRUPT interrupt = (PWDF_SHIM_INTERRUPT) Interrupt;
+    BOOLEAN             queued;
+
+    if (!interrupt->Config.EvtInterruptDpc) {
+        return FALSE;
+    }
+
+    pthread_mutex_lock(&interrupt->DpcLock);
+    queued = !interrupt->DpcQueued;
+    interrupt->DpcQueued = TRUE;
+    pthread_cond_signal(&interrupt->DpcCond);
+    pthread_mutex_unlock(&interrupt->DpcLock);
+
+    return queued;
+}
+
+//-----------------------------------------------------------------------------
+// Memory
+//-----------------------------------------------------------------------------
+
+static VOID
+WdfShimMemoryRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    free(((PWDF_SHIM_MEMORY) Object)->Buffer);
+}
+
+NTSTATUS
+WdfMemoryCreate(
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    POOL_TYPE PoolType,
+    ULONG PoolTag,
+    size_t BufferSize,
+    WDFMEMORY * Memory,
+    PVOID * Buffer
+    )
+{
+    PWDF_SHIM_MEMORY memory;
+
+    (void) PoolType;
+    (void) PoolTag;
+
+    if (BufferSize == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memory = (PWDF_SHIM_MEMORY) WdfShimObjectAllocate(sizeof(*memory), WdfShimObjectMemory,
+                                                       Attributes, NULL);
+    if (!memory) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memory->Buffer = calloc(1, BufferSize);
+    memory->Length = BufferSize;
+    memory->Object.Release = WdfShimMemoryRelease;
+
+    if (!memory->Buffer) {
+        WdfShimObjectDelete(&memory->Object);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *Memory = memory;
+    if (Buffer) {
+        *Buffer = memory->Buffer;
+    }
+    return STATUS_SUCCESS;
+}
+
+PVOID
+WdfMemoryGetBuffer(
+    WDFMEMORY Memory,
+    size_t * BufferSize
+    )
+{
+    PWDF_SHIM_MEMORY memory = (PWDF_SHIM_MEMORY) Memory;
+
+    if (BufferSize) {
+        *BufferSize = memory->Length;
+    }
+    return memory->Buffer;
+}
+
+//-----------------------------------------------------------------------------
+// Timers
+//-----------------------------------------------------------------------------
+
+static BOOLEAN
+WdfShimTimespecBefore(
+    const struct timespec * A,
+    const struct timespec * B
+    )
+{
+    return A->tv_sec < B->tv_sec ||
+           (A->tv_sec == B->tv_sec && A->tv_nsec < B->tv_nsec);
+}
+
+static PVOID
+WdfShimTimerThread(
+    PVOID Context
+    )
+{
+    PWDF_SHIM_TIMER timer = (PWDF_SHIM_TIMER) Context;
+
+    pthread_mutex_lock(&timer->Lock);
+
+    for (;;) {
+        pthread_mutex_t * lock = NULL;
+        struct timespec   now;
+
+        while (!timer->Stop && !timer->Armed) {
+            pthread_cond_wait(&timer->Cond, &timer->Lock);
+        }
+
+        if (timer->Stop) {
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (WdfShimTimespecBefore(&now, &timer->Due)) {
+            pthread_cond_timedwait(&timer->Cond, &timer->Lock, &timer->Due);
+            continue;
+        }
+
+        timer->Armed   = FALSE;
+        timer->Running = TRUE;
+        pthread_mutex_unlock(&timer->Lock);
+
+        if (timer->Config.AutomaticSerialization && timer->Device &&
+            WdfShimDeviceScope(timer->Device) != WdfSynchronizationScopeNone) {
+            lock = &timer->Device->SyncLock;
+        }
+
+        if (lock) {
+            pthread_mutex_lock(lock);
+        }
+
+        timer->Config.EvtTimerFunc(timer);
+
+        if (lock) {
+            pthread_mutex_unlock(lock);
+        }
+
+        pthread_mutex_lock(&timer->Lock);
+        timer->Running = FALSE;
+        pthread_cond_broadcast(&timer->Cond);
+    }
+
+    pthread_mutex_unlock(&timer->Lock);
+    return NULL;
+}
+
+static VOID
+WdfShimTimerDispose(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_TIMER timer = (PWDF_SHIM_TIMER) Object;
+
+    pthread_mutex_lock(&timer->Lock);
+    timer->Stop = TRUE;
+    pthread_cond_broadcast(&timer->Cond);
+    pthread_mutex_unlock(&timer->Lock);
+
+    pthread_join(timer->Thread, NULL);
+}
+
+static VOID
+WdfShimTimerRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_TIMER timer = (PWDF_SHIM_TIMER) Object;
+
+    pthread_cond_destroy(&timer->Cond);
+    pthread_mutex_destroy(&timer->Lock);
+}
+
+NTSTATUS
+WdfTimerCreate(
+    PWDF_TIMER_CONFIG Config,
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    WDFTIMER * Timer
+    )
+{
+    PWDF_SHIM_TIMER     timer;
+    PWDF_SHIM_OBJECT    parent;
+    pthread_condattr_t  condAttr;
+
+    if (!Config->EvtTimerFunc || Config->Period != 0 ||
+        !Attributes || !Attributes->ParentObject) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    timer = (PWDF_SHIM_TIMER) WdfShimObjectAllocate(sizeof(*timer), WdfShimObjectTimer,
+                                                     Attributes, NULL);
+    if (!timer) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    timer->Config = *Config;
+
+    for (parent = timer->Object.Parent; parent; parent = parent->Parent) {
+        if (parent->Type == WdfShimObjectDevice) {
+            timer->Device = (PWDF_SHIM_DEVICE) parent;
+            break;
+        }
+    }
+
+    pthread_mutex_init(&timer->Lock, NULL);
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer->Cond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+
+    if (pthread_create(&timer->Thread, NULL, WdfShimTimerThread, timer) != 0) {
+        pthread_cond_destroy(&timer->Cond);
+        pthread_mutex_destroy(&timer->Lock);
+        WdfShimObjectDelete(&timer->Object);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    timer->Object.Dispose = WdfShimTimerDispose;
+    timer->Object.Release = WdfShimTimerRelease;
+
+    *Timer = timer;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+WdfTimerStart(
+    WDFTIMER Timer,
+    LONGLONG DueTime
+    )
+/*++
+
+Routine Description:
+
+    Only relative due times (negative, 100ns units) are supported.
+    Returns TRUE if the timer was already armed; it is re-armed.
+
+--*/
+{
+    PWDF_SHIM_TIMER timer = (PWDF_SHIM_TIMER) Timer;
+    BOOLEAN         armed;
+    LONGLONG        ns = (DueTime < 0 ? -DueTime : 0) * 100;
+
+    pthread_mutex_lock(&timer->Lock);
+
+    armed = timer->Armed;
+
+    clock_gettime(CLOCK_MONOTONIC, &timer->Due);
+    timer->Due.tv_sec  += ns / 1000000000ll;
+    timer->Due.tv_nsec += ns % 1000000000ll;
+    if (timer->Due.tv_nsec >= 1000000000l) {
+        timer->Due.tv_sec++;
+        timer->Due.tv_nsec -= 1000000000l;
+    }
+
+    timer->Armed = TRUE;
+    pthread_cond_broadcast(&timer->Cond);
+    pthread_mutex_unlock(&timer->Lock);
+
+    return armed;
+}
+
+BOOLEAN
+WdfTimerStop(
+    WDFTIMER Timer,
+    BOOLEAN Wait
+    )
+{
+    PWDF_SHIM_TIMER timer = (PWDF_SHIM_TIMER) Timer;
+    BOOLEAN         armed;
+
+    pthread_mutex_lock(&timer->Lock);
+
+    armed = timer->Armed;
+    timer->Armed = FALSE;
+    pthread_cond_broadcast(&timer->Cond);
+
+    while (Wait && timer->Running && !pthread_equal(timer->Thread, pthread_self())) {
+        pthread_cond_wait(&timer->Cond, &timer->Lock);
+    }
+
+    pthread_mutex_unlock(&timer->Lock);
+
+    return armed;
+}
+
+WDFOBJECT
+WdfTimerGetParentObject(
+    WDFTIMER Timer
+    )
+{
+    return ((PWDF_SHIM_TIMER) Timer)->Object.Parent;
+}
+
+//-----------------------------------------------------------------------------
+// DPCs
+//-----------------------------------------------------------------------------
+
+static VOID
+WdfShimDpcSetProcessor(
+    PWDF_SHIM_DPC Dpc
+    )
+/*++
+
+Routine Description:
+
+    Move the DPC thread to the processor KeSetTargetProcessorDpc chose.
+
+--*/
+{
+    LONG        number = __atomic_load_n(&Dpc->Dpc.Number, __ATOMIC_RELAXED);
+    cpu_set_t   set;
+
+    if (number == Dpc->Processor || number < 0 || number >= CPU_SETSIZE) {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(number, &set);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        Dpc->Processor = number;
+    }
+}
+
+static PVOID
+WdfShimDpcObjectThread(
+    PVOID Context
+    )
+{
+    PWDF_SHIM_DPC dpc = (PWDF_SHIM_DPC) Context;
+
+    pthread_mutex_lock(&dpc->Lock);
+
+    for (;;) {
+        pthread_mutex_t * lock = NULL;
+
+        while (!dpc->Stop && !dpc->Queued) {
+            pthread_cond_wait(&dpc->Cond, &dpc->Lock);
+        }
+
+        if (dpc->Stop) {
+            break;
+        }
+
+        dpc->Queued  = FALSE;
+        dpc->Running = TRUE;
+        pthread_mutex_unlock(&dpc->Lock);
+
+        WdfShimDpcSetProcessor(dpc);
+
+        if (dpc->Config.AutomaticSerialization && dpc->Device &&
+            WdfShimDeviceScope(dpc->Device) != WdfSynchronizationScopeNone) {
+            lock = &dpc->Device->SyncLock;
+        }
+
+        if (lock) {
+            pthread_mutex_lock(lock);
+        }
+
+        dpc->Config.EvtDpcFunc(dpc);
+
+        if (lock) {
+            pthread_mutex_unlock(lock);
+        }
+
+        pthread_mutex_lock(&dpc->Lock);
+        dpc->Running = FALSE;
+        pthread_cond_broadcast(&dpc->Cond);
+    }
+
+    pthread_mutex_unlock(&dpc->Lock);
+    return NULL;
+}
+
+static VOID
+WdfShimDpcDispose(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_DPC dpc = (PWDF_SHIM_DPC) Object;
+
+    pthread_mutex_lock(&WdfShimDpcsLock);
+    RemoveEntryList(&dpc->Link);
+    pthread_mutex_unlock(&WdfShimDpcsLock);
+
+    pthread_mutex_lock(&dpc->Lock);
+    dpc->Stop = TRUE;
+    pthread_cond_broadcast(&dpc->Cond);
+    pthread_mutex_unlock(&dpc->Lock);
+
+    pthread_join(dpc->Thread, NULL);
+}
+
+static VOID
+WdfShimDpcRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_DPC dpc = (PWDF_SHIM_DPC) Object;
+
+    pthread_cond_destroy(&dpc->Cond);
+    pthread_mutex_destroy(&dpc->Lock);
+}
+
+NTSTATUS
+WdfDpcCreate(
+    PWDF_DPC_CONFIG Config,
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    WDFDPC * Dpc
+    )
+{
+    PWDF_SHIM_DPC       dpc;
+    PWDF_SHIM_OBJECT    parent;
+
+    if (!Config->EvtDpcFunc || !Attributes || !Attributes->ParentObject) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    dpc = (PWDF_SHIM_DPC) WdfShimObjectAllocate(sizeof(*dpc), WdfShimObjectDpc,
+                                                 Attributes, NULL);
+    if (!dpc) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    dpc->Config     = *Config;
+    dpc->Dpc.Number = -1;
+    dpc->Processor  = -1;
+
+    for (parent = dpc->Object.Parent; parent; parent = parent->Parent) {
+        if (parent->Type == WdfShimObjectDevice) {
+            dpc->Device = (PWDF_SHIM_DEVICE) parent;
+            break;
+        }
+    }
+
+    pthread_mutex_init(&dpc->Lock, NULL);
+    pthread_cond_init(&dpc->Cond, NULL);
+
+    if (pthread_create(&dpc->Thread, NULL, WdfShimDpcObjectThread, dpc) != 0) {
+        pthread_cond_destroy(&dpc->Cond);
+        pthread_mutex_destroy(&dpc->Lock);
+        WdfShimObjectDelete(&dpc->Object);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    dpc->Object.Dispose = WdfShimDpcDispose;
+    dpc->Object.Release = WdfShimDpcRelease;
+
+    pthread_mutex_lock(&WdfShimDpcsLock);
+    InsertTailList(&WdfShimDpcs, &dpc->Link);
+    pthread_mutex_unlock(&WdfShimDpcsLock);
+
+    *Dpc = dpc;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+WdfDpcEnqueue(
+    WDFDPC Dpc
+    )
+{
+    PWDF_SHIM_DPC   dpc = (PWDF_SHIM_DPC) Dpc;
+    BOOLEAN         queued;
+
+    pthread_mutex_lock(&dpc->Lock);
+    queued = !dpc->Queued;
+    dpc->Queued = TRUE;
+    pthread_cond_signal(&dpc->Cond);
+    pthread_mutex_unlock(&dpc->Lock);
+
+    return queued;
+}
+
+BOOLEAN
+WdfDpcCancel(
+    WDFDPC Dpc,
+    BOOLEAN Wait
+    )
+/*++
+
+Routine Description:
+
+    Dequeue the DPC; with Wait, also wait for a running callback to
+    return. Returns TRUE if the DPC was queued.
+
+--*/
+{
+    PWDF_SHIM_DPC   dpc = (PWDF_SHIM_DPC) Dpc;
+    BOOLEAN         queued;
+
+    pthread_mutex_lock(&dpc->Lock);
+
+    queued = dpc->Queued;
+    dpc->Queued = FALSE;
+
+    while (Wait && dpc->Running && !pthread_equal(dpc->Thread, pthread_self())) {
+        pthread_cond_wait(&dpc->Cond, &dpc->Lock);
+    }
+
+    pthread_mutex_unlock(&dpc->Lock);
+
+    return queued;
+}
+
+VOID
+KeFlushQueuedDpcs(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Wait until every DPC queued so far has run: until no DPC object is
+    queued or running.
+
+--*/
+{
+    PLIST_ENTRY     entry;
+    PWDF_SHIM_DPC   dpc;
+
+    pthread_mutex_lock(&WdfShimDpcsLock);
+
+    for (entry = WdfShimDpcs.Flink; entry != &WdfShimDpcs; entry = entry->Flink) {
+
+        dpc = CONTAINING_RECORD(entry, WDF_SHIM_DPC, Link);
+
+        pthread_mutex_lock(&dpc->Lock);
+        while ((dpc->Queued || dpc->Running) &&
+               !pthread_equal(dpc->Thread, pthread_self())) {
+            pthread_cond_wait(&dpc->Cond, &dpc->Lock);
+        }
+        pthread_mutex_unlock(&dpc->Lock);
+    }
+
+    pthread_mutex_unlock(&WdfShimDpcsLock);
+}
+
+WDFOBJECT
+WdfDpcGetParentObject(
+    WDFDPC Dpc
+    )
+{
+    return ((PWDF_SHIM_DPC) Dpc)->Object.Parent;
+}
+
+PKDPC
+WdfDpcWdmGetDpc(
+    WDFDPC Dpc
+    )
+{
+    return &((PWDF_SHIM_DPC) Dpc)->Dpc;
+}
+
+//-----------------------------------------------------------------------------
+// Work items
+//-----------------------------------------------------------------------------
+
+static PVOID
+WdfShimWorkItemThread(
+    PVOID Context
+    )
+{
+    PWDF_SHIM_WORKITEM workItem = (PWDF_SHIM_WORKITEM) Context;
+
+    pthread_mutex_lock(&workItem->Lock);
+
+    for (;;) {
+        pthread_mutex_t * lock = NULL;
+
+        while (!workItem->Stop && !workItem->Queued) {
+            pthread_cond_wait(&workItem->Cond, &workItem->Lock);
+        }
+
+        if (workItem->Stop) {
+            break;
+        }
+
+        workItem->Queued  = FALSE;
+        workItem->Running = TRUE;
+        pthread_mutex_unlock(&workItem->Lock);
+
+        if (workItem->Config.AutomaticSerialization && workItem->Device &&
+            WdfShimDeviceScope(workItem->Device) != WdfSynchronizationScopeNone) {
+            lock = &workItem->Device->SyncLock;
+        }
+
+        if (lock) {
+            pthread_mutex_lock(lock);
+        }
+
+        workItem->Config.EvtWorkItemFunc(workItem);
+
+        if (lock) {
+            pthread_mutex_unlock(lock);
+        }
+
+        pthread_mutex_lock(&workItem->Lock);
+        workItem->Running = FALSE;
+        pthread_cond_broadcast(&workItem->Cond);
+    }
+
+    pthread_mutex_unlock(&workItem->Lock);
+    return NULL;
+}
+
+static VOID
+WdfShimWorkItemDispose(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_WORKITEM workItem = (PWDF_SHIM_WORKITEM) Object;
+
+    pthread_mutex_lock(&workItem->Lock);
+    workItem->Stop = TRUE;
+    pthread_cond_broadcast(&workItem->Cond);
+    pthread_mutex_unlock(&workItem->Lock);
+
+    pthread_join(workItem->Thread, NULL);
+}
+
+static VOID
+WdfShimWorkItemRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_WORKITEM workItem = (PWDF_SHIM_WORKITEM) Object;
+
+    pthread_cond_destroy(&workItem->Cond);
+    pthread_mutex_destroy(&workItem->Lock);
+}
+
+NTSTATUS
+WdfWorkItemCreate(
+    PWDF_WORKITEM_CONFIG Config,
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    WDFWORKITEM * WorkItem
+    )
+{
+    PWDF_SHIM_WORKITEM  workItem;
+    PWDF_SHIM_OBJECT    parent;
+
+    if (!Config->EvtWorkItemFunc || !Attributes || !Attributes->ParentObject) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    workItem = (PWDF_SHIM_WORKITEM) WdfShimObjectAllocate(sizeof(*workItem),
+                                                           WdfShimObjectWorkItem,
+                                                           Attributes, NULL);
+    if (!workItem) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    workItem->Config = *Config;
+
+    for (parent = workItem->Object.Parent; parent; parent = parent->Parent) {
+        if (parent->Type == WdfShimObjectDevice) {
+            workItem->Device = (PWDF_SHIM_DEVICE) parent;
+            break;
+        }
+    }
+
+    pthread_mutex_init(&workItem->Lock, NULL);
+    pthread_cond_init(&workItem->Cond, NULL);
+
+    if (pthread_create(&workItem->Thread, NULL, WdfShimWorkItemThread, workItem) != 0) {
+        pthread_cond_destroy(&workItem->Cond);
+        pthread_mutex_destroy(&workItem->Lock);
+        WdfShimObjectDelete(&workItem->Object);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    workItem->Object.Dispose = WdfShimWorkItemDispose;
+    workItem->Object.Release = WdfShimWorkItemRelease;
+
+    *WorkItem = workItem;
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfWorkItemEnqueue(
+    WDFWORKITEM WorkItem
+    )
+{
+    PWDF_SHIM_WORKITEM workItem = (PWDF_SHIM_WORKITEM) WorkItem;
+
+    pthread_mutex_lock(&workItem->Lock);
+    workItem->Queued = TRUE;
+    pthread_cond_signal(&workItem->Cond);
+    pthread_mutex_unlock(&workItem->Lock);
+}
+
+VOID
+WdfWorkItemFlush(
+    WDFWORKITEM WorkItem
+    )
+/*++
+
+Routine Description:
+
+    Wait until the work item is neither queued nor running.
+
+--*/
+{
+    PWDF_SHIM_WORKITEM workItem = (PWDF_SHIM_WORKITEM) WorkItem;
+
+    pthread_mutex_lock(&workItem->Lock);
+
+    while ((workItem->Queued || workItem->Running) && !workItem->Stop &&
+           !pthread_equal(workItem->Thread, pthread_self())) {
+        pthread_cond_wait(&workItem->Cond, &workItem->Lock);
+    }
+
+    pthread_mutex_unlock(&workItem->Lock);
+}
+
+WDFOBJECT
+WdfWorkItemGetParentObject(
+    WDFWORKITEM WorkItem
+    )
+{
+    return ((PWDF_SHIM_WORKITEM) WorkItem)->Object.Parent;
+}
+
+//-----------------------------------------------------------------------------
+// Wait locks
+//-----------------------------------------------------------------------------
+
+static VOID
+WdfShimWaitLockRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    pthread_mutex_destroy(&((PWDF_SHIM_WAITLOCK) Object)->Lock);
+}
+
+NTSTATUS
+WdfWaitLockCreate(
+    PWDF_OBJECT_ATTRIBUTES LockAttributes,
+    WDFWAITLOCK * Lock
+    )
+{
+    PWDF_SHIM_WAITLOCK lock;
+
+    if (!LockAttributes || !LockAttributes->ParentObject) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    lock = (PWDF_SHIM_WAITLOCK) WdfShimObjectAllocate(sizeof(*lock), WdfShimObjectWaitLock,
+                                                       LockAttributes, NULL);
+    if (!lock) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pthread_mutex_init(&lock->Lock, NULL);
+    lock->Object.Release = WdfShimWaitLockRelease;
+
+    *Lock = lock;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfWaitLockAcquire(
+    WDFWAITLOCK Lock,
+    PLONGLONG Timeout
+    )
+/*++
+
+Routine Description:
+
+    Only an infinite wait (NULL) and a try (*Timeout == 0) are supported.
+
+--*/
+{
+    PWDF_SHIM_WAITLOCK lock = (PWDF_SHIM_WAITLOCK) Lock;
+
+    if (Timeout == NULL) {
+        pthread_mutex_lock(&lock->Lock);
+        return STATUS_SUCCESS;
+    }
+
+    return (pthread_mutex_trylock(&lock->Lock) == 0) ? STATUS_SUCCESS : STATUS_TIMEOUT;
+}
+
+VOID
+WdfWaitLockRelease(
+    WDFWAITLOCK Lock
+    )
+{
+    pthread_mutex_unlock(&((PWDF_SHIM_WAITLOCK) Lock)->Lock);
+}
+
+//-----------------------------------------------------------------------------
+// DMA
+//-----------------------------------------------------------------------------
+
+NTSTATUS
+WdfDmaEnablerCreate(
+    WDFDEVICE Device,
+    PWDF_DMA_ENABLER_CONFIG Config,
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    WDFDMAENABLER * DmaEnablerHandle
+    )
+{
+    PWDF_SHIM_DEVICE        device = (PWDF_SHIM_DEVICE) Device;
+    PWDF_SHIM_DMA_ENABLER   enabler;
+
+    if (Config->MaximumLength == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    enabler = (PWDF_SHIM_DMA_ENABLER) WdfShimObjectAllocate(sizeof(*enabler),
+                                                             WdfShimObjectDmaEnabler,
+                                                             Attributes,
+                                                             &device->Object);
+    if (!enabler) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    enabler->Device = device;
+    enabler->Config = *Config;
+
+    *DmaEnablerHandle = enabler;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+WdfShimCommonBufferRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    free(((PWDF_SHIM_COMMON_BUFFER) Object)->Memory);
+}
+
+static PVOID
+WdfShimAllocateDmaMemory(
+    size_t Length
+    )
+/*++
+
+Routine Description:
+
+    Page-aligned memory whose logical (= virtual) range does not cross a
+    4GB boundary, which the card cannot do within one packet or page.
+
+--*/
+{
+    PVOID       rejected[16];
+    PVOID       memory = NULL;
+    ULONG       count = 0;
+    ULONG       i;
+
+    while (count < sizeof(rejected) / sizeof(rejected[0])) {
+
+        ULONG_PTR start;
+
+        memory = aligned_alloc(PAGE_SIZE, Length);
+        if (!memory) {
+            break;
+        }
+
+        start = (ULONG_PTR) memory;
+        if (((ULONGLONG) start >> 32) == (((ULONGLONG) start + Length - 1) >> 32)) {
+            break;
+        }
+
+        rejected[count++] = memory;
+        memory = NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        free(rejected[i]);
+    }
+
+    return memory;
+}
+
+NTSTATUS
+WdfCommonBufferCreate(
+    WDFDMAENABLER DmaEnabler,
+    size_t Length,
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    WDFCOMMONBUFFER * CommonBuffer
+    )
+{
+    PWDF_SHIM_COMMON_BUFFER buffer;
+    size_t                  length;
+
+    if (Length == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    length = ROUND_TO_PAGES(Length);
+
+    buffer = (PWDF_SHIM_COMMON_BUFFER) WdfShimObjectAllocate(sizeof(*buffer),
+                                                              WdfShimObjectCommonBuffer,
+                                                              Attributes,
+                                                              (PWDF_SHIM_OBJECT) DmaEnabler);
+    if (!buffer) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    buffer->Memory = WdfShimAllocateDmaMemory(length);
+    buffer->Length = Length;
+    buffer->Object.Release = WdfShimCommonBufferRelease;
+
+    if (!buffer->Memory) {
+        WdfShimObjectDelete(&buffer->Object);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *CommonBuffer = buffer;
+    return STATUS_SUCCESS;
+}
+
+PVOID
+WdfCommonBufferGetAlignedVirtualAddress(
+    WDFCOMMONBUFFER CommonBuffer
+    )
+{
+    return ((PWDF_SHIM_COMMON_BUFFER) CommonBuffer)->Memory;
+}
+
+PHYSICAL_ADDRESS
+WdfCommonBufferGetAlignedLogicalAddress(
+    WDFCOMMONBUFFER CommonBuffer
+    )
+{
+    PHYSICAL_ADDRESS address;
+
+    address.QuadPart = (LONGLONG) (ULONG_PTR) ((PWDF_SHIM_COMMON_BUFFER) CommonBuffer)->Memory;
+    return address;
+}
+
+size_t
+WdfCommonBufferGetLength(
+    WDFCOMMONBUFFER CommonBuffer
+    )
+{
+    return ((PWDF_SHIM_COMMON_BUFFER) CommonBuffer)->Length;
+}
+
+static VOID
+WdfShimDmaTransactionRelease(
+    PWDF_SHIM_OBJECT Object
+    )
+{
+    PWDF_SHIM_DMA_TRANSACTION transaction = (PWDF_SHIM_DMA_TRANSACTION) Object;
+
+    if (transaction->Request) {
+        WdfObjectDereference(transaction->Request);
+    }
+
+    free(transaction->SgList);
+}
+
+NTSTATUS
+WdfDmaTransactionCreate(
+    WDFDMAENABLER DmaEnabler,
+    PWDF_OBJECT_ATTRIBUTES Attributes,
+    WDFDMATRANSACTION * DmaTransaction
+    )
+{
+    PWDF_SHIM_DMA_ENABLER       enabler = (PWDF_SHIM_DMA_ENABLER) DmaEnabler;
+    PWDF_SHIM_DMA_TRANSACTION   transaction;
+
+    transaction = (PWDF_SHIM_DMA_TRANSACTION) WdfShimObjectAllocate(sizeof(*transaction),
+                                                                     WdfShimObjectDmaTransaction,
+                                                                     Attributes,
+                                                                     &enabler->Object);
+    if (!transaction) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    transaction->Enabler = enabler;
+    transaction->Object.Release = WdfShimDmaTransactionRelease;
+
+    //
+    // One element per page of the largest piece, plus one for a buffer
+    // that does not start on a page boundary.
+    //
+    transaction->SgCapacity = (ULONG) BYTES_TO_PAGES(enabler->Config.MaximumLength) + 1;
+    transaction->SgList = (PSCATTER_GATHER_LIST)
+        calloc(1, sizeof(SCATTER_GATHER_LIST) +
+                  transaction->SgCapacity * sizeof(SCATTER_GATHER_ELEMENT));
+
+    if (!transaction->SgList) {
+        WdfShimObjectDelete(&transaction->Object);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *DmaTransaction = transaction;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+WdfShimDmaTransactionSetup(
+    PWDF_SHIM_DMA_TRANSACTION Transaction,
+    PFN_WDF_PROGRAM_DMA EvtProgramDmaFunction,
+    WDF_DMA_DIRECTION DmaDirection,
+    PVOID VirtualAddress,
+    size_t Length
+    )
+{
+    if (Transaction->Initialized) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (!EvtProgramDmaFunction || !VirtualAddress || Length == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Transaction->EvtProgramDma  = EvtProgramDmaFunction;
+    Transaction->Direction      = DmaDirection;
+    Transaction->VirtualAddress = (PUCHAR) VirtualAddress;
+    Transaction->Length         = Length;
+    Transaction->Transferred    = 0;
+    Transaction->CurrentLength  = 0;
+    Transaction->MaximumLength  = Transaction->Enabler->Config.MaximumLength;
+    Transaction->Initialized    = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfDmaTransactionInitializeUsingRequest(
+    WDFDMATRANSACTION DmaTransaction,
+    WDFREQUEST Request,
+    PFN_WDF_PROGRAM_DMA EvtProgramDmaFunction,
+    WDF_DMA_DIRECTION DmaDirection
+    )
+{
+    PWDF_SHIM_DMA_TRANSACTION   transaction = (PWDF_SHIM_DMA_TRANSACTION) DmaTransaction;
+    PWDF_SHIM_REQUEST           request = (PWDF_SHIM_REQUEST) Request;
+    PMDL                        mdl;
+    NTSTATUS                    status;
+
+    if (request->Type == WdfRequestTypeRead) {
+        mdl = request->HasOutputMdl ? &request->OutputMdl : NULL;
+    } else if (request->Type == WdfRequestTypeWrite) {
+        mdl = request->HasInputMdl ? &request->InputMdl : NULL;
+    } else {
+        mdl = request->HasOutputMdl ? &request->OutputMdl : NULL;
+    }
+
+    if (!mdl) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    status = WdfShimDmaTransactionSetup(transaction, EvtProgramDmaFunction, DmaDirection,
+                                        MmGetMdlVirtualAddress(mdl),
+                                        MmGetMdlByteCount(mdl));
+    if (NT_SUCCESS(status)) {
+        WdfObjectReference(Request);
+        transaction->Request = request;
+    }
+
+    return status;
+}
+
+NTSTATUS
+WdfDmaTransactionInitialize(
+    WDFDMATRANSACTION DmaTransaction,
+    PFN_WDF_PROGRAM_DMA EvtProgramDmaFunction,
+    WDF_DMA_DIRECTION DmaDirection,
+    PMDL Mdl,
+    PVOID VirtualAddress,
+    size_t Length
+    )
+{
+    UNREFERENCED_PARAMETER(Mdl);
+
+    return WdfShimDmaTransactionSetup((PWDF_SHIM_DMA_TRANSACTION) DmaTransaction,
+                                      EvtProgramDmaFunction, DmaDirection,
+                                      VirtualAddress, Length);
+}
+
+static BOOLEAN
+WdfShimDmaProgramNext(
+    PWDF_SHIM_DMA_TRANSACTION Transaction
+    )
+/*++
+
+Routine Description:
+
+    Describe the next MaximumLength piece of the buffer one page per
+    element and hand it to EvtProgramDma.
+
+--*/
+{
+    PSCATTER_GATHER_LIST    sgList = Transaction->SgList;
+    PUCHAR                  va;
+    size_t                  remaining;
+    size_t                  chunk;
+    ULONG                   n = 0;
+
+    remaining = Transaction->Length - Transaction->Transferred;
+    chunk     = remaining < Transaction->MaximumLength ? remaining : Transaction->MaximumLength;
+    va        = Transaction->VirtualAddress + Transaction->Transferred;
+
+    Transaction->CurrentLength = chunk;
+
+    while (chunk) {
+
+        size_t length = PAGE_SIZE - BYTE_OFFSET(va);
+
+        if (length > chunk) {
+            length = chunk;
+        }
+
+        ASSERT(n < Transaction->SgCapacity);
+        sgList->Elements[n].Address.QuadPart = (LONGLONG) (ULONG_PTR) va;
+        sgList->Elements[n].Length = (ULONG) length;
+        sgList->Elements[n].Reserved = 0;
+        n++;
+
+        va    += length;
+        chunk -= length;
+    }
+
+    sgList->NumberOfElements = n;
+
+    return Transaction->EvtProgramDma(Transaction,
+                                      Transaction->Enabler->Device,
+                                      Transaction->Context,
+                                      Transaction->Direction,
+                                      sgList);
+}
+
+NTSTATUS
+WdfDmaTransactionExecute(
+    WDFDMATRANSACTION DmaTransaction,
+    WDFCONTEXT Context
+    )
+{
+    PWDF_SHIM_DMA_TRANSACTION transaction = (PWDF_SHIM_DMA_TRANSACTION) DmaTransaction;
+
+    if (!transaction->Initialized) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    transaction->Context = Context;
+    (VOID) WdfShimDmaProgramNext(transaction);
+
+    return STATUS_SUCCESS;
+}
+
+static BOOLEAN
+WdfShimDmaCompleted(
+    PWDF_SHIM_DMA_TRANSACTION Transaction,
+    size_t TransferredLength,
+    BOOLEAN Final,
+    NTSTATUS * Status
+    )
+{
+    if (!Transaction->Initialized) {
+        //
+        // A late completion for a transaction the driver has already
+        // released (e.g. from its cancel routine). Report "not done" so the
+        // caller does not complete anything a second time.
+        //
+        *Status = STATUS_INVALID_DEVICE_STATE;
+        return FALSE;
+    }
+
+    Transaction->Transferred += TransferredLength;
+    if (Transaction->Transferred > Transaction->Length) {
+        Transaction->Transferred = Transaction->Length;
+    }
+
+    if (Final || Transaction->Transferred == Transaction->Length) {
+        *Status = STATUS_SUCCESS;
+        return TRUE;
+    }
+
+    *Status = STATUS_MORE_PROCESSING_REQUIRED;
+    (VOID) WdfShimDmaProgramNext(Transaction);
+
+    return FALSE;
+}
+
+BOOLEAN
+WdfDmaTransactionDmaCompleted(
+    WDFDMATRANSACTION DmaTransaction,
+    NTSTATUS * Status
+    )
+{
+    PWDF_SHIM_DMA_TRANSACTION transaction = (PWDF_SHIM_DMA_TRANSACTION) DmaTransaction;
+
+    return WdfShimDmaCompleted(transaction, transaction->CurrentLength, FALSE, Status);
+}
+
+BOOLEAN
+WdfDmaTransactionDmaCompletedWithLength(
+    WDFDMATRANSACTION DmaTransaction,
+    size_t TransferredLength,
+    NTSTATUS * Status
+    )
+{
+    return WdfShimDmaCompleted((PWDF_SHIM_DMA_TRANSACTION) DmaTransaction,
+                               TransferredLength, FALSE, Status);
+}
+
+BOOLEAN
+WdfDmaTransactionDmaCompletedFinal(
+    WDFDMATRANSACTION DmaTransaction,
+    size_t FinalTransferredLength,
+    NTSTATUS * Status
+    )
+{
+    return WdfShimDmaCompleted((PWDF_SHIM_DMA_TRANSACTION) DmaTransaction,
+                               FinalTransferredLength, TRUE, Status);
+}
+
+NTSTATUS
+WdfDmaTransactionRelease(
+    WDFDMATRANSACTION DmaTransaction
+    )
+{
+    PWDF_SHIM_DMA_TRANSACTION transaction = (PWDF_SHIM_DMA_TRANSACTION) DmaTransaction;
+    PWDF_SHIM_REQUEST         request = transaction->Request;
+
+    transaction->Initialized    = FALSE;
+    transaction->Request        = NULL;
+    transaction->VirtualAddress = NULL;
+    transaction->Length         = 0;
+    transaction->Transferred    = 0;
+    transaction->CurrentLength  = 0;
+
+    if (request) {
+        WdfObjectDereference(request);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+WDFREQUEST
+WdfDmaTransactionGetRequest(
+    WDFDMATRANSACTION DmaTransaction
+    )
+{
+    return ((PWDF_SHIM_DMA_TRANSACTION) DmaTransaction)->Request;
+}
+
+size_t
+WdfDmaTransactionGetBytesTransferred(
+    WDFDMATRANSACTION DmaTransaction
+    )
+{
+    return ((PWDF_SHIM_DMA_TRANSACTION) DmaTransaction)->Transferred;
+}
+
+size_t
+WdfDmaTransactionGetCurrentDmaTransferLength(
+    WDFDMATRANSACTION DmaTransaction
+    )
+{
+    return ((PWDF_SHIM_DMA_TRANSACTION) DmaTransaction)->CurrentLength;
+}
+
+WDFDEVICE
+WdfDmaTransactionGetDevice(
+    WDFDMATRANSACTION DmaTransaction
+    )
+{
+    return ((PWDF_SHIM_DMA_TRANSACTION) DmaTransaction)->Enabler->Device;
+}
+
+VOID
+WdfDmaTransactionSetMaximumLength(
+    WDFDMATRANSACTION DmaTransaction,
+    size_t MaximumLength
+    )
+{
+    PWDF_SHIM_DMA_TRANSACTION transaction = (PWDF_SHIM_DMA_TRANSACTION) DmaTransaction;
+
+    if (MaximumLength && MaximumLength <= transaction->Enabler->Config.MaximumLength) {
+        transaction->MaximumLength = MaximumLength;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Harness entry points
+//-----------------------------------------------------------------------------
+
+VOID
+WdfShimBindSimulator(
+    struct _HSAC_SIM * Sim,
+    ULONG SramSize
+    )
+{
+    WdfShimSim      = Sim;
+    WdfShimSramSize = SramSize;
+}
+
+VOID
+WdfShimSetInterruptMessages(
+    ULONG Messages
+    )
+{
+    WdfShimMessages = (Messages > 1) ? min(Messages, WDF_SHIM_MAX_MESSAGES) : 0;
+}
+
+NTSTATUS
+WdfShimSetRegistryValue(
+    const char * Name,
+    ULONG Value
+    )
+{
+    ULONG i;
+
+    if (strlen(Name) >= sizeof(WdfShimRegistry[0].Name)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    for (i = 0; i < WdfShimRegistryValues; i++) {
+        if (strcasecmp(WdfShimRegistry[i].Name, Name) == 0) {
+            break;
+        }
+    }
+
+    if (i == WDF_SHIM_MAX_REGISTRY_VALUES) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    strcpy(WdfShimRegistry[i].Name, Name);
+    WdfShimRegistry[i].Value = Value;
+    if (i == WdfShimRegistryValues) {
+        WdfShimRegistryValues++;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+WdfShimDriverLoad(
+    DRIVER_INITIALIZE * DriverEntry
+    )
+{
+    UNICODE_STRING registryPath;
+
+    registryPath.Buffer        = WdfShimRegistryPathBuffer;
+    registryPath.Length        = (USHORT) (sizeof(WdfShimRegistryPathBuffer) - sizeof(WCHAR));
+    registryPath.MaximumLength = (USHORT) sizeof(WdfShimRegistryPathBuffer);
+
+    return DriverEntry((PDRIVER_OBJECT) WdfShimWdmDriverObject, &registryPath);
+}
+
+VOID
+WdfShimDriverUnload(
+    VOID
+    )
+{
+    PWDF_SHIM_DRIVER driver = WdfShimDriver;
+
+    if (driver) {
+        WdfShimObjectDelete(&driver->Object);
+        WdfShimDriver = NULL;
+    }
+}
+
+NTSTATUS
+WdfShimDeviceAdd(
+    WDFDEVICE * Device
+    )
+{
+    PWDFDEVICE_INIT deviceInit;
+    NTSTATUS        status;
+
+    if (!WdfShimDriver || !WdfShimDriver->Config.EvtDriverDeviceAdd) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    deviceInit = (PWDFDEVICE_INIT) calloc(1, sizeof(*deviceInit));
+    if (!deviceInit) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    WdfShimDriver->LastDevice = NULL;
+
+    status = WdfShimDriver->Config.EvtDriverDeviceAdd(WdfShimDriver, deviceInit);
+
+    if (!WdfShimDriver->LastDevice) {
+        //
+        // WdfDeviceCreate was never reached; the init structure is ours.
+        //
+        free(deviceInit);
+        return NT_SUCCESS(status) ? STATUS_INVALID_DEVICE_STATE : status;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        WdfShimObjectDelete(&WdfShimDriver->LastDevice->Object);
+        return status;
+    }
+
+    *Device = WdfShimDriver->LastDevice;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+WdfShimDeviceSetStarted(
+    PWDF_SHIM_DEVICE Device,
+    LONG Started
+    )
+{
+    ULONG i;
+
+    InterlockedExchange(&Device->Started, Started);
+
+    for (i = 0; i < WDF_SHIM_MAX_QUEUES; i++) {
+
+        PWDF_SHIM_QUEUE queue = Device->Queues[i];
+
+        if (queue) {
+            pthread_mutex_lock(&queue->Lock);
+            pthread_cond_broadcast(&queue->Cond);
+            pthread_mutex_unlock(&queue->Lock);
+        }
+    }
+}
+
+static VOID
+WdfShimDeviceReleaseInterrupts(
+    PWDF_SHIM_DEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Delete the interrupts created in EvtDevicePrepareHardware, as the
+    framework does once the hardware is released.
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < WDF_SHIM_MAX_INTERRUPTS; i++) {
+
+        PWDF_SHIM_INTERRUPT interrupt = Device->Interrupts[i];
+
+        if (interrupt && interrupt->Config.InterruptTranslated) {
+            WdfShimObjectDelete(&interrupt->Object);
+        }
+    }
+}
+
+NTSTATUS
+WdfShimDeviceStart(
+    WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Start the device the way the PnP manager and framework do:
+    EvtDevicePrepareHardware, EvtDeviceD0Entry, connect the interrupt,
+    EvtInterruptEnable, then let the power-managed queues dispatch.
+
+--*/
+{
+    PWDF_SHIM_DEVICE                device = (PWDF_SHIM_DEVICE) Device;
+    PWDF_SHIM_RESOURCE_LIST         resources = &device->Resources;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR desc;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR interrupts;
+    NTSTATUS                        status = STATUS_SUCCESS;
+    ULONG                           message;
+    ULONG                           i;
+
+    if (!WdfShimSim) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (device->Started) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    //
+    // BAR0: register block. BAR2: SRAM window.
+    //
+    memset(resources, 0, sizeof(*resources));
+
+    desc = &resources->Descriptors[resources->Count++];
+    desc->Type = CmResourceTypeMemory;
+    desc->u.Memory.Start.QuadPart = (LONGLONG) WDF_SHIM_BAR0_PA;
+    desc->u.Memory.Length = sizeof(HSAC_REGS);
+
+    if (WdfShimSramSize) {
+
+        if (!device->Sram) {
+            device->Sram = calloc(1, WdfShimSramSize);
+            if (!device->Sram) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+        }
+
+        desc = &resources->Descriptors[resources->Count++];
+        desc->Type = CmResourceTypeMemory;
+        desc->u.Memory.Start.QuadPart = (LONGLONG) WDF_SHIM_BAR2_PA;
+        desc->u.Memory.Length = WdfShimSramSize;
+    }
+
+    //
+    // One line-based interrupt, or one resource per MSI message granted.
+    //
+    device->Messages = WdfShimMessages;
+    interrupts = &resources->Descriptors[resources->Count];
+
+    for (message = 0; message < max(device->Messages, 1); message++) {
+
+        desc = &resources->Descriptors[resources->Count++];
+        desc->Type = CmResourceTypeInterrupt;
+
+        if (device->Messages) {
+            desc->Flags = CM_RESOURCE_INTERRUPT_MESSAGE | CM_RESOURCE_INTERRUPT_LATCHED;
+            desc->u.MessageInterrupt.Translated.Vector = message;
+        }
+    }
+
+    if (device->PnpPower.EvtDevicePrepareHardware) {
+        status = device->PnpPower.EvtDevicePrepareHardware(device, resources, resources);
+        if (!NT_SUCCESS(status)) {
+            WdfShimDeviceReleaseInterrupts(device);
+            return status;
+        }
+    }
+
+    //
+    // Interrupts created in EvtDriverDeviceAdd take the interrupt resources
+    // in order; one created in EvtDevicePrepareHardware takes the one it
+    // names.
+    //
+    message = 0;
+    for (i = 0; i < WDF_SHIM_MAX_INTERRUPTS; i++) {
+
+        PWDF_SHIM_INTERRUPT interrupt = device->Interrupts[i];
+
+        if (!interrupt) {
+            continue;
+        }
+
+        if (interrupt->Config.InterruptTranslated) {
+            interrupt->MessageId = (ULONG) (interrupt->Config.InterruptTranslated - interrupts);
+        } else {
+            interrupt->MessageId = message++;
+        }
+    }
+
+    if (device->PnpPower.EvtDeviceD0Entry) {
+        status = device->PnpPower.EvtDeviceD0Entry(device, WdfPowerDeviceD3Final);
+        if (!NT_SUCCESS(status)) {
+            if (device->PnpPower.EvtDeviceReleaseHardware) {
+                device->PnpPower.EvtDeviceReleaseHardware(device, resources);
+            }
+            WdfShimDeviceReleaseInterrupts(device);
+            return status;
+        }
+    }
+
+    HsacSimSetMessages(WdfShimSim, max(device->Messages, 1));
+    HsacSimConnectInterrupt(WdfShimSim, WdfShimDeviceInterrupt, device);
+
+    for (i = 0; i < WDF_SHIM_MAX_INTERRUPTS; i++) {
+
+        PWDF_SHIM_INTERRUPT interrupt = device->Interrupts[i];
+
+        if (!interrupt) {
+            continue;
+        }
+
+        pthread_mutex_lock(&interrupt->Lock);
+        interrupt->Connected = TRUE;
+        if (interrupt->Config.EvtInterruptEnable) {
+            status = interrupt->Config.EvtInterruptEnable(interrupt, device);
+        }
+        pthread_mutex_unlock(&interrupt->Lock);
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    WdfShimDeviceSetStarted(device, TRUE);
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfShimDeviceStop(
+    WDFDEVICE Device
+    )
+/*++
+
+Routine Description:
+
+    Reverse of WdfShimDeviceStart. Power-managed queues stop presenting
+    and the requests already presented get a few seconds to complete
+    before interrupts are disabled.
+
+--*/
+{
+    PWDF_SHIM_DEVICE    device = (PWDF_SHIM_DEVICE) Device;
+    struct timespec     deadline;
+    ULONG               i;
+
+    if (!device->Started) {
+        return;
+    }
+
+    WdfShimDeviceSetStarted(device, FALSE);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += WDF_SHIM_STOP_TIMEOUT_MS / 1000;
+
+    for (i = 0; i < WDF_SHIM_MAX_QUEUES; i++) {
+
+        PWDF_SHIM_QUEUE queue = device->Queues[i];
+
+        if (!queue || !queue->Config.PowerManaged) {
+            continue;
+        }
+
+        pthread_mutex_lock(&queue->Lock);
+        while (queue->InFlight) {
+            if (pthread_cond_timedwait(&queue->Cond, &queue->Lock, &deadline) == ETIMEDOUT) {
+                fprintf(stderr, "WdfShim: %u request(s) still presented at stop\n",
+                        queue->InFlight);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&queue->Lock);
+    }
+
+    for (i = 0; i < WDF_SHIM_MAX_INTERRUPTS; i++) {
+
+        PWDF_SHIM_INTERRUPT interrupt = device->Interrupts[i];
+
+        if (!interrupt) {
+            continue;
+        }
+
+        pthread_mutex_lock(&interrupt->Lock);
+        if (interrupt->Config.EvtInterruptDisable) {
+            interrupt->Config.EvtInterruptDisable(interrupt, device);
+        }
+        interrupt->Connected = FALSE;
+        pthread_mutex_unlock(&interrupt->Lock);
+
+        //
+        // Flush the DpcForIsr.
+        //
+        pthread_mutex_lock(&interrupt->DpcLock);
+        while (interrupt->DpcQueued || interrupt->DpcRunning) {
+            pthread_cond_wait(&interrupt->DpcCond, &interrupt->DpcLock);
+        }
+        pthread_mutex_unlock(&interrupt->DpcLock);
+    }
+
+    HsacSimDisconnectInterrupt(WdfShimSim);
+
+    if (device->PnpPower.EvtDeviceD0Exit) {
+        device->PnpPower.EvtDeviceD0Exit(device, WdfPowerDeviceD3Final);
+    }
+
+    if (device->PnpPower.EvtDeviceReleaseHardware) {
+        device->PnpPower.EvtDeviceReleaseHardware(device, &device->Resources);
+    }
+
+    WdfShimDeviceReleaseInterrupts(device);
+}
+
+VOID
+WdfShimDeviceRemove(
+    WDFDEVICE Device
+    )
+{
+    WdfShimDeviceStop(Device);
+
+    if (WdfShimDeviceIdleReferences(Device) != 0) {
+        fprintf(stderr, "WdfShim: %d idle reference(s) still held at remove\n",
+                WdfShimDeviceIdleReferences(Device));
+    }
+
+    WdfShimObjectDelete((PWDF_SHIM_OBJECT) Device);
+}
+
+static NTSTATUS
+WdfShimSubmit(
+    PWDF_SHIM_DEVICE Device,
+    PWDF_SHIM_FILE File,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    PFN_WDF_SHIM_REQUEST_COMPLETION Completion,
+    PVOID CompletionContext,
+    WDFREQUEST * Request
+    )
+{
+    PWDF_SHIM_DEVICE    device = Device;
+    PWDF_SHIM_REQUEST   request;
+    PWDF_SHIM_QUEUE     queue;
+
+    if ((ULONG) RequestType >= WdfRequestTypeMax) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    request = (PWDF_SHIM_REQUEST) WdfShimObjectAllocate(sizeof(*request),
+                                                         WdfShimObjectRequest,
+                                                         NULL, NULL);
+    if (!request) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    request->Object.Release     = WdfShimRequestRelease;
+    request->File               = File;
+    request->Type               = RequestType;
+    request->IoControlCode      = IoControlCode;
+    request->Completion         = Completion;
+    request->CompletionContext  = CompletionContext;
+    InitializeListHead(&request->QueueLink);
+
+    switch (RequestType) {
+
+    case WdfRequestTypeRead:
+        request->OutputBuffer = OutputBuffer;
+        request->OutputLength = OutputLength;
+        request->OutputMdl.VirtualAddress = OutputBuffer;
+        request->OutputMdl.ByteCount = (ULONG) OutputLength;
+        request->HasOutputMdl = OutputBuffer != NULL;
+        break;
+
+    case WdfRequestTypeWrite:
+        request->InputBuffer = InputBuffer;
+        request->InputLength = InputLength;
+        request->InputMdl.VirtualAddress = InputBuffer;
+        request->InputMdl.ByteCount = (ULONG) InputLength;
+        request->HasInputMdl = InputBuffer != NULL;
+        break;
+
+    case WdfRequestTypeDeviceControl:
+
+        switch (METHOD_FROM_CTL_CODE(IoControlCode)) {
+
+        case METHOD_BUFFERED:
+            {
+                size_t length = InputLength > OutputLength ? InputLength : OutputLength;
+
+                if (length) {
+                    request->SystemBuffer = calloc(1, length);
+                    if (!request->SystemBuffer) {
+                        WdfObjectDereference(request);
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                    }
+                    if (InputLength) {
+                        memcpy(request->SystemBuffer, InputBuffer, InputLength);
+                    }
+                }
+
+                request->InputBuffer      = InputLength ? request->SystemBuffer : NULL;
+                request->InputLength      = InputLength;
+                request->OutputBuffer     = OutputLength ? request->SystemBuffer : NULL;
+                request->OutputLength     = OutputLength;
+                request->UserOutputBuffer = OutputBuffer;
+                request->UserOutputLength = OutputLength;
+            }
+            break;
+
+        case METHOD_IN_DIRECT:
+        case METHOD_OUT_DIRECT:
+            if (InputLength) {
+                request->SystemBuffer = malloc(InputLength);
+                if (!request->SystemBuffer) {
+                    WdfObjectDereference(request);
+                    return STATUS_INSUFFICIENT_RESOURCES;
+                }
+                memcpy(request->SystemBuffer, InputBuffer, InputLength);
+            }
+
+            request->InputBuffer  = request->SystemBuffer;
+            request->InputLength  = InputLength;
+            request->OutputBuffer = OutputBuffer;
+            request->OutputLength = OutputLength;
+            request->OutputMdl.VirtualAddress = OutputBuffer;
+            request->OutputMdl.ByteCount = (ULONG) OutputLength;
+            request->HasOutputMdl = OutputBuffer != NULL;
+            break;
+
+        default:
+            request->InputBuffer  = InputBuffer;
+            request->InputLength  = InputLength;
+            request->OutputBuffer = OutputBuffer;
+            request->OutputLength = OutputLength;
+            break;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (Request) {
+        WdfObjectReference(request);
+        *Request = request;
+    }
+
+    if (RequestType == WdfRequestTypeCreate && device->FileConfig.EvtDeviceFileCreate) {
+        device->FileConfig.EvtDeviceFileCreate(device, request, File);
+        return STATUS_PENDING;
+    }
+
+    queue = device->Dispatch[RequestType];
+
+    if (!queue) {
+        NTSTATUS status = (RequestType == WdfRequestTypeCreate ||
+                           RequestType == WdfRequestTypeClose) ?
+                          STATUS_SUCCESS : STATUS_INVALID_DEVICE_REQUEST;
+
+        WdfRequestCompleteWithInformation(request, status, 0);
+        return status;
+    }
+
+    request->Queue = queue;
+
+    if (!queue->Config.AllowZeroLengthRequests &&
+        ((RequestType == WdfRequestTypeRead && OutputLength == 0) ||
+         (RequestType == WdfRequestTypeWrite && InputLength == 0))) {
+
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, 0);
+        return STATUS_SUCCESS;
+    }
+
+    pthread_mutex_lock(&queue->Lock);
+    request->State = WdfShimRequestQueued;
+    InsertTailList(&queue->PendingList, &request->QueueLink);
+    pthread_cond_broadcast(&queue->Cond);
+    pthread_mutex_unlock(&queue->Lock);
+
+    return STATUS_PENDING;
+}
+
+typedef struct _WDF_SHIM_SYNC_COMPLETION {
+
+    pthread_mutex_t Lock;
+    pthread_cond_t  Cond;
+    BOOLEAN         Done;
+    NTSTATUS        Status;
+    ULONG_PTR       Information;
+
+} WDF_SHIM_SYNC_COMPLETION, * PWDF_SHIM_SYNC_COMPLETION;
+
+static VOID
+WdfShimSyncCompletion(
+    PVOID Context,
+    WDFREQUEST Request,
+    NTSTATUS Status,
+    ULONG_PTR Information
+    )
+{
+    PWDF_SHIM_SYNC_COMPLETION sync = (PWDF_SHIM_SYNC_COMPLETION) Context;
+
+    UNREFERENCED_PARAMETER(Request);
+
+    pthread_mutex_lock(&sync->Lock);
+    sync->Status      = Status;
+    sync->Information = Information;
+    sync->Done        = TRUE;
+    pthread_cond_signal(&sync->Cond);
+    pthread_mutex_unlock(&sync->Lock);
+}
+
+static NTSTATUS
+WdfShimSubmitSynchronously(
+    PWDF_SHIM_DEVICE Device,
+    PWDF_SHIM_FILE File,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    ULONG_PTR * Information
+    )
+{
+    WDF_SHIM_SYNC_COMPLETION    sync;
+    NTSTATUS                    status;
+
+    memset(&sync, 0, sizeof(sync));
+    pthread_mutex_init(&sync.Lock, NULL);
+    pthread_cond_init(&sync.Cond, NULL);
+
+    status = WdfShimSubmit(Device, File, RequestType, IoControlCode,
+                           InputBuffer, InputLength,
+                           OutputBuffer, OutputLength,
+                           WdfShimSyncCompletion, &sync, NULL);
+
+    pthread_mutex_lock(&sync.Lock);
+    if (status == STATUS_PENDING || sync.Done) {
+        while (!sync.Done) {
+            pthread_cond_wait(&sync.Cond, &sync.Lock);
+        }
+        status = sync.Status;
+        if (Information) {
+            *Information = sync.Information;
+        }
+    }
+    pthread_mutex_unlock(&sync.Lock);
+
+    pthread_cond_destroy(&sync.Cond);
+    pthread_mutex_destroy(&sync.Lock);
+
+    return status;
+}
+
+NTSTATUS
+WdfShimSubmitRequest(
+    WDFDEVICE Device,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    PFN_WDF_SHIM_REQUEST_COMPLETION Completion,
+    PVOID CompletionContext,
+    WDFREQUEST * Request
+    )
+{
+    return WdfShimSubmit((PWDF_SHIM_DEVICE) Device, NULL, RequestType, IoControlCode,
+                         InputBuffer, InputLength, OutputBuffer, OutputLength,
+                         Completion, CompletionContext, Request);
+}
+
+NTSTATUS
+WdfShimSubmitRequestSynchronously(
+    WDFDEVICE Device,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    ULONG_PTR * Information
+    )
+{
+    return WdfShimSubmitSynchronously((PWDF_SHIM_DEVICE) Device, NULL, RequestType,
+                                      IoControlCode, InputBuffer, InputLength,
+                                      OutputBuffer, OutputLength, Information);
+}
+
+NTSTATUS
+WdfShimSubmitFileRequest(
+    WDFFILEOBJECT FileObject,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    PFN_WDF_SHIM_REQUEST_COMPLETION Completion,
+    PVOID CompletionContext,
+    WDFREQUEST * Request
+    )
+{
+    PWDF_SHIM_FILE file = (PWDF_SHIM_FILE) FileObject;
+
+    return WdfShimSubmit(file->Device, file, RequestType, IoControlCode,
+                         InputBuffer, InputLength, OutputBuffer, OutputLength,
+                         Completion, CompletionContext, Request);
+}
+
+NTSTATUS
+WdfShimSubmitFileRequestSynchronously(
+    WDFFILEOBJECT FileObject,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    ULONG_PTR * Information
+    )
+{
+    PWDF_SHIM_FILE file = (PWDF_SHIM_FILE) FileObject;
+
+    return WdfShimSubmitSynchronously(file->Device, file, RequestType, IoControlCode,
+                                      InputBuffer, InputLength,
+                                      OutputBuffer, OutputLength, Information);
+}
+
+NTSTATUS
+WdfShimFileOpen(
+    WDFDEVICE Device,
+    WDFFILEOBJECT * FileObject
+    )
+/*++
+
+Routine Description:
+
+    Create a file object under the device (with the driver's file object
+    attributes) and send it the create request.
+
+--*/
+{
+    PWDF_SHIM_DEVICE    device = (PWDF_SHIM_DEVICE) Device;
+    PWDF_SHIM_FILE      file;
+    NTSTATUS            status;
+
+    file = (PWDF_SHIM_FILE) WdfShimObjectAllocate(sizeof(*file), WdfShimObjectFile,
+                                                   device->FileAttributes.Size ?
+                                                   &device->FileAttributes : NULL,
+                                                   &device->Object);
+    if (!file) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    file->Device = device;
+
+    status = WdfShimSubmitSynchronously(device, file, WdfRequestTypeCreate, 0,
+                                        NULL, 0, NULL, 0, NULL);
+    if (!NT_SUCCESS(status)) {
+        WdfShimObjectDelete(&file->Object);
+        return status;
+    }
+
+    *FileObject = file;
+    return STATUS_SUCCESS;
+}
+
+VOID
+WdfShimFileClose(
+    WDFFILEOBJECT FileObject
+    )
+{
+    PWDF_SHIM_FILE      file = (PWDF_SHIM_FILE) FileObject;
+    PWDF_SHIM_DEVICE    device = file->Device;
+
+    if (device->FileConfig.EvtFileCleanup) {
+        device->FileConfig.EvtFileCleanup(file);
+    }
+    if (device->FileConfig.EvtFileClose) {
+        device->FileConfig.EvtFileClose(file);
+    }
+
+    WdfShimObjectDelete(&file->Object);
+}
+
+VOID
+WdfShimCancelRequest(
+    WDFREQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    IoCancelIrp. A request still in its queue is completed with
+    STATUS_CANCELLED; a presented request has its cancel routine called
+    (now, or from WdfRequestMarkCancelable if it is not cancelable yet).
+
+--*/
+{
+    PWDF_SHIM_REQUEST       request = (PWDF_SHIM_REQUEST) Request;
+    PWDF_SHIM_QUEUE         queue = request->Queue;
+    PFN_WDF_REQUEST_CANCEL  cancelRoutine = NULL;
+
+    //
+    // The queue moves the request between Queued and Presented under its
+    // lock, and completion makes it Completed under WdfShimCancelLock:
+    // look at it under both.
+    //
+    if (queue) {
+        pthread_mutex_lock(&queue->Lock);
+    }
+    pthread_mutex_lock(&WdfShimCancelLock);
+
+    if (queue && request->State == WdfShimRequestQueued) {
+        RemoveEntryList(&request->QueueLink);
+        request->State = WdfShimRequestPresented;
+        request->Cancelled = TRUE;
+        pthread_mutex_unlock(&WdfShimCancelLock);
+        pthread_mutex_unlock(&queue->Lock);
+
+        WdfRequestComplete(Request, STATUS_CANCELLED);
+        return;
+    }
+
+    if (request->State != WdfShimRequestCompleted) {
+        request->Cancelled = TRUE;
+        cancelRoutine = request->CancelRoutine;
+        if (cancelRoutine) {
+            request->CancelRoutine = NULL;
+            request->CancelRoutineTaken = TRUE;
+        }
+    }
+
+    pthread_mutex_unlock(&WdfShimCancelLock);
+    if (queue) {
+        pthread_mutex_unlock(&queue->Lock);
+    }
+
+    if (cancelRoutine) {
+        WdfShimCallCancelRoutine(request, cancelRoutine);
+    }
+}
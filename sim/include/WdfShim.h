@@ -0,0 +1,1430 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    WdfShim.h
+
+Abstract:
+
+    User-mode stand-in for the subset of KMDF and the NT DDI used by the
+    driver. The driver sources (HSAC.c, Init.c, Read.c, Write.c,
+    IsrDpc.c, DeviceControl.c) compile unmodified against this header
+    and run on Linux against the HSAC card model in HsacSim.c.
+
+    Semantics kept from the framework:
+
+      - each queue dispatches on its own thread; sequential queues present
+        one request at a time, parallel queues up to
+        NumberOfPresentedRequests;
+      - WdfSynchronizationScopeDevice serializes queue callbacks, cancel
+        routines and (with AutomaticSerialization) the DpcForIsr;
+      - the ISR runs under the interrupt lock on the model's interrupt
+        thread, the DpcForIsr and each WDFDPC on a thread of their own;
+      - with WdfShimSetInterruptMessages(n > 1) the device gets n MSI
+        message resources instead of a line, and each message reaches
+        only the interrupt object connected to it;
+      - WdfDmaTransactionExecute/DmaCompleted split a transfer into
+        MaximumLength pieces and call EvtProgramDma for each one;
+      - scatter/gather lists describe the buffer one page at a time and
+        logical addresses equal host virtual addresses, which is what the
+        card model expects;
+      - METHOD_BUFFERED IOCTLs share one system buffer for input and
+        output.
+
+    Entry points with no framework equivalent (playing the PnP and I/O
+    managers, binding the card model) are prefixed WdfShim.
+
+Environment:
+
+    User mode (Linux, pthreads)
+
+--*/
+
+#ifndef WDF_SHIM_H
+#define WDF_SHIM_H
+
+#include <assert.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Build environment
+//-----------------------------------------------------------------------------
+#ifndef DBG
+#define DBG 0
+#endif
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define __in
+#define __out
+#define __inout
+#define __in_opt
+#define __out_opt
+
+#define UNREFERENCED_PARAMETER(P)   ((void) (P))
+#define PAGED_CODE()                ((void) 0)
+#define ASSERT(e)                   assert(e)
+#define C_ASSERT(e)                 _Static_assert(e, #e)
+#define FORCEINLINE                 static inline __attribute__((always_inline))
+#define RTL_NUMBER_OF(A)            (sizeof(A) / sizeof((A)[0]))
+
+//
+// Structured exception handling has no user-mode equivalent here; the
+// guarded block always runs and the handler never does.
+//
+#define __try                       if (1)
+#define __except(filter)            else if (0)
+#define EXCEPTION_EXECUTE_HANDLER   1
+#define GetExceptionCode()          STATUS_ACCESS_VIOLATION
+
+//-----------------------------------------------------------------------------
+// Basic NT types
+//-----------------------------------------------------------------------------
+typedef void                VOID, * PVOID;
+typedef char                CHAR, * PCHAR;
+typedef unsigned char       UCHAR, * PUCHAR;
+typedef short               SHORT;
+typedef unsigned short      USHORT, * PUSHORT;
+typedef int                 LONG, * PLONG;
+typedef unsigned int        ULONG, * PULONG;
+typedef long long           LONGLONG, * PLONGLONG, LONG64, * PLONG64;
+typedef unsigned long long  ULONGLONG, * PULONGLONG, ULONG64, * PULONG64;
+typedef uintptr_t           ULONG_PTR, * PULONG_PTR;
+typedef intptr_t            LONG_PTR;
+typedef size_t              SIZE_T;
+typedef unsigned char       BOOLEAN, * PBOOLEAN;
+typedef LONG                NTSTATUS;
+typedef UCHAR               KIRQL, * PKIRQL;
+typedef CHAR                CCHAR;
+typedef ULONG_PTR           KAFFINITY, * PKAFFINITY;
+typedef ULONG               ACCESS_MASK;
+typedef PVOID               HANDLE;
+typedef unsigned short      WCHAR, * PWCHAR;
+
+#ifndef TRUE
+#define TRUE    1
+#define FALSE   0
+#endif
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG   LowPart;
+        LONG    HighPart;
+    };
+    LONGLONG    QuadPart;
+} LARGE_INTEGER, * PLARGE_INTEGER, PHYSICAL_ADDRESS, * PPHYSICAL_ADDRESS;
+
+typedef struct _GUID {
+    ULONG   Data1;
+    USHORT  Data2;
+    USHORT  Data3;
+    UCHAR   Data4[8];
+} GUID, * LPGUID;
+
+typedef struct _UNICODE_STRING {
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PWCHAR  Buffer;
+} UNICODE_STRING, * PUNICODE_STRING;
+
+typedef const UNICODE_STRING * PCUNICODE_STRING;
+
+//
+// The driver's L"" strings are WCHAR strings: the Makefile builds it
+// with -fshort-wchar.
+//
+#define DECLARE_CONST_UNICODE_STRING(_var, _string)                         \
+    const WCHAR _var ## _buffer[] = _string;                                \
+    const UNICODE_STRING _var = { sizeof(_string) - sizeof(WCHAR),          \
+                                  sizeof(_string), (PWCHAR) _var ## _buffer }
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY * Flink;
+    struct _LIST_ENTRY * Blink;
+} LIST_ENTRY, * PLIST_ENTRY;
+
+FORCEINLINE VOID
+InitializeListHead(
+    PLIST_ENTRY ListHead
+    )
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+#define IsListEmpty(ListHead)   ((ListHead)->Flink == (ListHead))
+
+FORCEINLINE BOOLEAN
+RemoveEntryList(
+    PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY flink = Entry->Flink;
+    PLIST_ENTRY blink = Entry->Blink;
+
+    blink->Flink = flink;
+    flink->Blink = blink;
+    return (BOOLEAN) (flink == blink);
+}
+
+FORCEINLINE PLIST_ENTRY
+RemoveHeadList(
+    PLIST_ENTRY ListHead
+    )
+{
+    PLIST_ENTRY entry = ListHead->Flink;
+
+    RemoveEntryList(entry);
+    return entry;
+}
+
+FORCEINLINE VOID
+InsertTailList(
+    PLIST_ENTRY ListHead,
+    PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY blink = ListHead->Blink;
+
+    Entry->Flink = ListHead;
+    Entry->Blink = blink;
+    blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+FORCEINLINE VOID
+InsertHeadList(
+    PLIST_ENTRY ListHead,
+    PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY flink = ListHead->Flink;
+
+    Entry->Flink = flink;
+    Entry->Blink = ListHead;
+    flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+//
+// Interlocked singly linked list. The kernel's header carries a sequence
+// number against ABA; the shim only needs push and flush, which do not.
+//
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+#define DECLSPEC_ALIGN(x)           __attribute__((aligned(x)))
+
+typedef struct _SLIST_ENTRY {
+    struct _SLIST_ENTRY * Next;
+} SLIST_ENTRY, * PSLIST_ENTRY;
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _SLIST_HEADER {
+    PSLIST_ENTRY volatile Next;
+} SLIST_HEADER, * PSLIST_HEADER;
+
+FORCEINLINE VOID
+InitializeSListHead(
+    PSLIST_HEADER SListHead
+    )
+{
+    SListHead->Next = NULL;
+}
+
+FORCEINLINE PSLIST_ENTRY
+InterlockedPushEntrySList(
+    PSLIST_HEADER ListHead,
+    PSLIST_ENTRY  ListEntry
+    )
+{
+    PSLIST_ENTRY first = __atomic_load_n(&ListHead->Next, __ATOMIC_RELAXED);
+
+    do {
+        ListEntry->Next = first;
+    } while (!__atomic_compare_exchange_n(&ListHead->Next, &first, ListEntry, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return first;
+}
+
+FORCEINLINE PSLIST_ENTRY
+InterlockedFlushSList(
+    PSLIST_HEADER ListHead
+    )
+{
+    return __atomic_exchange_n(&ListHead->Next, NULL, __ATOMIC_SEQ_CST);
+}
+
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, * PDRIVER_OBJECT;
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, * PDEVICE_OBJECT;
+
+#define NT_SUCCESS(Status)  (((NTSTATUS) (Status)) >= 0)
+
+#define STATUS_SUCCESS                      ((NTSTATUS) 0x00000000L)
+#define STATUS_TIMEOUT                      ((NTSTATUS) 0x00000102L)
+#define STATUS_PENDING                      ((NTSTATUS) 0x00000103L)
+#define STATUS_OBJECT_NAME_EXISTS           ((NTSTATUS) 0x40000000L)
+#define STATUS_MORE_PROCESSING_REQUIRED     ((NTSTATUS) 0xC0000016L)
+#define STATUS_DEVICE_BUSY                  ((NTSTATUS) 0x80000011L)
+#define STATUS_NO_MORE_ENTRIES              ((NTSTATUS) 0x8000001AL)
+#define STATUS_UNSUCCESSFUL                 ((NTSTATUS) 0xC0000001L)
+#define STATUS_ACCESS_VIOLATION             ((NTSTATUS) 0xC0000005L)
+#define STATUS_INVALID_HANDLE               ((NTSTATUS) 0xC0000008L)
+#define STATUS_INVALID_PARAMETER            ((NTSTATUS) 0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST       ((NTSTATUS) 0xC0000010L)
+#define STATUS_OBJECT_NAME_NOT_FOUND        ((NTSTATUS) 0xC0000034L)
+#define STATUS_BUFFER_TOO_SMALL             ((NTSTATUS) 0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES       ((NTSTATUS) 0xC000009AL)
+#define STATUS_DEVICE_NOT_READY             ((NTSTATUS) 0xC00000A3L)
+#define STATUS_NOT_SUPPORTED                ((NTSTATUS) 0xC00000BBL)
+#define STATUS_CANCELLED                    ((NTSTATUS) 0xC0000120L)
+#define STATUS_DEVICE_CONFIGURATION_ERROR   ((NTSTATUS) 0xC0000182L)
+#define STATUS_INVALID_DEVICE_STATE         ((NTSTATUS) 0xC0000184L)
+#define STATUS_INVALID_BUFFER_SIZE          ((NTSTATUS) 0xC0000206L)
+
+//-----------------------------------------------------------------------------
+// IRQL and interlocked operations
+//-----------------------------------------------------------------------------
+#define PASSIVE_LEVEL               0
+#define APC_LEVEL                   1
+#define DISPATCH_LEVEL              2
+
+#define KeGetCurrentIrql()          ((KIRQL) PASSIVE_LEVEL)
+#define KeLowerIrql(NewIrql)        ((void) (NewIrql))
+#define KeRaiseIrql(NewIrql, Old)   ((void) (NewIrql), *(Old) = PASSIVE_LEVEL)
+
+#define InterlockedIncrement(p)             __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)             __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(p, v)           __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)        __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedOr(p, v)                 __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(p, v)                __atomic_fetch_and((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64              InterlockedIncrement
+#define InterlockedDecrement64              InterlockedDecrement
+#define InterlockedExchange64               InterlockedExchange
+#define InterlockedExchangeAdd64            InterlockedExchangeAdd
+#define InterlockedExchangePointer          InterlockedExchange
+#define ReadNoFence(p)                      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ReadNoFence64(p)                    __atomic_load_n((p), __ATOMIC_RELAXED)
+#define WriteNoFence(p, v)                  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define WriteNoFence64(p, v)                __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+FORCEINLINE LONG
+InterlockedCompareExchange(
+    volatile LONG * Destination,
+    LONG Exchange,
+    LONG Comparand
+    )
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE PVOID
+InterlockedCompareExchangePointer(
+    PVOID volatile * Destination,
+    PVOID Exchange,
+    PVOID Comparand
+    )
+{
+    __atomic_compare_exchange_n(Destination, &Comparand, Exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+#ifndef min
+#define min(a, b)                   (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b)                   (((a) > (b)) ? (a) : (b))
+#endif
+
+#define KeMemoryBarrier()           __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define ReadAcquire(Source)                 __atomic_load_n((Source), __ATOMIC_ACQUIRE)
+#define ReadULongAcquire(Source)            __atomic_load_n((Source), __ATOMIC_ACQUIRE)
+#define WriteRelease(Destination, Value) \
+    __atomic_store_n((Destination), (Value), __ATOMIC_RELEASE)
+#define WriteULongRelease(Destination, Value) \
+    __atomic_store_n((Destination), (Value), __ATOMIC_RELEASE)
+#define WriteRelease64(Destination, Value) \
+    __atomic_store_n((Destination), (Value), __ATOMIC_RELEASE)
+
+//
+// A spinning thread gives the model's worker threads the CPU.
+//
+#define YieldProcessor()            sched_yield()
+
+LARGE_INTEGER
+KeQueryPerformanceCounter(
+    PLARGE_INTEGER PerformanceFrequency
+    );
+
+ULONG
+KeQueryActiveProcessorCount(
+    PKAFFINITY ActiveProcessors
+    );
+
+ULONG
+KeGetCurrentProcessorNumber(
+    VOID
+    );
+
+//
+// Only the target processor of a DPC is modelled; the shim's DPC thread
+// moves itself there the next time the DPC runs.
+//
+typedef struct _KDPC {
+    volatile LONG   Number;     // target processor, -1 for any
+} KDPC, * PKDPC, * PRKDPC;
+
+VOID
+KeSetTargetProcessorDpc(
+    PRKDPC Dpc,
+    CCHAR Number
+    );
+
+//
+// Processors are numbered in groups of 64, the way Windows forms them on
+// a machine without NUMA constraints: processor index Group * 64 + Number.
+//
+typedef struct _PROCESSOR_NUMBER {
+    USHORT  Group;
+    UCHAR   Number;
+    UCHAR   Reserved;
+} PROCESSOR_NUMBER, * PPROCESSOR_NUMBER;
+
+#define INVALID_PROCESSOR_INDEX     0xffffffff
+
+ULONG
+KeGetProcessorIndexFromNumber(
+    PPROCESSOR_NUMBER ProcNumber
+    );
+
+NTSTATUS
+KeSetTargetProcessorDpcEx(
+    PKDPC Dpc,
+    PPROCESSOR_NUMBER ProcNumber
+    );
+
+VOID
+KeFlushQueuedDpcs(
+    VOID
+    );
+
+//-----------------------------------------------------------------------------
+// Memory, MDLs and mapping
+//-----------------------------------------------------------------------------
+#define PAGE_SIZE                   0x1000
+#define PAGE_SHIFT                  12
+#define BYTE_OFFSET(Va)             ((ULONG) ((ULONG_PTR) (Va) & (PAGE_SIZE - 1)))
+#define ROUND_TO_PAGES(Size)        (((ULONG_PTR) (Size) + PAGE_SIZE - 1) & ~(ULONG_PTR) (PAGE_SIZE - 1))
+#define BYTES_TO_PAGES(Size)        (((Size) >> PAGE_SHIFT) + (((Size) & (PAGE_SIZE - 1)) != 0))
+#define FILE_OCTA_ALIGNMENT         0x0000000f
+
+#define RtlCopyMemory(d, s, l)      memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)      memmove((d), (s), (l))
+#define RtlZeroMemory(d, l)         memset((d), 0, (l))
+#define RtlFillMemory(d, l, f)      memset((d), (f), (l))
+
+#define FIELD_OFFSET(type, field)   ((LONG) offsetof(type, field))
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *) ((PCHAR) (address) - offsetof(type, field)))
+
+typedef struct _MDL {
+    PVOID   VirtualAddress;
+    ULONG   ByteCount;
+} MDL, * PMDL;
+
+#define MmGetMdlVirtualAddress(Mdl)     ((Mdl)->VirtualAddress)
+#define MmGetMdlByteCount(Mdl)          ((Mdl)->ByteCount)
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority) ((Mdl)->VirtualAddress)
+#define MmBuildMdlForNonPagedPool(Mdl)  ((void) (Mdl))
+
+typedef enum _MEMORY_CACHING_TYPE {
+    MmNonCached = 0,
+    MmCached = 1,
+    MmWriteCombined = 2
+} MEMORY_CACHING_TYPE;
+
+typedef enum _MODE {
+    KernelMode,
+    UserMode
+} KPROCESSOR_MODE;
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+#define MdlMappingNoWrite           0x80000000
+
+typedef enum _LOCK_OPERATION {
+    IoReadAccess,
+    IoWriteAccess,
+    IoModifyAccess
+} LOCK_OPERATION;
+
+PMDL    IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer,
+                      BOOLEAN ChargeQuota, PVOID Irp);
+VOID    IoFreeMdl(PMDL Mdl);
+
+//
+// Nothing pages here, so locking a buffer down only checks it is there.
+//
+#define MmProbeAndLockPages(Mdl, AccessMode, Operation) \
+    ((void) (AccessMode), (void) (Operation), ASSERT((Mdl)->VirtualAddress != NULL))
+#define MmUnlockPages(Mdl)              ((void) (Mdl))
+
+//
+// Sleeps for a relative (negative, 100ns units) Interval.
+//
+NTSTATUS
+KeDelayExecutionThread(
+    KPROCESSOR_MODE WaitMode,
+    BOOLEAN Alertable,
+    PLARGE_INTEGER Interval
+    );
+
+//
+// The harness runs in a single address space, so "mapping into the
+// caller's process" hands back the system address.
+//
+PVOID   MmMapLockedPagesSpecifyCache(PMDL Mdl, KPROCESSOR_MODE AccessMode,
+                                     MEMORY_CACHING_TYPE CacheType, PVOID RequestedAddress,
+                                     ULONG BugCheckOnFailure, MM_PAGE_PRIORITY Priority);
+VOID    MmUnmapLockedPages(PVOID BaseAddress, PMDL Mdl);
+
+PVOID   MmMapIoSpace(PHYSICAL_ADDRESS PhysicalAddress, SIZE_T NumberOfBytes,
+                     MEMORY_CACHING_TYPE CacheType);
+VOID    MmUnmapIoSpace(PVOID BaseAddress, SIZE_T NumberOfBytes);
+
+#define MmLockPagableDataSection(Address)       ((PVOID) (Address))
+#define MmLockPagableSectionByHandle(Handle)    ((void) (Handle))
+#define MmUnlockPagableImageSection(Handle)     ((void) (Handle))
+
+//-----------------------------------------------------------------------------
+// Register access (routed to the card model when it owns the address)
+//-----------------------------------------------------------------------------
+ULONG   WdfShimReadRegisterUlong(volatile ULONG * Register);
+VOID    WdfShimWriteRegisterUlong(volatile ULONG * Register, ULONG Value);
+
+#define READ_REGISTER_ULONG(r)          WdfShimReadRegisterUlong((volatile ULONG *) (r))
+#define WRITE_REGISTER_ULONG(r, v)      WdfShimWriteRegisterUlong((volatile ULONG *) (r), (v))
+#define READ_REGISTER_UCHAR(r)          (*(volatile UCHAR *) (r))
+#define WRITE_REGISTER_UCHAR(r, v)      (*(volatile UCHAR *) (r) = (v))
+
+FORCEINLINE VOID
+READ_REGISTER_BUFFER_ULONG(
+    volatile ULONG * Register,
+    PULONG Buffer,
+    ULONG Count
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        Buffer[i] = WdfShimReadRegisterUlong(Register + i);
+    }
+}
+
+FORCEINLINE VOID
+WRITE_REGISTER_BUFFER_ULONG(
+    volatile ULONG * Register,
+    PULONG Buffer,
+    ULONG Count
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        WdfShimWriteRegisterUlong(Register + i, Buffer[i]);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// I/O control codes
+//-----------------------------------------------------------------------------
+#define FILE_DEVICE_UNKNOWN         0x00000022
+#define METHOD_BUFFERED             0
+#define METHOD_IN_DIRECT            1
+#define METHOD_OUT_DIRECT           2
+#define METHOD_NEITHER              3
+#define FILE_ANY_ACCESS             0
+#define FILE_READ_ACCESS            0x0001
+#define FILE_WRITE_ACCESS           0x0002
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define METHOD_FROM_CTL_CODE(ctrlCode)  ((ULONG) ((ctrlCode) & 3))
+
+//-----------------------------------------------------------------------------
+// Scatter/gather and resource lists
+//-----------------------------------------------------------------------------
+typedef struct _SCATTER_GATHER_ELEMENT {
+    PHYSICAL_ADDRESS    Address;
+    ULONG               Length;
+    ULONG_PTR           Reserved;
+} SCATTER_GATHER_ELEMENT, * PSCATTER_GATHER_ELEMENT;
+
+typedef struct _SCATTER_GATHER_LIST {
+    ULONG                   NumberOfElements;
+    ULONG_PTR               Reserved;
+    SCATTER_GATHER_ELEMENT  Elements[1];
+} SCATTER_GATHER_LIST, * PSCATTER_GATHER_LIST;
+
+#define CmResourceTypeNull          0
+#define CmResourceTypePort          1
+#define CmResourceTypeInterrupt     2
+#define CmResourceTypeMemory        3
+
+#define CM_RESOURCE_INTERRUPT_LEVEL_SENSITIVE   0x0000
+#define CM_RESOURCE_INTERRUPT_LATCHED           0x0001
+#define CM_RESOURCE_INTERRUPT_MESSAGE           0x0002
+
+typedef struct _CM_PARTIAL_RESOURCE_DESCRIPTOR {
+    UCHAR   Type;
+    UCHAR   ShareDisposition;
+    USHORT  Flags;
+    union {
+        struct {
+            PHYSICAL_ADDRESS    Start;
+            ULONG               Length;
+        } Port;
+        struct {
+            PHYSICAL_ADDRESS    Start;
+            ULONG               Length;
+        } Memory;
+        struct {
+            ULONG               Level;
+            ULONG               Vector;
+            ULONG_PTR           Affinity;
+        } Interrupt;
+        struct {
+            union {
+                struct {
+                    USHORT      Reserved;
+                    USHORT      MessageCount;
+                    ULONG       Vector;
+                    ULONG_PTR   Affinity;
+                } Raw;
+                struct {
+                    ULONG       Level;
+                    ULONG       Vector;
+                    ULONG_PTR   Affinity;
+                } Translated;
+            };
+        } MessageInterrupt;
+    } u;
+} CM_PARTIAL_RESOURCE_DESCRIPTOR, * PCM_PARTIAL_RESOURCE_DESCRIPTOR;
+
+//-----------------------------------------------------------------------------
+// WDF handles and enumerations
+//
+// Every handle is a WDFOBJECT, as the framework's callback typedefs take
+// WDFOBJECT where drivers write the specific handle type.
+//-----------------------------------------------------------------------------
+typedef PVOID WDFOBJECT;
+typedef PVOID WDFCONTEXT;
+
+typedef WDFOBJECT WDFDRIVER;
+typedef WDFOBJECT WDFDEVICE;
+typedef WDFOBJECT WDFQUEUE;
+typedef WDFOBJECT WDFREQUEST;
+typedef WDFOBJECT WDFINTERRUPT;
+typedef WDFOBJECT WDFDMAENABLER;
+typedef WDFOBJECT WDFDMATRANSACTION;
+typedef WDFOBJECT WDFCOMMONBUFFER;
+typedef WDFOBJECT WDFTIMER;
+typedef WDFOBJECT WDFDPC;
+typedef WDFOBJECT WDFWORKITEM;
+typedef WDFOBJECT WDFWAITLOCK;
+typedef WDFOBJECT WDFFILEOBJECT;
+typedef WDFOBJECT WDFCMRESLIST;
+typedef WDFOBJECT WDFMEMORY;
+
+typedef struct WDFDEVICE_INIT__ WDFDEVICE_INIT, * PWDFDEVICE_INIT;
+
+#define WDF_NO_OBJECT_ATTRIBUTES    NULL
+#define WDF_NO_HANDLE               NULL
+#define WDF_NO_CONTEXT              NULL
+
+typedef enum _WDF_DMA_PROFILE {
+    WdfDmaProfileInvalid = 0,
+    WdfDmaProfilePacket,
+    WdfDmaProfileScatterGather,
+    WdfDmaProfilePacket64,
+    WdfDmaProfileScatterGather64,
+    WdfDmaProfileScatterGatherDuplex,
+    WdfDmaProfileScatterGather64Duplex
+} WDF_DMA_PROFILE;
+
+typedef enum _WDF_DMA_DIRECTION {
+    WdfDmaDirectionReadFromDevice = FALSE,
+    WdfDmaDirectionWriteToDevice = TRUE
+} WDF_DMA_DIRECTION;
+
+typedef enum _WDF_REQUEST_TYPE {
+    WdfRequestTypeCreate = 0x0,
+    WdfRequestTypeClose = 0x2,
+    WdfRequestTypeRead = 0x3,
+    WdfRequestTypeWrite = 0x4,
+    WdfRequestTypeDeviceControl = 0xE,
+    WdfRequestTypeMax = 0x1C
+} WDF_REQUEST_TYPE;
+
+typedef enum _WDF_IO_QUEUE_DISPATCH_TYPE {
+    WdfIoQueueDispatchInvalid = 0,
+    WdfIoQueueDispatchSequential,
+    WdfIoQueueDispatchParallel,
+    WdfIoQueueDispatchManual
+} WDF_IO_QUEUE_DISPATCH_TYPE;
+
+typedef enum _WDF_SYNCHRONIZATION_SCOPE {
+    WdfSynchronizationScopeInvalid = 0,
+    WdfSynchronizationScopeInheritFromParent,
+    WdfSynchronizationScopeDevice,
+    WdfSynchronizationScopeQueue,
+    WdfSynchronizationScopeNone
+} WDF_SYNCHRONIZATION_SCOPE;
+
+typedef enum _WDF_EXECUTION_LEVEL {
+    WdfExecutionLevelInvalid = 0,
+    WdfExecutionLevelInheritFromParent,
+    WdfExecutionLevelPassive,
+    WdfExecutionLevelDispatch
+} WDF_EXECUTION_LEVEL;
+
+typedef enum _WDF_POWER_DEVICE_STATE {
+    WdfPowerDeviceInvalid = 0,
+    WdfPowerDeviceD0,
+    WdfPowerDeviceD1,
+    WdfPowerDeviceD2,
+    WdfPowerDeviceD3,
+    WdfPowerDeviceD3Final,
+    WdfPowerDevicePrepareForHibernation,
+    WdfPowerDeviceMaximum
+} WDF_POWER_DEVICE_STATE;
+
+typedef enum _WDF_DEVICE_IO_TYPE {
+    WdfDeviceIoUndefined = 0,
+    WdfDeviceIoNeither,
+    WdfDeviceIoBuffered,
+    WdfDeviceIoDirect
+} WDF_DEVICE_IO_TYPE;
+
+//-----------------------------------------------------------------------------
+// Callback types
+//-----------------------------------------------------------------------------
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
+
+typedef NTSTATUS EVT_WDF_DRIVER_DEVICE_ADD(WDFDRIVER Driver, PWDFDEVICE_INIT DeviceInit);
+typedef EVT_WDF_DRIVER_DEVICE_ADD * PFN_WDF_DRIVER_DEVICE_ADD;
+
+typedef VOID EVT_WDF_OBJECT_CONTEXT_CLEANUP(WDFOBJECT Object);
+typedef VOID EVT_WDF_OBJECT_CONTEXT_DESTROY(WDFOBJECT Object);
+typedef EVT_WDF_OBJECT_CONTEXT_CLEANUP * PFN_WDF_OBJECT_CONTEXT_CLEANUP;
+typedef EVT_WDF_OBJECT_CONTEXT_DESTROY * PFN_WDF_OBJECT_CONTEXT_DESTROY;
+
+typedef NTSTATUS EVT_WDF_DEVICE_D0_ENTRY(WDFDEVICE Device, WDF_POWER_DEVICE_STATE PreviousState);
+typedef NTSTATUS EVT_WDF_DEVICE_D0_EXIT(WDFDEVICE Device, WDF_POWER_DEVICE_STATE TargetState);
+typedef NTSTATUS EVT_WDF_DEVICE_PREPARE_HARDWARE(WDFDEVICE Device, WDFCMRESLIST Resources,
+                                                 WDFCMRESLIST ResourcesTranslated);
+typedef NTSTATUS EVT_WDF_DEVICE_RELEASE_HARDWARE(WDFDEVICE Device, WDFCMRESLIST ResourcesTranslated);
+typedef EVT_WDF_DEVICE_D0_ENTRY         * PFN_WDF_DEVICE_D0_ENTRY;
+typedef EVT_WDF_DEVICE_D0_EXIT          * PFN_WDF_DEVICE_D0_EXIT;
+typedef EVT_WDF_DEVICE_PREPARE_HARDWARE * PFN_WDF_DEVICE_PREPARE_HARDWARE;
+typedef EVT_WDF_DEVICE_RELEASE_HARDWARE * PFN_WDF_DEVICE_RELEASE_HARDWARE;
+
+typedef VOID EVT_WDF_IO_QUEUE_IO_READ(WDFQUEUE Queue, WDFREQUEST Request, size_t Length);
+typedef VOID EVT_WDF_IO_QUEUE_IO_WRITE(WDFQUEUE Queue, WDFREQUEST Request, size_t Length);
+typedef VOID EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL(WDFQUEUE Queue, WDFREQUEST Request,
+                                                 size_t OutputBufferLength,
+                                                 size_t InputBufferLength,
+                                                 ULONG IoControlCode);
+typedef EVT_WDF_IO_QUEUE_IO_READ           * PFN_WDF_IO_QUEUE_IO_READ;
+typedef EVT_WDF_IO_QUEUE_IO_WRITE          * PFN_WDF_IO_QUEUE_IO_WRITE;
+typedef EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL * PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL;
+
+typedef VOID EVT_WDF_REQUEST_CANCEL(WDFREQUEST Request);
+typedef EVT_WDF_REQUEST_CANCEL * PFN_WDF_REQUEST_CANCEL;
+
+typedef BOOLEAN  EVT_WDF_INTERRUPT_ISR(WDFINTERRUPT Interrupt, ULONG MessageID);
+typedef VOID     EVT_WDF_INTERRUPT_DPC(WDFINTERRUPT Interrupt, WDFOBJECT AssociatedObject);
+typedef NTSTATUS EVT_WDF_INTERRUPT_ENABLE(WDFINTERRUPT Interrupt, WDFDEVICE AssociatedDevice);
+typedef NTSTATUS EVT_WDF_INTERRUPT_DISABLE(WDFINTERRUPT Interrupt, WDFDEVICE AssociatedDevice);
+typedef EVT_WDF_INTERRUPT_ISR     * PFN_WDF_INTERRUPT_ISR;
+typedef EVT_WDF_INTERRUPT_DPC     * PFN_WDF_INTERRUPT_DPC;
+typedef EVT_WDF_INTERRUPT_ENABLE  * PFN_WDF_INTERRUPT_ENABLE;
+typedef EVT_WDF_INTERRUPT_DISABLE * PFN_WDF_INTERRUPT_DISABLE;
+
+typedef BOOLEAN EVT_WDF_PROGRAM_DMA(WDFDMATRANSACTION Transaction, WDFDEVICE Device,
+                                    WDFCONTEXT Context, WDF_DMA_DIRECTION Direction,
+                                    PSCATTER_GATHER_LIST SgList);
+typedef EVT_WDF_PROGRAM_DMA * PFN_WDF_PROGRAM_DMA;
+
+//-----------------------------------------------------------------------------
+// Objects and typed contexts
+//-----------------------------------------------------------------------------
+typedef struct _WDF_OBJECT_CONTEXT_TYPE_INFO {
+    ULONG           Size;
+    const char    * ContextName;
+    size_t          ContextSize;
+} WDF_OBJECT_CONTEXT_TYPE_INFO, * PWDF_OBJECT_CONTEXT_TYPE_INFO;
+
+typedef struct _WDF_OBJECT_ATTRIBUTES {
+    ULONG                               Size;
+    PFN_WDF_OBJECT_CONTEXT_CLEANUP      EvtCleanupCallback;
+    PFN_WDF_OBJECT_CONTEXT_DESTROY      EvtDestroyCallback;
+    WDF_EXECUTION_LEVEL                 ExecutionLevel;
+    WDF_SYNCHRONIZATION_SCOPE           SynchronizationScope;
+    WDFOBJECT                           ParentObject;
+    size_t                              ContextSizeOverride;
+    const WDF_OBJECT_CONTEXT_TYPE_INFO * ContextTypeInfo;
+} WDF_OBJECT_ATTRIBUTES, * PWDF_OBJECT_ATTRIBUTES;
+
+FORCEINLINE VOID
+WDF_OBJECT_ATTRIBUTES_INIT(
+    PWDF_OBJECT_ATTRIBUTES Attributes
+    )
+{
+    memset(Attributes, 0, sizeof(*Attributes));
+    Attributes->Size = sizeof(*Attributes);
+    Attributes->ExecutionLevel = WdfExecutionLevelInheritFromParent;
+    Attributes->SynchronizationScope = WdfSynchronizationScopeInheritFromParent;
+}
+
+#define WDF_GET_CONTEXT_TYPE_INFO(_contexttype) (&WDF_##_contexttype##_TYPE_INFO)
+
+#define WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(_attributes, _contexttype)   \
+    do {                                                                    \
+        WDF_OBJECT_ATTRIBUTES_INIT(_attributes);                            \
+        (_attributes)->ContextTypeInfo = WDF_GET_CONTEXT_TYPE_INFO(_contexttype); \
+    } while (0)
+
+#define WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(_attributes, _contexttype)    \
+    ((_attributes)->ContextTypeInfo = WDF_GET_CONTEXT_TYPE_INFO(_contexttype))
+
+PVOID
+WdfObjectGetTypedContextWorker(
+    WDFOBJECT Handle,
+    const WDF_OBJECT_CONTEXT_TYPE_INFO * TypeInfo
+    );
+
+//
+// The weak definition gives every translation unit the same type-info
+// object, as __declspec(selectany) does for the real framework.
+//
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(_contexttype, _castingfunction)   \
+    __attribute__((weak)) const WDF_OBJECT_CONTEXT_TYPE_INFO                 \
+        WDF_##_contexttype##_TYPE_INFO = {                                  \
+            sizeof(WDF_OBJECT_CONTEXT_TYPE_INFO), #_contexttype,            \
+            sizeof(_contexttype) };                                         \
+    static inline __attribute__((unused)) _contexttype *                    \
+    _castingfunction(WDFOBJECT Handle)                                      \
+    {                                                                       \
+        return (_contexttype *) WdfObjectGetTypedContextWorker(             \
+            Handle, WDF_GET_CONTEXT_TYPE_INFO(_contexttype));               \
+    }
+
+#define WDF_DECLARE_CONTEXT_TYPE(_contexttype) \
+    WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(_contexttype, WdfObjectGet_##_contexttype)
+
+NTSTATUS    WdfObjectAllocateContext(WDFOBJECT Handle, PWDF_OBJECT_ATTRIBUTES ContextAttributes,
+                                     PVOID * Context);
+VOID        WdfObjectDelete(WDFOBJECT Object);
+VOID        WdfObjectReference(WDFOBJECT Handle);
+VOID        WdfObjectDereference(WDFOBJECT Handle);
+
+//
+// Memory objects: zeroed heap memory; the pool type and tag are ignored.
+//
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+NTSTATUS    WdfMemoryCreate(PWDF_OBJECT_ATTRIBUTES Attributes, POOL_TYPE PoolType, ULONG PoolTag,
+                            size_t BufferSize, WDFMEMORY * Memory, PVOID * Buffer);
+PVOID       WdfMemoryGetBuffer(WDFMEMORY Memory, size_t * BufferSize);
+
+//-----------------------------------------------------------------------------
+// Driver
+//-----------------------------------------------------------------------------
+typedef struct _WDF_DRIVER_CONFIG {
+    ULONG                       Size;
+    PFN_WDF_DRIVER_DEVICE_ADD   EvtDriverDeviceAdd;
+    PVOID                       EvtDriverUnload;
+    ULONG                       DriverInitFlags;
+    ULONG                       DriverPoolTag;
+} WDF_DRIVER_CONFIG, * PWDF_DRIVER_CONFIG;
+
+FORCEINLINE VOID
+WDF_DRIVER_CONFIG_INIT(
+    PWDF_DRIVER_CONFIG Config,
+    PFN_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd
+    )
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Size = sizeof(*Config);
+    Config->EvtDriverDeviceAdd = EvtDriverDeviceAdd;
+}
+
+NTSTATUS
+WdfDriverCreate(
+    PDRIVER_OBJECT DriverObject,
+    PUNICODE_STRING RegistryPath,
+    PWDF_OBJECT_ATTRIBUTES DriverAttributes,
+    PWDF_DRIVER_CONFIG DriverConfig,
+    WDFDRIVER * Driver
+    );
+
+PDRIVER_OBJECT  WdfDriverWdmGetDriverObject(WDFDRIVER Driver);
+
+//-----------------------------------------------------------------------------
+// Device
+//-----------------------------------------------------------------------------
+typedef struct _WDF_PNPPOWER_EVENT_CALLBACKS {
+    ULONG                               Size;
+    PFN_WDF_DEVICE_D0_ENTRY             EvtDeviceD0Entry;
+    PFN_WDF_DEVICE_D0_EXIT              EvtDeviceD0Exit;
+    PFN_WDF_DEVICE_PREPARE_HARDWARE     EvtDevicePrepareHardware;
+    PFN_WDF_DEVICE_RELEASE_HARDWARE     EvtDeviceReleaseHardware;
+} WDF_PNPPOWER_EVENT_CALLBACKS, * PWDF_PNPPOWER_EVENT_CALLBACKS;
+
+FORCEINLINE VOID
+WDF_PNPPOWER_EVENT_CALLBACKS_INIT(
+    PWDF_PNPPOWER_EVENT_CALLBACKS Callbacks
+    )
+{
+    memset(Callbacks, 0, sizeof(*Callbacks));
+    Callbacks->Size = sizeof(*Callbacks);
+}
+
+typedef enum _WDF_POWER_POLICY_S0_IDLE_CAPABILITIES {
+    IdleCapsInvalid = 0,
+    IdleCannotWakeFromS0,
+    IdleCanWakeFromS0,
+    IdleUsbSelectiveSuspend
+} WDF_POWER_POLICY_S0_IDLE_CAPABILITIES;
+
+typedef struct _WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS {
+    ULONG                                   Size;
+    WDF_POWER_POLICY_S0_IDLE_CAPABILITIES   IdleCaps;
+    ULONG                                   IdleTimeout;
+} WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS, * PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS;
+
+FORCEINLINE VOID
+WDF_DEVICE_POWER_POLICY_IDLE_SETTINGS_INIT(
+    PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS Settings,
+    WDF_POWER_POLICY_S0_IDLE_CAPABILITIES IdleCaps
+    )
+{
+    memset(Settings, 0, sizeof(*Settings));
+    Settings->Size = sizeof(*Settings);
+    Settings->IdleCaps = IdleCaps;
+}
+
+typedef struct _WDF_DEVICE_POWER_POLICY_WAKE_SETTINGS {
+    ULONG   Size;
+    BOOLEAN Enabled;
+} WDF_DEVICE_POWER_POLICY_WAKE_SETTINGS, * PWDF_DEVICE_POWER_POLICY_WAKE_SETTINGS;
+
+FORCEINLINE VOID
+WDF_DEVICE_POWER_POLICY_WAKE_SETTINGS_INIT(
+    PWDF_DEVICE_POWER_POLICY_WAKE_SETTINGS Settings
+    )
+{
+    memset(Settings, 0, sizeof(*Settings));
+    Settings->Size = sizeof(*Settings);
+    Settings->Enabled = TRUE;
+}
+
+//
+// File objects. The callbacks are not synchronized with the device.
+//
+typedef VOID EVT_WDF_DEVICE_FILE_CREATE(WDFDEVICE Device, WDFREQUEST Request,
+                                        WDFFILEOBJECT FileObject);
+typedef EVT_WDF_DEVICE_FILE_CREATE * PFN_WDF_DEVICE_FILE_CREATE;
+typedef VOID EVT_WDF_FILE_CLOSE(WDFFILEOBJECT FileObject);
+typedef EVT_WDF_FILE_CLOSE * PFN_WDF_FILE_CLOSE;
+typedef VOID EVT_WDF_FILE_CLEANUP(WDFFILEOBJECT FileObject);
+typedef EVT_WDF_FILE_CLEANUP * PFN_WDF_FILE_CLEANUP;
+
+#define WDF_NO_EVENT_CALLBACK       NULL
+
+typedef struct _WDF_FILEOBJECT_CONFIG {
+    ULONG                       Size;
+    PFN_WDF_DEVICE_FILE_CREATE  EvtDeviceFileCreate;
+    PFN_WDF_FILE_CLOSE          EvtFileClose;
+    PFN_WDF_FILE_CLEANUP        EvtFileCleanup;
+} WDF_FILEOBJECT_CONFIG, * PWDF_FILEOBJECT_CONFIG;
+
+FORCEINLINE VOID
+WDF_FILEOBJECT_CONFIG_INIT(
+    PWDF_FILEOBJECT_CONFIG Config,
+    PFN_WDF_DEVICE_FILE_CREATE EvtDeviceFileCreate,
+    PFN_WDF_FILE_CLOSE EvtFileClose,
+    PFN_WDF_FILE_CLEANUP EvtFileCleanup
+    )
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Size = sizeof(*Config);
+    Config->EvtDeviceFileCreate = EvtDeviceFileCreate;
+    Config->EvtFileClose = EvtFileClose;
+    Config->EvtFileCleanup = EvtFileCleanup;
+}
+
+VOID        WdfDeviceInitSetIoType(PWDFDEVICE_INIT DeviceInit, WDF_DEVICE_IO_TYPE IoType);
+VOID        WdfDeviceInitSetFileObjectConfig(PWDFDEVICE_INIT DeviceInit,
+                                             PWDF_FILEOBJECT_CONFIG FileObjectConfig,
+                                             PWDF_OBJECT_ATTRIBUTES FileObjectAttributes);
+VOID        WdfDeviceInitSetPnpPowerEventCallbacks(PWDFDEVICE_INIT DeviceInit,
+                                                   PWDF_PNPPOWER_EVENT_CALLBACKS PnpPowerEventCallbacks);
+NTSTATUS    WdfDeviceCreate(PWDFDEVICE_INIT * DeviceInit, PWDF_OBJECT_ATTRIBUTES DeviceAttributes,
+                            WDFDEVICE * Device);
+WDFFILEOBJECT   WdfRequestGetFileObject(WDFREQUEST Request);
+WDFDEVICE       WdfFileObjectGetDevice(WDFFILEOBJECT FileObject);
+NTSTATUS    WdfDeviceCreateDeviceInterface(WDFDEVICE Device, const GUID * InterfaceClassGUID,
+                                           PUNICODE_STRING ReferenceString);
+NTSTATUS    WdfDeviceAssignS0IdleSettings(WDFDEVICE Device,
+                                          PWDF_DEVICE_POWER_POLICY_IDLE_SETTINGS Settings);
+NTSTATUS    WdfDeviceAssignSxWakeSettings(WDFDEVICE Device,
+                                          PWDF_DEVICE_POWER_POLICY_WAKE_SETTINGS Settings);
+NTSTATUS    WdfDeviceStopIdle(WDFDEVICE Device, BOOLEAN WaitForD0);
+VOID        WdfDeviceResumeIdle(WDFDEVICE Device);
+VOID        WdfDeviceSetAlignmentRequirement(WDFDEVICE Device, ULONG AlignmentRequirement);
+ULONG       WdfDeviceGetAlignmentRequirement(WDFDEVICE Device);
+NTSTATUS    WdfDeviceConfigureRequestDispatching(WDFDEVICE Device, WDFQUEUE Queue,
+                                                 WDF_REQUEST_TYPE RequestType);
+
+//
+// Registry: the device's hardware key holds the REG_DWORD values set with
+// WdfShimSetRegistryValue, and nothing else.
+//
+typedef WDFOBJECT WDFKEY;
+
+#define PLUGPLAY_REGKEY_DEVICE      1
+#define KEY_READ                    0x20019
+
+NTSTATUS    WdfDeviceOpenRegistryKey(WDFDEVICE Device, ULONG DeviceInstanceKeyType,
+                                     ACCESS_MASK DesiredAccess,
+                                     PWDF_OBJECT_ATTRIBUTES KeyAttributes, WDFKEY * Key);
+NTSTATUS    WdfRegistryQueryULong(WDFKEY Key, PCUNICODE_STRING ValueName, PULONG Value);
+VOID        WdfRegistryClose(WDFKEY Key);
+PDEVICE_OBJECT  WdfDeviceWdmGetDeviceObject(WDFDEVICE Device);
+PDEVICE_OBJECT  WdfDeviceWdmGetPhysicalDevice(WDFDEVICE Device);
+
+ULONG                           WdfCmResourceListGetCount(WDFCMRESLIST List);
+PCM_PARTIAL_RESOURCE_DESCRIPTOR WdfCmResourceListGetDescriptor(WDFCMRESLIST List, ULONG Index);
+
+//-----------------------------------------------------------------------------
+// Queues
+//-----------------------------------------------------------------------------
+typedef struct _WDF_IO_QUEUE_CONFIG {
+    ULONG                               Size;
+    WDF_IO_QUEUE_DISPATCH_TYPE          DispatchType;
+    BOOLEAN                             PowerManaged;
+    BOOLEAN                             AllowZeroLengthRequests;
+    BOOLEAN                             DefaultQueue;
+    PFN_WDF_IO_QUEUE_IO_READ            EvtIoRead;
+    PFN_WDF_IO_QUEUE_IO_WRITE           EvtIoWrite;
+    PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL  EvtIoDeviceControl;
+    union {
+        struct {
+            ULONG   NumberOfPresentedRequests;
+        } Parallel;
+    } Settings;
+} WDF_IO_QUEUE_CONFIG, * PWDF_IO_QUEUE_CONFIG;
+
+FORCEINLINE VOID
+WDF_IO_QUEUE_CONFIG_INIT(
+    PWDF_IO_QUEUE_CONFIG Config,
+    WDF_IO_QUEUE_DISPATCH_TYPE DispatchType
+    )
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Size = sizeof(*Config);
+    Config->DispatchType = DispatchType;
+    Config->PowerManaged = TRUE;
+    if (DispatchType == WdfIoQueueDispatchParallel) {
+        Config->Settings.Parallel.NumberOfPresentedRequests = (ULONG) -1;
+    }
+}
+
+NTSTATUS    WdfIoQueueCreate(WDFDEVICE Device, PWDF_IO_QUEUE_CONFIG Config,
+                             PWDF_OBJECT_ATTRIBUTES QueueAttributes, WDFQUEUE * Queue);
+WDFDEVICE   WdfIoQueueGetDevice(WDFQUEUE Queue);
+VOID        WdfIoQueueStopSynchronously(WDFQUEUE Queue);
+VOID        WdfIoQueueStart(WDFQUEUE Queue);
+
+//-----------------------------------------------------------------------------
+// Requests
+//-----------------------------------------------------------------------------
+WDFQUEUE    WdfRequestGetIoQueue(WDFREQUEST Request);
+VOID        WdfRequestComplete(WDFREQUEST Request, NTSTATUS Status);
+VOID        WdfRequestCompleteWithInformation(WDFREQUEST Request, NTSTATUS Status,
+                                              ULONG_PTR Information);
+VOID        WdfRequestSetInformation(WDFREQUEST Request, ULONG_PTR Information);
+ULONG_PTR   WdfRequestGetInformation(WDFREQUEST Request);
+VOID        WdfRequestMarkCancelable(WDFREQUEST Request, PFN_WDF_REQUEST_CANCEL EvtRequestCancel);
+NTSTATUS    WdfRequestMarkCancelableEx(WDFREQUEST Request, PFN_WDF_REQUEST_CANCEL EvtRequestCancel);
+NTSTATUS    WdfRequestUnmarkCancelable(WDFREQUEST Request);
+BOOLEAN     WdfRequestIsCanceled(WDFREQUEST Request);
+
+NTSTATUS    WdfRequestRetrieveInputBuffer(WDFREQUEST Request, size_t MinimumRequiredLength,
+                                          PVOID * Buffer, size_t * Length);
+NTSTATUS    WdfRequestRetrieveOutputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize,
+                                           PVOID * Buffer, size_t * Length);
+NTSTATUS    WdfRequestRetrieveInputWdmMdl(WDFREQUEST Request, PMDL * Mdl);
+NTSTATUS    WdfRequestForwardToIoQueue(WDFREQUEST Request, WDFQUEUE DestinationQueue);
+NTSTATUS    WdfRequestRetrieveOutputWdmMdl(WDFREQUEST Request, PMDL * Mdl);
+
+//-----------------------------------------------------------------------------
+// Interrupts
+//-----------------------------------------------------------------------------
+typedef struct _WDF_INTERRUPT_CONFIG {
+    ULONG                       Size;
+    BOOLEAN                     ShareVector;
+    BOOLEAN                     FloatingSave;
+    BOOLEAN                     AutomaticSerialization;
+    PFN_WDF_INTERRUPT_ISR       EvtInterruptIsr;
+    PFN_WDF_INTERRUPT_DPC       EvtInterruptDpc;
+    PFN_WDF_INTERRUPT_ENABLE    EvtInterruptEnable;
+    PFN_WDF_INTERRUPT_DISABLE   EvtInterruptDisable;
+
+    //
+    // Set only when the interrupt is created in EvtDevicePrepareHardware,
+    // to pick the (message) interrupt resource it is connected to. The
+    // framework deletes such an interrupt after EvtDeviceReleaseHardware.
+    //
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptRaw;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR InterruptTranslated;
+} WDF_INTERRUPT_CONFIG, * PWDF_INTERRUPT_CONFIG;
+
+FORCEINLINE VOID
+WDF_INTERRUPT_CONFIG_INIT(
+    PWDF_INTERRUPT_CONFIG Config,
+    PFN_WDF_INTERRUPT_ISR EvtInterruptIsr,
+    PFN_WDF_INTERRUPT_DPC EvtInterruptDpc
+    )
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Size = sizeof(*Config);
+    Config->EvtInterruptIsr = EvtInterruptIsr;
+    Config->EvtInterruptDpc = EvtInterruptDpc;
+}
+
+NTSTATUS    WdfInterruptCreate(WDFDEVICE Device, PWDF_INTERRUPT_CONFIG Configuration,
+                               PWDF_OBJECT_ATTRIBUTES Attributes, WDFINTERRUPT * Interrupt);
+WDFDEVICE   WdfInterruptGetDevice(WDFINTERRUPT Interrupt);
+VOID        WdfInterruptAcquireLock(WDFINTERRUPT Interrupt);
+VOID        WdfInterruptReleaseLock(WDFINTERRUPT Interrupt);
+BOOLEAN     WdfInterruptQueueDpcForIsr(WDFINTERRUPT Interrupt);
+
+//-----------------------------------------------------------------------------
+// Timers (one-shot; Period is not supported)
+//-----------------------------------------------------------------------------
+typedef VOID EVT_WDF_TIMER(WDFTIMER Timer);
+typedef EVT_WDF_TIMER * PFN_WDF_TIMER;
+
+typedef struct _WDF_TIMER_CONFIG {
+    ULONG                       Size;
+    PFN_WDF_TIMER               EvtTimerFunc;
+    ULONG                       Period;
+    BOOLEAN                     AutomaticSerialization;
+    ULONG                       TolerableDelay;
+} WDF_TIMER_CONFIG, * PWDF_TIMER_CONFIG;
+
+FORCEINLINE VOID
+WDF_TIMER_CONFIG_INIT(
+    PWDF_TIMER_CONFIG Config,
+    PFN_WDF_TIMER EvtTimerFunc
+    )
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Size = sizeof(*Config);
+    Config->EvtTimerFunc = EvtTimerFunc;
+    Config->AutomaticSerialization = TRUE;
+}
+
+#define WDF_REL_TIMEOUT_IN_US(Time) (-((LONGLONG) (Time) * 10))
+
+NTSTATUS    WdfTimerCreate(PWDF_TIMER_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes,
+                           WDFTIMER * Timer);
+BOOLEAN     WdfTimerStart(WDFTIMER Timer, LONGLONG DueTime);
+BOOLEAN     WdfTimerStop(WDFTIMER Timer, BOOLEAN Wait);
+WDFOBJECT   WdfTimerGetParentObject(WDFTIMER Timer);
+
+//-----------------------------------------------------------------------------
+// DPCs
+//-----------------------------------------------------------------------------
+typedef VOID EVT_WDF_DPC(WDFDPC Dpc);
+typedef EVT_WDF_DPC * PFN_WDF_DPC;
+
+typedef struct _WDF_DPC_CONFIG {
+    ULONG                       Size;
+    PFN_WDF_DPC                 EvtDpcFunc;
+    BOOLEAN                     AutomaticSerialization;
+} WDF_DPC_CONFIG, * PWDF_DPC_CONFIG;
+
+FORCEINLINE VOID
+WDF_DPC_CONFIG_INIT(
+    PWDF_DPC_CONFIG Config,
+    PFN_WDF_DPC EvtDpcFunc
+    )
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Size = sizeof(*Config);
+    Config->EvtDpcFunc = EvtDpcFunc;
+    Config->AutomaticSerialization = TRUE;
+}
+
+NTSTATUS    WdfDpcCreate(PWDF_DPC_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes,
+                         WDFDPC * Dpc);
+BOOLEAN     WdfDpcEnqueue(WDFDPC Dpc);
+BOOLEAN     WdfDpcCancel(WDFDPC Dpc, BOOLEAN Wait);
+WDFOBJECT   WdfDpcGetParentObject(WDFDPC Dpc);
+PKDPC       WdfDpcWdmGetDpc(WDFDPC Dpc);
+
+//-----------------------------------------------------------------------------
+// Work items (a thread each, at PASSIVE_LEVEL)
+//-----------------------------------------------------------------------------
+typedef VOID EVT_WDF_WORKITEM(WDFWORKITEM WorkItem);
+typedef EVT_WDF_WORKITEM * PFN_WDF_WORKITEM;
+
+typedef struct _WDF_WORKITEM_CONFIG {
+    ULONG                       Size;
+    PFN_WDF_WORKITEM            EvtWorkItemFunc;
+    BOOLEAN                     AutomaticSerialization;
+} WDF_WORKITEM_CONFIG, * PWDF_WORKITEM_CONFIG;
+
+FORCEINLINE VOID
+WDF_WORKITEM_CONFIG_INIT(
+    PWDF_WORKITEM_CONFIG Config,
+    PFN_WDF_WORKITEM EvtWorkItemFunc
+    )
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Size = sizeof(*Config);
+    Config->EvtWorkItemFunc = EvtWorkItemFunc;
+    Config->AutomaticSerialization = TRUE;
+}
+
+NTSTATUS    WdfWorkItemCreate(PWDF_WORKITEM_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes,
+                              WDFWORKITEM * WorkItem);
+VOID        WdfWorkItemEnqueue(WDFWORKITEM WorkItem);
+VOID        WdfWorkItemFlush(WDFWORKITEM WorkItem);
+WDFOBJECT   WdfWorkItemGetParentObject(WDFWORKITEM WorkItem);
+
+//-----------------------------------------------------------------------------
+// Wait locks (Timeout: NULL waits, 0 tries)
+//-----------------------------------------------------------------------------
+NTSTATUS    WdfWaitLockCreate(PWDF_OBJECT_ATTRIBUTES LockAttributes, WDFWAITLOCK * Lock);
+NTSTATUS    WdfWaitLockAcquire(WDFWAITLOCK Lock, PLONGLONG Timeout);
+VOID        WdfWaitLockRelease(WDFWAITLOCK Lock);
+
+//-----------------------------------------------------------------------------
+// DMA
+//-----------------------------------------------------------------------------
+typedef struct _WDF_DMA_ENABLER_CONFIG {
+    ULONG               Size;
+    WDF_DMA_PROFILE     Profile;
+    size_t              MaximumLength;
+} WDF_DMA_ENABLER_CONFIG, * PWDF_DMA_ENABLER_CONFIG;
+
+FORCEINLINE VOID
+WDF_DMA_ENABLER_CONFIG_INIT(
+    PWDF_DMA_ENABLER_CONFIG Config,
+    WDF_DMA_PROFILE Profile,
+    size_t MaximumLength
+    )
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Size = sizeof(*Config);
+    Config->Profile = Profile;
+    Config->MaximumLength = MaximumLength;
+}
+
+NTSTATUS    WdfDmaEnablerCreate(WDFDEVICE Device, PWDF_DMA_ENABLER_CONFIG Config,
+                                PWDF_OBJECT_ATTRIBUTES Attributes, WDFDMAENABLER * DmaEnablerHandle);
+
+NTSTATUS    WdfCommonBufferCreate(WDFDMAENABLER DmaEnabler, size_t Length,
+                                  PWDF_OBJECT_ATTRIBUTES Attributes, WDFCOMMONBUFFER * CommonBuffer);
+PVOID               WdfCommonBufferGetAlignedVirtualAddress(WDFCOMMONBUFFER CommonBuffer);
+PHYSICAL_ADDRESS    WdfCommonBufferGetAlignedLogicalAddress(WDFCOMMONBUFFER CommonBuffer);
+size_t              WdfCommonBufferGetLength(WDFCOMMONBUFFER CommonBuffer);
+
+NTSTATUS    WdfDmaTransactionCreate(WDFDMAENABLER DmaEnabler, PWDF_OBJECT_ATTRIBUTES Attributes,
+                                    WDFDMATRANSACTION * DmaTransaction);
+NTSTATUS    WdfDmaTransactionInitializeUsingRequest(WDFDMATRANSACTION DmaTransaction,
+                                                    WDFREQUEST Request,
+                                                    PFN_WDF_PROGRAM_DMA EvtProgramDmaFunction,
+                                                    WDF_DMA_DIRECTION DmaDirection);
+NTSTATUS    WdfDmaTransactionInitialize(WDFDMATRANSACTION DmaTransaction,
+                                        PFN_WDF_PROGRAM_DMA EvtProgramDmaFunction,
+                                        WDF_DMA_DIRECTION DmaDirection, PMDL Mdl,
+                                        PVOID VirtualAddress, size_t Length);
+NTSTATUS    WdfDmaTransactionExecute(WDFDMATRANSACTION DmaTransaction, WDFCONTEXT Context);
+BOOLEAN     WdfDmaTransactionDmaCompleted(WDFDMATRANSACTION DmaTransaction, NTSTATUS * Status);
+BOOLEAN     WdfDmaTransactionDmaCompletedWithLength(WDFDMATRANSACTION DmaTransaction,
+                                                     size_t TransferredLength, NTSTATUS * Status);
+BOOLEAN     WdfDmaTransactionDmaCompletedFinal(WDFDMATRANSACTION DmaTransaction,
+                                                size_t FinalTransferredLength, NTSTATUS * Status);
+NTSTATUS    WdfDmaTransactionRelease(WDFDMATRANSACTION DmaTransaction);
+WDFREQUEST  WdfDmaTransactionGetRequest(WDFDMATRANSACTION DmaTransaction);
+size_t      WdfDmaTransactionGetBytesTransferred(WDFDMATRANSACTION DmaTransaction);
+size_t      WdfDmaTransactionGetCurrentDmaTransferLength(WDFDMATRANSACTION DmaTransaction);
+WDFDEVICE   WdfDmaTransactionGetDevice(WDFDMATRANSACTION DmaTransaction);
+VOID        WdfDmaTransactionSetMaximumLength(WDFDMATRANSACTION DmaTransaction,
+                                              size_t MaximumLength);
+
+//-----------------------------------------------------------------------------
+// Harness entry points (no framework equivalent)
+//-----------------------------------------------------------------------------
+struct _HSAC_SIM;
+
+//
+// Back BAR0 with the card model's register block and BAR2 with SramSize
+// bytes of plain memory. Must be called before WdfShimDeviceStart.
+//
+VOID        WdfShimBindSimulator(struct _HSAC_SIM * Sim, ULONG SramSize);
+
+//
+// Number of MSI messages the next WdfShimDeviceStart grants the device:
+// 0 or 1 (the default) for one line-based interrupt resource, up to
+// WDF_SHIM_MAX_MESSAGES for that many message resources.
+//
+#define WDF_SHIM_MAX_MESSAGES       2
+
+VOID        WdfShimSetInterruptMessages(ULONG Messages);
+
+//
+// Set a REG_DWORD value in the device's hardware key, as the INF or an
+// administrator would, for the driver to read when the device is added.
+//
+#define WDF_SHIM_MAX_REGISTRY_VALUES    16
+
+NTSTATUS    WdfShimSetRegistryValue(const char * Name, ULONG Value);
+
+//
+// Load the driver: call DriverEntry with a driver object and registry path
+// of the shim's own.
+//
+NTSTATUS    WdfShimDriverLoad(DRIVER_INITIALIZE * DriverEntry);
+
+//
+// PnP manager: call the driver's EvtDriverDeviceAdd, then take the device
+// to D0 (PrepareHardware, D0Entry, connect and enable the interrupts,
+// start the power-managed queues). Stop and remove run the reverse.
+//
+NTSTATUS    WdfShimDeviceAdd(WDFDEVICE * Device);
+NTSTATUS    WdfShimDeviceStart(WDFDEVICE Device);
+VOID        WdfShimDeviceStop(WDFDEVICE Device);
+VOID        WdfShimDeviceRemove(WDFDEVICE Device);
+VOID        WdfShimDriverUnload(VOID);
+
+//
+// Power policy: the idle references the driver holds (WdfDeviceStopIdle
+// not yet matched by WdfDeviceResumeIdle). The shim never idles the
+// device; it only counts them.
+//
+LONG        WdfShimDeviceIdleReferences(WDFDEVICE Device);
+
+typedef VOID WDF_SHIM_REQUEST_COMPLETION(PVOID Context, WDFREQUEST Request,
+                                         NTSTATUS Status, ULONG_PTR Information);
+typedef WDF_SHIM_REQUEST_COMPLETION * PFN_WDF_SHIM_REQUEST_COMPLETION;
+
+//
+// I/O manager: build a request and queue it to whichever queue the
+// device dispatches RequestType to. Read and write requests use direct
+// I/O on Buffer. Device control requests take the transfer method from
+// the control code. Completion runs on the completing thread. If Request
+// is not NULL it receives a referenced handle, released with
+// WdfObjectDereference.
+//
+NTSTATUS
+WdfShimSubmitRequest(
+    WDFDEVICE Device,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    PFN_WDF_SHIM_REQUEST_COMPLETION Completion,
+    PVOID CompletionContext,
+    WDFREQUEST * Request
+    );
+
+NTSTATUS
+WdfShimSubmitRequestSynchronously(
+    WDFDEVICE Device,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    ULONG_PTR * Information
+    );
+
+//
+// CreateFile / CloseHandle: a file object whose requests are submitted
+// with the *FileRequest variants below. WdfShimSubmitRequest uses no file
+// object (WdfRequestGetFileObject returns NULL).
+//
+NTSTATUS    WdfShimFileOpen(WDFDEVICE Device, WDFFILEOBJECT * FileObject);
+VOID        WdfShimFileClose(WDFFILEOBJECT FileObject);
+
+NTSTATUS
+WdfShimSubmitFileRequest(
+    WDFFILEOBJECT FileObject,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    PFN_WDF_SHIM_REQUEST_COMPLETION Completion,
+    PVOID CompletionContext,
+    WDFREQUEST * Request
+    );
+
+NTSTATUS
+WdfShimSubmitFileRequestSynchronously(
+    WDFFILEOBJECT FileObject,
+    WDF_REQUEST_TYPE RequestType,
+    ULONG IoControlCode,
+    PVOID InputBuffer,
+    size_t InputLength,
+    PVOID OutputBuffer,
+    size_t OutputLength,
+    ULONG_PTR * Information
+    );
+
+//
+// IoCancelIrp.
+//
+VOID        WdfShimCancelRequest(WDFREQUEST Request);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // WDF_SHIM_H
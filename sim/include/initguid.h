@@ -0,0 +1,19 @@
+/*++
+
+Module Name:
+
+    initguid.h
+
+Abstract:
+
+    User-mode build: DEFINE_GUID instantiates the GUID in the including
+    translation unit.
+
+--*/
+
+#include "WdfShim.h"
+
+#undef DEFINE_GUID
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    static const GUID name __attribute__((unused)) =                 \
+        { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }
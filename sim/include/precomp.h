@@ -0,0 +1,65 @@
+/*++
+
+Copyright (c) ESSS.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+Module Name:
+
+    precomp.h
+
+Abstract:
+
+    Stand-in for the driver's Precomp.h in the user-mode build. Found
+    ahead of the parent directory on the include path, it pulls in the
+    framework shim instead of ntddk.h/wdf.h and turns WPP tracing into
+    no-ops.
+
+Environment:
+
+    User mode (Linux, pthreads)
+
+--*/
+
+#ifndef HSAC_SIM_PRECOMP_H
+#define HSAC_SIM_PRECOMP_H
+
+#include "WdfShim.h"
+
+//
+// WPP tracing (trace.h) is not available outside the WDK.
+//
+#define TRACE_LEVEL_NONE            0
+#define TRACE_LEVEL_CRITICAL        1
+#define TRACE_LEVEL_FATAL           1
+#define TRACE_LEVEL_ERROR           2
+#define TRACE_LEVEL_WARNING         3
+#define TRACE_LEVEL_INFORMATION     4
+#define TRACE_LEVEL_VERBOSE         5
+
+#define DBG_INIT                    0x00000001
+#define DBG_PNP                     0x00000002
+#define DBG_POWER                   0x00000004
+#define DBG_WMI                     0x00000008
+#define DBG_CREATE_CLOSE            0x00000010
+#define DBG_IOCTLS                  0x00000020
+#define DBG_WRITE                   0x00000040
+#define DBG_READ                    0x00000080
+#define DBG_DPC                     0x00000100
+#define DBG_INTERRUPT               0x00000200
+#define DBG_LOCKS                   0x00000400
+#define DBG_QUEUEING                0x00000800
+#define DBG_HW_ACCESS               0x00001000
+
+#define TraceEvents(...)            ((void) 0)
+#define WPP_INIT_TRACING(d, r)      ((void) 0)
+#define WPP_CLEANUP(d)              ((void) 0)
+
+#include "Reg.h"
+#include "Public.h"
+#include "Private.h"
+
+#endif  // HSAC_SIM_PRECOMP_H